@@ -0,0 +1,203 @@
+/*!
+ * \file vfs_dir_bench.c
+ *
+ * Compare a log directory scan and cleanup entry by entry (vfs_readdir, vfs_stat, vfs_unlink)
+ * with the batched calls (vfs_readdir_batch, vfs_statx_batch, vfs_unlinkat), then walk a tree.
+ * Usage: vfs_dir_bench DIR [NB_FILES] [TREE]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+
+#include <libvapi/vfs.h>
+
+#define BATCH   256
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int create_files(const char *dir, long nb_files)
+{
+    char path[PATH_MAX];
+    long i;
+    int fd;
+
+    for (i = 0; i < nb_files; i++) {
+        snprintf(path, sizeof(path), "%s/app.log.%ld", dir, i);
+        fd = vfs_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return -1;
+        vfs_write(fd, "log line\n", 9);
+        vfs_close_simple(fd);
+    }
+
+    return 0;
+}
+
+/* Scan the directory, and remove the regular files older than limit when cleanup is set */
+static long scan_single(const char *dir, time_t limit, int cleanup, long *bytes)
+{
+    char path[PATH_MAX];
+    char name[NAME_MAX + 1];
+    vfs_dir_handle_t handle;
+    vfs_stat_t statbuf;
+    long count = 0;
+
+    *bytes = 0;
+    if (vfs_opendir(dir, &handle) < 0)
+        return -1;
+
+    while (vfs_readdir(handle, name, sizeof(name)) > 0) {
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        if (vfs_stat(path, &statbuf) < 0 || !S_ISREG(statbuf.st_mode))
+            continue;
+        count++;
+        *bytes += statbuf.st_size;
+        if (cleanup && statbuf.st_mtime <= limit)
+            vfs_unlink(path);
+    }
+
+    vfs_closedir(handle);
+
+    return count;
+}
+
+static long scan_batch(const char *dir, time_t limit, int cleanup, long *bytes)
+{
+    vfs_dirent_t dirents[BATCH];
+    vfs_statx_t entries[BATCH];
+    vfs_dir_handle_t handle;
+    long count = 0;
+    int nb, i;
+
+    *bytes = 0;
+    if (vfs_opendir(dir, &handle) < 0)
+        return -1;
+
+    while ((nb = vfs_readdir_batch(handle, dirents, BATCH)) > 0) {
+        for (i = 0; i < nb; i++)
+            entries[i].name = dirents[i].name;
+        vfs_statx_batch(handle, entries, nb, VFS_STATX_TYPE | VFS_STATX_SIZE | VFS_STATX_MTIME);
+
+        for (i = 0; i < nb; i++) {
+            if (entries[i].error != 0 || !S_ISREG(entries[i].mode))
+                continue;
+            count++;
+            *bytes += entries[i].size;
+            if (cleanup && entries[i].mtime <= limit)
+                vfs_unlinkat(handle, entries[i].name, 0);
+        }
+    }
+
+    vfs_closedir(handle);
+
+    return count;
+}
+
+/* Count the regular files from the types of the directory entries, no stat */
+static long scan_types(const char *dir)
+{
+    vfs_dirent_t dirents[BATCH];
+    vfs_dir_handle_t handle;
+    long count = 0;
+    int nb, i;
+
+    if (vfs_opendir(dir, &handle) < 0)
+        return -1;
+
+    while ((nb = vfs_readdir_batch(handle, dirents, BATCH)) > 0) {
+        for (i = 0; i < nb; i++) {
+            if (dirents[i].type == DT_REG)
+                count++;
+        }
+    }
+
+    vfs_closedir(handle);
+
+    return count;
+}
+
+static void walk(const char *tree, unsigned int threads, unsigned int mask)
+{
+    vfs_walk_params_t params = VFS_WALK_PARAMS_DEFAULT;
+    vfs_walk_stats_t stats;
+    double start;
+
+    params.threads = threads;
+    params.mask = mask;
+
+    start = now();
+    vfs_walk(tree, &params, &stats);
+    printf("walk %u thread(s) %-9s: %.1f ms, %lu dirs, %lu files, %lu KiB, %lu errors\n", threads,
+           (mask == VFS_STATX_TYPE) ? "types" : "du", (now() - start) * 1e3,
+           (unsigned long)stats.dirs, (unsigned long)stats.files,
+           (unsigned long)(stats.blocks / 2), (unsigned long)stats.errors);
+}
+
+int main(int argc, char* argv[])
+{
+    const char *tree = "/usr";
+    char dir[PATH_MAX];
+    long nb_files = 100000;
+    long count, bytes;
+    double start;
+    time_t limit;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s DIR [NB_FILES] [TREE]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (argc > 2)
+        nb_files = strtol(argv[2], NULL, 0);
+    if (argc > 3)
+        tree = argv[3];
+
+    snprintf(dir, sizeof(dir), "%s/vfs_dir_bench", argv[1]);
+    if (vfs_mkdir(dir, 0755) < 0 && !vfs_file_exists(dir)) {
+        fprintf(stderr, "%s: cannot create\n", dir);
+        return EXIT_FAILURE;
+    }
+    if (create_files(dir, nb_files) < 0) {
+        fprintf(stderr, "%s: cannot create the files\n", dir);
+        return EXIT_FAILURE;
+    }
+    limit = time(NULL) + 1;
+
+    /* warm the dentry cache, both then run on it */
+    scan_batch(dir, limit, 0, &bytes);
+
+    start = now();
+    count = scan_single(dir, limit, 0, &bytes);
+    printf("scan    readdir + stat  : %.1f ms, %ld files, %ld bytes\n", (now() - start) * 1e3, count, bytes);
+    start = now();
+    count = scan_batch(dir, limit, 0, &bytes);
+    printf("scan    batch + statx   : %.1f ms, %ld files, %ld bytes\n", (now() - start) * 1e3, count, bytes);
+    start = now();
+    count = scan_types(dir);
+    printf("scan    batch, d_type   : %.1f ms, %ld files\n", (now() - start) * 1e3, count);
+
+    start = now();
+    count = scan_single(dir, limit, 1, &bytes);
+    printf("cleanup readdir + unlink: %.1f ms, %ld files\n", (now() - start) * 1e3, count);
+    create_files(dir, nb_files);
+    limit = time(NULL) + 1;
+    start = now();
+    count = scan_batch(dir, limit, 1, &bytes);
+    printf("cleanup batch + unlinkat: %.1f ms, %ld files\n", (now() - start) * 1e3, count);
+    vfs_rmdir(dir);
+
+    walk(tree, 1, VFS_STATX_TYPE);
+    walk(tree, 1, 0);
+    walk(tree, 4, 0);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,129 @@
+/*!
+ * \file vfs_zstd_dict.c
+ *
+ * Train a zstd dictionary from sample files, and compare compressing them with and without it.
+ * Usage: vfs_zstd_dict SAMPLE_DIR DICT [DICT_SIZE]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <time.h>
+
+#include <libvapi/vfs.h>
+
+#define RUNS    5
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Compress each sample file to OUT, return the total compressed size */
+static long compress_samples(const char *sample_dir, const char *out, vfs_zstd_dict_t dict,
+                             long *raw, double *seconds)
+{
+    vfs_zstd_params_t params = VFS_ZSTD_PARAMS_DEFAULT;
+    char path[PATH_MAX];
+    char buffer[65536];
+    struct dirent *entry;
+    vfs_stat_t statbuf;
+    long total = 0;
+    ssize_t len;
+    double start;
+    DIR *dir;
+    int in, fd;
+
+    params.dict = dict;
+    *raw = 0;
+    *seconds = 0;
+
+    dir = opendir(sample_dir);
+    if (dir == NULL)
+        return -1;
+
+    while ((entry = readdir(dir)) != NULL) {
+        snprintf(path, sizeof(path), "%s/%s", sample_dir, entry->d_name);
+        if (vfs_stat(path, &statbuf) < 0 || !S_ISREG(statbuf.st_mode))
+            continue;
+
+        in = vfs_open(path, O_RDONLY, (mode_t) -1);
+        if (in < 0)
+            continue;
+
+        start = now();
+        fd = vfs_open_zstd(out, O_WRONLY | O_CREAT | O_TRUNC, 0644, &params);
+        while (fd >= 0 && (len = vfs_read(in, buffer, sizeof(buffer))) > 0) {
+            vfs_write(fd, buffer, len);
+            *raw += len;
+        }
+        vfs_close_simple(fd);
+        *seconds += now() - start;
+        vfs_close_simple(in);
+
+        if (vfs_stat(out, &statbuf) == 0)
+            total += statbuf.st_size;
+    }
+
+    closedir(dir);
+    vfs_unlink(out);
+
+    return total;
+}
+
+int main(int argc, char* argv[])
+{
+    const char *out = "/tmp/vfs_zstd_dict.zst";
+    size_t dict_size = 112640;
+    vfs_zstd_dict_t dict;
+    long raw, plain, with_dict;
+    double t_plain, t_dict, t;
+    ssize_t len;
+    int i;
+
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s SAMPLE_DIR DICT [DICT_SIZE]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (argc > 3)
+        dict_size = strtoul(argv[3], NULL, 0);
+
+    len = vfs_zstd_dict_train(argv[1], argv[2], dict_size);
+    if (len < 0) {
+        fprintf(stderr, "%s: training failed\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    printf("dictionary: %s, %zd bytes\n", argv[2], len);
+
+    dict = vfs_zstd_dict_load(argv[2], 0);
+    if (dict == NULL) {
+        fprintf(stderr, "%s: cannot load dictionary\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    /* best of RUNS, the open of each file weighs on small samples */
+    t_plain = t_dict = 1e9;
+    for (i = 0; i < RUNS; i++) {
+        plain = compress_samples(argv[1], out, NULL, &raw, &t);
+        t_plain = (t < t_plain) ? t : t_plain;
+        with_dict = compress_samples(argv[1], out, dict, &raw, &t);
+        t_dict = (t < t_dict) ? t : t_dict;
+    }
+    vfs_zstd_dict_release(dict);
+
+    if (plain <= 0 || with_dict <= 0) {
+        fprintf(stderr, "%s: no sample compressed\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    printf("samples   : %ld bytes\n", raw);
+    printf("no dict   : %ld bytes, ratio %.2f, %.1f MB/s\n", plain, (double)raw / plain, raw / t_plain / 1e6);
+    printf("with dict : %ld bytes, ratio %.2f, %.1f MB/s\n", with_dict, (double)raw / with_dict, raw / t_dict / 1e6);
+
+    return EXIT_SUCCESS;
+}
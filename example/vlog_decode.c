@@ -0,0 +1,40 @@
+/*!
+ * \file vlog_decode.c
+ *
+ * Offline decoder for binary logs written by vlog_deferred_open().
+ * Usage: vlog_decode FILE
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "src/vlog_deferred_decode.h"
+
+int main(int argc, char* argv[])
+{
+    long count;
+    int fd;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s FILE\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    count = vlog_deferred_decode(fd, stdout);
+    close(fd);
+
+    if (count < 0) {
+        fprintf(stderr, "%s: not a valid binary log\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,133 @@
+/*!
+ * \file vlog_file_bench.c
+ *
+ * Compares the lines per second of the mmap based vlog_file writer with a
+ * mutex protected FILE* stream, the way log files were written before.
+ *
+ * usage: vlog_file_bench [directory] [threads] [lines per thread]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <libvapi/vlog.h>
+#include <libvapi/vlog_file.h>
+
+#define BENCH_LINES     1000000UL
+#define BENCH_THREADS   4
+#define BENCH_MAX_THREADS 64
+
+static vlog_file_type_t bench_file;
+static FILE *bench_stream;
+static pthread_mutex_t bench_stream_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long bench_lines = BENCH_LINES;
+
+static double bench_elapsed_s(struct timespec *start)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void bench_line(char *line, size_t size, long thread, unsigned long i)
+{
+    snprintf(line, size, "Jan 01 00:00:00.000000 [bench%ld] ERROR bench.c:42 line %lu of the log file benchmark\n",
+             thread, i);
+}
+
+static void *bench_mmap_thread(void *arg)
+{
+    char line[256];
+    unsigned long i;
+
+    for (i = 0; i < bench_lines; i++) {
+        bench_line(line, sizeof(line), (long)arg, i);
+        vlog_file_write(&bench_file, line);
+    }
+
+    return NULL;
+}
+
+static void *bench_stream_thread(void *arg)
+{
+    char line[256];
+    unsigned long i;
+
+    for (i = 0; i < bench_lines; i++) {
+        bench_line(line, sizeof(line), (long)arg, i);
+        pthread_mutex_lock(&bench_stream_lock);
+        fputs(line, bench_stream);
+        pthread_mutex_unlock(&bench_stream_lock);
+    }
+
+    return NULL;
+}
+
+static double bench_run(void *(*fn)(void *), int threads)
+{
+    pthread_t tid[BENCH_MAX_THREADS];
+    struct timespec start;
+    long t;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (t = 0; t < threads; t++)
+        pthread_create(&tid[t], NULL, fn, (void *)t);
+    for (t = 0; t < threads; t++)
+        pthread_join(tid[t], NULL);
+
+    return bench_elapsed_s(&start);
+}
+
+int main(int argc, char* argv[])
+{
+    const char *dir = "/tmp";
+    char path[2 * VLOG_MAX_FILENAME];
+    int threads = BENCH_THREADS;
+    double elapsed;
+
+    if (argc > 1)
+        dir = argv[1];
+    if (argc > 2)
+        threads = atoi(argv[2]);
+    if (argc > 3)
+        bench_lines = strtoul(argv[3], NULL, 0);
+    if (threads < 1 || threads > BENCH_MAX_THREADS) {
+        fprintf(stderr, "threads must be between 1 and %d\n", BENCH_MAX_THREADS);
+        return EXIT_FAILURE;
+    }
+
+    snprintf(bench_file.pathname, sizeof(bench_file.pathname), "%s", dir);
+    snprintf(bench_file.filename, sizeof(bench_file.filename), "vlog_file_bench.log");
+    bench_file.nb_logfiles_max = 2;
+    bench_file.maxentries = 100000;
+    bench_file.flushtime = 1;
+
+    if (vlog_file_open(&bench_file) != 0) {
+        fprintf(stderr, "failed to open %s/%s\n", dir, bench_file.filename);
+        return EXIT_FAILURE;
+    }
+    elapsed = bench_run(bench_mmap_thread, threads);
+    vlog_file_close(&bench_file);
+    vlog_file_cleanup(&bench_file);
+    snprintf(path, sizeof(path), "%s/%s", dir, bench_file.filename);
+    remove(path);
+    fprintf(stderr, "mmap vlog_file:  %12.0f lines/s\n", threads * bench_lines / elapsed);
+
+    snprintf(path, sizeof(path), "%s/vlog_file_bench.stream", dir);
+    bench_stream = fopen(path, "w");
+    if (bench_stream == NULL) {
+        fprintf(stderr, "failed to open %s\n", path);
+        return EXIT_FAILURE;
+    }
+    elapsed = bench_run(bench_stream_thread, threads);
+    fflush(bench_stream);
+    fclose(bench_stream);
+    remove(path);
+    fprintf(stderr, "FILE* + mutex:   %12.0f lines/s\n", threads * bench_lines / elapsed);
+
+    return EXIT_SUCCESS;
+}
@@ -29,9 +29,9 @@ typedef void *vfs_dir_handle_t;
  */
 typedef enum {
     VFS_EVENT_NONE = 0,
-    VFS_EVENT_CREATE = 1, /*!< Creation of an entry on the filesystem */
-    VFS_EVENT_MODIFY = 2,
-    VFS_EVENT_DELETE = 4
+    VFS_EVENT_CREATE = 1, /*!< Creation of an entry on the filesystem, or an entry moved in */
+    VFS_EVENT_MODIFY = 2, /*!< Write to a file */
+    VFS_EVENT_DELETE = 4  /*!< Removal of an entry, or an entry moved out */
 } vfs_monitor_event_t;
 
 /*!
@@ -72,6 +72,89 @@ typedef void (*vfs_monitor_cb_t)(vevent_reason_t reason, uint32_t type_mask, con
  */
 int vfs_open(const char *path, int flags, mode_t mode);
 
+/*!
+ * \brief Zstd dictionary, shared by the files opened with it.
+ */
+typedef struct vfs_zstd_dict *vfs_zstd_dict_t;
+
+/*!
+ * \brief Compression parameters of a file opened with vfs_open_zstd().
+ */
+typedef struct {
+    int level;              /*!< Compression level, 0 for the zstd default. A dictionary uses its own level. */
+    int nb_workers;         /*!< Threads compressing in the background, 0 to compress in vfs_write(). */
+    int long_distance;      /*!< Long distance matching, for large files with distant repetitions. */
+    int window_log;         /*!< Log2 of the match window, 0 for the default. Readers need the same value. */
+    vfs_zstd_dict_t dict;   /*!< Dictionary, NULL for none. Readers need the same dictionary. */
+    size_t frame_size;      /*!< Uncompressed bytes per independent frame of a seekable file, at most 64 MiB,
+                                 0 for a single frame. Smaller frames seek faster and compress less. */
+} vfs_zstd_params_t;
+
+#define VFS_ZSTD_PARAMS_DEFAULT { 0, 0, 0, 0, NULL, 0 }
+
+/*!
+ * \brief Open a file with zstd compression and the given parameters.
+ *
+ * Same as vfs_open() with VFS_MODE_ZSTD, which uses VFS_ZSTD_PARAMS_DEFAULT.
+ * With nb_workers, vfs_write() hands the data to the zstd worker threads and only waits
+ * for them when their buffers are full, and at vfs_lseek() and vfs_close().
+ * The parameters are only used for the open, the dictionary may be released after it.
+ *
+ * With a frame_size, the file is written in the zstd seekable format: independent frames and,
+ * at close, a seek table in a skippable frame which plain zstd decoders ignore. The file must be
+ * written from its start, vfs_lseek() of the writer only returns its uncompressed position.
+ * A VFS_MODE_ZSTD file opened O_RDONLY is read through its seek table when it has one: vfs_lseek()
+ * and vfs_pread() then use uncompressed offsets, and only the frames read are decompressed.
+ * \param path IN Path of the file.
+ * \param flags IN Flags, see vfs_open().
+ * \param mode IN Mode of a created file.
+ * \param params IN Compression parameters, NULL for vfs_open().
+ * \return file descriptor on success, error -1 on failure.
+ * \sa vfs_open, vfs_zstd_dict_load
+ */
+int vfs_open_zstd(const char *path, int flags, mode_t mode, const vfs_zstd_params_t *params);
+
+/*!
+ * \brief Create a dictionary from a buffer.
+ *
+ * The dictionary is digested once, for compression at the given level and for decompression.
+ * \param buffer IN Dictionary content, copied.
+ * \param size IN Size of the dictionary.
+ * \param level IN Compression level of the files using the dictionary, 0 for the zstd default.
+ * \return dictionary on success, NULL on failure.
+ * \sa vfs_zstd_dict_release
+ */
+vfs_zstd_dict_t vfs_zstd_dict_create(const void *buffer, size_t size, int level);
+
+/*!
+ * \brief Load a dictionary file, as written by vfs_zstd_dict_train() or zstd --train.
+ * \param path IN Path of the dictionary.
+ * \param level IN Compression level of the files using the dictionary, 0 for the zstd default.
+ * \return dictionary on success, NULL on failure.
+ * \sa vfs_zstd_dict_release
+ */
+vfs_zstd_dict_t vfs_zstd_dict_load(const char *path, int level);
+
+/*!
+ * \brief Release a dictionary, it is freed when the last file using it is closed.
+ * \param dict IN Dictionary, NULL is ignored.
+ */
+void vfs_zstd_dict_release(vfs_zstd_dict_t dict);
+
+/*!
+ * \brief Train a dictionary from sample files.
+ *
+ * The regular files of sample_dir, uncompressed, are used as samples; larger ones are split.
+ * At most 64 MiB of samples are read. A dictionary pays off for many small similar files,
+ * with a hundred times its size in samples.
+ * \param sample_dir IN Directory of the sample files.
+ * \param dict_path IN Path of the dictionary file written.
+ * \param dict_size IN Maximum dictionary size, typically 64 KiB to 112 KiB.
+ * \return size of the dictionary on success, error -1 on failure.
+ * \sa vfs_zstd_dict_load
+ */
+ssize_t vfs_zstd_dict_train(const char *sample_dir, const char *dict_path, size_t dict_size);
+
 /*!
  * \brief Close a file descriptor.
  *
@@ -109,6 +192,8 @@ int vfs_close(int fd);
  * <li> SEEK_CUR: Offset will be referred to from current position.
  * <li> SEEK_END: Offset will be referred to from end of file (file size).
  * </ul>
+ * Offsets of a seekable zstd file are uncompressed offsets, see vfs_open_zstd(). Other VFS_MODE_ZSTD
+ * files are flushed and seeked in their compressed data.
  * \return file position on success, error -1 on failure.
  * \sa vfs_read, vfs_write
  */
@@ -128,6 +213,20 @@ off_t vfs_lseek(int fd, off_t offset, int whence);
  */
 ssize_t vfs_read(int fd, void *buffer, size_t nbytes);
 
+/*!
+ * \brief Read a number of bytes from a given position of a file.
+ *
+ * Same as vfs_read(), at offset and without moving the file position.
+ * A VFS_MODE_ZSTD file must be seekable, see vfs_open_zstd(): offset is an uncompressed offset.
+ * \param fd IN File descriptor to specify the file.
+ * \param buffer OUT Pointer to the data-location.
+ * \param nbytes IN Number of bytes to be read.
+ * \param offset IN Position of the first byte read.
+ * \return Number of read bytes on success, 0 past the end of the file, error -1 on failure.
+ * \sa vfs_read, vfs_lseek
+ */
+ssize_t vfs_pread(int fd, void *buffer, size_t nbytes, off_t offset);
+
 /*!
  * \brief Write a number of bytes to a file.
  *
@@ -144,6 +243,62 @@ ssize_t vfs_read(int fd, void *buffer, size_t nbytes);
  */
 ssize_t vfs_write(int fd, const void *buffer, size_t nbytes);
 
+/*!
+ * \brief Write a number of bytes at a given position of a file.
+ *
+ * Same as vfs_write(), at offset and without moving the file position.
+ * Not supported on VFS_MODE_ZSTD files.
+ * \param fd IN File descriptor to specify the file.
+ * \param buffer IN Pointer to the data-location.
+ * \param nbytes IN Number of bytes to be written.
+ * \param offset IN Position of the first byte written.
+ * \return Number of written bytes on success, error -1 on failure.
+ * \sa vfs_write, vfs_pread
+ */
+ssize_t vfs_pwrite(int fd, const void *buffer, size_t nbytes, off_t offset);
+
+/* access hints of vfs_map() */
+#define VFS_MAP_SEQUENTIAL  0x01    /* read once from start to end, pages are read ahead and dropped early */
+#define VFS_MAP_WILLNEED    0x02    /* read the whole file in now */
+#define VFS_MAP_HUGEPAGE    0x04    /* back with huge pages where the kernel supports it */
+
+/*!
+ * \brief Map a whole file read-only in memory.
+ *
+ * The file is read from the page cache without a copy into a heap buffer.
+ * With VFS_MODE_ZSTD in the flags, the file is decompressed into an anonymous mapping instead,
+ * all its frames, seekable ones included. Files compressed with a dictionary can not be mapped.
+ * An empty file gives a valid mapping with a length of 0.
+ * \param path IN Path of the file.
+ * \param flags IN Bitwise OR-ed VFS_MAP_* hints, and VFS_MODE_ZSTD for a compressed file.
+ * \param len OUT Length of the (decompressed) contents.
+ * \return Address of the contents on success, NULL on failure.
+ * \sa vfs_unmap, vfs_prefetch
+ */
+void *vfs_map(const char *path, unsigned int flags, size_t *len);
+
+/*!
+ * \brief Release a mapping of vfs_map().
+ * \param addr IN Address returned by vfs_map().
+ * \param len IN Length returned by vfs_map().
+ * \return 0 on success, error -1 on failure.
+ * \sa vfs_map
+ */
+int vfs_unmap(void *addr, size_t len);
+
+/*!
+ * \brief Read part of a file into the page cache ahead of its use.
+ *
+ * Uses readahead(), or posix_fadvise() on filesystems without it. The data is not returned,
+ * later reads and mappings of that part of the file do not wait for the disk.
+ * \param path IN Path of the file.
+ * \param offset IN Position of the first byte to read.
+ * \param len IN Number of bytes to read, 0 up to the end of the file.
+ * \return 0 on success, error -1 on failure.
+ * \sa vfs_map
+ */
+int vfs_prefetch(const char *path, off_t offset, size_t len);
+
 /*!
  * \brief Read a string from a text file.
  *
@@ -283,7 +438,8 @@ void vfs_sync(void);
  * \brief Copy the contents from a file to a destination file.
  *
  * Copy the file contents from specified source file to destination file.
- * If destination file didn't exist, it is created.
+ * If destination file didn't exist, it is created, otherwise it is truncated.
+ * Same as vfs_copy_ex() with VFS_COPY_PARAMS_DEFAULT.
  * \param srcpath IN Path to source file.
  * \param dstpath IN Path to destination file.
  * \param dstmode IN Path to destination file.
@@ -294,6 +450,56 @@ void vfs_sync(void);
  */
 ssize_t vfs_copy(const char *srcpath, const char *dstpath, mode_t mode);
 
+/*!
+ * \brief Progress of a vfs_copy_ex(), called after each chunk.
+ * \param copied IN Bytes copied so far.
+ * \param total IN Size of the source, 0 when unknown (compressed source).
+ * \param ctxt IN User context of the copy.
+ * \return 0 to continue, non-zero to abort the copy, which then fails with errno ECANCELED.
+ */
+typedef int (*vfs_copy_progress_cb_t)(off_t copied, off_t total, void *ctxt);
+
+/* copy methods of vfs_copy_ex(), tried in this order */
+#define VFS_COPY_REFLINK        0x01    /* share the extents, on filesystems supporting FICLONE */
+#define VFS_COPY_FILE_RANGE     0x02    /* copy_file_range(), in-kernel or server-side copy */
+#define VFS_COPY_SENDFILE       0x04    /* sendfile() */
+#define VFS_COPY_READ_WRITE     0x08    /* read/write loop through a user space buffer */
+#define VFS_COPY_ALL            0x0F
+
+/*!
+ * \brief Parameters of vfs_copy_ex().
+ */
+typedef struct {
+    mode_t src_mode;                    /*!< VFS_MODE_ZSTD for a compressed source, (mode_t) -1 otherwise (detected for a VFS_MODE_ZSTD destination). */
+    const vfs_zstd_params_t *zstd;      /*!< Compression parameters of a VFS_MODE_ZSTD destination, NULL for the defaults. */
+    vfs_copy_progress_cb_t progress;    /*!< Progress callback, NULL for none. */
+    void *ctxt;                         /*!< User context of the progress callback. */
+    size_t chunk_size;                  /*!< Bytes per copy call, 0 for 8 MiB. */
+    unsigned int methods;               /*!< VFS_COPY_* methods allowed, 0 for all. */
+} vfs_copy_params_t;
+
+#define VFS_COPY_PARAMS_DEFAULT { (mode_t) -1, NULL, NULL, NULL, 0, 0 }
+
+/*!
+ * \brief Copy a file with progress reporting and a choice of copy methods.
+ *
+ * The destination is truncated and filled with the fastest method supported by both files:
+ * a reflink shares the extents, copy_file_range() copies in the kernel (or on the server for NFS),
+ * then sendfile() and a read/write loop. The space is reserved up front, so a full disk fails
+ * the copy before anything is written.
+ * When the source and the destination are both compressed, the compressed bytes are copied as
+ * they are: a source starting with a zstd frame is taken as compressed when its mode is not given. A compressed source copied to a plain destination is decompressed and the reverse
+ * compresses, in a single pass.
+ * \param srcpath IN Path to source file.
+ * \param dstpath IN Path to destination file.
+ * \param dstmode IN Destination file permissions, optionally with VFS_MODE_ZSTD
+ * ((mode_t) -1 to inherit the permissions and the compression of the source file).
+ * \param params IN Copy parameters, NULL for VFS_COPY_PARAMS_DEFAULT.
+ * \return Number of bytes copied (uncompressed when transcoding) on success, error -1 on failure.
+ * \sa vfs_copy
+ */
+ssize_t vfs_copy_ex(const char *srcpath, const char *dstpath, mode_t dstmode, const vfs_copy_params_t *params);
+
 /*!
  * \brief Remove this link and possibly the file it refers to.
  *
@@ -388,11 +594,135 @@ int vfs_readdir(vfs_dir_handle_t handle, char *buffer, size_t size);
  */
 int vfs_closedir(vfs_dir_handle_t handle);
 
+/*!
+ * \brief Directory entry returned by vfs_readdir_batch().
+ */
+typedef struct {
+    const char *name;       /*!< Entry name, valid until the next read or the close of the handle */
+    uint64_t ino;           /*!< Inode number */
+    unsigned char type;     /*!< DT_REG, DT_DIR, DT_LNK..., DT_UNKNOWN when the filesystem does not tell */
+} vfs_dirent_t;
+
+/*!
+ * \brief Read many entries of a directory at once.
+ *
+ * The entries are read from the kernel in bulk (getdents64), with their type and inode, so a
+ * scan which only needs the type does not stat each entry. "." and ".." are skipped.
+ * Reads may be mixed with vfs_readdir() on the same handle.
+ *
+ * \note The input parameter handle should NOT be shared between threads.
+ *
+ * \param handle IN Directory stream handle.
+ * \param entries OUT Entries read, their names point into the handle.
+ * \param max IN Size of the entries array.
+ * \return The number of entries read, 0 at the end of the directory stream, -1 on failure.
+ * \sa vfs_opendir, vfs_statx_batch
+ */
+int vfs_readdir_batch(vfs_dir_handle_t handle, vfs_dirent_t *entries, int max);
+
+/* Fields of vfs_statx_t, the values of the kernel STATX_* bits */
+#define VFS_STATX_TYPE          0x0001  /* file type bits of mode */
+#define VFS_STATX_MODE          0x0002  /* permission bits of mode */
+#define VFS_STATX_NLINK         0x0004
+#define VFS_STATX_MTIME         0x0040
+#define VFS_STATX_INO           0x0100
+#define VFS_STATX_SIZE          0x0200
+#define VFS_STATX_BLOCKS        0x0400
+#define VFS_STATX_ALL           0x0747
+#define VFS_STATX_DONT_SYNC     0x80000000  /* take cached attributes of network filesystems as they are */
+
+/*!
+ * \brief Attributes of a directory entry, filled by vfs_statx_batch().
+ */
+typedef struct {
+    const char *name;       /*!< IN Entry name, relative to the directory */
+    int error;              /*!< OUT 0, or errno of the failed call */
+    unsigned int mask;      /*!< OUT VFS_STATX_* fields filled */
+    mode_t mode;            /*!< OUT File type and permissions */
+    uint32_t nlink;         /*!< OUT Number of hard links */
+    uint64_t ino;           /*!< OUT Inode number */
+    uint64_t size;          /*!< OUT Size in bytes */
+    uint64_t blocks;        /*!< OUT Allocated 512-byte blocks */
+    int64_t mtime;          /*!< OUT Last modification, seconds */
+    uint32_t mtime_nsec;    /*!< OUT Last modification, nanoseconds */
+} vfs_statx_t;
+
+/*!
+ * \brief Get some attributes of many entries of a directory.
+ *
+ * Each entry is looked up relative to the open directory, not from its full path, and only the
+ * requested fields are fetched (statx). Symbolic links are not followed.
+ * \param handle IN Directory stream handle, NULL for names relative to the current directory.
+ * \param entries IN/OUT Entries, name set by the caller.
+ * \param count IN Number of entries.
+ * \param mask IN Bitwise OR-ed VFS_STATX_* fields to get.
+ * \return The number of entries whose error is 0, -1 on invalid arguments.
+ * \sa vfs_readdir_batch
+ */
+int vfs_statx_batch(vfs_dir_handle_t handle, vfs_statx_t *entries, int count, unsigned int mask);
+
+/*!
+ * \brief Remove an entry of an open directory.
+ * \param handle IN Directory stream handle, NULL for a name relative to the current directory.
+ * \param name IN Entry name.
+ * \param flags IN 0 for a file, AT_REMOVEDIR for an empty directory.
+ * \return 0 on success, error -1 on failure.
+ * \sa vfs_unlink, vfs_rmdir
+ */
+int vfs_unlinkat(vfs_dir_handle_t handle, const char *name, int flags);
+
+/*!
+ * \brief Totals of a vfs_walk().
+ */
+typedef struct {
+    uint64_t dirs;          /*!< Directories, the root included */
+    uint64_t files;         /*!< Other entries */
+    uint64_t bytes;         /*!< Sum of the sizes, with VFS_STATX_SIZE */
+    uint64_t blocks;        /*!< Sum of the allocated 512-byte blocks, with VFS_STATX_BLOCKS */
+    uint64_t errors;        /*!< Entries or directories which could not be read */
+} vfs_walk_stats_t;
+
+/*!
+ * \brief Type of callback of vfs_walk(), called for each entry below the root.
+ * \param dir Path of the directory of the entry.
+ * \param entry Attributes of the entry.
+ * \param ctxt User context given to vfs_walk().
+ * \return 0 to go on, non-zero to stop the walk.
+ */
+typedef int (*vfs_walk_cb_t)(const char *dir, const vfs_statx_t *entry, void *ctxt);
+
+/*!
+ * \brief Parameters of vfs_walk().
+ */
+typedef struct {
+    unsigned int threads;   /*!< Threads reading directories, the caller included, 0 for 4, 64 at most */
+    unsigned int mask;      /*!< VFS_STATX_* fields of the entries, 0 for VFS_STATX_SIZE | VFS_STATX_BLOCKS */
+    vfs_walk_cb_t cb;       /*!< Called for each entry, concurrently from the threads, or NULL */
+    void *ctxt;             /*!< Context given to the callback */
+} vfs_walk_params_t;
+
+#define VFS_WALK_PARAMS_DEFAULT { 0, 0, NULL, NULL }
+
+/*!
+ * \brief Walk a directory tree in parallel, du-style.
+ *
+ * The directories are read by a bounded set of threads, each with vfs_readdir_batch() and
+ * vfs_statx_batch(). No stat is done when only the type and inode are requested and the
+ * filesystem reports the types. Symbolic links are not followed, hard links are counted
+ * once per name. The call blocks until the tree is walked, keep it off the loop threads.
+ * \param path IN Root directory, followed when it is a symbolic link.
+ * \param params IN Walk parameters, NULL for VFS_WALK_PARAMS_DEFAULT.
+ * \param stats OUT Totals, also filled when the walk was stopped.
+ * \return 0 on success, -1 when the root cannot be read or the callback stopped the walk (errno
+ * ECANCELED).
+ */
+int vfs_walk(const char *path, const vfs_walk_params_t *params, vfs_walk_stats_t *stats);
+
 /*!
  * \brief Monitor a path for filesystem events.
- * The current implementation only supports file creation events. The path should be an
- * existing directory. When a file is created in this directory, the given callback is
- * called.
+ * The path should be an existing directory. When an entry of this directory is created, modified
+ * or deleted, the given callback is called with the name of the entry.
+ * Same as vfs_monitor_ex() with VFS_MONITOR_PARAMS_DEFAULT.
  * \param path Path to be monitored.
  * \param type_mask Bitwise OR-ed vfs_monitor_event_t's to be reported.
  * \param cb Callback to be called when an event occurs.
@@ -402,6 +732,144 @@ int vfs_closedir(vfs_dir_handle_t handle);
  */
 vevent_t *vfs_monitor(const char *path, uint32_t type_mask, vfs_monitor_cb_t cb, void *ctxt);
 
+#define VFS_MONITOR_RECURSIVE   0x01    /* also monitor the subdirectories, present and future */
+
+/*!
+ * \brief Parameters of vfs_monitor_ex().
+ */
+typedef struct {
+    uint32_t flags;             /*!< VFS_MONITOR_* flags. */
+    unsigned int coalesce_ms;   /*!< Window in which the events on the same name are merged into one
+                                     callback, 0 to report each event. */
+} vfs_monitor_params_t;
+
+#define VFS_MONITOR_PARAMS_DEFAULT { 0, 0 }
+
+/*!
+ * \brief Monitor a directory, optionally with its subdirectories, for filesystem events.
+ *
+ * The monitors of a loop thread share one inotify descriptor, read in large batches, so thousands
+ * of watched directories cost one descriptor and one loop event.
+ * With a coalescing window, the first event on a name opens the window and, when it ends, one
+ * callback reports the OR-ed types of all events on that name, in the order the names were first
+ * seen. The order of the merged types is lost, the caller checks the state of the entry.
+ * A recursive monitor reports names relative to the path ("dir/file"), watches the directories
+ * created or moved in later on, and reports as created the entries they already contain.
+ * When events were lost by the kernel, the callback gets an empty name with all the requested
+ * types, the caller then rescans the directory.
+ * When the directory itself is removed or moved, the callback is called with VEVENT_FAILURE and the
+ * monitoring ends. Cancelling the vevent ends it with VEVENT_CANCEL.
+ * \param path Directory to be monitored.
+ * \param type_mask Bitwise OR-ed vfs_monitor_event_t's to be reported.
+ * \param params Monitor parameters, NULL for VFS_MONITOR_PARAMS_DEFAULT.
+ * \param cb Callback to be called when an event occurs.
+ * \param ctxt Context pointer to be given to the callback
+ * \return NULL on failure, a vevent in case of success, to stop the monitoring with vevent_cancel().
+ * \sa vfs_monitor
+ */
+vevent_t *vfs_monitor_ex(const char *path, uint32_t type_mask, const vfs_monitor_params_t *params,
+                         vfs_monitor_cb_t cb, void *ctxt);
+
+/*!
+ * \brief Type of callback of the asynchronous file operations.
+ * \param reason VEVENT_OCCURED on success, VEVENT_FAILURE when the operation failed,
+ * VEVENT_CANCEL or VEVENT_TIMEOUT when the vevent was cancelled or timed out first.
+ * \param result Result of the synchronous call: bytes read, written or copied, 0 for fsync, -1 on failure
+ * or when the operation was cancelled before it started.
+ * \param error errno of a failed operation, ECANCELED when it was cancelled before it started.
+ * \param ctxt User context given to the asynchronous call.
+ */
+typedef void (*vfs_async_cb_t)(vevent_reason_t reason, ssize_t result, int error, void *ctxt);
+
+/*!
+ * \brief Statistics of the asynchronous file operations.
+ */
+typedef struct {
+    unsigned int workers;       /*!< I/O threads started */
+    unsigned int queued;        /*!< Operations waiting for a thread */
+    unsigned int running;       /*!< Operations in progress */
+    unsigned int max_queued;    /*!< Highest number of operations waiting */
+    unsigned long submitted;    /*!< Operations accepted */
+    unsigned long completed;    /*!< Operations run which succeeded */
+    unsigned long failed;       /*!< Operations run which returned -1 */
+    unsigned long cancelled;    /*!< Operations whose vevent was cancelled or timed out before they finished */
+} vfs_async_stats_t;
+
+/*!
+ * \brief Read from a file without blocking the loop.
+ *
+ * The read runs on a thread of the vfs I/O pool, see vfs_async_set_workers(). The callback
+ * is called once, on the calling loop, when it is done. The buffer must stay valid until then.
+ * Operations run concurrently: do not queue several reads or writes at the current position
+ * of the same file.
+ * Cancelling the returned vevent drops a read which has not started yet, otherwise the callback
+ * is called with VEVENT_CANCEL after it.
+ * \param fd IN File descriptor to specify the file.
+ * \param buffer OUT Pointer to the data-location.
+ * \param nbytes IN Number of bytes to be read.
+ * \param offset IN Position to read from as vfs_pread(), -1 for the current position as vfs_read().
+ * \param cb IN Completion callback.
+ * \param ctxt IN Context given to the callback.
+ * \return A vevent handle on success, NULL on failure or when 4096 operations are already queued.
+ * \sa vfs_write_async, vfs_async_get_stats
+ */
+vevent_t *vfs_read_async(int fd, void *buffer, size_t nbytes, off_t offset, vfs_async_cb_t cb, void *ctxt);
+
+/*!
+ * \brief Write to a file without blocking the loop.
+ *
+ * Same as vfs_read_async(), for vfs_pwrite() or, with offset -1, vfs_write().
+ * \param fd IN File descriptor to specify the file.
+ * \param buffer IN Pointer to the data-location, not copied.
+ * \param nbytes IN Number of bytes to be written.
+ * \param offset IN Position to write at, -1 for the current position.
+ * \param cb IN Completion callback.
+ * \param ctxt IN Context given to the callback.
+ * \return A vevent handle on success, NULL on failure.
+ * \sa vfs_read_async, vfs_fsync_async
+ */
+vevent_t *vfs_write_async(int fd, const void *buffer, size_t nbytes, off_t offset, vfs_async_cb_t cb, void *ctxt);
+
+/*!
+ * \brief Copy a file without blocking the loop.
+ *
+ * Same as vfs_copy(), on a thread of the vfs I/O pool.
+ * \param srcpath IN Path to source file, copied.
+ * \param dstpath IN Path to destination file, copied.
+ * \param mode IN Destination file permissions, (mode_t) -1 for those of the source file.
+ * \param cb IN Completion callback.
+ * \param ctxt IN Context given to the callback.
+ * \return A vevent handle on success, NULL on failure.
+ * \sa vfs_copy
+ */
+vevent_t *vfs_copy_async(const char *srcpath, const char *dstpath, mode_t mode, vfs_async_cb_t cb, void *ctxt);
+
+/*!
+ * \brief Sync a file to its storage medium without blocking the loop.
+ * \param fd IN File descriptor to specify the file.
+ * \param cb IN Completion callback.
+ * \param ctxt IN Context given to the callback.
+ * \return A vevent handle on success, NULL on failure.
+ * \sa vfs_close, vfs_write_async
+ */
+vevent_t *vfs_fsync_async(int fd, vfs_async_cb_t cb, void *ctxt);
+
+/*!
+ * \brief Set the number of I/O threads of the asynchronous file operations.
+ *
+ * Threads are started when operations are queued and none is idle, 2 at most by default.
+ * Lowering the number does not stop started threads.
+ * \param nb_workers IN Maximum number of threads, 1 to 16.
+ * \return 0 on success, -1 on failure.
+ */
+int vfs_async_set_workers(unsigned int nb_workers);
+
+/*!
+ * \brief Get the statistics of the asynchronous file operations.
+ * \param stats OUT Statistics of the process.
+ */
+void vfs_async_get_stats(vfs_async_stats_t *stats);
+
 /*!
  * \brief Check whether a file exists on the filesystem.
  * \param path Path to the file, absolute or relative to current directory
@@ -7,7 +7,9 @@
 #include <libvapi/vlog_opentracing_wrapper.h>
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
 
 /*! \file vlog.h
  *  \brief Logging interface of the libvapi platform.
@@ -100,7 +102,9 @@
  *
  *    1. Early filter: if the level is below the configured threshold for this
  *       module, drop the trace. This is done to avoid processing the tags and
- *       the format string when not necessary.
+ *       the format string when not necessary. Call sites over the rate limit
+ *       of their module are dropped at the same point, see
+ *       vlog_module_set_ratelimit().
  *
  *    2. Tag filter: for each tag associated to the trace, if there is a filter
  *       registered for this tag, execute it. If the filter is positive, drop
@@ -142,10 +146,18 @@ extern "C"
 #define VLOG_MAX_FILENAME	128
 #endif
 
+#ifndef VLOG_MAX_KV
+#define VLOG_MAX_KV	16
+#endif
+
 #ifndef VLOG_MAX_SPAN_NAME
 #define VLOG_MAX_SPAN_NAME	64
 #endif
 
+#ifndef VLOG_MAX_MODULES
+#define VLOG_MAX_MODULES	256     /* log ids with a dense level threshold entry */
+#endif
+
 typedef unsigned long vlog_id_t; /*!< \brief Identifier for a log module (user of the logging interface) */
 
 
@@ -186,6 +198,26 @@ typedef enum {
     VLOG_STATUS_ENABLED = 1,
 } vlog_status_t;
 
+/*!
+ * \brief State of a logging call site, see vlog_callsite_set().
+ */
+typedef enum {
+    VLOG_CALLSITE_DEFAULT = 0,  /*!< Filtered by the level of its module. */
+    VLOG_CALLSITE_ON = 1,       /*!< Traced whatever the level of its module. */
+    VLOG_CALLSITE_OFF = 2,      /*!< Never traced. */
+} vlog_callsite_state_t;
+
+/*!
+ * \brief Type of the value of a key-value pair attached to a trace, see vlog_kv().
+ */
+typedef enum {
+    VLOG_KV_STR,        /*!< const char *, NULL is printed as null. */
+    VLOG_KV_INT,        /*!< long long */
+    VLOG_KV_UINT,       /*!< unsigned long long */
+    VLOG_KV_DOUBLE,     /*!< double, NaN and infinities are printed as null. */
+    VLOG_KV_BOOL,       /*!< int, printed as true or false. */
+} vlog_kv_type_t;
+
 /*!
  * \brief Log categories, used for syslog configuration.
  */
@@ -202,6 +234,25 @@ typedef struct {
     vlog_category_t mod_category;           /*!< log category */
 } vlog_module_config_t;
 
+/*!
+ * \brief Syslog transport.
+ */
+typedef enum {
+    VLOG_SYSLOG_DGRAM,      /*!< One datagram per message, sent in batches with sendmmsg. */
+    VLOG_SYSLOG_STREAM,     /*!< Octet-counted messages (RFC 6587) on a stream connection. */
+} vlog_syslog_transport_t;
+
+/*!
+ * \brief Syslog output counters.
+ */
+typedef struct {
+    unsigned long sent;         /*!< Messages handed to the socket. */
+    unsigned long batches;      /*!< Send system calls. */
+    unsigned long dropped;      /*!< Messages lost: socket full or unusable after a retry. */
+    unsigned long retries;      /*!< Sends retried after a full socket or a lost connection. */
+    unsigned long reconnects;   /*!< Socket reopened. */
+} vlog_syslog_stats_t;
+
 
 
 /*! \cond */
@@ -230,7 +281,145 @@ void __vlog_vprintf_ot(const char *span_name, const char *fmt, va_list ap) __FOR
 void __vlog_hexdump(void *addr, size_t size);
 void __vlog_print_full(const char *str, size_t len);
 int vlog_early_filter(vlog_id_t module, vlog_level_t level);
-void vlog_set_default_tags(const char *file, int line, const char *function);
+void vlog_set_default_tags(vlog_id_t module, vlog_level_t level, const char *file, int line, const char *function);
+
+/* Highest level that passes the early filter, per log id. Error levels always pass. */
+extern signed char vlog_module_threshold[VLOG_MAX_MODULES];
+
+static inline int __vlog_early_filter(vlog_id_t module, vlog_level_t level)
+{
+    if (__builtin_expect(module < VLOG_MAX_MODULES, 1))
+        return (int)level > __atomic_load_n(&vlog_module_threshold[module], __ATOMIC_RELAXED);
+
+    return vlog_early_filter(module, level);
+}
+
+/* Static state of one logging call site for rate limiting, see vlog_module_set_ratelimit() */
+typedef struct vlog_ratelimit_site {
+    const char *file;
+    int line;
+    uint64_t until;                     /* monotonic ns before which the site drops traces, 0 if open */
+    uint64_t tat;                       /* theoretical arrival time of the token bucket */
+    unsigned long passed;
+    unsigned long suppressed;           /* traces dropped by the token bucket */
+    unsigned long reported;             /* part of suppressed already noted in the log */
+    unsigned long repeated;             /* traces dropped as repeats of the previous one */
+    unsigned long repeats;              /* repeats not yet noted in the log */
+    uint64_t last_hash;
+    uint64_t last_time;
+    vlog_id_t module;
+    int lock;
+} vlog_ratelimit_site_t;
+
+#define VLOG_RATELIMIT_REPEAT_MAX_S     30  /* longest run of repeats folded into one note */
+
+#define VLOG_RATELIMIT_SITE_INITIALIZER { __FILE__, __LINE__, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }
+
+/* Set for the log ids having a rate limit or repeat suppression, see vlog_module_set_ratelimit() */
+extern unsigned char vlog_module_ratelimited[VLOG_MAX_MODULES];
+
+int __vlog_ratelimit_pass(vlog_ratelimit_site_t *site, vlog_id_t module);
+
+/* Same coarse clock as vlog_ratelimit.c, read from the vDSO without a system call */
+static inline uint64_t __vlog_ratelimit_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Drop the trace if its call site is over its rate. A site only pays for the clock read
+ * while it is being limited, and the sites of a module without limits only for two loads:
+ * rejecting a trace is a load, a coarse clock read and a relaxed counter update, without
+ * formatting nor locking. The counter may miss updates when several threads hit the same site.
+ */
+static inline int __vlog_ratelimit(vlog_ratelimit_site_t *site, vlog_id_t module)
+{
+    uint64_t until = __atomic_load_n(&site->until, __ATOMIC_RELAXED);
+
+    if (__builtin_expect(until != 0, 0)) {
+        if (__vlog_ratelimit_now() < until) {
+            __atomic_store_n(&site->suppressed, site->suppressed + 1, __ATOMIC_RELAXED);
+            return 1;
+        }
+    } else if (__builtin_expect(module < VLOG_MAX_MODULES, 1) &&
+               !__atomic_load_n(&vlog_module_ratelimited[module], __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    return __vlog_ratelimit_pass(site, module);
+}
+
+/*
+ * Static descriptor of one logging call site. The descriptors of an executable or shared
+ * object are gathered by the linker in the vlog_callsites section, and registered at startup.
+ * g++ ignores the section of the static variables of function templates: their call sites
+ * are filtered and counted, but cannot be listed nor set.
+ */
+typedef struct vlog_callsite {
+    const char *file;
+    const char *func;
+    const char *fmt;                    /* NULL if not a string literal */
+    int line;
+    signed char level;                  /* -1 if not a constant */
+    unsigned char flags;                /* vlog_callsite_state_t */
+    vlog_id_t module;                   /* log id of the last trace, -1 before the first */
+    unsigned long hits;                 /* traces past the filters */
+    vlog_ratelimit_site_t rl;
+} vlog_callsite_t;
+
+/* aligned: the compiler must not pad between the descriptors of the section */
+#define VLOG_CALLSITE_DECLARE(name, level, fmtstr) \
+    static vlog_callsite_t name __attribute__((section("vlog_callsites"), used, aligned(8))) = { \
+        __FILE__, __func__, __builtin_constant_p(fmtstr) ? (fmtstr) : NULL, __LINE__, \
+        __builtin_constant_p(level) ? (level) : -1, VLOG_CALLSITE_DEFAULT, (vlog_id_t)-1, 0, \
+        VLOG_RATELIMIT_SITE_INITIALIZER }
+
+extern vlog_callsite_t __start_vlog_callsites[] __attribute__((weak, visibility("hidden")));
+extern vlog_callsite_t __stop_vlog_callsites[] __attribute__((weak, visibility("hidden")));
+
+void __vlog_callsites_register(vlog_callsite_t *start, vlog_callsite_t *stop);
+void __vlog_callsites_unregister(vlog_callsite_t *start);
+void __vlog_set_callsite(vlog_callsite_t *site, vlog_id_t module, vlog_level_t level);
+
+/*
+ * The section of each executable or shared object is registered once: every translation unit
+ * emits the same hidden weak functions, and their init and fini array entries in a COMDAT
+ * group, so the linker keeps one of each per object.
+ */
+#define __VLOG_STR(x) #x
+#define __VLOG_XSTR(x) __VLOG_STR(x)
+#define __VLOG_CALLSITES_HOOK(array, func) \
+    __asm__(".pushsection ." #array ",\"awG\",@" #array "," #func "_entry,comdat\n" \
+            "\t.balign " __VLOG_XSTR(__SIZEOF_POINTER__) "\n" \
+            "\t.dc.a " #func "\n" \
+            "\t.popsection")
+
+__attribute__((weak, visibility("hidden"), used)) void __vlog_callsites_init(void)
+{
+    __vlog_callsites_register(__start_vlog_callsites, __stop_vlog_callsites);
+}
+
+__attribute__((weak, visibility("hidden"), used)) void __vlog_callsites_exit(void)
+{
+    __vlog_callsites_unregister(__start_vlog_callsites);
+}
+
+__VLOG_CALLSITES_HOOK(init_array, __vlog_callsites_init);
+__VLOG_CALLSITES_HOOK(fini_array, __vlog_callsites_exit);
+
+/* A site set on or off overrides the level of its module: one byte load before the early filter */
+static inline int __vlog_callsite_filter(vlog_callsite_t *site, vlog_id_t module, vlog_level_t level)
+{
+    unsigned char flags = __atomic_load_n(&site->flags, __ATOMIC_RELAXED);
+
+    if (__builtin_expect(flags == VLOG_CALLSITE_DEFAULT, 1))
+        return __vlog_early_filter(module, level);
+
+    return flags != VLOG_CALLSITE_ON;
+}
 
 /*! \endcond */
 
@@ -238,36 +427,47 @@ void vlog_set_default_tags(const char *file, int line, const char *function);
  * \brief Central logging macro. Not to be used directly.
  *
  * All traces go through here. It has the following roles:
- *   - Early stop: do nothing if the log level is not activated for the log module.
+ *   - Call site: declare the static descriptor of the call site, see vlog_callsite_set().
+ *   - Early stop: do nothing if the log level is not activated for the log module,
+ *     unless the call site is set on or off.
+ *   - Rate limit: do nothing if the call site is over the rate of its module.
  *   - Save each tag value in the corresponding global variable, and add default tags.
  *   - Call the logging function.
  *
  */
 
-#define VLOG_PRINT_CORE(vlog_printf_variant, module, level, tags, fmtstr, ...) do { \
-        if (vlog_early_filter(module, level)) break; \
-        vlog_set_default_tags(__FILE__, __LINE__, __func__); \
+#define VLOG_PRINT_CORE_KV(vlog_printf_variant, module, level, tags, kvs, fmtstr, ...) do { \
+        VLOG_CALLSITE_DECLARE(__vlog_site, level, fmtstr); \
+        if (__vlog_callsite_filter(&__vlog_site, module, level)) break; \
+        if (__vlog_ratelimit(&__vlog_site.rl, module)) break; \
+        __vlog_set_callsite(&__vlog_site, module, level); \
         VLOG_SET_TAGS(tags); \
+        (void)kvs; \
         vlog_printf_variant(fmtstr, ##__VA_ARGS__); \
     } while (0);
 
+#define VLOG_PRINT_CORE(vlog_printf_variant, module, level, tags, fmtstr, ...) \
+    VLOG_PRINT_CORE_KV(vlog_printf_variant, module, level, tags, 0, fmtstr, ##__VA_ARGS__)
+
 #define VLOG_PRINT_CORE_FULL(vlog_printf_variant, module, level, tags, addr, size) do { \
-        if (vlog_early_filter(module, level)) break; \
-        vlog_set_default_tags(__FILE__, __LINE__, __func__); \
+        if (__vlog_early_filter(module, level)) break; \
+        vlog_set_default_tags(module, level, __FILE__, __LINE__, __func__); \
         VLOG_SET_TAGS(tags); \
         vlog_printf_variant(addr, size); \
     } while (0);
 
 #define VLOG_PRINT_CORE_OT(vlog_printf_variant, span_name, module, level, tags, fmtstr, ...) do { \
-        if (vlog_early_filter(module, level)) break; \
-        vlog_set_default_tags(__FILE__, __LINE__, __func__); \
+        VLOG_CALLSITE_DECLARE(__vlog_site, level, fmtstr); \
+        if (__vlog_callsite_filter(&__vlog_site, module, level)) break; \
+        if (__vlog_ratelimit(&__vlog_site.rl, module)) break; \
+        __vlog_set_callsite(&__vlog_site, module, level); \
         VLOG_SET_TAGS(tags); \
         vlog_printf_variant(span_name, fmtstr, ##__VA_ARGS__); \
     } while (0);
 
 #define VLOG_PRINT_CORE_FULL_OT(vlog_printf_variant, span_name, module, tags, addr, size) do { \
-        if (vlog_early_filter(module, VLOG_DEBUG)) break; \
-        vlog_set_default_tags(__FILE__, __LINE__, __func__); \
+        if (__vlog_early_filter(module, VLOG_DEBUG)) break; \
+        vlog_set_default_tags(module, VLOG_DEBUG, __FILE__, __LINE__, __func__); \
         VLOG_SET_TAGS(tags); \
         vlog_printf_variant(span_name, addr, size); \
     } while (0);
@@ -297,6 +497,34 @@ void vlog_set_default_tags(const char *file, int line, const char *function);
 #define vlog_printf_ot(span_name, module, level, tags, fmt, ...) \
     VLOG_PRINT_CORE_OT(__vlog_printf_ot, span_name, module, level, VLOG_TAGS(tags), fmt, ##__VA_ARGS__)
 
+/*!
+ * \brief Delimit a list of key-value pairs to pass to vlog_printf_kv().
+ *
+ * Example: `VLOG_KVS(vlog_kv_str("peer", addr), vlog_kv_int("port", port))`
+ */
+#define VLOG_KVS(...) (__VA_ARGS__)
+
+/*!
+ * \brief Print a trace with typed key-value pairs
+ *
+ * The pairs are only evaluated when the trace passes the early filters. They are fields of
+ * the outputs using the %JSON format, other formats ignore them.
+ *
+ * \param module Log id
+ * \param level Log level
+ * \param kvs List of key-value pairs delimited by VLOG_KVS
+ * \param fmt Message
+ * \param ... Format string arguments
+ */
+#define vlog_printf_kv(module, level, kvs, fmt, ...) \
+    VLOG_PRINT_CORE_KV(__vlog_printf, module, level, VLOG_TAGS(TAG_END), kvs, fmt, ##__VA_ARGS__)
+
+#define vlog_kv_str(key, val)       vlog_kv(key, VLOG_KV_STR, (const char *)(val))
+#define vlog_kv_int(key, val)       vlog_kv(key, VLOG_KV_INT, (long long)(val))
+#define vlog_kv_uint(key, val)      vlog_kv(key, VLOG_KV_UINT, (unsigned long long)(val))
+#define vlog_kv_double(key, val)    vlog_kv(key, VLOG_KV_DOUBLE, (double)(val))
+#define vlog_kv_bool(key, val)      vlog_kv(key, VLOG_KV_BOOL, (int)!!(val))
+
 /*!
  * \brief Print a trace with zero or more tags
  * \param module Log id
@@ -456,6 +684,95 @@ const char *vlog_module_get_name(vlog_id_t log_id);
  */
 int vlog_module_set_loglevel(vlog_id_t log_id, int level);
 
+/*!
+ * \brief   Sets the default rate limit of the call sites of a log module
+ *
+ * Each call site of the module gets its own token bucket, which refills at \p rate
+ * traces per second and holds up to \p burst traces. Traces over the limit are dropped
+ * before their message is formatted, and the next trace that passes at that call site
+ * is preceded by a note with the number of dropped traces.
+ *
+ * \param   log_id     IN Log module, must be below VLOG_MAX_MODULES
+ * \param   rate       IN Traces per second per call site, 0 disables rate limiting
+ * \param   burst      IN Traces allowed at once per call site, at least 1
+ *
+ * \return 0 in case of success, -1 in case of error
+ */
+int vlog_module_set_ratelimit(vlog_id_t log_id, unsigned int rate, unsigned int burst);
+
+/*!
+ * \brief   Enables the suppression of repeated traces for a log module
+ *
+ * When enabled, a trace identical to the previous trace of the same call site is dropped,
+ * and replaced by a "last message repeated N times" note once a different trace passes at
+ * that call site, or once the repeats last longer than VLOG_RATELIMIT_REPEAT_MAX_S.
+ *
+ * \param   log_id     IN Log module, must be below VLOG_MAX_MODULES
+ * \param   enable     IN 1 to enable, 0 to disable
+ *
+ * \return 0 in case of success, -1 in case of error
+ */
+int vlog_module_set_repeat_suppression(vlog_id_t log_id, int enable);
+
+/*!
+ * \brief   Gets the rate limit configuration of a log module
+ *
+ * \param   log_id     IN  Log module
+ * \param   rate       OUT Traces per second per call site, 0 if not limited
+ * \param   burst      OUT Traces allowed at once per call site
+ * \param   repeat     OUT 1 if repeated traces are suppressed
+ *
+ * \return 0 in case of success, -1 in case of error
+ */
+int vlog_module_get_ratelimit(vlog_id_t log_id, unsigned int *rate, unsigned int *burst, int *repeat);
+
+/*!
+ * \brief   Prints the counters of the rate limited call sites
+ *
+ * Only call sites that dropped or passed a trace of a module with a rate limit or with
+ * repeat suppression are listed.
+ *
+ * \param   print_cb   IN Callback called for each line
+ * \param   cb_arg     IN Argument passed to the callback
+ */
+void vlog_ratelimit_dump_sites(void (*print_cb)(void *cb_arg, const char *line), void *cb_arg);
+
+/*!
+ * \brief   Attach a key-value pair to the trace being printed by the calling thread.
+ *
+ * Meant to be called through vlog_printf_kv() and the vlog_kv_str(), vlog_kv_int(),
+ * vlog_kv_uint(), vlog_kv_double() and vlog_kv_bool() macros. The key and a string value
+ * are not copied and must stay valid until the trace is printed. Pairs beyond
+ * VLOG_MAX_KV are ignored.
+ *
+ * \param   key         IN Field name.
+ * \param   type        IN Type of the value that follows.
+ */
+void vlog_kv(const char *key, vlog_kv_type_t type, ...);
+
+/*!
+ * \brief   Set logging call sites on or off, whatever the level of their module.
+ *
+ * Enables the debug traces of one line in production, without raising the level of the
+ * whole module. The outputs still apply their own level.
+ *
+ * \param   file        IN Source file of the call sites, a path or a trailing part of it.
+ * \param   line        IN Line of the call sites, 0 for all lines of the file.
+ * \param   state       IN New state of the call sites.
+ *
+ * \return  Number of call sites set, -1 in case of error
+ */
+int vlog_callsite_set(const char *file, int line, vlog_callsite_state_t state);
+
+/*!
+ * \brief   Print each logging call site: location, module, level, state and hit count.
+ *
+ * \param   file        IN Only the call sites of files containing this string, NULL for all.
+ * \param   print_cb    IN Callback called for each line.
+ * \param   cb_arg      IN Argument passed to the callback.
+ */
+void vlog_callsites_dump(const char *file, void (*print_cb)(void *cb_arg, const char *line), void *cb_arg);
+
 /*!
  * \brief   Returns a string representing the name of the given log level
  *
@@ -541,6 +858,27 @@ int vlog_set_syslog_config(vlog_module_config_t *cfg, int nbr);
  */
 int vlog_reset_syslog_config(vlog_category_t syslog_category);
 
+/*!
+ * \brief   Set the destination of the syslog output, and (re)open it.
+ *
+ * Messages are queued and sent in batches: when the batch is full, when its oldest
+ * message waited a few milliseconds, or at the end of a burst of traces.
+ *
+ * \param   addr        IN IPv4 or IPv6 address, or path of a unix socket.
+ * \param   port        IN Port, ignored for a unix socket.
+ * \param   transport   IN Datagrams, or octet-counted stream for reliable delivery.
+ *
+ * \return  0 in case of success, -1 in case of error
+ */
+int vlog_set_syslog_destination(const char *addr, int port, vlog_syslog_transport_t transport);
+
+/*!
+ * \brief   Get the syslog output counters.
+ *
+ * \param   stats       OUT Counters.
+ */
+void vlog_get_syslog_stats(vlog_syslog_stats_t *stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,80 @@
+#ifndef __VLOG_ASYNC_H__
+#define __VLOG_ASYNC_H__
+
+/*!
+ * \file vlog_async.h
+ *
+ * \brief Asynchronous log output.
+ *
+ * In asynchronous mode, a log call formats its record on the calling thread and
+ * copies it into a lock-free ring owned by that thread. A dedicated writer thread
+ * drains all rings in timestamp order and performs the console, file, tndd and
+ * syslog writes, so slow outputs no longer stall the callers.
+ *
+ * Pending records are flushed at exit() and, for console and log file, from the
+ * fatal signal handlers.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*!
+ * \brief What a logging thread does when its ring is full.
+ */
+typedef enum {
+    VLOG_ASYNC_BLOCK,       /*!< Wait until the writer thread made room. */
+    VLOG_ASYNC_DROP_NEW,    /*!< Drop the new record. */
+    VLOG_ASYNC_DROP_OLD,    /*!< Overwrite the oldest pending record. */
+} vlog_async_policy_t;
+
+/*!
+ * \brief Asynchronous logging counters.
+ */
+typedef struct {
+    unsigned long written;  /*!< Records handed to the outputs by the writer thread. */
+    unsigned long dropped;  /*!< Records lost because a ring was full. */
+    unsigned long sync;     /*!< Records written synchronously as fallback. */
+    unsigned int rings;     /*!< Per-thread rings currently allocated. */
+} vlog_async_stats_t;
+
+/*!
+ * \brief Switch log output to asynchronous mode.
+ *
+ * \param ring_records  IN Number of records per thread ring, rounded up to a power of two.
+ * \param policy        IN Overflow policy.
+ * \return 0 on success, -1 on failure
+ */
+int vlog_async_start(unsigned int ring_records, vlog_async_policy_t policy);
+
+/*!
+ * \brief Drain all pending records, stop the writer thread and return to synchronous mode.
+ */
+void vlog_async_stop(void);
+
+/*!
+ * \brief Wait until all records logged so far have been written.
+ *
+ * \return 0 on success, -1 if the writer did not catch up in time
+ */
+int vlog_async_flush(void);
+
+/*!
+ * \brief Change the overflow policy.
+ *
+ * \param policy        IN Overflow policy.
+ */
+void vlog_async_set_policy(vlog_async_policy_t policy);
+
+/*!
+ * \brief Get asynchronous logging counters.
+ *
+ * \param stats         OUT Counters.
+ */
+void vlog_async_get_stats(vlog_async_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef __VLOG_DEFERRED_H__
+#define __VLOG_DEFERRED_H__
+
+#include <stdint.h>
+
+#include <libvapi/vlog.h>
+
+/*!
+ * \file vlog_deferred.h
+ *
+ * \brief Deferred-formatting log records.
+ *
+ * A vlog_deferred_printf() call site registers a static descriptor holding its format
+ * string, source location and level on first use. Each call then only copies the raw
+ * arguments into a compact binary record, without running vsnprintf on the caller.
+ *
+ * Records travel through the asynchronous output rings (see vlog_async.h). The writer
+ * thread either formats them to the regular log outputs, or appends them unformatted to
+ * a binary log file opened with vlog_deferred_open(). Such a file is turned into text
+ * offline with the vlog_decode tool.
+ *
+ * Restrictions:
+ *   - the level must be a compile-time constant,
+ *   - tags are not supported,
+ *   - %n, %m, %ls and long double conversions are not supported, and strings are
+ *     truncated to fit the record. Call sites with an unsupported format, calls of a level
+ *     kept by the flight recorder, and all calls while asynchronous output is stopped, are
+ *     formatted synchronously like vlog_printf().
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VLOG_DEFERRED_MAX_ARGS      16
+#define VLOG_DEFERRED_MAX_SITES     4096
+
+/*! \cond */
+
+typedef struct vlog_deferred_site {
+    const char *fmt;
+    const char *file;
+    int line;
+    vlog_level_t level;
+    uint32_t id;                                /* assigned on first use */
+    int8_t nargs;                               /* -1 when formatted synchronously */
+    uint8_t types[VLOG_DEFERRED_MAX_ARGS];
+    unsigned long hits;
+} vlog_deferred_site_t;
+
+void __vlog_deferred(vlog_deferred_site_t *site, vlog_id_t module, ...);
+
+/*! \endcond */
+
+/*!
+ * \brief Print a trace with deferred formatting.
+ * \param module Log id
+ * \param level Log level, must be a constant
+ * \param fmt Message, must be a string literal
+ * \param ... Format string arguments
+ */
+#define vlog_deferred_printf(module, level, fmt, ...) do { \
+        static vlog_deferred_site_t __vlog_site = { fmt, __FILE__, __LINE__, level, 0, 0, {0}, 0 }; \
+        if (__vlog_early_filter(module, level)) break; \
+        if (0) __vlog_printf(fmt, ##__VA_ARGS__); /* format check only */ \
+        __vlog_deferred(&__vlog_site, module, ##__VA_ARGS__); \
+    } while (0)
+
+/*!
+ * \brief Write deferred records unformatted to a binary log file instead of the log outputs.
+ *
+ * \param path          IN File to create (truncated if it exists).
+ * \return 0 on success, -1 on failure
+ */
+int vlog_deferred_open(const char *path);
+
+/*!
+ * \brief Close the binary log file, deferred records go to the log outputs again.
+ */
+void vlog_deferred_close(void);
+
+/*!
+ * \brief Print the registered call sites.
+ *
+ * \param print_cb      IN Callback called for each line.
+ * \param cb_arg        IN Argument passed to the callback.
+ */
+void vlog_deferred_dump_sites(void (*print_cb)(void *cb_arg, const char *line), void *cb_arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -18,11 +18,19 @@ enum rotate_states {
 };
 
 struct vlog_file_type;
+struct vlog_file_segment;
 
 typedef int (*vlog_file_rotate_cb)(struct vlog_file_type *handle);
 
+/*
+ * Log lines are appended into a pre-sized mmap'd region of the active file.
+ * Rotation, flushing (every flushtime seconds), disk preallocation and the
+ * filesystem usage watermarks (fs_size_hwm/lwm, in percent) are handled by a
+ * maintenance thread, not by the writing threads.
+ */
 typedef struct vlog_file_type {
-    FILE      *file;
+    struct vlog_file_segment *seg;      /* active file */
+    struct vlog_file_segment *next;     /* pre-created file to rotate to */
     char      pathname[VLOG_MAX_FILENAME];
     char      filename[VLOG_MAX_FILENAME];
     int       force_rotate;
@@ -39,13 +47,17 @@ typedef struct vlog_file_type {
     enum rotate_states rstate;
     vthread_mutex_t mutex;
     vlog_file_rotate_cb cb;
-    struct vlist filelist;
+    struct vlist filelist;              /* rotated out files waiting to be closed */
     void      *data;
+    int       rotate_pending;
+    unsigned long dropped;              /* lines lost while above the high watermark */
+    struct vlist node;                  /* maintenance thread list */
 } vlog_file_type_t;
 
 int vlog_file_open(vlog_file_type_t *handle);
 int vlog_file_flush(vlog_file_type_t *handle, time_t now);
 int vlog_file_write(vlog_file_type_t *handle, char *line);
+int vlog_file_write_asyncsignalsafe(vlog_file_type_t *handle, const char *str, size_t len);
 int vlog_file_close(vlog_file_type_t *handle);
 int vlog_file_get_fd(vlog_file_type_t *handle);
 int vlog_file_cleanup(vlog_file_type_t *handle);
@@ -0,0 +1,91 @@
+#ifndef __VLOG_FLIGHTREC_H__
+#define __VLOG_FLIGHTREC_H__
+
+#include <stddef.h>
+
+#include <libvapi/vlog.h>
+
+/*!
+ * \file vlog_flightrec.h
+ *
+ * \brief Crash flight recorder.
+ *
+ * Each thread that logs gets a ring in memory, holding its last traces of all levels down
+ * to the flight recorder floor, including the levels not enabled on the module. Recording
+ * a trace does no I/O: it is a memcpy of the formatted message into the ring of the thread.
+ *
+ * The rings live in a shared mapping of a memfd named "vlog_flightrec", which can be read
+ * from /proc/PID/fd while the process runs. On a fatal signal, the last bytes of each ring
+ * are written to the error records after the crash report. They can also be printed on
+ * demand with `log flightrecorder dump`.
+ *
+ * The recorder is started by vlog_init() with a floor of VLOG_FLIGHTREC_DEFAULT_FLOOR, which
+ * records nothing: a floor raises the early filter threshold of every module, so recording
+ * is enabled on demand with vlog_flightrec_set_floor() or `log flightrecorder floor`.
+ *
+ * Deferred traces (see vlog_deferred.h) of a recorded level are formatted on the calling
+ * thread, so that they reach its ring before a crash.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VLOG_FLIGHTREC_RING_SIZE        (64 * 1024)     /* bytes per thread */
+#define VLOG_FLIGHTREC_MAX_THREADS      64
+#define VLOG_FLIGHTREC_DUMP_SIZE        (16 * 1024)     /* bytes per ring dumped on a crash */
+#define VLOG_FLIGHTREC_DEFAULT_FLOOR    VLOG_DISABLED
+
+/*!
+ * \brief Callback receiving the dump of the flight recorder, one line at a time.
+ */
+typedef void (*vlog_flightrec_write_cb_t)(void *cb_arg, const char *line, size_t len);
+
+/*!
+ * \brief Start the flight recorder. Called by vlog_init().
+ *
+ * \param ring_size     IN Bytes per thread ring.
+ * \param floor         IN Lowest priority level recorded, VLOG_DISABLED records nothing.
+ * \return 0 on success, -1 on failure
+ */
+int vlog_flightrec_init(size_t ring_size, vlog_level_t floor);
+
+/*!
+ * \brief Set the lowest priority level recorded.
+ *
+ * Traces down to this level pass the early filter of all modules, and are formatted
+ * even when no output takes them.
+ *
+ * \param floor         IN VLOG_CRITICAL to VLOG_DEBUG, or VLOG_DISABLED to stop recording.
+ * \return 0 on success, -1 on failure
+ */
+int vlog_flightrec_set_floor(vlog_level_t floor);
+
+/*!
+ * \brief Get the lowest priority level recorded.
+ *
+ * \return The floor, VLOG_DISABLED if the recorder is not running.
+ */
+vlog_level_t vlog_flightrec_get_floor(void);
+
+/*!
+ * \brief Set the number of bytes of each ring written to the error records on a crash.
+ *
+ * \param size          IN Bytes per ring, at most the ring size.
+ */
+void vlog_flightrec_set_dump_size(size_t size);
+
+/*!
+ * \brief Dump the last traces of each ring. Async-signal-safe.
+ *
+ * \param write_cb      IN Callback called for each line.
+ * \param cb_arg        IN Argument passed to the callback.
+ * \param max_bytes     IN Bytes of each ring to dump, 0 for the whole ring.
+ */
+void vlog_flightrec_dump(vlog_flightrec_write_cb_t write_cb, void *cb_arg, size_t max_bytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
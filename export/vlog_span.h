@@ -0,0 +1,175 @@
+#ifndef __VLOG_SPAN_H__
+#define __VLOG_SPAN_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libvapi/vlog.h>
+
+/*!
+ * \file vlog_span.h
+ *
+ * \brief Low-overhead spans for the tracing hooks of vloop, vmutex and vtimer.
+ *
+ * Span names are interned: a handle formats its name once, the first time it is traced,
+ * and then refers to it by id. Starting and finishing a span takes a record from a
+ * preallocated per-thread pool, copies the interned name into it and stamps it with the
+ * monotonic clock, without allocation, formatting nor locking.
+ *
+ * Finished spans are buffered per thread, and handed in batches to the exporters: when
+ * VLOG_SPAN_BATCH spans are buffered, when the oldest one waited VLOG_SPAN_FLUSH_MS, on
+ * vlog_span_flush() and at thread exit. The event loop also flushes its thread from a
+ * timer, so that an idle loop does not hold its spans back. The OpenTracing output
+ * registers an exporter which replays the spans into the tracer, with their duration as
+ * a tag.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VLOG_SPAN_POOL          64      /* spans open at once per thread */
+#define VLOG_SPAN_BATCH         128     /* finished spans buffered per thread */
+#define VLOG_SPAN_FLUSH_MS      100     /* max age of a buffered span */
+#define VLOG_SPAN_MAX_CONTEXT   128     /* bytes of reference context kept per span */
+#define VLOG_SPAN_MAX_EXPORTERS 4
+
+/*!
+ * \brief Interned span name, VLOG_SPAN_NAME_NONE if not registered.
+ */
+typedef uint32_t vlog_span_name_t;
+
+#define VLOG_SPAN_NAME_NONE     0
+
+/*!
+ * \brief Reference of a span to the context it starts from.
+ */
+typedef enum {
+    VLOG_SPAN_PARENT,           /*!< No reference, the span starts a trace. */
+    VLOG_SPAN_CHILD_OF,         /*!< Child of the span of the context. */
+    VLOG_SPAN_FOLLOWS_FROM,     /*!< Follows from the span of the context. */
+} vlog_span_ref_t;
+
+/*!
+ * \brief Finished span, as handed to the exporters.
+ */
+typedef struct {
+    vlog_span_name_t name;
+    vlog_span_ref_t ref;
+    uint64_t start_ns;          /*!< CLOCK_MONOTONIC */
+    uint64_t end_ns;
+    char name_str[VLOG_MAX_SPAN_NAME];  /*!< Name when the span started */
+    int context_size;           /*!< 0 for VLOG_SPAN_PARENT */
+    char context[VLOG_SPAN_MAX_CONTEXT];
+} vlog_span_t;
+
+/*!
+ * \brief Exporter of finished spans, called with the batches of the thread flushing them.
+ */
+typedef void (*vlog_span_export_cb_t)(const vlog_span_t *spans, unsigned int count, void *cb_arg);
+
+/*!
+ * \brief Span counters.
+ */
+typedef struct {
+    unsigned long names;        /*!< Names registered and not released. */
+    unsigned long spans;        /*!< Spans finished. */
+    unsigned long batches;      /*!< Batches handed to the exporters. */
+    unsigned long dropped;      /*!< Spans lost: pool exhausted, name released, or finished without start. */
+} vlog_span_stats_t;
+
+/*!
+ * \brief Intern a span name.
+ *
+ * \param fmt           IN Format of the name, truncated to VLOG_MAX_SPAN_NAME.
+ * \return The id of the name, VLOG_SPAN_NAME_NONE on failure
+ */
+vlog_span_name_t vlog_span_name_register(const char *fmt, ...) __FORMAT_PRINTF(1, 2);
+
+/*!
+ * \brief Intern the name of a handle once, on its first use by any thread.
+ *
+ * \param name          IN/OUT Name of the handle, set if VLOG_SPAN_NAME_NONE.
+ * \param fmt           IN Format of the name.
+ * \return The id of the name, VLOG_SPAN_NAME_NONE on failure
+ */
+vlog_span_name_t vlog_span_name_get_or_register(vlog_span_name_t *name, const char *fmt, ...) __FORMAT_PRINTF(2, 3);
+
+/*!
+ * \brief Release an interned name, when its handle is deleted.
+ *
+ * Spans already started keep the copy of the name they took.
+ *
+ * \param name          IN Name to release, VLOG_SPAN_NAME_NONE is ignored.
+ */
+void vlog_span_name_release(vlog_span_name_t name);
+
+/*!
+ * \brief Copy the string of an interned name.
+ *
+ * \param name          IN Name id.
+ * \param buf           OUT Name, truncated to size.
+ * \param size          IN Size of buf.
+ * \return 0 on success, -1 if the name is unknown or released
+ */
+int vlog_span_name_copy(vlog_span_name_t name, char *buf, size_t size);
+
+/*!
+ * \brief Start a span on the calling thread.
+ *
+ * \param name          IN Interned name of the span.
+ * \param ref           IN Reference to the context.
+ * \param context       IN Context the span starts from, NULL for VLOG_SPAN_PARENT.
+ * \param context_size  IN Bytes of context, a larger context starts a parent span.
+ * \return 0 on success, -1 if the span is not recorded
+ */
+int vlog_span_start(vlog_span_name_t name, vlog_span_ref_t ref, const char *context, int context_size);
+
+/*!
+ * \brief Finish the last span of this name started on the calling thread.
+ *
+ * \param name          IN Interned name of the span.
+ */
+void vlog_span_finish(vlog_span_name_t name);
+
+/*!
+ * \brief Hand the finished spans of the calling thread to the exporters.
+ */
+void vlog_span_flush(void);
+
+/*!
+ * \brief Get the number of finished spans buffered by the calling thread.
+ *
+ * \return The number of spans waiting for a flush
+ */
+unsigned int vlog_span_pending(void);
+
+/*!
+ * \brief Register an exporter of finished spans.
+ *
+ * \param export_cb     IN Exporter.
+ * \param cb_arg        IN Argument passed to the exporter.
+ * \return 0 on success, -1 on failure
+ */
+int vlog_span_add_exporter(vlog_span_export_cb_t export_cb, void *cb_arg);
+
+/*!
+ * \brief Unregister an exporter.
+ *
+ * \param export_cb     IN Exporter.
+ * \param cb_arg        IN Argument it was registered with.
+ */
+void vlog_span_remove_exporter(vlog_span_export_cb_t export_cb, void *cb_arg);
+
+/*!
+ * \brief Get the span counters.
+ *
+ * \param stats         OUT Counters.
+ */
+void vlog_span_get_stats(vlog_span_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__VLOG_SPAN_H__
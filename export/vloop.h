@@ -276,6 +276,25 @@ void vloop_action_delete(vloop_action_t action);
  */
 struct event_base *vloop_get_base(void);
 
+/*!
+ * \brief Start tracing the loop activity of all threads to a file.
+ *
+ * fd callbacks, actions, timer callbacks, contended vmutex_lock calls, vsem waits and vsystem
+ * commands are recorded in a ring of the last 65536 events per thread.
+ * The trace is written by vloop_trace_stop(), in the Chrome trace event format
+ * (chrome://tracing, ui.perfetto.dev).
+ *
+ * \param path IN File the trace is written to, created or truncated now.
+ * \return 0 on success, -1 if the file cannot be created or a trace is already running
+ */
+int vloop_trace_start(const char *path);
+
+/*!
+ * \brief Stop the trace started by vloop_trace_start() and write it.
+ * \return number of events written, -1 on failure
+ */
+long vloop_trace_stop(void);
+
 #if defined(__cplusplus)
 };
 #endif
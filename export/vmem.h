@@ -198,6 +198,126 @@ vmem_error_t vmem_setoption(vmem_alloc_t allocator, vmem_options_t options);
  */
 vmem_error_t vmem_getoption(vmem_alloc_t allocator, vmem_options_t *options);
 
+/*!
+ * \brief   Maximum length of an object cache name (including terminating NUL).
+ */
+#define VMEM_CACHE_NAME_SIZE 32
+
+/*!
+ * \brief   Object constructor/destructor of an object cache.
+ * \param   obj         IN  Object to construct or destruct.
+ */
+typedef void (*vmem_cache_ctor_t)(void *obj);
+typedef void (*vmem_cache_dtor_t)(void *obj);
+
+/*!
+ * \brief   Create object cache.
+ *
+ * Creates a thread-safe allocator handing out objects of a fixed size, in the style of kmem_cache.
+ * The constructor runs once when an object is first carved out of a chunk, the destructor
+ * only when its chunk is released again (vmem_cache_shrink, vmem_cache_destroy).
+ * Freed objects stay constructed: callers must return them in their constructed state.
+ * The cache grows on demand and can be used with vmem_malloc and vmem_free as well
+ * (not with vmem_calloc, which would wipe the constructed state).
+ *
+ * \param   name        IN  Cache name, reported by vmem_alloc_print.
+ * \param   size        IN  Object size in bytes.
+ * \param   align       IN  Object alignment (power of two), 0 for the default pool alignment.
+ * \param   ctor        IN  Object constructor, or NULL.
+ * \param   dtor        IN  Object destructor, or NULL.
+ * \return                  Reference to allocator, or NULL on error.
+ * \sa      vmem_cache_alloc vmem_cache_free vmem_cache_destroy
+ */
+vmem_alloc_t vmem_cache_create(const char *name, size_t size, size_t align,
+                               vmem_cache_ctor_t ctor, vmem_cache_dtor_t dtor);
+
+/*!
+ * \brief   Allocate a constructed object from an object cache.
+ *
+ * \param   cache       IN  Cache to allocate from.
+ * \return                  Pointer to object, or NULL on error.
+ * \sa      vmem_cache_free
+ */
+void *vmem_cache_alloc(vmem_alloc_t cache);
+
+/*!
+ * \brief   Return an object to an object cache.
+ *
+ * \param   cache       IN  Cache the object was allocated from.
+ * \param   obj         IN  Object to return, in its constructed state.
+ * \return                  NULL, or obj on error.
+ * \sa      vmem_cache_alloc
+ */
+void *vmem_cache_free(vmem_alloc_t cache, void *obj);
+
+/*!
+ * \brief   Release unused chunks of an object cache.
+ *
+ * Destructs the objects of every completely free chunk (except the first one)
+ * and releases the chunk to the system.
+ *
+ * \param   cache       IN  Cache to shrink.
+ * \return                  Number of chunks released.
+ */
+ulong_t vmem_cache_shrink(vmem_alloc_t cache);
+
+/*!
+ * \brief   Destroy object cache.
+ *
+ * Destructs all objects and releases all chunks. All objects must have been
+ * returned to the cache beforehand.
+ *
+ * \param   cache       IN  Cache to destroy.
+ * \return                  On succes vmem_error_success, or vmem_error_failure otherwise.
+ * \sa      vmem_cache_create
+ */
+vmem_error_t vmem_cache_destroy(vmem_alloc_t cache);
+
+/*!
+ * \brief   Number of allocation size classes in vmem_alloc_stats_t.
+ */
+#define VMEM_STATS_HIST_BUCKETS 16
+
+/*!
+ * \brief   Allocation statistics of an allocator.
+ */
+typedef struct {
+    ulong_t allocs;     /*!< Successful allocations. */
+    ulong_t frees;      /*!< Successful frees. */
+    ulong_t peak;       /*!< High-watermark of the blocks in use: sum of the per-shard peaks, exact
+                             when threads free the blocks they allocate, an upper bound otherwise. */
+    ulong_t failed;     /*!< Failed allocations and frees. */
+    ulong_t bytes;      /*!< Bytes requested by successful allocations. */
+    ulong_t hist[VMEM_STATS_HIST_BUCKETS];  /*!< Allocations per size class: hist[0] up to 16 bytes,
+                                                 hist[i] up to (16 << i) bytes, last class unbounded. */
+    ulong_t rate;       /*!< Allocations per second since the previous call. */
+}
+vmem_alloc_stats_t;
+
+/*!
+ * \brief   Get allocation statistics.
+ *
+ * Counters are kept in per-thread shards without locking and are aggregated here,
+ * so the result is a consistent-enough snapshot rather than an atomic one.
+ *
+ * \param   allocator   IN  Allocator to get the statistics from.
+ * \param   stats       OUT Aggregated statistics.
+ * \return                  On succes vmem_error_success, or vmem_error_failure otherwise.
+ */
+vmem_error_t vmem_alloc_get_stats(vmem_alloc_t allocator, vmem_alloc_stats_t *stats);
+
+/*!
+ * \brief   Dump the statistics of all allocators in machine-readable form.
+ *
+ * One JSON object per allocator and per line, with the fields of vmem_alloc_stats_t plus
+ * the allocator address, type and cache name. The rate is computed since the previous dump,
+ * independently of vmem_alloc_get_stats callers.
+ *
+ * \param   print_cb    IN  Called with each line.
+ * \param   cb_arg      IN  Argument given to print_cb.
+ */
+void vmem_alloc_dump_stats(void (*print_cb)(void *cb_arg, const char *string), void *cb_arg);
+
 typedef void (*vmem_cb_t)(const char *string);
 
 /*!
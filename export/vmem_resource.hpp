@@ -0,0 +1,217 @@
+#ifndef __VMEM_RESOURCE_HPP__
+#define __VMEM_RESOURCE_HPP__
+
+#include <cstddef>
+#include <new>
+#include <memory_resource>
+
+#include <libvapi/vmem.h>
+
+namespace vapi
+{
+
+/** memory resource forwarding to a vmem allocator
+ *
+ * Lets std::pmr containers allocate from a vmem_alloc_t, so their memory is
+ * accounted for in vmem_alloc_print. Over-aligned requests are served with
+ * vmem_memalign, which is not supported on pool allocators.
+ */
+class vmem_resource : public std::pmr::memory_resource
+{
+public:
+    /** @brief construct resource on the default allocator */
+    vmem_resource() noexcept : m_alloc(vmem_alloc_default()) {}
+
+    /** @brief construct resource on a given allocator
+     * @param alloc vmem allocator handle, must outlive the resource */
+    explicit vmem_resource(vmem_alloc_t alloc) noexcept : m_alloc(alloc) {}
+
+    /** @brief get the underlying allocator handle */
+    [[nodiscard]] vmem_alloc_t allocator() const noexcept { return m_alloc; }
+
+private:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        void *ptr;
+
+        if (alignment <= alignof(std::max_align_t))
+            ptr = vmem_malloc(m_alloc, bytes);
+        else
+            ptr = vmem_memalign(m_alloc, alignment, bytes);
+
+        if (ptr == nullptr)
+            throw std::bad_alloc();
+
+        return ptr;
+    }
+
+    void do_deallocate(void *ptr, std::size_t, std::size_t) override
+    {
+        vmem_free(m_alloc, ptr);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        const vmem_resource *res = dynamic_cast<const vmem_resource *>(&other);
+        return (res != nullptr) && (res->m_alloc == m_alloc);
+    }
+
+    vmem_alloc_t m_alloc;  ///< allocator all requests are forwarded to
+};
+
+/** STL allocator forwarding to a vmem allocator
+ *
+ * For containers that do not use std::pmr, e.g.
+ * std::vector<int, vapi::vmem_allocator<int>> v(vapi::vmem_allocator<int>(pool));
+ */
+template<typename T>
+class vmem_allocator
+{
+public:
+    using value_type = T;
+
+    /** @brief construct allocator on the default allocator */
+    vmem_allocator() noexcept : m_alloc(vmem_alloc_default()) {}
+
+    /** @brief construct allocator on a given allocator
+     * @param alloc vmem allocator handle, must outlive all containers using it */
+    explicit vmem_allocator(vmem_alloc_t alloc) noexcept : m_alloc(alloc) {}
+
+    /** @brief rebind constructor */
+    template<typename U>
+    vmem_allocator(const vmem_allocator<U> &other) noexcept : m_alloc(other.allocator()) {}
+
+    /** @brief get the underlying allocator handle */
+    [[nodiscard]] vmem_alloc_t allocator() const noexcept { return m_alloc; }
+
+    [[nodiscard]] T *allocate(std::size_t n)
+    {
+        void *ptr;
+
+        if (n > static_cast<std::size_t>(-1) / sizeof(T))
+            throw std::bad_alloc();
+
+        if (alignof(T) <= alignof(std::max_align_t))
+            ptr = vmem_malloc(m_alloc, n * sizeof(T));
+        else
+            ptr = vmem_memalign(m_alloc, alignof(T), n * sizeof(T));
+
+        if (ptr == nullptr)
+            throw std::bad_alloc();
+
+        return static_cast<T *>(ptr);
+    }
+
+    void deallocate(T *ptr, std::size_t) noexcept
+    {
+        vmem_free(m_alloc, ptr);
+    }
+
+private:
+    vmem_alloc_t m_alloc;  ///< allocator all requests are forwarded to
+};
+
+template<typename T, typename U>
+bool operator==(const vmem_allocator<T> &a, const vmem_allocator<U> &b) noexcept
+{
+    return a.allocator() == b.allocator();
+}
+
+template<typename T, typename U>
+bool operator!=(const vmem_allocator<T> &a, const vmem_allocator<U> &b) noexcept
+{
+    return !(a == b);
+}
+
+/** monotonic memory resource carving allocations out of vmem chunks
+ *
+ * Deallocation is a no-op: memory is only handed back to the vmem allocator
+ * by release() or on destruction. Not thread-safe, meant for per-thread or
+ * per-request scratch containers. When backed by a pool allocator, the chunk
+ * size must not exceed the pool block size.
+ */
+class vmem_monotonic_resource : public std::pmr::memory_resource
+{
+public:
+    /** @brief construct resource
+     * @param alloc vmem allocator chunks are taken from, must outlive the resource
+     * @param chunk_size size of each chunk in bytes, header included */
+    explicit vmem_monotonic_resource(vmem_alloc_t alloc = vmem_alloc_default(), std::size_t chunk_size = 4096) noexcept
+        : m_alloc(alloc), m_chunk_size(chunk_size), m_chunks(nullptr), m_curr(nullptr), m_end(nullptr) {}
+
+    vmem_monotonic_resource(const vmem_monotonic_resource &) = delete;
+    vmem_monotonic_resource &operator=(const vmem_monotonic_resource &) = delete;
+
+    ~vmem_monotonic_resource() override { release(); }
+
+    /** @brief give all chunks back to the vmem allocator */
+    void release() noexcept
+    {
+        while (m_chunks != nullptr) {
+            chunk *next = m_chunks->next;
+            vmem_free(m_alloc, m_chunks);
+            m_chunks = next;
+        }
+        m_curr = m_end = nullptr;
+    }
+
+private:
+    struct chunk {
+        chunk *next;
+    };
+
+    static constexpr std::size_t header_size()
+    {
+        return (sizeof(chunk) + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+    }
+
+    static char *align_up(char *ptr, std::size_t alignment)
+    {
+        std::size_t addr = reinterpret_cast<std::size_t>(ptr);
+        return ptr + (((addr + alignment - 1) & ~(alignment - 1)) - addr);
+    }
+
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        char *ptr = (m_curr != nullptr) ? align_up(m_curr, alignment) : nullptr;
+
+        if ((ptr == nullptr) || (ptr > m_end) || (static_cast<std::size_t>(m_end - ptr) < bytes)) {
+            /* Oversized requests get a dedicated chunk. */
+            std::size_t size = header_size() + bytes;
+            if (alignment > alignof(std::max_align_t))
+                size += alignment;
+            if (size < m_chunk_size)
+                size = m_chunk_size;
+
+            chunk *c = static_cast<chunk *>(vmem_malloc(m_alloc, size));
+            if (c == nullptr)
+                throw std::bad_alloc();
+
+            c->next = m_chunks;
+            m_chunks = c;
+            m_curr = reinterpret_cast<char *>(c) + header_size();
+            m_end = reinterpret_cast<char *>(c) + size;
+            ptr = align_up(m_curr, alignment);
+        }
+
+        m_curr = ptr + bytes;
+        return ptr;
+    }
+
+    void do_deallocate(void *, std::size_t, std::size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    }
+
+    vmem_alloc_t m_alloc;       ///< allocator chunks are taken from
+    std::size_t m_chunk_size;   ///< default chunk size
+    chunk *m_chunks;            ///< chunks in use, most recent first
+    char *m_curr;               ///< next free byte in the current chunk
+    char *m_end;                ///< end of the current chunk
+};
+
+} //namespace vapi
+
+#endif
@@ -3,6 +3,7 @@
 #define __VMUTEX_H__
 
 #include <libvapi/vlog.h>
+#include <libvapi/vlog_span.h>
 
 #include <pthread.h>
 
@@ -18,6 +19,7 @@ typedef struct vthread_mutex {
     pthread_mutex_t mutex_id;
     vlog_opentracing_context_ptr jsonopentracer_context;
     int jsonopentracer_context_size;
+    vlog_span_name_t span_name; /* interned on the first traced lock */
 } vthread_mutex_t;
 
 /*!
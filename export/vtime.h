@@ -138,6 +138,24 @@ int vtime_get_next_interval_time(vtime_interval_t interval, struct timespec *tim
  */
 int vtime_time_date_str(char *buf, int len, struct timespec *time);
 
+/*!
+ * \brief   Convert date/time to string, for frequent callers like log prefixes.
+ *
+ * Same output as vtime_time_date_str(). The part up to the second is rendered
+ * once per second and per thread, and the timezone is only reloaded after
+ * vtime_time_date_invalidate().
+ * \param   buf        IN/OUT  Buffer to store date/time in string format
+ * \param   len        IN   Length of the buffer, at least ETIME_TIME_DATE_STR_LEN + 1
+ * \param   time       IN   Time to be converted
+ * \return  0 on success, -1 on error.
+ */
+int vtime_time_date_str_cached(char *buf, int len, struct timespec *time);
+
+/*!
+ * \brief   Drop the strings cached by vtime_time_date_str_cached(), e.g. after a timezone change.
+ */
+void vtime_time_date_invalidate(void);
+
 /*!
  * \brief   Changes the current timezone name
  *
@@ -1,13 +1,28 @@
 #ifndef __VTND_LOG_HDR__
 #define __VTND_LOG_HDR__
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#define VTND_LOG_SHM_MIN_SIZE   (64 * 1024)
+
 typedef void (*vtnd_log_serv_cb)(const char *log_id, int log_level, const char *log_string, int error_record);
 typedef void (*vtnd_log_cleanup_cb)(int id);
 
+/*!
+ * \brief Counters of the log client.
+ */
+typedef struct {
+    unsigned long records;      /*!< Records sent in datagrams. */
+    unsigned long datagrams;    /*!< Datagrams sent, each holding a batch of records. */
+    unsigned long shm_records;  /*!< Records written to the shared ring. */
+    unsigned long doorbells;    /*!< Wakeups of tndd for the shared ring. */
+    unsigned long dropped;      /*!< Records lost: tndd not running or not keeping up. */
+} vtnd_log_stats_t;
+
 int vtnd_log_server_start(const char *service_name, vtnd_log_serv_cb recv_cb, vtnd_log_cleanup_cb clean_cb);
 int vtnd_log_client_start(const char *service_name);
 int vtnd_log_client_is_enabled(void);
@@ -15,6 +30,34 @@ int vtnd_log_write(char *output, int level);
 int vtnd_log_write_error(char *output, int level);
 void vtnd_log_server_cleanup(int id);
 
+/*!
+ * \brief Send the records queued by vtnd_log_write.
+ *
+ * Records are sent in batches, several per datagram: when the datagram is full, when the
+ * oldest record waited a few milliseconds, or when the log output flushes at the end of a burst.
+ */
+void vtnd_log_flush(void);
+
+/*!
+ * \brief Send the records through a ring in shared memory instead of datagrams.
+ *
+ * The ring and an eventfd are passed to tndd, which drains the ring when the eventfd is
+ * signaled. The client signals it only when tndd has drained the ring and waits, so a burst
+ * costs no system call. When the ring is full, records go in datagrams again, and records of
+ * both paths may then arrive out of order.
+ *
+ * \param ring_size     IN Bytes of the ring, rounded up to a power of two, at least VTND_LOG_SHM_MIN_SIZE.
+ * \return 0 on success, -1 on failure
+ */
+int vtnd_log_client_enable_shm(size_t ring_size);
+
+/*!
+ * \brief Get the counters of the log client.
+ *
+ * \param stats         OUT Counters.
+ */
+void vtnd_log_client_get_stats(vtnd_log_stats_t *stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,5 +1,5 @@
 #include <libvapi/param_json.hpp>
-#include <fstream>
+#include <libvapi/vfs.h>
 
 vapi::ParamJson::ParamJson(std::string& jsonFile) :
     m_jsonState(false)
@@ -9,13 +9,16 @@ vapi::ParamJson::ParamJson(std::string& jsonFile) :
 
 void vapi::ParamJson::jsonParse(std::string& jsonFile)
 {
-    std::ifstream file(jsonFile);
-    if (!file.is_open()) {
+    size_t len;
+    const char *data = static_cast<const char *>(vfs_map(jsonFile.c_str(), VFS_MAP_SEQUENTIAL, &len));
+    if (data == nullptr) {
         std::cout << "open json file " << jsonFile << " failed..." << std::endl;
         return;
     }
 
-    file >> m_jsonObj;
+    /* parsed in place from the page cache, without exceptions */
+    m_jsonObj = Json::parse(data, data + len, nullptr, false);
+    vfs_unmap(const_cast<char *>(data), len);
     if (m_jsonObj.is_discarded()) {
         std::cout << "parse " << jsonFile << " data failed..." << std::endl;
         return;
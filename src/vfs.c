@@ -1,17 +1,60 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* copy_file_range, fallocate */
+#endif
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/sysinfo.h>
 #include <sys/sendfile.h>
-#include <sys/resource.h>
+#include <linux/fs.h>
 #include <errno.h>
 #include <dirent.h>
+#include <limits.h>
 #include <zstd.h>
+#include <zdict.h>
 
 #include <libvapi/vfs.h>
 #include <libvapi/vmutex.h>
 #include "vlog_vapi.h"
 
+#define VFS_ZSTD_DICT_MAX       (16 * 1024 * 1024)  /* larger dictionary files are refused */
+#define VFS_ZSTD_SAMPLE_CHUNK   (64 * 1024)         /* training sample size, larger files are split */
+#define VFS_ZSTD_TRAIN_MAX      (64 * 1024 * 1024)  /* sample bytes read for a training */
+#define VFS_ZSTD_FRAME_MAX      (64 * 1024 * 1024)  /* largest frame of a seekable file */
+#define VFS_COPY_CHUNK_DEFAULT  (8 * 1024 * 1024)   /* bytes per copy call, between progress reports */
+#define VFS_COPY_BUFFER_SIZE    (256 * 1024)        /* read/write and transcoding buffer */
+#define VFS_MAP_GROW_MIN        (1024 * 1024)       /* decompressed mapping of a file without content size */
+
+/* zstd seekable format: the seek table is a skippable frame closing the file */
+#define ZSTD_SEEKABLE_MAGIC             0x8F92EAB1
+#define ZSTD_SEEKABLE_SKIPPABLE_MAGIC   0x184D2A5E
+#define ZSTD_SEEKABLE_HEADER_SIZE       8
+#define ZSTD_SEEKABLE_FOOTER_SIZE       9
+#define ZSTD_SEEKABLE_CHECKSUM_FLAG     0x80
+#define ZSTD_SEEKABLE_RESERVED_BITS     0x7C
+
+/* Digested dictionary, shared by the handles that reference it */
+struct vfs_zstd_dict {
+    ZSTD_CDict *cdict;
+    ZSTD_DDict *ddict;
+    int refs;
+};
+
+/* Frame of a seekable file, the next one gives its end */
+struct zstd_frame {
+    uint64_t c_off;
+    uint64_t d_off;
+};
+
+/* Seek table entry of a frame being written */
+struct zstd_seek_entry {
+    uint32_t c_size;
+    uint32_t d_size;
+};
+
 struct zstd_ctx {
     ZSTD_CCtx *cctx;
     size_t  buffInSize_c;
@@ -30,6 +73,27 @@ struct zstd_ctx {
     ZSTD_outBuffer output_d;
     size_t  readPos_d;
     ssize_t remaining_d;
+
+    vfs_zstd_dict_t dict;
+
+    /* seekable writer */
+    size_t  frame_size;         /* uncompressed bytes per frame, 0 for a single frame */
+    size_t  frame_csize;
+    size_t  frame_dsize;
+    off_t   written;
+    struct zstd_seek_entry *entries;
+    unsigned int nb_entries;
+    unsigned int max_entries;
+    int     closed;
+
+    /* seekable reader */
+    int     seekable;           /* -1 until the first access, then 1 with a seek table */
+    struct zstd_frame *frames;  /* nb_frames + 1 */
+    unsigned int nb_frames;
+    unsigned int cached;        /* frame in cache_d, nb_frames for none */
+    void   *cache_c;
+    void   *cache_d;
+    off_t   pos;
 };
 struct ycfs_handle {
     int fd;
@@ -39,48 +103,68 @@ struct ycfs_handle {
 };
 
 typedef struct ycfs_handle *ycfs_handle_t;
-static void **vfs_private_data = NULL;
-static struct rlimit rlim = {0, 0};
+
+/*
+ * Handles of the compressed fds, in a two-level table indexed by fd: the leaves are allocated on
+ * first use and published with a compare-and-swap, and never freed, so lookups take no lock.
+ */
+#define VFS_PRIVATE_LEAF_BITS   10
+#define VFS_PRIVATE_LEAF_SIZE   (1 << VFS_PRIVATE_LEAF_BITS)
+#define VFS_PRIVATE_ROOT_SIZE   4096    /* up to 4M fds, above the default nr_open */
+
+static void **vfs_private_data[VFS_PRIVATE_ROOT_SIZE];
 
 static ssize_t vfs_read_non_compressed(int fd, void *buffer, size_t nbytes);
 static ssize_t vfs_write_non_compressed(int fd, const void *buffer, size_t nbytes);
+static ssize_t vfs_pread_non_compressed(int fd, void *buffer, size_t nbytes, off_t offset);
 
-static int vfs_private_data_init()
+static void **vfs_private_data_slot(int fd, int create)
 {
-    if (vfs_private_data == NULL) {
-        if (getrlimit(RLIMIT_NOFILE, &rlim) < 0)
-            return -1;
+    void **leaf, **expected = NULL;
 
-        vapi_debug("[vfs]: Alloc private data for %ld num of fd", rlim.rlim_cur);
-        vfs_private_data = vmem_calloc(vmem_alloc_default(), rlim.rlim_cur * sizeof(void *));
-        if (!vfs_private_data)
-            return -1;
+    if ((fd < 0) || ((unsigned)fd >= VFS_PRIVATE_ROOT_SIZE * VFS_PRIVATE_LEAF_SIZE)) {
+        /* plain fds are looked up too, only a compressed one out of range is an error */
+        if (create) {
+            vapi_info("vfs: invalid fd: %d, out of range [%d, %d]\n", fd, 0, VFS_PRIVATE_ROOT_SIZE * VFS_PRIVATE_LEAF_SIZE - 1);
+        }
+        return NULL;
     }
 
-    return 0;
+    leaf = __atomic_load_n(&vfs_private_data[fd >> VFS_PRIVATE_LEAF_BITS], __ATOMIC_ACQUIRE);
+    if (!leaf && create) {
+        leaf = vmem_calloc(vmem_alloc_default(), VFS_PRIVATE_LEAF_SIZE * sizeof(void *));
+        if (!leaf) {
+            return NULL;
+        }
+
+        /* another thread may have published the leaf first */
+        if (!__atomic_compare_exchange_n(&vfs_private_data[fd >> VFS_PRIVATE_LEAF_BITS], &expected, leaf, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            vmem_free(vmem_alloc_default(), leaf);
+            leaf = expected;
+        }
+    }
+
+    return leaf ? &leaf[fd & (VFS_PRIVATE_LEAF_SIZE - 1)] : NULL;
 }
 
-static void vfs_set_private_data(int fd, void *data)
+static int vfs_set_private_data(int fd, void *data)
 {
-    if (vfs_private_data) {
-        if ((fd < 0) || ((unsigned)fd >= rlim.rlim_cur)) {
-            vapi_info("vfs: invalid fd: %d, out of range [%d, %ld]\n", fd, 0, rlim.rlim_cur);
-            return;
-        }
-        vfs_private_data[fd] = data;
+    void **slot = vfs_private_data_slot(fd, data != NULL);
+
+    if (!slot) {
+        return (data != NULL) ? -1 : 0;
     }
+
+    __atomic_store_n(slot, data, __ATOMIC_RELEASE);
+    return 0;
 }
 
 static void *vfs_get_private_data(int fd)
 {
-    if (vfs_private_data) {
-        if ((fd < 0) || ((unsigned)fd >= rlim.rlim_cur)) {
-            vapi_info("vfs: invalid fd: %d, out of range [%d, %ld]\n", fd, 0, rlim.rlim_cur);
-            return NULL;
-        }
-        return vfs_private_data[fd];
-    } else
-        return NULL;
+    void **slot = vfs_private_data_slot(fd, 0);
+
+    return slot ? __atomic_load_n(slot, __ATOMIC_ACQUIRE) : NULL;
 }
 
 static void zstd_free(ycfs_handle_t handle)
@@ -107,34 +191,42 @@ static void zstd_free(ycfs_handle_t handle)
     if (handle->zstd.buffOut_d) {
         vmem_free(vmem_alloc_default(), handle->zstd.buffOut_d);
     }
+    if (handle->zstd.dict) {
+        vfs_zstd_dict_release(handle->zstd.dict);
+    }
+    if (handle->zstd.entries) {
+        vmem_free(vmem_alloc_default(), handle->zstd.entries);
+    }
+    if (handle->zstd.frames) {
+        vmem_free(vmem_alloc_default(), handle->zstd.frames);
+    }
+    if (handle->zstd.cache_c) {
+        vmem_free(vmem_alloc_default(), handle->zstd.cache_c);
+    }
+    if (handle->zstd.cache_d) {
+        vmem_free(vmem_alloc_default(), handle->zstd.cache_d);
+    }
 
     vmutex_delete(&handle->lock);
     vmem_free(vmem_alloc_default(), handle);
 
 }
 
-static ycfs_handle_t zstd_init(int clevel)
+/* Compression side of a handle opened for writing */
+static int zstd_init_compress(ycfs_handle_t handle, const vfs_zstd_params_t *params)
 {
+    int clevel = params->level ? params->level : ZSTD_CLEVEL_DEFAULT;
     size_t ret;
 
-    ycfs_handle_t handle = vmem_calloc(vmem_alloc_default(), sizeof(struct ycfs_handle));
-    if (!handle) {
-        return NULL;
-    }
-
-    if (vmutex_create(&handle->lock)) {
-        goto error;
-    }
-
     handle->zstd.buffInSize_c = ZSTD_CStreamInSize();
     handle->zstd.buffOutSize_c = ZSTD_CStreamOutSize();
     handle->zstd.buffIn_c = vmem_calloc(vmem_alloc_default(), handle->zstd.buffInSize_c);
     if (!handle->zstd.buffIn_c) {
-        goto error;
+        return -1;
     }
     handle->zstd.buffOut_c = vmem_calloc(vmem_alloc_default(), handle->zstd.buffOutSize_c);
     if (!handle->zstd.buffOut_c) {
-        goto error;
+        return -1;
     }
 
     handle->zstd.output_c.dst = handle->zstd.buffOut_c;
@@ -143,18 +235,79 @@ static ycfs_handle_t zstd_init(int clevel)
     handle->zstd.cctx = ZSTD_createCCtx();
     if (!handle->zstd.cctx) {
         vapi_info("zstd_init failed: could not create zstd cctx\n");
-        goto error;
+        return -1;
+    }
+
+    ret = ZSTD_CCtx_setParameter(handle->zstd.cctx, ZSTD_c_compressionLevel, clevel);
+    if (ZSTD_isError(ret)) {
+        vapi_info("zstd_init failed: %s\n", ZSTD_getErrorName(ret));
+        return -1;
+    }
+
+    ret = ZSTD_CCtx_setParameter(handle->zstd.cctx, ZSTD_c_checksumFlag, 1);
+    if (ZSTD_isError(ret)) {
+        vapi_info("zstd_init failed: %s\n", ZSTD_getErrorName(ret));
+        return -1;
+    }
+
+    /* libzstd may be built without ZSTD_MULTITHREAD: compress on the caller's thread then */
+    if (params->nb_workers > 0) {
+        ret = ZSTD_CCtx_setParameter(handle->zstd.cctx, ZSTD_c_nbWorkers, params->nb_workers);
+        if (ZSTD_isError(ret)) {
+            vapi_warning("zstd_init: no background compression: %s", ZSTD_getErrorName(ret));
+        }
     }
 
+    if (params->long_distance) {
+        ret = ZSTD_CCtx_setParameter(handle->zstd.cctx, ZSTD_c_enableLongDistanceMatching, 1);
+        if (ZSTD_isError(ret)) {
+            vapi_info("zstd_init failed: %s\n", ZSTD_getErrorName(ret));
+            return -1;
+        }
+    }
+
+    if (params->window_log) {
+        ret = ZSTD_CCtx_setParameter(handle->zstd.cctx, ZSTD_c_windowLog, params->window_log);
+        if (ZSTD_isError(ret)) {
+            vapi_info("zstd_init failed: window log %d: %s\n", params->window_log, ZSTD_getErrorName(ret));
+            return -1;
+        }
+    }
+
+    if (params->dict) {
+        ret = ZSTD_CCtx_refCDict(handle->zstd.cctx, params->dict->cdict);
+        if (ZSTD_isError(ret)) {
+            vapi_info("zstd_init failed: %s\n", ZSTD_getErrorName(ret));
+            return -1;
+        }
+    }
+
+    if (params->frame_size > VFS_ZSTD_FRAME_MAX) {
+        vapi_info("zstd_init failed: frame size %zu above %d\n", params->frame_size, VFS_ZSTD_FRAME_MAX);
+        return -1;
+    }
+    handle->zstd.frame_size = params->frame_size;
+
+    vapi_debug("[zstd_init]: buffInSize_c: %ld, addr: %p\n", handle->zstd.buffInSize_c, handle->zstd.buffIn_c);
+    vapi_debug("[zstd_init]: buffOutSize_c: %ld, addr: %p\n", handle->zstd.buffOutSize_c, handle->zstd.buffOut_c);
+
+    return 0;
+}
+
+/* Decompression side of a handle opened for reading */
+static int zstd_init_decompress(ycfs_handle_t handle, const vfs_zstd_params_t *params)
+{
+    size_t ret;
+
     handle->zstd.buffInSize_d = ZSTD_DStreamInSize();
     handle->zstd.buffOutSize_d = ZSTD_DStreamOutSize();
     handle->zstd.buffIn_d = vmem_calloc(vmem_alloc_default(), handle->zstd.buffInSize_d);
     if (!handle->zstd.buffIn_d) {
-        goto error;
+        return -1;
     }
     handle->zstd.buffOut_d = vmem_calloc(vmem_alloc_default(), handle->zstd.buffOutSize_d);
     if (!handle->zstd.buffOut_d) {
-        goto error;
+        return -1;
     }
 
     handle->zstd.input_d.src = handle->zstd.buffIn_d;
@@ -166,25 +319,56 @@ static ycfs_handle_t zstd_init(int clevel)
     handle->zstd.dctx = ZSTD_createDCtx();
     if (!handle->zstd.dctx) {
         vapi_info("zstd_init failed: could not create zstd dctx\n");
+        return -1;
+    }
+
+    if (params->window_log) {
+        ret = ZSTD_DCtx_setParameter(handle->zstd.dctx, ZSTD_d_windowLogMax, params->window_log);
+        if (ZSTD_isError(ret)) {
+            vapi_info("zstd_init failed: window log %d: %s\n", params->window_log, ZSTD_getErrorName(ret));
+            return -1;
+        }
+    }
+
+    if (params->dict) {
+        ret = ZSTD_DCtx_refDDict(handle->zstd.dctx, params->dict->ddict);
+        if (ZSTD_isError(ret)) {
+            vapi_info("zstd_init failed: %s\n", ZSTD_getErrorName(ret));
+            return -1;
+        }
+    }
+
+    vapi_debug("[zstd_init]: buffInSize_d: %ld, addr: %p\n", handle->zstd.buffInSize_d, handle->zstd.buffIn_d);
+    vapi_debug("[zstd_init]: buffOutSize_d: %ld, addr: %p\n", handle->zstd.buffOutSize_d, handle->zstd.buffOut_d);
+
+    return 0;
+}
+
+/* Only the sides of the access mode are set up, small files are dominated by their open */
+static ycfs_handle_t zstd_init(const vfs_zstd_params_t *params, int flags)
+{
+    ycfs_handle_t handle = vmem_calloc(vmem_alloc_default(), sizeof(struct ycfs_handle));
+    if (!handle) {
+        return NULL;
+    }
+
+    if (vmutex_create(&handle->lock)) {
         goto error;
     }
+    handle->zstd.seekable = -1;
 
-    ret = ZSTD_CCtx_setParameter(handle->zstd.cctx, ZSTD_c_compressionLevel, clevel);
-    if (ZSTD_isError(ret)) {
-        vapi_info("zstd_init failed: %s\n", ZSTD_getErrorName(ret));
+    if ((flags & O_ACCMODE) != O_RDONLY && zstd_init_compress(handle, params) != 0) {
         goto error;
     }
 
-    ret = ZSTD_CCtx_setParameter(handle->zstd.cctx, ZSTD_c_checksumFlag, 1);
-    if (ZSTD_isError(ret)) {
-        vapi_info("zstd_init failed: %s\n", ZSTD_getErrorName(ret));
+    if ((flags & O_ACCMODE) != O_WRONLY && zstd_init_decompress(handle, params) != 0) {
         goto error;
     }
 
-    vapi_debug("[zstd_init]: buffInSize_c: %ld, addr: %p\n", handle->zstd.buffInSize_c, handle->zstd.buffIn_c);
-    vapi_debug("[zstd_init]: buffOutSize_c: %ld, addr: %p\n", handle->zstd.buffOutSize_c, handle->zstd.buffOut_c);
-    vapi_debug("[zstd_init]: buffInSize_d: %ld, addr: %p\n", handle->zstd.buffInSize_d, handle->zstd.buffIn_d);
-    vapi_debug("[zstd_init]: buffOutSize_d: %ld, addr: %p\n", handle->zstd.buffOutSize_d, handle->zstd.buffOut_d);
+    if (params->dict) {
+        __atomic_add_fetch(&params->dict->refs, 1, __ATOMIC_RELAXED);
+        handle->zstd.dict = params->dict;
+    }
 
     return handle;
 
@@ -230,503 +414,1480 @@ static int zstd_do_decompress(ZSTD_DCtx *dctx, ZSTD_inBuffer *input, ZSTD_outBuf
     return (input->pos == input->size);
 }
 
-static int zstd_drop_read_cache(ycfs_handle_t handle)
+static uint32_t zstd_get_le32(const uint8_t *p)
 {
-    ZSTD_inBuffer *input;
-    ZSTD_outBuffer *output;
-    int ret = 0;
-
-    if (!handle) {
-        return -1;
-    }
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
 
-    input = &handle->zstd.input_d;
-    output = &handle->zstd.output_d;
+static void zstd_put_le32(uint8_t *p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
 
-    vmutex_lock(&handle->lock);
-    if (handle->zstd.remaining_d) {
-        do {
-            ret = zstd_do_decompress(handle->zstd.dctx, input, output);
-            if (ret == -1) {
-                break;
-            }
-        } while (!ret);
+/* Write the whole compressed output, counted in the current frame */
+static int zstd_write_output(ycfs_handle_t handle, ZSTD_outBuffer *output)
+{
+    size_t done = 0;
+    ssize_t ret;
 
-        handle->zstd.remaining_d = 0;
+    while (done < output->pos) {
+        ret = vfs_write_non_compressed(handle->fd, (char *)output->dst + done, output->pos - done);
+        if (ret <= 0) {
+            return -1;
+        }
+        done += ret;
     }
 
-    handle->zstd.readPos_d = 0;
+    handle->zstd.frame_csize += done;
     output->pos = 0;
-    vmutex_unlock(&handle->lock);
 
-    return ret;
+    return 0;
 }
 
-static int zstd_flush_write_cache(ycfs_handle_t handle, ZSTD_EndDirective mode)
+static int zstd_compress_frame(ycfs_handle_t handle, const void *buffer, size_t nbytes, ZSTD_EndDirective mode)
 {
-    ZSTD_inBuffer *input;
-    ZSTD_outBuffer *output;
+    ZSTD_inBuffer input = { buffer, nbytes, 0 };
     int finished;
-    int ret = 0;
 
-    if (!handle) {
-        return -1;
-    }
+    do {
+        finished = zstd_do_compress(handle->zstd.cctx, &input, &handle->zstd.output_c, mode);
+        if (finished == -1 || zstd_write_output(handle, &handle->zstd.output_c) == -1) {
+            return -1;
+        }
+    } while (!finished);
 
-    input = &handle->zstd.input_c;
-    output = &handle->zstd.output_c;
+    handle->zstd.frame_dsize += nbytes;
+    handle->zstd.written += nbytes;
 
-    /* flush remaining data */
-    vmutex_lock(&handle->lock);
-    if (input->src) {
-        do {
-            finished = zstd_do_compress(handle->zstd.cctx, input, output, mode);
-            if (finished == -1) {
-                ret = -1;
-                break;
-            }
+    return 0;
+}
 
-            if (output->pos) {
-                ret = vfs_write_non_compressed(handle->fd, output->dst, output->pos);
-                if (ret == -1) {
-                    break;
-                }
-            }
-        } while (!finished);
+/* Seekable writer: close the current frame and add it to the seek table, lock held */
+static int zstd_end_frame(ycfs_handle_t handle)
+{
+    struct zstd_seek_entry *entries;
 
-        input->size = 0;
-        input->pos = 0;
+    if (!handle->zstd.frame_dsize) {
+        return 0;
+    }
 
+    if (zstd_compress_frame(handle, NULL, 0, ZSTD_e_end) == -1) {
+        return -1;
+    }
 
+    if (handle->zstd.nb_entries == handle->zstd.max_entries) {
+        entries = vmem_realloc(vmem_alloc_default(), handle->zstd.entries,
+                               2 * (handle->zstd.max_entries + 32) * sizeof(*entries));
+        if (!entries) {
+            return -1;
+        }
+        handle->zstd.entries = entries;
+        handle->zstd.max_entries = 2 * (handle->zstd.max_entries + 32);
     }
-    vmutex_unlock(&handle->lock);
 
-    return ret;
+    handle->zstd.entries[handle->zstd.nb_entries].c_size = handle->zstd.frame_csize;
+    handle->zstd.entries[handle->zstd.nb_entries].d_size = handle->zstd.frame_dsize;
+    handle->zstd.nb_entries++;
+    handle->zstd.frame_csize = 0;
+    handle->zstd.frame_dsize = 0;
+
+    return 0;
 }
 
-static ssize_t zstd_write(ycfs_handle_t handle, const void *buffer, size_t nbytes)
+/* Seekable writer: cut the data in frames of frame_size uncompressed bytes */
+static ssize_t zstd_write_frames(ycfs_handle_t handle, const void *buffer, size_t nbytes)
 {
-    ZSTD_inBuffer *input;
-    ZSTD_outBuffer *output;
-    int finished = 0;
-    ssize_t ret = 0;
-    size_t room = 0; /* buffer size to cache user data */
     ssize_t size_return = 0;
-
-    if (!handle || !buffer) {
-        return -1;
-    }
-    if (!nbytes) {
-        return 0;
-    }
-
-    input = &handle->zstd.input_c;
-    output = &handle->zstd.output_c;
+    size_t len;
 
     vmutex_lock(&handle->lock);
     while (nbytes) {
-        input->src = handle->zstd.buffIn_c;
-        room = handle->zstd.buffInSize_c - input->size;
-
-        if (nbytes < room) { /* cache small data */
-            memcpy((void *)input->src + input->size, buffer, nbytes);
-            input->size += nbytes;
-            size_return += nbytes;
-            nbytes = 0;
+        len = MIN(nbytes, handle->zstd.frame_size - handle->zstd.frame_dsize);
+        if (zstd_compress_frame(handle, buffer, len, ZSTD_e_continue) == -1) {
+            size_return = -1;
             break;
-        } else {
-            if (input->size) {
-                memcpy((void *)input->src + input->size, buffer, room);
-            } else {
-                input->src = buffer;
-            }
-
-            input->size += room;
-            size_return += room;
-            buffer += room;
-            nbytes -= room;
         }
+        buffer += len;
+        nbytes -= len;
+        size_return += len;
 
-        do {
-            finished = zstd_do_compress(handle->zstd.cctx, input, output, ZSTD_e_continue);
-            if (finished == -1) {
-                ret = -1;
-                break;
-            }
-
-            if (output->pos) {
-                ret = vfs_write_non_compressed(handle->fd, output->dst, output->pos);
-                if (ret == -1) {
-                    break;
-                }
-            }
-        } while (!finished);
-
-        input->size = 0;
-        input->pos = 0;
-
-        if (ret == -1) {
+        if (handle->zstd.frame_dsize == handle->zstd.frame_size && zstd_end_frame(handle) == -1) {
+            size_return = -1;
             break;
         }
     }
-
     vmutex_unlock(&handle->lock);
-    return (ret < 0) ? -1 : size_return;
+
+    return size_return;
 }
 
-static ssize_t zstd_read(ycfs_handle_t handle, void *buffer, size_t nbytes)
+/* Seekable writer: end the last frame and append the seek table, once */
+static int zstd_finish_frames(ycfs_handle_t handle)
+{
+    ZSTD_outBuffer table;
+    size_t table_size;
+    uint8_t *p;
+    unsigned int i;
+    int ret = -1;
+
+    if (!handle->zstd.frame_size || handle->zstd.closed) {
+        return 0;
+    }
+
+    vmutex_lock(&handle->lock);
+    handle->zstd.closed = 1;
+    if (zstd_end_frame(handle) == -1) {
+        goto zstd_finish_frames_exit;
+    }
+
+    table_size = ZSTD_SEEKABLE_HEADER_SIZE + handle->zstd.nb_entries * sizeof(uint32_t) * 2 + ZSTD_SEEKABLE_FOOTER_SIZE;
+    p = vmem_malloc(vmem_alloc_default(), table_size);
+    if (!p) {
+        goto zstd_finish_frames_exit;
+    }
+
+    table.dst = p;
+    table.size = table_size;
+    table.pos = table_size;
+
+    zstd_put_le32(p, ZSTD_SEEKABLE_SKIPPABLE_MAGIC);
+    zstd_put_le32(p + 4, table_size - ZSTD_SEEKABLE_HEADER_SIZE);
+    p += ZSTD_SEEKABLE_HEADER_SIZE;
+    for (i = 0; i < handle->zstd.nb_entries; i++, p += 8) {
+        zstd_put_le32(p, handle->zstd.entries[i].c_size);
+        zstd_put_le32(p + 4, handle->zstd.entries[i].d_size);
+    }
+    zstd_put_le32(p, handle->zstd.nb_entries);
+    p[4] = 0;   /* no checksums, the frames have theirs */
+    zstd_put_le32(p + 5, ZSTD_SEEKABLE_MAGIC);
+
+    ret = zstd_write_output(handle, &table);
+    vmem_free(vmem_alloc_default(), table.dst);
+
+zstd_finish_frames_exit:
+    vmutex_unlock(&handle->lock);
+    if (ret == -1) {
+        vapi_info("vfs_close failed: seek table of fd = %d not written", handle->fd);
+    }
+
+    return ret;
+}
+
+static ssize_t zstd_pread_all(int fd, void *buffer, size_t nbytes, off_t offset)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < nbytes) {
+        ret = vfs_pread_non_compressed(fd, (char *)buffer + done, nbytes - done, offset + done);
+        if (ret <= 0) {
+            return -1;
+        }
+        done += ret;
+    }
+
+    return done;
+}
+
+/* Seekable reader: return 1 and index the frames when the file ends with a seek table */
+static int zstd_load_seek_table(ycfs_handle_t handle)
+{
+    uint8_t footer[ZSTD_SEEKABLE_FOOTER_SIZE];
+    struct zstd_frame *frames = NULL;
+    uint8_t *table = NULL, *p;
+    size_t entry_size, table_size, max_c = 0, max_d = 0;
+    uint32_t nb, i, c_size, d_size;
+    uint64_t c_off = 0, d_off = 0;
+    vfs_stat_t statbuf;
+
+    if (fstat(handle->fd, &statbuf) < 0 || statbuf.st_size < ZSTD_SEEKABLE_HEADER_SIZE + ZSTD_SEEKABLE_FOOTER_SIZE) {
+        return 0;
+    }
+
+    if (zstd_pread_all(handle->fd, footer, sizeof(footer), statbuf.st_size - sizeof(footer)) < 0 ||
+        zstd_get_le32(footer + 5) != ZSTD_SEEKABLE_MAGIC || (footer[4] & ZSTD_SEEKABLE_RESERVED_BITS)) {
+        return 0;
+    }
+
+    nb = zstd_get_le32(footer);
+    entry_size = (footer[4] & ZSTD_SEEKABLE_CHECKSUM_FLAG) ? 3 * sizeof(uint32_t) : 2 * sizeof(uint32_t);
+    table_size = ZSTD_SEEKABLE_HEADER_SIZE + (size_t)nb * entry_size + ZSTD_SEEKABLE_FOOTER_SIZE;
+    if (table_size > (size_t)statbuf.st_size) {
+        return 0;
+    }
+
+    table = vmem_malloc(vmem_alloc_default(), table_size);
+    frames = vmem_malloc(vmem_alloc_default(), ((size_t)nb + 1) * sizeof(*frames));
+    if (!table || !frames ||
+        zstd_pread_all(handle->fd, table, table_size, statbuf.st_size - table_size) < 0 ||
+        zstd_get_le32(table) != ZSTD_SEEKABLE_SKIPPABLE_MAGIC ||
+        zstd_get_le32(table + 4) != table_size - ZSTD_SEEKABLE_HEADER_SIZE) {
+        goto zstd_load_seek_table_error;
+    }
+
+    for (i = 0, p = table + ZSTD_SEEKABLE_HEADER_SIZE; i < nb; i++, p += entry_size) {
+        c_size = zstd_get_le32(p);
+        d_size = zstd_get_le32(p + 4);
+        if (d_size > VFS_ZSTD_FRAME_MAX) {
+            goto zstd_load_seek_table_error;
+        }
+        frames[i].c_off = c_off;
+        frames[i].d_off = d_off;
+        c_off += c_size;
+        d_off += d_size;
+        max_c = MAX(max_c, (size_t)c_size);
+        max_d = MAX(max_d, (size_t)d_size);
+    }
+    frames[nb].c_off = c_off;
+    frames[nb].d_off = d_off;
+
+    /* the frames fill the file up to the seek table */
+    if (c_off != statbuf.st_size - table_size) {
+        goto zstd_load_seek_table_error;
+    }
+
+    handle->zstd.cache_c = vmem_malloc(vmem_alloc_default(), max_c ? max_c : 1);
+    handle->zstd.cache_d = vmem_malloc(vmem_alloc_default(), max_d ? max_d : 1);
+    if (!handle->zstd.cache_c || !handle->zstd.cache_d) {
+        goto zstd_load_seek_table_error;
+    }
+
+    vmem_free(vmem_alloc_default(), table);
+    handle->zstd.frames = frames;
+    handle->zstd.nb_frames = nb;
+    handle->zstd.cached = nb;
+
+    return 1;
+
+zstd_load_seek_table_error:
+    if (table) {
+        vmem_free(vmem_alloc_default(), table);
+    }
+    if (frames) {
+        vmem_free(vmem_alloc_default(), frames);
+    }
+    vapi_info("vfs: fd = %d has no valid seek table, read as a stream", handle->fd);
+
+    return 0;
+}
+
+/* Only read-only handles are probed, at their first access, lock held */
+static int zstd_has_seek_table(ycfs_handle_t handle)
+{
+    if (handle->zstd.seekable < 0) {
+        handle->zstd.seekable = (!handle->zstd.cctx && handle->zstd.dctx) ? zstd_load_seek_table(handle) : 0;
+    }
+
+    return handle->zstd.seekable;
+}
+
+static int zstd_load_frame(ycfs_handle_t handle, unsigned int i)
+{
+    const struct zstd_frame *frame = &handle->zstd.frames[i];
+    size_t c_size = frame[1].c_off - frame[0].c_off;
+    size_t d_size = frame[1].d_off - frame[0].d_off;
+    size_t ret;
+
+    if (handle->zstd.cached == i) {
+        return 0;
+    }
+    handle->zstd.cached = handle->zstd.nb_frames;
+
+    if (zstd_pread_all(handle->fd, handle->zstd.cache_c, c_size, frame->c_off) < 0) {
+        return -1;
+    }
+
+    ret = ZSTD_decompressDCtx(handle->zstd.dctx, handle->zstd.cache_d, d_size, handle->zstd.cache_c, c_size);
+    if (ZSTD_isError(ret) || ret != d_size) {
+        vapi_info("vfs_read failed: fd = %d, frame %u: %s", handle->fd, i,
+                  ZSTD_isError(ret) ? ZSTD_getErrorName(ret) : "size mismatch");
+        errno = EIO;
+        return -1;
+    }
+    handle->zstd.cached = i;
+
+    return 0;
+}
+
+/* Seekable reader: copy the uncompressed range from the frames holding it, lock held */
+static ssize_t zstd_read_frames(ycfs_handle_t handle, void *buffer, size_t nbytes, off_t offset)
+{
+    const struct zstd_frame *frames = handle->zstd.frames;
+    unsigned int lo = 0, hi = handle->zstd.nb_frames, mid;
+    ssize_t size_return = 0;
+    size_t skip, size_copy;
+
+    if ((uint64_t)offset >= frames[hi].d_off) {
+        return 0;
+    }
+
+    /* frames[lo].d_off <= offset < frames[hi].d_off */
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (frames[mid].d_off <= (uint64_t)offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    for (; nbytes && lo < handle->zstd.nb_frames; lo++) {
+        if (zstd_load_frame(handle, lo) == -1) {
+            return size_return ? size_return : -1;
+        }
+
+        skip = offset - frames[lo].d_off;
+        size_copy = MIN(nbytes, (size_t)(frames[lo + 1].d_off - frames[lo].d_off - skip));
+        memcpy(buffer, (char *)handle->zstd.cache_d + skip, size_copy);
+        buffer += size_copy;
+        nbytes -= size_copy;
+        offset += size_copy;
+        size_return += size_copy;
+    }
+
+    return size_return;
+}
+
+static off_t zstd_seek_position(off_t cur, off_t end, off_t offset, int whence)
+{
+    off_t base;
+
+    switch (whence) {
+    case SEEK_SET:
+        base = 0;
+        break;
+    case SEEK_CUR:
+        base = cur;
+        break;
+    case SEEK_END:
+        base = end;
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (base + offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return base + offset;
+}
+
+/* Uncompressed offsets: readers move anywhere, writers can only ask their position. -2 for a stream. */
+static off_t zstd_seek(ycfs_handle_t handle, off_t offset, int whence)
+{
+    off_t ret = -2;
+
+    vmutex_lock(&handle->lock);
+    if (handle->zstd.frame_size) {
+        ret = zstd_seek_position(handle->zstd.written, handle->zstd.written, offset, whence);
+        if (ret >= 0 && ret != handle->zstd.written) {
+            errno = ESPIPE;
+            ret = -1;
+        }
+    } else if (zstd_has_seek_table(handle)) {
+        ret = zstd_seek_position(handle->zstd.pos, handle->zstd.frames[handle->zstd.nb_frames].d_off, offset, whence);
+        if (ret >= 0) {
+            handle->zstd.pos = ret;
+        }
+    }
+    vmutex_unlock(&handle->lock);
+
+    return ret;
+}
+
+static int zstd_drop_read_cache(ycfs_handle_t handle)
+{
+    ZSTD_inBuffer *input;
+    ZSTD_outBuffer *output;
+    int ret = 0;
+
+    if (!handle) {
+        return -1;
+    }
+
+    input = &handle->zstd.input_d;
+    output = &handle->zstd.output_d;
+
+    vmutex_lock(&handle->lock);
+    if (handle->zstd.remaining_d) {
+        do {
+            ret = zstd_do_decompress(handle->zstd.dctx, input, output);
+            if (ret == -1) {
+                break;
+            }
+        } while (!ret);
+
+        handle->zstd.remaining_d = 0;
+    }
+
+    handle->zstd.readPos_d = 0;
+    output->pos = 0;
+    vmutex_unlock(&handle->lock);
+
+    return ret;
+}
+
+static int zstd_flush_write_cache(ycfs_handle_t handle, ZSTD_EndDirective mode)
+{
+    ZSTD_inBuffer *input;
+    ZSTD_outBuffer *output;
+    int finished;
+    int ret = 0;
+
+    if (!handle) {
+        return -1;
+    }
+
+    input = &handle->zstd.input_c;
+    output = &handle->zstd.output_c;
+
+    /* flush remaining data */
+    vmutex_lock(&handle->lock);
+    if (handle->zstd.frame_size) {
+        ret = zstd_end_frame(handle);
+    } else if (input->src) {
+        do {
+            finished = zstd_do_compress(handle->zstd.cctx, input, output, mode);
+            if (finished == -1) {
+                ret = -1;
+                break;
+            }
+
+            if (output->pos) {
+                ret = vfs_write_non_compressed(handle->fd, output->dst, output->pos);
+                if (ret == -1) {
+                    break;
+                }
+            }
+        } while (!finished);
+
+        input->size = 0;
+        input->pos = 0;
+
+
+    }
+    vmutex_unlock(&handle->lock);
+
+    return ret;
+}
+
+static ssize_t zstd_write(ycfs_handle_t handle, const void *buffer, size_t nbytes)
 {
     ZSTD_inBuffer *input;
     ZSTD_outBuffer *output;
+    int finished = 0;
+    ssize_t ret = 0;
+    size_t room = 0; /* buffer size to cache user data */
+    ssize_t size_return = 0;
+
+    if (!handle || !buffer) {
+        return -1;
+    }
+    if (!handle->zstd.cctx) {
+        errno = EBADF;
+        return -1;
+    }
+    if (!nbytes) {
+        return 0;
+    }
+    if (handle->zstd.frame_size) {
+        return zstd_write_frames(handle, buffer, nbytes);
+    }
+
+    input = &handle->zstd.input_c;
+    output = &handle->zstd.output_c;
+
+    vmutex_lock(&handle->lock);
+    while (nbytes) {
+        input->src = handle->zstd.buffIn_c;
+        room = handle->zstd.buffInSize_c - input->size;
+
+        if (nbytes < room) { /* cache small data */
+            memcpy((void *)input->src + input->size, buffer, nbytes);
+            input->size += nbytes;
+            size_return += nbytes;
+            nbytes = 0;
+            break;
+        } else {
+            if (input->size) {
+                memcpy((void *)input->src + input->size, buffer, room);
+            } else {
+                input->src = buffer;
+            }
+
+            input->size += room;
+            size_return += room;
+            buffer += room;
+            nbytes -= room;
+        }
+
+        do {
+            finished = zstd_do_compress(handle->zstd.cctx, input, output, ZSTD_e_continue);
+            if (finished == -1) {
+                ret = -1;
+                break;
+            }
+
+            if (output->pos) {
+                ret = vfs_write_non_compressed(handle->fd, output->dst, output->pos);
+                if (ret == -1) {
+                    break;
+                }
+            }
+        } while (!finished);
+
+        input->size = 0;
+        input->pos = 0;
+
+        if (ret == -1) {
+            break;
+        }
+    }
+
+    vmutex_unlock(&handle->lock);
+    return (ret < 0) ? -1 : size_return;
+}
+
+static ssize_t zstd_read(ycfs_handle_t handle, void *buffer, size_t nbytes)
+{
+    ZSTD_inBuffer *input;
+    ZSTD_outBuffer *output;
+    ssize_t ret = 0;
+    size_t bytes_left = 0; /* decompressed data left in zstd buffer */
+    ssize_t size_src = 0; /* compressed data read from src file */
+    ssize_t size_return = 0;
+    ssize_t size_copy = 0; /* size copied to user */
+
+    if (!handle || !buffer) {
+        return -1;
+    }
+    if (!handle->zstd.dctx) {
+        errno = EBADF;
+        return -1;
+    }
+    if (!nbytes) {
+        return 0;
+    }
+
+    input = &handle->zstd.input_d;
+    output = &handle->zstd.output_d;
+
+    vmutex_lock(&handle->lock);
+    if (zstd_has_seek_table(handle)) {
+        ret = zstd_read_frames(handle, buffer, nbytes, handle->zstd.pos);
+        if (ret > 0) {
+            handle->zstd.pos += ret;
+        }
+        vmutex_unlock(&handle->lock);
+        return ret;
+    }
+
+    do {
+        /* if already decompressed, copy it directly from output buffer */
+        bytes_left = output->pos - handle->zstd.readPos_d;
+        size_copy = (bytes_left >= nbytes) ? nbytes : bytes_left;
+
+        if (size_copy) {
+            memcpy(buffer, output->dst + handle->zstd.readPos_d, size_copy);
+            handle->zstd.readPos_d += size_copy;
+            buffer += size_copy;
+            size_return += size_copy;
+            nbytes -= size_copy;
+        }
+
+        if (!nbytes) {
+            break;
+        }
+
+        handle->zstd.readPos_d = 0;
+        output->pos = 0;
+
+        /* start decompressing new data */
+        if (!handle->zstd.remaining_d) {
+            size_src = vfs_read_non_compressed(handle->fd, (void *)input->src, handle->zstd.buffInSize_d);
+            if (size_src == 0) { /* EOF */
+                break;
+            } else if (size_src == -1) { /* Error */
+                ret = -1;
+                break;
+            }
+            input->size = size_src;
+            input->pos = 0;
+        }
+
+        ret = zstd_do_decompress(handle->zstd.dctx, input, output);
+        if (ret == -1) {
+            break;
+        }
+
+        handle->zstd.remaining_d = !ret;
+    } while (nbytes);
+
+    vmutex_unlock(&handle->lock);
+    return (ret < 0) ? -1 : size_return;
+}
+
+ssize_t vfs_read(int fd, void *buffer, size_t nbytes)
+{
+    ycfs_handle_t handle = vfs_get_private_data(fd);
+
+    if ((handle) && ((handle->vfs_mode & VFS_MODE_ZSTD) == VFS_MODE_ZSTD)) {
+        return zstd_read(handle, buffer, nbytes);
+    }
+
+    return vfs_read_non_compressed(fd, buffer, nbytes);
+}
+
+ssize_t vfs_pread(int fd, void *buffer, size_t nbytes, off_t offset)
+{
+    ycfs_handle_t handle = vfs_get_private_data(fd);
+    ssize_t ret;
+
+    if ((handle) && ((handle->vfs_mode & VFS_MODE_ZSTD) == VFS_MODE_ZSTD)) {
+        if (!buffer || offset < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        vmutex_lock(&handle->lock);
+        if (zstd_has_seek_table(handle)) {
+            ret = zstd_read_frames(handle, buffer, nbytes, offset);
+        } else {
+            errno = ESPIPE;
+            ret = -1;
+        }
+        vmutex_unlock(&handle->lock);
+
+        return ret;
+    }
+
+    return vfs_pread_non_compressed(fd, buffer, nbytes, offset);
+}
+
+ssize_t vfs_write(int fd, const void *buffer, size_t nbytes)
+{
+    ycfs_handle_t handle = vfs_get_private_data(fd);
+
+    if ((handle) && ((handle->vfs_mode & VFS_MODE_ZSTD) == VFS_MODE_ZSTD)) {
+        return zstd_write(handle, buffer, nbytes);
+    }
+
+    return vfs_write_non_compressed(fd, buffer, nbytes);
+}
+
+ssize_t vfs_pwrite(int fd, const void *buffer, size_t nbytes, off_t offset)
+{
+    ycfs_handle_t handle = vfs_get_private_data(fd);
+    ssize_t ret;
+
+    if ((handle) && ((handle->vfs_mode & VFS_MODE_ZSTD) == VFS_MODE_ZSTD)) {
+        errno = ESPIPE;
+        return -1;
+    }
+
+    while ((ret = pwrite(fd, buffer, nbytes, offset)) == -1) {
+        if (errno == EINTR) {
+            /* just restart */
+            continue;
+        }
+
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            vapi_info("vfs_pwrite failed: pwrite: fd = %d, errno = %d (%s)", fd, errno, strerror(errno));
+        }
+        break;
+    }
+
+    return ret;
+}
+
+int vfs_open(const char *path, int flags, mode_t mode)
+{
+    return vfs_open_zstd(path, flags, mode, NULL);
+}
+
+int vfs_open_zstd(const char *path, int flags, mode_t mode, const vfs_zstd_params_t *params)
+{
+    static const vfs_zstd_params_t default_params = VFS_ZSTD_PARAMS_DEFAULT;
+    int fd;
+    ycfs_handle_t handle = NULL;
+    int vfs_mode;
+
+    if (params) {
+        mode |= VFS_MODE_ZSTD;
+    } else {
+        params = &default_params;
+    }
+    vfs_mode = mode & VFS_MODE_MASK;
+
+    while ((fd = open(path, flags, mode & ~VFS_MODE_MASK)) < 0) {
+        /* If not interrupted by signal, don't retry */
+        if (errno != EINTR) {
+            vapi_info("vfs_open failed: open %s: fd = %d, errno = %d (%s)", path, fd, errno, strerror(errno));
+            return fd;
+        }
+    }
+
+    if (((signed)mode != -1) && ((vfs_mode & VFS_MODE_ZSTD) == VFS_MODE_ZSTD)) {
+        handle = zstd_init(params, flags);
+        if (!handle) {
+            vapi_info("vfs_open failed: zstd_init failed");
+            goto error;
+        } else {
+            handle->fd = fd;
+            handle->vfs_mode = vfs_mode;
+            if (vfs_set_private_data(fd, handle) < 0) {
+                vapi_info("vfs_open failed: private data init failed");
+                zstd_free(handle);
+                goto error;
+            }
+            vapi_debug("[vfs_open]: with ZSTD mode, fd: %d, handle: %p", fd, handle);
+        }
+    }
+
+    return fd;
+
+error:
+    vfs_close_simple(fd);
+    return -1;
+}
+
+int vfs_close_simple(int fd)
+{
+    int ret = 0;
+    ycfs_handle_t handle = vfs_get_private_data(fd);
+
+    if ((handle) && ((handle->vfs_mode & VFS_MODE_ZSTD) == VFS_MODE_ZSTD)) {
+        zstd_flush_write_cache(handle, ZSTD_e_end);
+        zstd_finish_frames(handle);
+        zstd_free(handle);
+        vfs_set_private_data(fd, NULL);
+    }
+
+    while ((ret = close(fd)) != 0) {
+        /* If not interrupted by signal, don't retry */
+        if (errno != EINTR) {
+            vapi_info("vfs_close failed: close: fd = %d, errno = %d (%s)", fd, errno, strerror(errno));
+            return ret;
+        }
+    }
+
+    return ret;
+}
+
+int vfs_close(int fd)
+{
+    ycfs_handle_t handle = vfs_get_private_data(fd);
+    int ret = 0;
+
+    /* the seek table is synced with the frames */
+    if ((handle) && ((handle->vfs_mode & VFS_MODE_ZSTD) == VFS_MODE_ZSTD)) {
+        zstd_finish_frames(handle);
+    }
+
+#ifndef OFF_LINE_MIGRATION
+#ifdef __linux__
+    // prevent loss of data at power failure
+    // UBIFS uses write back iso synchronous file access
+    while ((ret = fsync(fd)) != 0) {
+        /* If not interrupted by signal, don't retry */
+        if (errno != EINTR) {
+            vapi_info("vfs_close failed: fsync: fd = %d, errno = %d (%s)", fd, errno, strerror(errno));
+            return ret;
+        }
+    }
+#endif
+#endif
+
+    return vfs_close_simple(fd);
+}
+
+off_t vfs_lseek(int fd, off_t offset, int whence)
+{
+    ycfs_handle_t handle = vfs_get_private_data(fd);
+
+    if ((handle) && ((handle->vfs_mode & VFS_MODE_ZSTD) == VFS_MODE_ZSTD)) {
+        off_t pos = zstd_seek(handle, offset, whence);
+        if (pos != -2) {
+            return pos;
+        }
+
+        zstd_flush_write_cache(handle, ZSTD_e_end);
+        zstd_drop_read_cache(handle);
+    }
+
+    off_t ret = lseek(fd, offset, whence);
+
+    if (ret == -1) {
+        vapi_info("vfs_lseek failed: lseek: fd = %d, errno = %d (%s)", fd, errno, strerror(errno));
+    }
+
+    return ret;
+}
+
+static ssize_t vfs_read_non_compressed(int fd, void *buffer, size_t nbytes)
+{
+    ssize_t ret = 0;
+
+    while ((ret = read(fd, buffer, nbytes)) != 0) {
+        if (ret == -1) {
+            if (errno == EINTR) {
+                /* just restart */
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* non-blocking fd: read would block, so return */
+                break;
+            }
+
+            vapi_info("vfs_read failed: read: fd = %d, errno = %d (%s)", fd, errno, strerror(errno));
+            break;
+        }
+        break;
+    }
+
+    return ret;
+}
+
+static ssize_t vfs_pread_non_compressed(int fd, void *buffer, size_t nbytes, off_t offset)
+{
+    ssize_t ret;
+
+    while ((ret = pread(fd, buffer, nbytes, offset)) == -1) {
+        if (errno == EINTR) {
+            /* just restart */
+            continue;
+        }
+
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            vapi_info("vfs_pread failed: pread: fd = %d, errno = %d (%s)", fd, errno, strerror(errno));
+        }
+        break;
+    }
+
+    return ret;
+}
+
+static ssize_t vfs_write_non_compressed(int fd, const void *buffer, size_t nbytes)
+{
+    ssize_t ret = 0;
+
+    while ((ret = write(fd, buffer, nbytes)) != 0) {
+        if (ret == -1) {
+            if (errno == EINTR) {
+                /* just restart */
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* non-blocking fd: write would block, so return */
+                break;
+            }
+
+            vapi_info("vfs_write failed: write: fd = %d, errno = %d (%s)", fd, errno, strerror(errno));
+            break;
+        }
+        break;
+    }
+
+    return ret;
+}
+
+ssize_t vfs_readstring(int fd, char *buffer, size_t size)
+{
+    char c = '\0';
     ssize_t ret = 0;
-    size_t bytes_left = 0; /* decompressed data left in zstd buffer */
-    ssize_t size_src = 0; /* compressed data read from src file */
-    ssize_t size_return = 0;
-    ssize_t size_copy = 0; /* size copied to user */
+    size_t len = 0;
 
-    if (!handle || !buffer) {
+    if ((buffer == NULL) || (size == 0)) {
+        vapi_error("vfs_readstring failed: buffer = %p, size = %zu", buffer, size);
         return -1;
     }
-    if (!nbytes) {
-        return 0;
-    }
-
-    input = &handle->zstd.input_d;
-    output = &handle->zstd.output_d;
 
-    vmutex_lock(&handle->lock);
-    do {
-        /* if already decompressed, copy it directly from output buffer */
-        bytes_left = output->pos - handle->zstd.readPos_d;
-        size_copy = (bytes_left >= nbytes) ? nbytes : bytes_left;
+    while (len < size - 1) {
+        ret = vfs_read(fd, &c, 1);
 
-        if (size_copy) {
-            memcpy(buffer, output->dst + handle->zstd.readPos_d, size_copy);
-            handle->zstd.readPos_d += size_copy;
-            buffer += size_copy;
-            size_return += size_copy;
-            nbytes -= size_copy;
+        if (ret < 0) {
+            vapi_warning("vfs_readstring failed: vfs_read: fd = %d", fd);
+            return -1;
         }
 
-        if (!nbytes) {
+        if (ret == 0)   /* End of file. */
             break;
-        }
-
-        handle->zstd.readPos_d = 0;
-        output->pos = 0;
 
-        /* start decompressing new data */
-        if (!handle->zstd.remaining_d) {
-            size_src = vfs_read_non_compressed(handle->fd, (void *)input->src, handle->zstd.buffInSize_d);
-            if (size_src == 0) { /* EOF */
-                break;
-            } else if (size_src == -1) { /* Error */
-                ret = -1;
-                break;
-            }
-            input->size = size_src;
-            input->pos = 0;
-        }
+        buffer[len++] = c;
 
-        ret = zstd_do_decompress(handle->zstd.dctx, input, output);
-        if (ret == -1) {
+        if (c == '\n')
             break;
+    }
+
+    buffer[len] = '\0'; /* Write (but do not count) trailing null. */
+
+    return len;
+}
+
+ssize_t vfs_readlink(const char *path, char *buf, size_t bufsiz)
+{
+    if ((buf == NULL) || (bufsiz == 0)) {
+        vapi_error("vfs_readlink failed: null or empty buffer");
+        return -1;
+    } else if ((path == NULL) || (strlen(path) == 0)) {
+        vapi_error("vfs_readlink failed: null or empty path");
+        return -1;
+    }
+    return readlink(path, buf, bufsiz - 1);
+}
+
+int vfs_symlink(const char *sourcePath, const char *symlinkPath)
+{
+    if ((sourcePath == NULL) || (strlen(sourcePath) == 0)) {
+        vapi_error("vfs_symlink failed: null or empty sourcePath");
+        return -1;
+    } else if ((symlinkPath == NULL) || (strlen(symlinkPath) == 0)) {
+        vapi_error("vfs_symlink failed: null or empty symlinkPath");
+        return -1;
+    }
+    return symlink(sourcePath, symlinkPath);
+}
+
+int vfs_stat(const char *path, vfs_stat_t *buf)
+{
+    return stat(path, buf);
+}
+
+int vfs_fstat(int fd, vfs_stat_t *buf)
+{
+    return fstat(fd, buf);
+}
+
+int vfs_lstat(const char *path, vfs_stat_t *buf)
+{
+    return lstat(path, buf);
+}
+
+int vfs_statvfs(const char *file, vfs_statvfs_t *buf)
+{
+    int rc;
+
+    rc = statvfs(file, buf);
+    if (rc != 0) {
+        return rc;
+    }
+
+#ifdef __linux__
+    struct sysinfo sysinfo1;
+    if (buf->f_blocks == 0) {  // on linux ramfs, zero means no limits
+        rc = sysinfo(&sysinfo1);
+        if (rc != 0) {
+            return rc;
         }
+        buf->f_blocks = sysinfo1.totalram / buf->f_bsize;
+        buf->f_bfree  = sysinfo1.freeram  / buf->f_bsize;
+        buf->f_bavail = buf->f_bfree;
+        buf->f_files  = sysinfo1.totalram / 128;
+        buf->f_favail = sysinfo1.freeram  / 128;
+    }
+#endif
+    return rc;
+}
 
-        handle->zstd.remaining_d = !ret;
-    } while (nbytes);
+int vfs_fstatvfs(int fd, vfs_statvfs_t *buf)
+{
+    return fstatvfs(fd, buf);
+}
 
-    vmutex_unlock(&handle->lock);
-    return (ret < 0) ? -1 : size_return;
+void vfs_sync(void)
+{
+    sync();
 }
 
-ssize_t vfs_read(int fd, void *buffer, size_t nbytes)
+static void vfs_map_advise(void *addr, size_t len, unsigned int flags)
 {
-    ycfs_handle_t handle = vfs_get_private_data(fd);
+    /* hints only, a kernel without them maps all the same */
+    if (flags & VFS_MAP_SEQUENTIAL) {
+        madvise(addr, len, MADV_SEQUENTIAL);
+    }
+    if (flags & VFS_MAP_WILLNEED) {
+        madvise(addr, len, MADV_WILLNEED);
+    }
+#ifdef MADV_HUGEPAGE
+    if (flags & VFS_MAP_HUGEPAGE) {
+        madvise(addr, len, MADV_HUGEPAGE);
+    }
+#endif
+}
 
-    if ((handle) && ((handle->vfs_mode & VFS_MODE_ZSTD) == VFS_MODE_ZSTD)) {
-        return zstd_read(handle, buffer, nbytes);
+/* Sum of the content sizes of all the frames, skippable ones count for 0 */
+static unsigned long long vfs_map_zstd_size(const char *src, size_t src_len)
+{
+    unsigned long long total = 0;
+
+    while (src_len > 0) {
+        size_t frame_len = ZSTD_findFrameCompressedSize(src, src_len);
+        unsigned long long content_size = 0;
+
+        if (src_len >= 4 && (zstd_get_le32((const uint8_t *)src) & 0xFFFFFFF0) != ZSTD_MAGIC_SKIPPABLE_START) {
+            content_size = ZSTD_getFrameContentSize(src, src_len);
+        }
+        if (content_size == ZSTD_CONTENTSIZE_ERROR || ZSTD_isError(frame_len)) {
+            return ZSTD_CONTENTSIZE_ERROR;
+        }
+        if (content_size == ZSTD_CONTENTSIZE_UNKNOWN) {
+            return ZSTD_CONTENTSIZE_UNKNOWN;
+        }
+        total += content_size;
+        src += frame_len;
+        src_len -= frame_len;
     }
 
-    return vfs_read_non_compressed(fd, buffer, nbytes);
+    return total;
 }
 
-ssize_t vfs_write(int fd, const void *buffer, size_t nbytes)
+/* Seek table entries of a mapped seekable file, NULL if it has none or an invalid one */
+static const uint8_t *vfs_map_zstd_seek_table(const uint8_t *src, size_t src_len, uint32_t *nb, size_t *entry_size,
+                                              uint64_t *d_total)
 {
-    ycfs_handle_t handle = vfs_get_private_data(fd);
+    const uint8_t *footer = src + src_len - ZSTD_SEEKABLE_FOOTER_SIZE;
+    const uint8_t *table, *p;
+    uint64_t c_total = 0;
+    size_t table_size;
+    uint32_t i;
+
+    if (src_len < ZSTD_SEEKABLE_HEADER_SIZE + ZSTD_SEEKABLE_FOOTER_SIZE ||
+        zstd_get_le32(footer + 5) != ZSTD_SEEKABLE_MAGIC || (footer[4] & ZSTD_SEEKABLE_RESERVED_BITS)) {
+        return NULL;
+    }
 
-    if ((handle) && ((handle->vfs_mode & VFS_MODE_ZSTD) == VFS_MODE_ZSTD)) {
-        return zstd_write(handle, buffer, nbytes);
+    *nb = zstd_get_le32(footer);
+    *entry_size = (footer[4] & ZSTD_SEEKABLE_CHECKSUM_FLAG) ? 3 * sizeof(uint32_t) : 2 * sizeof(uint32_t);
+    table_size = ZSTD_SEEKABLE_HEADER_SIZE + (size_t)*nb * *entry_size + ZSTD_SEEKABLE_FOOTER_SIZE;
+    if (table_size > src_len) {
+        return NULL;
     }
 
-    return vfs_write_non_compressed(fd, buffer, nbytes);
+    table = src + src_len - table_size;
+    if (zstd_get_le32(table) != ZSTD_SEEKABLE_SKIPPABLE_MAGIC ||
+        zstd_get_le32(table + 4) != table_size - ZSTD_SEEKABLE_HEADER_SIZE) {
+        return NULL;
+    }
+
+    *d_total = 0;
+    for (i = 0, p = table + ZSTD_SEEKABLE_HEADER_SIZE; i < *nb; i++, p += *entry_size) {
+        if (zstd_get_le32(p + 4) > VFS_ZSTD_FRAME_MAX) {
+            return NULL;
+        }
+        c_total += zstd_get_le32(p);
+        *d_total += zstd_get_le32(p + 4);
+    }
+
+    /* the frames fill the file up to the seek table */
+    return (c_total == src_len - table_size) ? table + ZSTD_SEEKABLE_HEADER_SIZE : NULL;
 }
 
-int vfs_open(const char *path, int flags, mode_t mode)
+/* Decompress each frame of a seekable file at its place in the mapping, without a stream buffer */
+static int vfs_map_zstd_frames(ZSTD_DCtx *dctx, uint8_t *dst, const uint8_t *src, const uint8_t *entry,
+                               uint32_t nb, size_t entry_size)
 {
-    int fd;
-    ycfs_handle_t handle = NULL;
-    int vfs_mode = mode & VFS_MODE_MASK;
+    uint32_t i, c_size, d_size;
+    size_t ret;
 
-    while ((fd = open(path, flags, mode & ~VFS_MODE_MASK)) < 0) {
-        /* If not interrupted by signal, don't retry */
-        if (errno != EINTR) {
-            vapi_info("vfs_open failed: open %s: fd = %d, errno = %d (%s)", path, fd, errno, strerror(errno));
-            return fd;
+    for (i = 0; i < nb; i++, entry += entry_size) {
+        c_size = zstd_get_le32(entry);
+        d_size = zstd_get_le32(entry + 4);
+        ret = ZSTD_decompressDCtx(dctx, dst, d_size, src, c_size);
+        if (ZSTD_isError(ret) || ret != d_size) {
+            vapi_warning("vfs_map failed: frame %u: %s", i, ZSTD_isError(ret) ? ZSTD_getErrorName(ret) : "size mismatch");
+            return -1;
         }
+        src += c_size;
+        dst += d_size;
     }
 
-    if (((signed)mode != -1) && ((vfs_mode & VFS_MODE_ZSTD) == VFS_MODE_ZSTD)) {
-        if (vfs_private_data_init() < 0) {
-            vapi_info("vfs_open failed: private data init failed");
-            goto error;
+    return 0;
+}
+
+/* Decompress a mapped zstd file, its frames and seek table included, into an anonymous mapping */
+static void *vfs_map_zstd(const char *path, const void *src, size_t src_len, unsigned int flags, size_t *len)
+{
+    unsigned long long content_size = vfs_map_zstd_size(src, src_len);
+    const uint8_t *seek_table;
+    size_t entry_size = 0;
+    uint64_t d_total = 0;
+    uint32_t nb = 0;
+    ZSTD_inBuffer in = { src, src_len, 0 };
+    ZSTD_outBuffer out = { NULL, 0, 0 };
+    size_t map_len, ret = 1;
+    ZSTD_DCtx *dctx;
+    void *addr;
+
+    if (content_size == ZSTD_CONTENTSIZE_ERROR) {
+        vapi_warning("vfs_map failed: %s is not a zstd file", path);
+        return NULL;
+    }
+    /* the seek table has the size of each frame, frames written by a stream have none and the mapping grows */
+    seek_table = vfs_map_zstd_seek_table(src, src_len, &nb, &entry_size, &d_total);
+    if (seek_table) {
+        content_size = d_total;
+    }
+    map_len = (content_size == ZSTD_CONTENTSIZE_UNKNOWN) ? MAX(src_len * 4, (size_t)VFS_MAP_GROW_MIN) : (size_t)content_size;
+    map_len = MAX(map_len, (size_t)1);
+
+    dctx = ZSTD_createDCtx();
+    if (!dctx) {
+        return NULL;
+    }
+    /* the whole output is in memory anyway, any window fits */
+    ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax, ZSTD_dParam_getBounds(ZSTD_d_windowLogMax).upperBound);
+
+    addr = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        vapi_warning("vfs_map failed: mmap of %zu bytes: errno = %d (%s)", map_len, errno, strerror(errno));
+        addr = NULL;
+        goto vfs_map_zstd_exit;
+    }
+    vfs_map_advise(addr, map_len, flags & VFS_MAP_HUGEPAGE);
+
+    if (seek_table) {
+        if (vfs_map_zstd_frames(dctx, addr, src, seek_table, nb, entry_size) < 0) {
+            munmap(addr, map_len);
+            addr = NULL;
+            goto vfs_map_zstd_exit;
         }
+        in.pos = in.size;
+        out.pos = d_total;
+        ret = 0;
+    }
 
-        handle = zstd_init(ZSTD_CLEVEL_DEFAULT);
-        if (!handle) {
-            vapi_info("vfs_open failed: zstd_init failed");
-            goto error;
-        } else {
-            handle->fd = fd;
-            handle->vfs_mode = vfs_mode;
-            vfs_set_private_data(fd, handle);
-            vapi_debug("[vfs_open]: with ZSTD mode, fd: %d, handle: %p", fd, handle);
+    while (in.pos < in.size) {
+        if (out.pos == map_len) {
+            void *grown = mremap(addr, map_len, map_len * 2, MREMAP_MAYMOVE);
+
+            if (grown == MAP_FAILED) {
+                vapi_warning("vfs_map failed: mremap to %zu bytes: errno = %d (%s)", map_len * 2, errno, strerror(errno));
+                break;
+            }
+            addr = grown;
+            map_len *= 2;
+        }
+
+        out.dst = addr;
+        out.size = map_len;
+        ret = ZSTD_decompressStream(dctx, &out, &in);
+        if (ZSTD_isError(ret)) {
+            vapi_warning("vfs_map failed: %s: %s", path, ZSTD_getErrorName(ret));
+            break;
         }
     }
 
-    return fd;
+    /* ret is 0 at the end of a complete frame */
+    if (in.pos < in.size || ret != 0) {
+        if (!ZSTD_isError(ret) && in.pos == in.size) {
+            vapi_warning("vfs_map failed: %s is truncated", path);
+        }
+        munmap(addr, map_len);
+        addr = NULL;
+        goto vfs_map_zstd_exit;
+    }
 
-error:
-    vfs_close_simple(fd);
-    return -1;
+    /* shrinking in place, the length given to vfs_unmap() covers the whole mapping */
+    if (out.pos < map_len) {
+        addr = mremap(addr, map_len, MAX(out.pos, (size_t)1), 0);
+        map_len = MAX(out.pos, (size_t)1);
+    }
+    mprotect(addr, map_len, PROT_READ);
+    *len = out.pos;
+
+vfs_map_zstd_exit:
+    ZSTD_freeDCtx(dctx);
+    return addr;
 }
 
-int vfs_close_simple(int fd)
+void *vfs_map(const char *path, unsigned int flags, size_t *len)
 {
-    int ret = 0;
-    ycfs_handle_t handle = vfs_get_private_data(fd);
+    vfs_stat_t statbuf;
+    void *addr = NULL;
+    size_t map_len;
+    int fd;
 
-    if ((handle) && ((handle->vfs_mode & VFS_MODE_ZSTD) == VFS_MODE_ZSTD)) {
-        zstd_flush_write_cache(handle, ZSTD_e_end);
-        zstd_free(handle);
-        vfs_set_private_data(fd, NULL);
+    if (!len) {
+        errno = EINVAL;
+        return NULL;
     }
 
-    while ((ret = close(fd)) != 0) {
-        /* If not interrupted by signal, don't retry */
+    while ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
         if (errno != EINTR) {
-            vapi_info("vfs_close failed: close: fd = %d, errno = %d (%s)", fd, errno, strerror(errno));
-            return ret;
+            vapi_info("vfs_map failed: open %s: errno = %d (%s)", path, errno, strerror(errno));
+            return NULL;
         }
     }
 
-    return ret;
+    if (fstat(fd, &statbuf) != 0) {
+        vapi_warning("vfs_map failed: fstat %s: errno = %d (%s)", path, errno, strerror(errno));
+        goto vfs_map_exit;
+    }
+
+    /* an empty file has nothing to map, it gets a page that vfs_unmap() accepts */
+    map_len = statbuf.st_size ? (size_t)statbuf.st_size : 1;
+    addr = mmap(NULL, map_len, PROT_READ, statbuf.st_size ? MAP_PRIVATE : (MAP_PRIVATE | MAP_ANONYMOUS),
+                statbuf.st_size ? fd : -1, 0);
+    if (addr == MAP_FAILED) {
+        vapi_warning("vfs_map failed: mmap %s: errno = %d (%s)", path, errno, strerror(errno));
+        addr = NULL;
+        goto vfs_map_exit;
+    }
+
+    if ((flags & VFS_MODE_ZSTD) == VFS_MODE_ZSTD) {
+        void *compressed = addr;
+
+        madvise(compressed, map_len, MADV_SEQUENTIAL);
+        addr = vfs_map_zstd(path, compressed, statbuf.st_size, flags, len);
+        munmap(compressed, map_len);
+        goto vfs_map_exit;
+    }
+
+    vfs_map_advise(addr, map_len, flags);
+    *len = statbuf.st_size;
+
+vfs_map_exit:
+    close(fd);
+    return addr;
 }
 
-int vfs_close(int fd)
+int vfs_unmap(void *addr, size_t len)
+{
+    if (munmap(addr, len ? len : 1) != 0) {
+        vapi_warning("vfs_unmap failed: errno = %d (%s)", errno, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int vfs_prefetch(const char *path, off_t offset, size_t len)
 {
     int ret = 0;
+    int fd;
 
-#ifndef OFF_LINE_MIGRATION
-#ifdef __linux__
-    // prevent loss of data at power failure
-    // UBIFS uses write back iso synchronous file access
-    while ((ret = fsync(fd)) != 0) {
-        /* If not interrupted by signal, don't retry */
+    while ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
         if (errno != EINTR) {
-            vapi_info("vfs_close failed: fsync: fd = %d, errno = %d (%s)", fd, errno, strerror(errno));
-            return ret;
+            vapi_info("vfs_prefetch failed: open %s: errno = %d (%s)", path, errno, strerror(errno));
+            return -1;
         }
     }
-#endif
-#endif
 
-    return vfs_close_simple(fd);
+    /* posix_fadvise() for the filesystems without readahead() */
+    if (readahead(fd, offset, len ? len : SIZE_MAX) != 0) {
+        ret = posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+        if (ret != 0) {
+            vapi_warning("vfs_prefetch failed: %s: errno = %d (%s)", path, ret, strerror(ret));
+            ret = -1;
+        }
+    }
+
+    close(fd);
+    return ret;
 }
 
-off_t vfs_lseek(int fd, off_t offset, int whence)
+typedef struct {
+    int src_fd;
+    int dst_fd;
+    off_t total;            /* size of the source, 0 when unknown */
+    off_t copied;
+    size_t chunk;
+    const vfs_copy_params_t *params;
+} vfs_copy_ctx_t;
+
+static int vfs_copy_progress(vfs_copy_ctx_t *ctx, ssize_t len)
 {
-    ycfs_handle_t handle = vfs_get_private_data(fd);
+    ctx->copied += len;
 
-    if ((handle) && ((handle->vfs_mode & VFS_MODE_ZSTD) == VFS_MODE_ZSTD)) {
-        zstd_flush_write_cache(handle, ZSTD_e_end);
-        zstd_drop_read_cache(handle);
+    if (ctx->params->progress && ctx->params->progress(ctx->copied, ctx->total, ctx->params->ctxt) != 0) {
+        errno = ECANCELED;
+        return -1;
     }
 
-    off_t ret = lseek(fd, offset, whence);
+    return 0;
+}
 
-    if (ret == -1) {
-        vapi_info("vfs_lseek failed: lseek: fd = %d, errno = %d (%s)", fd, errno, strerror(errno));
+/* The copy methods return 0 when done, 1 when not supported before anything was copied */
+static int vfs_copy_reflink(vfs_copy_ctx_t *ctx)
+{
+#ifdef FICLONE
+    if (ioctl(ctx->dst_fd, FICLONE, ctx->src_fd) == 0) {
+        return vfs_copy_progress(ctx, ctx->total);
     }
+#endif
 
-    return ret;
+    return 1;
 }
 
-static ssize_t vfs_read_non_compressed(int fd, void *buffer, size_t nbytes)
+static int vfs_copy_file_range(vfs_copy_ctx_t *ctx)
 {
-    ssize_t ret = 0;
+    ssize_t ret;
 
-    while ((ret = read(fd, buffer, nbytes)) != 0) {
-        if (ret == -1) {
+    while ((ret = copy_file_range(ctx->src_fd, NULL, ctx->dst_fd, NULL, ctx->chunk, 0)) != 0) {
+        if (ret < 0) {
             if (errno == EINTR) {
-                /* just restart */
                 continue;
             }
-
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                /* non-blocking fd: read would block, so return */
-                break;
+            if (ctx->copied == 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                return 1;
             }
+            vapi_warning("vfs_copy failed: copy_file_range: errno = %d (%s)", errno, strerror(errno));
+            return -1;
+        }
 
-            vapi_info("vfs_read failed: read: fd = %d, errno = %d (%s)", fd, errno, strerror(errno));
-            break;
+        if (vfs_copy_progress(ctx, ret) < 0) {
+            return -1;
         }
-        break;
     }
 
-    return ret;
+    /* pseudo files report an empty source, copy them otherwise */
+    return (ctx->copied == 0) ? 1 : 0;
 }
 
-static ssize_t vfs_write_non_compressed(int fd, const void *buffer, size_t nbytes)
+static int vfs_copy_sendfile(vfs_copy_ctx_t *ctx)
 {
-    ssize_t ret = 0;
+    ssize_t ret;
 
-    while ((ret = write(fd, buffer, nbytes)) != 0) {
-        if (ret == -1) {
+    while ((ret = sendfile(ctx->dst_fd, ctx->src_fd, NULL, ctx->chunk)) != 0) {
+        if (ret < 0) {
             if (errno == EINTR) {
-                /* just restart */
                 continue;
             }
-
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                /* non-blocking fd: write would block, so return */
-                break;
+            if (ctx->copied == 0 && (errno == EINVAL || errno == ENOSYS)) {
+                return 1;
             }
+            vapi_warning("vfs_copy failed: sendfile: errno = %d (%s)", errno, strerror(errno));
+            return -1;
+        }
 
-            vapi_info("vfs_write failed: write: fd = %d, errno = %d (%s)", fd, errno, strerror(errno));
-            break;
+        if (vfs_copy_progress(ctx, ret) < 0) {
+            return -1;
         }
-        break;
     }
 
-    return ret;
+    return 0;
 }
 
-ssize_t vfs_readstring(int fd, char *buffer, size_t size)
+/* Read/write loop, through vfs_read()/vfs_write(): also transcodes VFS_MODE_ZSTD files */
+static int vfs_copy_read_write(vfs_copy_ctx_t *ctx)
 {
-    char c = '\0';
-    ssize_t ret = 0;
-    size_t len = 0;
+    ssize_t len, done, ret = 0;
+    char *buffer;
 
-    if ((buffer == NULL) || (size == 0)) {
-        vapi_error("vfs_readstring failed: buffer = %p, size = %zu", buffer, size);
+    buffer = vmem_malloc(vmem_alloc_default(), VFS_COPY_BUFFER_SIZE);
+    if (!buffer) {
         return -1;
     }
 
-    while (len < size - 1) {
-        ret = vfs_read(fd, &c, 1);
-
-        if (ret < 0) {
-            vapi_warning("vfs_readstring failed: vfs_read: fd = %d", fd);
-            return -1;
+    while ((len = vfs_read(ctx->src_fd, buffer, VFS_COPY_BUFFER_SIZE)) > 0) {
+        for (done = 0; done < len; done += ret) {
+            ret = vfs_write(ctx->dst_fd, buffer + done, len - done);
+            if (ret <= 0) {
+                break;
+            }
         }
-
-        if (ret == 0)   /* End of file. */
-            break;
-
-        buffer[len++] = c;
-
-        if (c == '\n')
+        if (ret <= 0 || vfs_copy_progress(ctx, len) < 0) {
+            len = -1;
             break;
+        }
     }
 
-    buffer[len] = '\0'; /* Write (but do not count) trailing null. */
+    vmem_free(vmem_alloc_default(), buffer);
 
-    return len;
+    return (len < 0) ? -1 : 0;
 }
 
-ssize_t vfs_readlink(const char *path, char *buf, size_t bufsiz)
+/* Raw copy of the bytes, with the fastest method supported by both files */
+static int vfs_copy_raw(vfs_copy_ctx_t *ctx)
 {
-    if ((buf == NULL) || (bufsiz == 0)) {
-        vapi_error("vfs_readlink failed: null or empty buffer");
-        return -1;
-    } else if ((path == NULL) || (strlen(path) == 0)) {
-        vapi_error("vfs_readlink failed: null or empty path");
-        return -1;
+    unsigned int methods = ctx->params->methods ? ctx->params->methods : VFS_COPY_ALL;
+    int ret = 1;
+
+    if (methods & VFS_COPY_REFLINK) {
+        ret = vfs_copy_reflink(ctx);
+        if (ret <= 0) {
+            return ret;
+        }
     }
-    return readlink(path, buf, bufsiz - 1);
-}
 
-int vfs_symlink(const char *sourcePath, const char *symlinkPath)
-{
-    if ((sourcePath == NULL) || (strlen(sourcePath) == 0)) {
-        vapi_error("vfs_symlink failed: null or empty sourcePath");
-        return -1;
-    } else if ((symlinkPath == NULL) || (strlen(symlinkPath) == 0)) {
-        vapi_error("vfs_symlink failed: null or empty symlinkPath");
+    /* reserve the space now, a full disk fails the copy before it starts */
+    if (ctx->total > 0 && fallocate(ctx->dst_fd, FALLOC_FL_KEEP_SIZE, 0, ctx->total) != 0 && errno == ENOSPC) {
+        vapi_warning("vfs_copy failed: fallocate of %ld bytes: no space left", (long)ctx->total);
         return -1;
     }
-    return symlink(sourcePath, symlinkPath);
-}
-
-int vfs_stat(const char *path, vfs_stat_t *buf)
-{
-    return stat(path, buf);
-}
-
-int vfs_fstat(int fd, vfs_stat_t *buf)
-{
-    return fstat(fd, buf);
-}
 
-int vfs_lstat(const char *path, vfs_stat_t *buf)
-{
-    return lstat(path, buf);
-}
+    if (methods & VFS_COPY_FILE_RANGE) {
+        ret = vfs_copy_file_range(ctx);
+        if (ret <= 0) {
+            return ret;
+        }
+    }
 
-int vfs_statvfs(const char *file, vfs_statvfs_t *buf)
-{
-    int rc;
+    if (methods & VFS_COPY_SENDFILE) {
+        ret = vfs_copy_sendfile(ctx);
+        if (ret <= 0) {
+            return ret;
+        }
+    }
 
-    rc = statvfs(file, buf);
-    if (rc != 0) {
-        return rc;
+    if (methods & VFS_COPY_READ_WRITE) {
+        ret = vfs_copy_read_write(ctx);
     }
 
-#ifdef __linux__
-    struct sysinfo sysinfo1;
-    if (buf->f_blocks == 0) {  // on linux ramfs, zero means no limits
-        rc = sysinfo(&sysinfo1);
-        if (rc != 0) {
-            return rc;
-        }
-        buf->f_blocks = sysinfo1.totalram / buf->f_bsize;
-        buf->f_bfree  = sysinfo1.freeram  / buf->f_bsize;
-        buf->f_bavail = buf->f_bfree;
-        buf->f_files  = sysinfo1.totalram / 128;
-        buf->f_favail = sysinfo1.freeram  / 128;
+    if (ret == 1) {
+        vapi_warning("vfs_copy failed: no supported copy method in 0x%x", methods);
+        ret = -1;
     }
-#endif
-    return rc;
+
+    return ret;
 }
 
-int vfs_fstatvfs(int fd, vfs_statvfs_t *buf)
+/* The file starts with a zstd frame, skippable or not */
+static int vfs_copy_is_zstd(int fd)
 {
-    return fstatvfs(fd, buf);
+    uint8_t magic[4];
+    uint32_t value;
+
+    if (vfs_pread(fd, magic, sizeof(magic), 0) != sizeof(magic)) {
+        return 0;
+    }
+    value = zstd_get_le32(magic);
+
+    return (value == ZSTD_MAGICNUMBER) || ((value & ZSTD_MAGIC_SKIPPABLE_MASK) == ZSTD_MAGIC_SKIPPABLE_START);
 }
 
-void vfs_sync(void)
+ssize_t vfs_copy(const char *srcpath, const char *dstpath, mode_t dstmode)
 {
-    sync();
+    return vfs_copy_ex(srcpath, dstpath, dstmode, NULL);
 }
 
-ssize_t vfs_copy(const char *srcpath, const char *dstpath, mode_t dstmode)
+ssize_t vfs_copy_ex(const char *srcpath, const char *dstpath, mode_t dstmode, const vfs_copy_params_t *params)
 {
-    vfs_stat_t statbuf;
+    static const vfs_copy_params_t default_params = VFS_COPY_PARAMS_DEFAULT;
     const mode_t srcmode = (mode_t) -1; /* Don't care, ignored anyway. */
+    vfs_copy_ctx_t ctx;
+    vfs_stat_t statbuf;
+    int src_zstd, dst_zstd, transcode;
     ssize_t ret = 0;
+    int dst_fd;
+
+    if (!params) {
+        params = &default_params;
+    }
+    /* an inherited destination mode keeps the compression of the source */
+    src_zstd = (params->src_mode != (mode_t) -1) && ((params->src_mode & VFS_MODE_ZSTD) == VFS_MODE_ZSTD);
+    dst_zstd = (dstmode != (mode_t) -1) ? ((dstmode & VFS_MODE_ZSTD) == VFS_MODE_ZSTD) : src_zstd;
+    transcode = (src_zstd != dst_zstd);
 
-    int src_fd = vfs_open(srcpath, O_RDONLY, srcmode);
+    int src_fd = vfs_open(srcpath, O_RDONLY, (transcode && src_zstd) ? VFS_MODE_ZSTD : srcmode);
     if (src_fd < 0) {
         vapi_warning("vfs_copy failed: vfs_open: path = %s", srcpath);
         ret = -1;
@@ -739,31 +1900,48 @@ ssize_t vfs_copy(const char *srcpath, const char *dstpath, mode_t dstmode)
         goto vfs_copy_exit_1;
     }
 
+    /* a source of unknown mode already made of zstd frames is not compressed a second time */
+    if (params->src_mode == (mode_t) -1 && dst_zstd && vfs_copy_is_zstd(src_fd)) {
+        src_zstd = 1;
+        transcode = 0;
+    }
+
     if (dstmode == (mode_t) -1)
         dstmode = statbuf.st_mode;
 
-    int dst_fd = vfs_open(dstpath, (O_WRONLY | O_CREAT), dstmode);
+    /* the compressed bytes are copied as they are when both sides have the same mode */
+    if (!transcode) {
+        dst_fd = vfs_open(dstpath, (O_WRONLY | O_CREAT | O_TRUNC), dstmode & ~VFS_MODE_MASK);
+    } else if (dst_zstd && params->zstd) {
+        dst_fd = vfs_open_zstd(dstpath, (O_WRONLY | O_CREAT | O_TRUNC), dstmode & ~VFS_MODE_MASK, params->zstd);
+    } else {
+        dst_fd = vfs_open(dstpath, (O_WRONLY | O_CREAT | O_TRUNC), dstmode);
+    }
     if (dst_fd < 0) {
         vapi_warning("vfs_copy failed: vfs_open: path = %s", dstpath);
         ret = -1;
         goto vfs_copy_exit_1;
     }
 
-    ret = sendfile(dst_fd, src_fd, NULL, statbuf.st_size);
-    if (ret < 0) {
-        vapi_warning("vfs_copy failed: sendfile: out_fd = %d, in_fd = %d, errno = %d (%s)", dst_fd, src_fd, errno, strerror(errno));
-        ret = -1;
-        goto vfs_copy_exit_2;
-    } else if (ret != statbuf.st_size) {
-        vapi_warning("vfs_copy failed: nwritten=%zd != nread=%ld", ret, statbuf.st_size);
+    ctx.src_fd = src_fd;
+    ctx.dst_fd = dst_fd;
+    ctx.total = (transcode && src_zstd) ? 0 : statbuf.st_size;
+    ctx.copied = 0;
+    ctx.chunk = params->chunk_size ? params->chunk_size : VFS_COPY_CHUNK_DEFAULT;
+    ctx.params = params;
+
+    if ((transcode ? vfs_copy_read_write(&ctx) : vfs_copy_raw(&ctx)) < 0) {
+        vapi_warning("vfs_copy failed: %s to %s after %ld bytes", srcpath, dstpath, (long)ctx.copied);
         ret = -1;
-        goto vfs_copy_exit_2;
+    } else {
+        ret = ctx.copied;
     }
 
-vfs_copy_exit_2:
-    vfs_close(dst_fd);
+    if (vfs_close(dst_fd) != 0) {
+        ret = -1;
+    }
 vfs_copy_exit_1:
-    vfs_close(src_fd);
+    vfs_close_simple(src_fd);
 vfs_copy_exit_0:
     return ret;
 }
@@ -788,69 +1966,215 @@ int vfs_mkdir(const char *path, mode_t mode)
     return mkdir(path, mode);
 }
 
-int vfs_opendir(const char *path, vfs_dir_handle_t *handle)
+int vfs_file_exists(const char *path)
+{
+    if (access(path, F_OK) != -1) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+vfs_zstd_dict_t vfs_zstd_dict_create(const void *buffer, size_t size, int level)
 {
-    DIR *stream = opendir(path);
+    vfs_zstd_dict_t dict;
 
-    *handle = stream;
+    if (!buffer || !size) {
+        vapi_error("vfs_zstd_dict_create failed: empty dictionary");
+        return NULL;
+    }
 
-    if (stream == NULL)
-        return -1;
+    dict = vmem_calloc(vmem_alloc_default(), sizeof(*dict));
+    if (!dict) {
+        return NULL;
+    }
 
-    return 0;
+    /* both copy the buffer */
+    dict->cdict = ZSTD_createCDict(buffer, size, level ? level : ZSTD_CLEVEL_DEFAULT);
+    dict->ddict = ZSTD_createDDict(buffer, size);
+    if (!dict->cdict || !dict->ddict) {
+        vapi_error("vfs_zstd_dict_create failed: could not digest dictionary of %zu bytes", size);
+        ZSTD_freeCDict(dict->cdict);
+        ZSTD_freeDDict(dict->ddict);
+        vmem_free(vmem_alloc_default(), dict);
+        return NULL;
+    }
+    dict->refs = 1;
+
+    return dict;
 }
 
-int vfs_readdir(vfs_dir_handle_t handle, char *buffer, size_t size)
+vfs_zstd_dict_t vfs_zstd_dict_load(const char *path, int level)
 {
-    DIR *stream = (DIR *) handle;
-    struct dirent *result;
-    const char *d_name;
+    vfs_zstd_dict_t dict = NULL;
+    vfs_stat_t statbuf;
+    ssize_t len = 0;
+    ssize_t ret;
+    char *buffer;
+    int fd;
 
-    if ((stream == NULL) || (buffer == NULL) || (size == 0))
-        return -1;
+    fd = vfs_open(path, O_RDONLY, (mode_t) -1);
+    if (fd < 0) {
+        vapi_warning("vfs_zstd_dict_load failed: vfs_open: path = %s", path);
+        return NULL;
+    }
+
+    if (vfs_fstat(fd, &statbuf) < 0 || statbuf.st_size <= 0 || statbuf.st_size > VFS_ZSTD_DICT_MAX) {
+        vapi_warning("vfs_zstd_dict_load failed: %s is not a dictionary", path);
+        vfs_close_simple(fd);
+        return NULL;
+    }
 
-    /* readdir_r is deprecated and cannot be used. See:
-     * http://man7.org/linux/man-pages/man3/readdir_r.3.html
-     * readdir on glibc is thread-safe for calls on different directory streams.
-     * If vfs_readdir needs to be supported on same directory stream by
-     * different threads, then external synchronization should be used.  This
-     * means that the caller should not share the used 'handle' between threads.
-     */
-    errno = 0;
-    result = readdir(stream);
+    buffer = vmem_malloc(vmem_alloc_default(), statbuf.st_size);
+    if (!buffer) {
+        vfs_close_simple(fd);
+        return NULL;
+    }
 
-    if (result != NULL) {
-        /* Not end of directory and no error */
-        d_name = result->d_name;
-    } else {
-        if (errno != 0) {
-            /* Error occurred */
-            vapi_warning("vfs_readdir failed: %s", strerror(errno));
-            return -1;
-        } else {
-            /* End of directory */
-            d_name = "";
+    while (len < statbuf.st_size) {
+        ret = vfs_read(fd, buffer + len, statbuf.st_size - len);
+        if (ret <= 0) {
+            break;
         }
+        len += ret;
+    }
+    vfs_close_simple(fd);
+
+    if (len == statbuf.st_size) {
+        dict = vfs_zstd_dict_create(buffer, len, level);
+    } else {
+        vapi_warning("vfs_zstd_dict_load failed: short read of %s", path);
+    }
+
+    vmem_free(vmem_alloc_default(), buffer);
+
+    return dict;
+}
+
+void vfs_zstd_dict_release(vfs_zstd_dict_t dict)
+{
+    if (!dict) {
+        return;
     }
 
-    return snprintf(buffer, size, "%s", d_name);
+    if (__atomic_sub_fetch(&dict->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        ZSTD_freeCDict(dict->cdict);
+        ZSTD_freeDDict(dict->ddict);
+        vmem_free(vmem_alloc_default(), dict);
+    }
 }
 
-int vfs_closedir(vfs_dir_handle_t handle)
+/* Append the regular file path to the samples, split in chunks of VFS_ZSTD_SAMPLE_CHUNK */
+static int vfs_zstd_add_samples(const char *path, char *samples, size_t *samples_len,
+                                size_t **sizes, unsigned int *nb_samples, unsigned int *max_samples)
 {
-    DIR *stream = (DIR *) handle;
+    size_t *new_sizes;
+    ssize_t ret;
+    int fd;
 
-    if (stream == NULL)
+    fd = vfs_open(path, O_RDONLY, (mode_t) -1);
+    if (fd < 0) {
         return -1;
+    }
+
+    while (*samples_len < VFS_ZSTD_TRAIN_MAX) {
+        ret = vfs_read(fd, samples + *samples_len, MIN((size_t)VFS_ZSTD_SAMPLE_CHUNK, VFS_ZSTD_TRAIN_MAX - *samples_len));
+        if (ret <= 0) {
+            break;
+        }
+
+        if (*nb_samples == *max_samples) {
+            new_sizes = vmem_realloc(vmem_alloc_default(), *sizes, 2 * *max_samples * sizeof(size_t));
+            if (!new_sizes) {
+                break;
+            }
+            *sizes = new_sizes;
+            *max_samples *= 2;
+        }
+
+        (*sizes)[(*nb_samples)++] = ret;
+        *samples_len += ret;
+    }
+
+    vfs_close_simple(fd);
 
-    return closedir(stream);
+    return 0;
 }
 
-int vfs_file_exists(const char *path)
+ssize_t vfs_zstd_dict_train(const char *sample_dir, const char *dict_path, size_t dict_size)
 {
-    if (access(path, F_OK) != -1) {
-        return 1;
+    unsigned int nb_samples = 0, max_samples = 1024;
+    size_t samples_len = 0;
+    size_t *sizes = NULL;
+    char *samples = NULL;
+    char *dict = NULL;
+    char path[PATH_MAX];
+    struct dirent *entry;
+    vfs_stat_t statbuf;
+    ssize_t ret = -1;
+    size_t len;
+    DIR *stream;
+    int fd;
+
+    if (!sample_dir || !dict_path || !dict_size) {
+        vapi_error("vfs_zstd_dict_train failed: invalid parameters");
+        return -1;
+    }
+
+    stream = opendir(sample_dir);
+    if (!stream) {
+        vapi_warning("vfs_zstd_dict_train failed: opendir %s (%s)", sample_dir, strerror(errno));
+        return -1;
+    }
+
+    samples = vmem_malloc(vmem_alloc_default(), VFS_ZSTD_TRAIN_MAX);
+    sizes = vmem_malloc(vmem_alloc_default(), max_samples * sizeof(size_t));
+    dict = vmem_malloc(vmem_alloc_default(), dict_size);
+    if (!samples || !sizes || !dict) {
+        goto vfs_zstd_dict_train_exit;
+    }
+
+    while ((entry = readdir(stream)) != NULL && samples_len < VFS_ZSTD_TRAIN_MAX) {
+        snprintf(path, sizeof(path), "%s/%s", sample_dir, entry->d_name);
+        if (stat(path, &statbuf) < 0 || !S_ISREG(statbuf.st_mode)) {
+            continue;
+        }
+        vfs_zstd_add_samples(path, samples, &samples_len, &sizes, &nb_samples, &max_samples);
+    }
+
+    len = ZDICT_trainFromBuffer(dict, dict_size, samples, sizes, nb_samples);
+    if (ZDICT_isError(len)) {
+        vapi_warning("vfs_zstd_dict_train failed: %u samples of %zu bytes: %s",
+                     nb_samples, samples_len, ZDICT_getErrorName(len));
+        goto vfs_zstd_dict_train_exit;
+    }
+
+    fd = vfs_open(dict_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        vapi_warning("vfs_zstd_dict_train failed: vfs_open: path = %s", dict_path);
+        goto vfs_zstd_dict_train_exit;
+    }
+
+    if (vfs_write(fd, dict, len) == (ssize_t)len) {
+        ret = len;
     } else {
-        return 0;
+        vapi_warning("vfs_zstd_dict_train failed: write %s", dict_path);
     }
+    if (vfs_close(fd) != 0) {
+        ret = -1;
+    }
+
+vfs_zstd_dict_train_exit:
+    if (samples) {
+        vmem_free(vmem_alloc_default(), samples);
+    }
+    if (sizes) {
+        vmem_free(vmem_alloc_default(), sizes);
+    }
+    if (dict) {
+        vmem_free(vmem_alloc_default(), dict);
+    }
+    closedir(stream);
+
+    return ret;
 }
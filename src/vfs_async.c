@@ -0,0 +1,572 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <event2/event.h>
+
+#include <libvapi/vfs.h>
+#include <libvapi/vmem.h>
+#include <libvapi/vlist.h>
+
+#include "vlog_vapi.h"
+#include "vloop_internal.h"
+
+#define VFS_ASYNC_WORKERS_DEFAULT   2
+#define VFS_ASYNC_WORKERS_MAX       16
+#define VFS_ASYNC_QUEUE_MAX         4096    /* queued requests, further ones are refused */
+
+typedef enum {
+    VFS_ASYNC_READ,
+    VFS_ASYNC_WRITE,
+    VFS_ASYNC_COPY,
+    VFS_ASYNC_FSYNC,
+} vfs_async_op_t;
+
+typedef enum {
+    VFS_ASYNC_QUEUED,
+    VFS_ASYNC_RUNNING,
+    VFS_ASYNC_DONE,
+} vfs_async_state_t;
+
+/* Completions of the requests submitted from one loop thread, freed with the last of them */
+typedef struct {
+    int fd;                     /* eventfd, written by the workers */
+    struct event *ev;
+    pthread_mutex_t lock;
+    vlist_t done;
+    int exited;                 /* the loop thread is gone, completions are dropped */
+    int refs;                   /* the loop thread and its requests not yet freed */
+} vfs_async_loop_t;
+
+typedef struct {
+    vlist_t node;
+    vfs_async_op_t op;
+    vfs_async_state_t state;
+    int fd;
+    void *buffer;
+    size_t nbytes;
+    off_t offset;
+    const char *srcpath;
+    const char *dstpath;
+    mode_t mode;
+    ssize_t result;
+    int error;
+    vevent_reason_t reason;     /* VEVENT_CANCEL or VEVENT_TIMEOUT once the vevent fired */
+    vevent_t *event;
+    vfs_async_cb_t cb;
+    void *ctxt;
+    vfs_async_loop_t *loop;
+    int cancelled;              /* cancelled or timed out while running */
+} vfs_async_req_t;
+
+/* Not a vmutex: the workers wait on the condition */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_key_t loop_key;
+    vlist_t queue;
+    vlist_t running;
+    unsigned int max_workers;
+    unsigned int workers;
+    unsigned int idle;
+    vfs_async_stats_t stats;
+} vfs_async = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .queue = ELIST_INITIALIZER(vfs_async.queue),
+    .running = ELIST_INITIALIZER(vfs_async.running),
+    .max_workers = VFS_ASYNC_WORKERS_DEFAULT,
+    .workers = 0,
+    .idle = 0,
+};
+
+static __thread vfs_async_loop_t *vfs_async_thread_loop = NULL;
+
+static void vfs_async_atfork_child(void)
+{
+    /* the workers are not forked, nor are their requests completed */
+    pthread_mutex_init(&vfs_async.lock, NULL);
+    pthread_cond_init(&vfs_async.cond, NULL);
+    vlist_init(&vfs_async.queue);
+    vlist_init(&vfs_async.running);
+    vfs_async.workers = 0;
+    vfs_async.idle = 0;
+    vfs_async.stats.queued = 0;
+    vfs_async.stats.running = 0;
+}
+
+static void vfs_async_loop_release(void *arg);
+
+__attribute__ ((constructor)) static void vfs_async_constructor(void)
+{
+    pthread_atfork(NULL, NULL, vfs_async_atfork_child);
+    pthread_key_create(&vfs_async.loop_key, vfs_async_loop_release);
+}
+
+static void vfs_async_loop_put(vfs_async_loop_t *loop)
+{
+    if (__atomic_sub_fetch(&loop->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+
+    close(loop->fd);
+    pthread_mutex_destroy(&loop->lock);
+    vmem_free(vmem_alloc_default(), loop);
+}
+
+static void vfs_async_req_free(vfs_async_req_t *req)
+{
+    vfs_async_loop_t *loop = req->loop;
+
+    vmem_free(vmem_alloc_default(), req);
+    vfs_async_loop_put(loop);
+}
+
+static void vfs_async_run(vfs_async_req_t *req)
+{
+    switch (req->op) {
+    case VFS_ASYNC_READ:
+        if (req->offset < 0) {
+            req->result = vfs_read(req->fd, req->buffer, req->nbytes);
+        } else {
+            req->result = vfs_pread(req->fd, req->buffer, req->nbytes, req->offset);
+        }
+        break;
+    case VFS_ASYNC_WRITE:
+        if (req->offset < 0) {
+            req->result = vfs_write(req->fd, req->buffer, req->nbytes);
+        } else {
+            req->result = vfs_pwrite(req->fd, req->buffer, req->nbytes, req->offset);
+        }
+        break;
+    case VFS_ASYNC_COPY:
+        req->result = vfs_copy(req->srcpath, req->dstpath, req->mode);
+        break;
+    case VFS_ASYNC_FSYNC:
+        while ((req->result = fsync(req->fd)) != 0 && errno == EINTR) {
+        }
+        break;
+    }
+
+    req->error = (req->result < 0) ? errno : 0;
+}
+
+/* Called with vfs_async.lock held. Returns 0 when the loop thread exited: the request is to be freed. */
+static int vfs_async_complete(vfs_async_req_t *req)
+{
+    vfs_async_loop_t *loop = req->loop;
+    uint64_t one = 1;
+    int exited;
+
+    /* the eventfd is written with the lock held: the loop may be freed as soon as it is released */
+    pthread_mutex_lock(&loop->lock);
+    exited = loop->exited;
+    if (!exited) {
+        vlist_add_tail(&loop->done, &req->node);
+        if (write(loop->fd, &one, sizeof(one)) != sizeof(one)) {
+            vapi_error("vfs_async: cannot wake up the loop [%s]", strerror(errno));
+        }
+    }
+    pthread_mutex_unlock(&loop->lock);
+
+    return !exited;
+}
+
+static void *vfs_async_worker(void *arg)
+{
+    vfs_async_req_t *req;
+    sigset_t set;
+
+    /* signals are for the loop threads */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    prctl(PR_SET_NAME, "vfs_async", 0, 0, 0);
+
+    pthread_mutex_lock(&vfs_async.lock);
+    for (;;) {
+        while (vlist_is_empty(&vfs_async.queue)) {
+            vfs_async.idle++;
+            pthread_cond_wait(&vfs_async.cond, &vfs_async.lock);
+            vfs_async.idle--;
+        }
+
+        vlist_get_head(&vfs_async.queue, req);
+        vlist_delete(&req->node);
+        vlist_add_tail(&vfs_async.running, &req->node);
+        req->state = VFS_ASYNC_RUNNING;
+        vfs_async.stats.queued--;
+        vfs_async.stats.running++;
+        pthread_mutex_unlock(&vfs_async.lock);
+
+        vfs_async_run(req);
+
+        pthread_mutex_lock(&vfs_async.lock);
+        vlist_delete(&req->node);
+        req->state = VFS_ASYNC_DONE;
+        vfs_async.stats.running--;
+        if (req->cancelled) {
+            vfs_async.stats.cancelled++;
+        } else if (req->result < 0) {
+            vfs_async.stats.failed++;
+        } else {
+            vfs_async.stats.completed++;
+        }
+
+        if (!vfs_async_complete(req)) {
+            pthread_mutex_unlock(&vfs_async.lock);
+            vfs_async_req_free(req);
+            pthread_mutex_lock(&vfs_async.lock);
+        }
+    }
+
+    return NULL;
+}
+
+static void vfs_async_deliver(vfs_async_req_t *req)
+{
+    vevent_reason_t reason = req->reason;
+
+    if (req->event) {
+        /* the normal way for the request to finish */
+        vevent_delete(req->event);
+        reason = (req->result < 0) ? VEVENT_FAILURE : VEVENT_OCCURED;
+    }
+
+    req->cb(reason, req->result, req->error, req->ctxt);
+    vfs_async_req_free(req);
+}
+
+static void vfs_async_loop_cb(evutil_socket_t fd, short events, void *arg)
+{
+    vfs_async_loop_t *loop = (vfs_async_loop_t *)arg;
+    vfs_async_req_t *req;
+    vlist_t done;
+    uint64_t val;
+
+    if (read(fd, &val, sizeof(val)) < 0 && errno != EAGAIN) {
+        vapi_warning("vfs_async: eventfd read failed [%s]", strerror(errno));
+    }
+
+    vlist_init(&done);
+    pthread_mutex_lock(&loop->lock);
+    vlist_append_list_to_list(&done, &loop->done);
+    pthread_mutex_unlock(&loop->lock);
+
+    while (!vlist_is_empty(&done)) {
+        vlist_get_head(&done, req);
+        vlist_delete(&req->node);
+        vfs_async_deliver(req);
+    }
+}
+
+static vfs_async_loop_t *vfs_async_get_loop(void)
+{
+    vfs_async_loop_t *loop = vfs_async_thread_loop;
+
+    if (loop) {
+        return loop;
+    }
+
+    if (!vloop_get_base()) {
+        vapi_error("vfs_async: not called from a loop thread");
+        return NULL;
+    }
+
+    loop = vmem_calloc(vmem_alloc_default(), sizeof(*loop));
+    if (!loop) {
+        return NULL;
+    }
+
+    loop->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (loop->fd == -1) {
+        vapi_error("vfs_async: failed to create eventfd [%s]", strerror(errno));
+        vmem_free(vmem_alloc_default(), loop);
+        return NULL;
+    }
+
+    loop->ev = event_new(vloop_get_base(), loop->fd, EV_READ | EV_PERSIST, vfs_async_loop_cb, loop);
+    if (!loop->ev || event_add(loop->ev, NULL) == -1) {
+        vapi_error("vfs_async: failed to add eventfd to event loop");
+        if (loop->ev) {
+            event_free(loop->ev);
+        }
+        close(loop->fd);
+        vmem_free(vmem_alloc_default(), loop);
+        return NULL;
+    }
+
+    pthread_mutex_init(&loop->lock, NULL);
+    vlist_init(&loop->done);
+    loop->refs = 1;
+    vfs_async_thread_loop = loop;
+    pthread_setspecific(vfs_async.loop_key, loop);
+
+    return loop;
+}
+
+/*
+ * Exit of a loop thread: its queued and completed requests are dropped without callback, the
+ * running ones when they complete. The loop is freed with the last of them.
+ */
+static void vfs_async_loop_release(void *arg)
+{
+    vfs_async_loop_t *loop = (vfs_async_loop_t *)arg;
+    vfs_async_req_t *req;
+    vlist_t *node;
+    vlist_t done;
+
+    vfs_async_thread_loop = NULL;
+    event_free(loop->ev);
+    vlist_init(&done);
+
+    pthread_mutex_lock(&vfs_async.lock);
+    vlist_foreach(&vfs_async.queue, node) {
+        req = (vfs_async_req_t *)node;
+        if (req->loop == loop) {
+            vlist_delete(&req->node);
+            vlist_add_tail(&done, &req->node);
+            vfs_async.stats.queued--;
+            vfs_async.stats.cancelled++;
+        }
+    }
+    /* the vevents belong to this thread, the running requests are freed by the workers */
+    vlist_foreach(&vfs_async.running, node) {
+        req = (vfs_async_req_t *)node;
+        if (req->loop == loop && req->event) {
+            vevent_delete(req->event);
+            req->event = NULL;
+        }
+    }
+    pthread_mutex_lock(&loop->lock);
+    loop->exited = 1;
+    vlist_append_list_to_list(&done, &loop->done);
+    pthread_mutex_unlock(&loop->lock);
+    pthread_mutex_unlock(&vfs_async.lock);
+
+    while (!vlist_is_empty(&done)) {
+        vlist_get_head(&done, req);
+        vlist_delete(&req->node);
+        if (req->event) {
+            vevent_delete(req->event);
+        }
+        vfs_async_req_free(req);
+    }
+
+    vfs_async_loop_put(loop);
+}
+
+/* vevent cancel or timeout: a queued request ends now, a running one when its I/O is done */
+static void vfs_async_cancel(vevent_reason_t reason, void *ctxt)
+{
+    vfs_async_req_t *req = (vfs_async_req_t *)ctxt;
+    int queued;
+
+    /* vevent.c deleted the vevent before calling this callback */
+    req->event = NULL;
+    req->reason = reason;
+
+    /* counted here when it never runs, by its worker when it is running, not at all when done */
+    pthread_mutex_lock(&vfs_async.lock);
+    queued = (req->state == VFS_ASYNC_QUEUED);
+    if (queued) {
+        vlist_delete(&req->node);
+        vfs_async.stats.queued--;
+        vfs_async.stats.cancelled++;
+    } else if (req->state == VFS_ASYNC_RUNNING) {
+        req->cancelled = 1;
+    }
+    pthread_mutex_unlock(&vfs_async.lock);
+
+    if (queued) {
+        req->result = -1;
+        req->error = ECANCELED;
+        vfs_async_deliver(req);
+    }
+}
+
+static vevent_t *vfs_async_submit(vfs_async_req_t *req)
+{
+    vevent_t *event;
+    pthread_t thread;
+
+    req->loop = vfs_async_get_loop();
+    if (!req->loop) {
+        vmem_free(vmem_alloc_default(), req);
+        return NULL;
+    }
+
+    event = vevent_new(vfs_async_cancel, req);
+    if (!event) {
+        vapi_error("vfs_async: failed to create vevent");
+        vmem_free(vmem_alloc_default(), req);
+        return NULL;
+    }
+    req->event = event;
+    req->state = VFS_ASYNC_QUEUED;
+
+    pthread_mutex_lock(&vfs_async.lock);
+    if (vfs_async.stats.queued >= VFS_ASYNC_QUEUE_MAX) {
+        pthread_mutex_unlock(&vfs_async.lock);
+        vapi_warning("vfs_async: %d requests queued, request refused", VFS_ASYNC_QUEUE_MAX);
+        vevent_delete(event);
+        vmem_free(vmem_alloc_default(), req);
+        errno = EAGAIN;
+        return NULL;
+    }
+
+    vlist_add_tail(&vfs_async.queue, &req->node);
+    __atomic_add_fetch(&req->loop->refs, 1, __ATOMIC_RELAXED);
+    vfs_async.stats.queued++;
+    vfs_async.stats.submitted++;
+    if (vfs_async.stats.queued > vfs_async.stats.max_queued) {
+        vfs_async.stats.max_queued = vfs_async.stats.queued;
+    }
+
+    /* workers are started on demand, up to max_workers */
+    if (vfs_async.idle == 0 && vfs_async.workers < vfs_async.max_workers) {
+        if (pthread_create(&thread, NULL, vfs_async_worker, NULL) == 0) {
+            pthread_detach(thread);
+            vfs_async.workers++;
+        } else if (vfs_async.workers == 0) {
+            vlist_delete(&req->node);
+            vfs_async.stats.queued--;
+            vfs_async.stats.submitted--;
+            pthread_mutex_unlock(&vfs_async.lock);
+            vapi_error("vfs_async: failed to start a worker");
+            vevent_delete(event);
+            vfs_async_req_free(req);
+            return NULL;
+        }
+    }
+    pthread_cond_signal(&vfs_async.cond);
+    pthread_mutex_unlock(&vfs_async.lock);
+
+    return event;
+}
+
+static vfs_async_req_t *vfs_async_req_new(vfs_async_op_t op, size_t extra, vfs_async_cb_t cb, void *ctxt)
+{
+    vfs_async_req_t *req;
+
+    if (!cb) {
+        vapi_error("vfs_async: no callback");
+        return NULL;
+    }
+
+    req = vmem_calloc(vmem_alloc_default(), sizeof(*req) + extra);
+    if (!req) {
+        return NULL;
+    }
+
+    req->op = op;
+    req->fd = -1;
+    req->offset = -1;
+    req->cb = cb;
+    req->ctxt = ctxt;
+
+    return req;
+}
+
+vevent_t *vfs_read_async(int fd, void *buffer, size_t nbytes, off_t offset, vfs_async_cb_t cb, void *ctxt)
+{
+    vfs_async_req_t *req = vfs_async_req_new(VFS_ASYNC_READ, 0, cb, ctxt);
+
+    if (!req) {
+        return NULL;
+    }
+
+    req->fd = fd;
+    req->buffer = buffer;
+    req->nbytes = nbytes;
+    req->offset = offset;
+
+    return vfs_async_submit(req);
+}
+
+vevent_t *vfs_write_async(int fd, const void *buffer, size_t nbytes, off_t offset, vfs_async_cb_t cb, void *ctxt)
+{
+    vfs_async_req_t *req = vfs_async_req_new(VFS_ASYNC_WRITE, 0, cb, ctxt);
+
+    if (!req) {
+        return NULL;
+    }
+
+    req->fd = fd;
+    req->buffer = (void *)buffer;
+    req->nbytes = nbytes;
+    req->offset = offset;
+
+    return vfs_async_submit(req);
+}
+
+vevent_t *vfs_copy_async(const char *srcpath, const char *dstpath, mode_t mode, vfs_async_cb_t cb, void *ctxt)
+{
+    vfs_async_req_t *req;
+    size_t srclen, dstlen;
+    char *paths;
+
+    if (!srcpath || !dstpath) {
+        vapi_error("vfs_copy_async failed: null path");
+        return NULL;
+    }
+
+    /* the paths are kept with the request */
+    srclen = strlen(srcpath) + 1;
+    dstlen = strlen(dstpath) + 1;
+    req = vfs_async_req_new(VFS_ASYNC_COPY, srclen + dstlen, cb, ctxt);
+    if (!req) {
+        return NULL;
+    }
+
+    paths = (char *)(req + 1);
+    memcpy(paths, srcpath, srclen);
+    memcpy(paths + srclen, dstpath, dstlen);
+    req->srcpath = paths;
+    req->dstpath = paths + srclen;
+    req->mode = mode;
+
+    return vfs_async_submit(req);
+}
+
+vevent_t *vfs_fsync_async(int fd, vfs_async_cb_t cb, void *ctxt)
+{
+    vfs_async_req_t *req = vfs_async_req_new(VFS_ASYNC_FSYNC, 0, cb, ctxt);
+
+    if (!req) {
+        return NULL;
+    }
+
+    req->fd = fd;
+
+    return vfs_async_submit(req);
+}
+
+int vfs_async_set_workers(unsigned int nb_workers)
+{
+    if (nb_workers == 0 || nb_workers > VFS_ASYNC_WORKERS_MAX) {
+        vapi_error("vfs_async_set_workers failed: %u workers, 1 to %d supported", nb_workers, VFS_ASYNC_WORKERS_MAX);
+        return -1;
+    }
+
+    /* started workers stay, idle */
+    pthread_mutex_lock(&vfs_async.lock);
+    vfs_async.max_workers = nb_workers;
+    pthread_mutex_unlock(&vfs_async.lock);
+
+    return 0;
+}
+
+void vfs_async_get_stats(vfs_async_stats_t *stats)
+{
+    pthread_mutex_lock(&vfs_async.lock);
+    *stats = vfs_async.stats;
+    stats->workers = vfs_async.workers;
+    pthread_mutex_unlock(&vfs_async.lock);
+}
@@ -0,0 +1,494 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* getdents64, statx */
+#endif
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <libvapi/vfs.h>
+#include <libvapi/vmem.h>
+#include <libvapi/vlist.h>
+
+#include "vlog_vapi.h"
+
+#define VFS_DIR_BUFFER_SIZE         (32 * 1024)     /* getdents64 records, about 1000 short names */
+#define VFS_WALK_THREADS_DEFAULT    4
+#define VFS_WALK_THREADS_MAX        64
+#define VFS_WALK_BATCH              256             /* entries read and stat'ed at once */
+
+#if VFS_STATX_TYPE != STATX_TYPE || VFS_STATX_MODE != STATX_MODE || VFS_STATX_NLINK != STATX_NLINK || \
+    VFS_STATX_MTIME != STATX_MTIME || VFS_STATX_INO != STATX_INO || VFS_STATX_SIZE != STATX_SIZE || \
+    VFS_STATX_BLOCKS != STATX_BLOCKS
+#error "VFS_STATX_* do not match the kernel STATX_* bits"
+#endif
+
+/* Directory stream, the records of one getdents64 are handed out one by one or by batch */
+struct vfs_dir {
+    int fd;
+    size_t len;                 /* bytes of records in buffer */
+    size_t pos;                 /* next record */
+    char buffer[VFS_DIR_BUFFER_SIZE] __attribute__((aligned(8)));
+};
+
+/* Directory to be read by a walk, path follows */
+typedef struct {
+    vlist_t node;
+    char path[];
+} vfs_walk_dir_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    vlist_t queue;              /* vfs_walk_dir_t */
+    unsigned int pending;       /* directories queued or being read */
+    int cancelled;
+    unsigned int mask;
+    vfs_walk_cb_t cb;
+    void *ctxt;
+    vfs_walk_stats_t stats;
+} vfs_walk_t;
+
+int vfs_opendir(const char *path, vfs_dir_handle_t *handle)
+{
+    struct vfs_dir *dir;
+    int fd;
+
+    *handle = NULL;
+
+    fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    dir = vmem_malloc(vmem_alloc_default(), sizeof(*dir));
+    if (dir == NULL) {
+        close(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+    dir->fd = fd;
+    dir->len = 0;
+    dir->pos = 0;
+
+    *handle = dir;
+
+    return 0;
+}
+
+/* Next record of the stream, NULL with errno 0 at the end */
+static struct dirent64 *vfs_dir_next(struct vfs_dir *dir)
+{
+    struct dirent64 *entry;
+    ssize_t len;
+
+    if (dir->pos >= dir->len) {
+        len = getdents64(dir->fd, dir->buffer, sizeof(dir->buffer));
+        if (len <= 0) {
+            if (len == 0)
+                errno = 0;
+            return NULL;
+        }
+        dir->len = len;
+        dir->pos = 0;
+    }
+
+    entry = (struct dirent64 *)(dir->buffer + dir->pos);
+    dir->pos += entry->d_reclen;
+
+    return entry;
+}
+
+static int vfs_dir_is_dot(const char *name)
+{
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+int vfs_readdir(vfs_dir_handle_t handle, char *buffer, size_t size)
+{
+    struct vfs_dir *dir = handle;
+    struct dirent64 *result;
+    const char *d_name;
+
+    if ((dir == NULL) || (buffer == NULL) || (size == 0))
+        return -1;
+
+    /* Records are read in bulk, a handle must not be shared between threads without
+     * external synchronization. Streams of different handles are independent.
+     */
+    result = vfs_dir_next(dir);
+
+    if (result != NULL) {
+        /* Not end of directory and no error */
+        d_name = result->d_name;
+    } else {
+        if (errno != 0) {
+            /* Error occurred */
+            vapi_warning("vfs_readdir failed: %s", strerror(errno));
+            return -1;
+        } else {
+            /* End of directory */
+            d_name = "";
+        }
+    }
+
+    return snprintf(buffer, size, "%s", d_name);
+}
+
+int vfs_readdir_batch(vfs_dir_handle_t handle, vfs_dirent_t *entries, int max)
+{
+    struct vfs_dir *dir = handle;
+    struct dirent64 *record;
+    int count = 0;
+
+    if ((dir == NULL) || (entries == NULL) || (max <= 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* hand out what is buffered, read once more when it was only "." and ".." */
+    do {
+        record = vfs_dir_next(dir);
+        if (record == NULL) {
+            if (errno != 0) {
+                vapi_warning("vfs_readdir_batch failed: %s", strerror(errno));
+                return -1;
+            }
+            break;
+        }
+
+        for (;;) {
+            if (!vfs_dir_is_dot(record->d_name)) {
+                entries[count].name = record->d_name;
+                entries[count].ino = record->d_ino;
+                entries[count].type = record->d_type;
+                count++;
+            }
+            if (count == max || dir->pos >= dir->len)
+                break;
+            record = (struct dirent64 *)(dir->buffer + dir->pos);
+            dir->pos += record->d_reclen;
+        }
+    } while (count == 0);
+
+    return count;
+}
+
+int vfs_closedir(vfs_dir_handle_t handle)
+{
+    struct vfs_dir *dir = handle;
+    int ret;
+
+    if (dir == NULL)
+        return -1;
+
+    ret = close(dir->fd);
+    vmem_free(vmem_alloc_default(), dir);
+
+    return ret;
+}
+
+static int vfs_statx_one(int dirfd, vfs_statx_t *entry, unsigned int mask, int flags)
+{
+    struct statx stx;
+
+    flags |= (mask & VFS_STATX_DONT_SYNC) ? AT_STATX_DONT_SYNC : AT_STATX_SYNC_AS_STAT;
+
+    if (statx(dirfd, entry->name, flags, mask & VFS_STATX_ALL, &stx) != 0) {
+        entry->error = errno;
+        entry->mask = 0;
+        return -1;
+    }
+
+    entry->error = 0;
+    entry->mask = stx.stx_mask & mask & VFS_STATX_ALL;
+    entry->mode = stx.stx_mode;
+    entry->nlink = stx.stx_nlink;
+    entry->ino = stx.stx_ino;
+    entry->size = stx.stx_size;
+    entry->blocks = stx.stx_blocks;
+    entry->mtime = stx.stx_mtime.tv_sec;
+    entry->mtime_nsec = stx.stx_mtime.tv_nsec;
+
+    return 0;
+}
+
+int vfs_statx_batch(vfs_dir_handle_t handle, vfs_statx_t *entries, int count, unsigned int mask)
+{
+    struct vfs_dir *dir = handle;
+    int dirfd = dir ? dir->fd : AT_FDCWD;
+    int done = 0;
+    int i;
+
+    if ((entries == NULL) || (count < 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (vfs_statx_one(dirfd, &entries[i], mask, AT_SYMLINK_NOFOLLOW) == 0)
+            done++;
+    }
+
+    return done;
+}
+
+int vfs_unlinkat(vfs_dir_handle_t handle, const char *name, int flags)
+{
+    struct vfs_dir *dir = handle;
+
+    return unlinkat(dir ? dir->fd : AT_FDCWD, name, flags & AT_REMOVEDIR);
+}
+
+/* Directory item for parent/name, for parent itself when name is NULL */
+static vfs_walk_dir_t *vfs_walk_dir_new(const char *parent, const char *name)
+{
+    size_t len = strlen(parent);
+    size_t name_len = name ? strlen(name) : 0;
+    vfs_walk_dir_t *item;
+
+    item = vmem_malloc(vmem_alloc_default(), sizeof(*item) + len + name_len + 2);
+    if (item == NULL)
+        return NULL;
+
+    memcpy(item->path, parent, len);
+    if (name != NULL) {
+        if (len == 0 || parent[len - 1] != '/')
+            item->path[len++] = '/';
+        memcpy(item->path + len, name, name_len);
+        len += name_len;
+    }
+    item->path[len] = '\0';
+
+    return item;
+}
+
+static void vfs_walk_account(vfs_walk_stats_t *stats, const vfs_statx_t *entry)
+{
+    if (S_ISDIR(entry->mode))
+        stats->dirs++;
+    else
+        stats->files++;
+
+    if (entry->mask & VFS_STATX_SIZE)
+        stats->bytes += entry->size;
+    if (entry->mask & VFS_STATX_BLOCKS)
+        stats->blocks += entry->blocks;
+}
+
+/* Read one directory, the subdirectories found are added to the found list */
+static void vfs_walk_read(vfs_walk_t *walk, const char *path, vfs_walk_stats_t *stats, vlist_t *found)
+{
+    vfs_dirent_t dirents[VFS_WALK_BATCH];
+    vfs_statx_t entries[VFS_WALK_BATCH];
+    vfs_dir_handle_t handle;
+    vfs_walk_dir_t *item;
+    int count, i;
+
+    if (vfs_opendir(path, &handle) < 0) {
+        stats->errors++;
+        return;
+    }
+
+    while ((count = vfs_readdir_batch(handle, dirents, VFS_WALK_BATCH)) > 0) {
+        for (i = 0; i < count; i++) {
+            entries[i].name = dirents[i].name;
+            /* the directory already told what is asked */
+            if ((walk->mask & ~(VFS_STATX_TYPE | VFS_STATX_INO | VFS_STATX_DONT_SYNC)) == 0 &&
+                dirents[i].type != DT_UNKNOWN) {
+                entries[i].error = 0;
+                entries[i].mask = VFS_STATX_TYPE | VFS_STATX_INO;
+                entries[i].mode = DTTOIF(dirents[i].type);
+                entries[i].ino = dirents[i].ino;
+                continue;
+            }
+            vfs_statx_one(((struct vfs_dir *)handle)->fd, &entries[i], walk->mask | VFS_STATX_TYPE,
+                          AT_SYMLINK_NOFOLLOW);
+        }
+
+        for (i = 0; i < count; i++) {
+            if (entries[i].error != 0) {
+                stats->errors++;
+                continue;
+            }
+            vfs_walk_account(stats, &entries[i]);
+
+            if (S_ISDIR(entries[i].mode)) {
+                item = vfs_walk_dir_new(path, entries[i].name);
+                if (item == NULL)
+                    stats->errors++;
+                else
+                    vlist_add_tail(found, &item->node);
+            }
+
+            if (walk->cb && walk->cb(path, &entries[i], walk->ctxt) != 0) {
+                __atomic_store_n(&walk->cancelled, 1, __ATOMIC_RELAXED);
+                goto vfs_walk_read_exit;
+            }
+        }
+
+        if (__atomic_load_n(&walk->cancelled, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (count < 0)
+        stats->errors++;
+
+vfs_walk_read_exit:
+    vfs_closedir(handle);
+}
+
+static void vfs_walk_run(vfs_walk_t *walk)
+{
+    vfs_walk_stats_t stats = { 0, 0, 0, 0, 0 };
+    vfs_walk_dir_t *item;
+    vlist_t found;
+    unsigned int nb_found;
+    struct vlist *node;
+    int cancelled;
+
+    vlist_init(&found);
+
+    pthread_mutex_lock(&walk->lock);
+    for (;;) {
+        cancelled = __atomic_load_n(&walk->cancelled, __ATOMIC_RELAXED);
+        while (vlist_is_empty(&walk->queue) && walk->pending > 0 && !cancelled) {
+            pthread_cond_wait(&walk->cond, &walk->lock);
+            cancelled = __atomic_load_n(&walk->cancelled, __ATOMIC_RELAXED);
+        }
+
+        if (walk->pending == 0 || cancelled)
+            break;
+
+        vlist_get_head(&walk->queue, item);
+        vlist_delete(&item->node);
+        pthread_mutex_unlock(&walk->lock);
+
+        vfs_walk_read(walk, item->path, &stats, &found);
+        vmem_free(vmem_alloc_default(), item);
+
+        nb_found = 0;
+        vlist_foreach(&found, node) {
+            nb_found++;
+        }
+
+        pthread_mutex_lock(&walk->lock);
+        /* found ones go first: depth first keeps the queue short on wide trees */
+        vlist_append_list_to_list(&found, &walk->queue);
+        vlist_append_list_to_list(&walk->queue, &found);
+        walk->pending += nb_found;
+        walk->pending--;
+        if (nb_found > 1 || walk->pending == 0 || __atomic_load_n(&walk->cancelled, __ATOMIC_RELAXED))
+            pthread_cond_broadcast(&walk->cond);
+        else if (nb_found == 1)
+            pthread_cond_signal(&walk->cond);
+    }
+
+    walk->stats.dirs += stats.dirs;
+    walk->stats.files += stats.files;
+    walk->stats.bytes += stats.bytes;
+    walk->stats.blocks += stats.blocks;
+    walk->stats.errors += stats.errors;
+    pthread_cond_broadcast(&walk->cond);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+static void *vfs_walk_worker(void *arg)
+{
+    sigset_t set;
+
+    /* signals are for the loop threads */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    vfs_walk_run(arg);
+
+    return NULL;
+}
+
+int vfs_walk(const char *path, const vfs_walk_params_t *params, vfs_walk_stats_t *stats)
+{
+    vfs_walk_params_t defaults = VFS_WALK_PARAMS_DEFAULT;
+    pthread_t threads[VFS_WALK_THREADS_MAX - 1];
+    unsigned int nb_threads, started, i;
+    vfs_walk_dir_t *item;
+    vfs_statx_t root;
+    vfs_walk_t walk;
+    int ret = -1;
+
+    memset(stats, 0, sizeof(*stats));
+
+    if (params == NULL)
+        params = &defaults;
+
+    nb_threads = params->threads ? params->threads : VFS_WALK_THREADS_DEFAULT;
+    if (nb_threads > VFS_WALK_THREADS_MAX)
+        nb_threads = VFS_WALK_THREADS_MAX;
+
+    memset(&walk, 0, sizeof(walk));
+    walk.mask = params->mask ? params->mask : (VFS_STATX_SIZE | VFS_STATX_BLOCKS);
+    walk.cb = params->cb;
+    walk.ctxt = params->ctxt;
+
+    /* the root is accounted as du does, and must be a directory or a link to one */
+    root.name = path;
+    if (vfs_statx_one(AT_FDCWD, &root, walk.mask | VFS_STATX_TYPE, 0) < 0) {
+        errno = root.error;
+        return -1;
+    }
+    if (!S_ISDIR(root.mode)) {
+        errno = ENOTDIR;
+        return -1;
+    }
+    vfs_walk_account(&walk.stats, &root);
+
+    item = vfs_walk_dir_new(path, NULL);
+    if (item == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.cond, NULL);
+    vlist_init(&walk.queue);
+    vlist_add_tail(&walk.queue, &item->node);
+    walk.pending = 1;
+
+    for (started = 0; started < nb_threads - 1; started++) {
+        if (pthread_create(&threads[started], NULL, vfs_walk_worker, &walk) != 0) {
+            vapi_warning("vfs_walk: started %u threads of %u", started + 1, nb_threads);
+            break;
+        }
+    }
+
+    /* the caller is one of the threads */
+    vfs_walk_run(&walk);
+
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    /* left over by a stopped walk */
+    while (!vlist_is_empty(&walk.queue)) {
+        vlist_get_head(&walk.queue, item);
+        vlist_delete(&item->node);
+        vmem_free(vmem_alloc_default(), item);
+    }
+
+    pthread_cond_destroy(&walk.cond);
+    pthread_mutex_destroy(&walk.lock);
+
+    *stats = walk.stats;
+
+    if (__atomic_load_n(&walk.cancelled, __ATOMIC_RELAXED)) {
+        errno = ECANCELED;
+    } else {
+        ret = 0;
+    }
+
+    return ret;
+}
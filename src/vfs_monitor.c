@@ -0,0 +1,731 @@
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+
+#include <libvapi/vfs.h>
+#include <libvapi/vmem.h>
+#include <libvapi/vlist.h>
+#include <libvapi/vloop.h>
+#include <libvapi/vtimer.h>
+
+#include "vlog_vapi.h"
+
+#define VFS_MONITOR_BUFFER_SIZE     (64 * 1024)     /* events drained per read() */
+#define VFS_MONITOR_READS_MAX       16              /* read() per wakeup, the loop runs in between */
+#define VFS_MONITOR_BUCKETS_MIN     64
+
+typedef struct vfs_monitor vfs_monitor_t;
+
+/* Entry of a vfs_monitor_table_t, first member of the hashed structures */
+typedef struct {
+    vlist_t node;
+    uint32_t hash;
+} vfs_monitor_hentry_t;
+
+/* Chained hash table, grown to keep one entry per bucket on average */
+typedef struct {
+    vlist_t *buckets;
+    unsigned int nb_buckets;    /* power of two */
+    unsigned int count;
+} vfs_monitor_table_t;
+
+/* One inotify watch of a monitor, found by its watch descriptor */
+typedef struct {
+    vfs_monitor_hentry_t h;     /* hash is the watch descriptor */
+    vlist_t node;               /* watches of the monitor */
+    int wd;
+    vfs_monitor_t *monitor;
+    size_t len;
+    char path[];                /* relative to the monitored path, "" for the path itself */
+} vfs_monitor_watch_t;
+
+/* Events on one name not delivered yet, merged during the coalescing window */
+typedef struct {
+    vfs_monitor_hentry_t h;     /* only hashed when the monitor coalesces */
+    vlist_t node;               /* pending events of the monitor, in arrival order */
+    vfs_monitor_t *monitor;
+    uint32_t type_mask;
+    char name[];
+} vfs_monitor_pending_t;
+
+/* Directory appeared or moved away in a recursive monitor, handled after its event */
+typedef struct {
+    vlist_t node;
+    vfs_monitor_t *monitor;
+    int add;
+    char path[];
+} vfs_monitor_subdir_t;
+
+struct vfs_monitor {
+    vlist_t node;               /* monitors of the loop */
+    vlist_t ready;              /* in the loop's ready list */
+    vlist_t watches;
+    vlist_t pending;
+    uint32_t type_mask;
+    uint32_t in_mask;
+    vfs_monitor_params_t params;
+    int failed;                 /* the monitored path is gone */
+    vtimer_t timer;
+    vevent_t *event;
+    vfs_monitor_cb_t cb;
+    void *ctxt;
+    char root[];
+};
+
+/* The inotify fd shared by the monitors of one loop thread, living as long as the thread */
+typedef struct {
+    int fd;
+    vloop_event_handle_t handle;
+    vfs_monitor_table_t watches;
+    vfs_monitor_table_t pending;
+    vlist_t monitors;
+    vlist_t ready;              /* monitors to deliver after the batch */
+    vlist_t subdirs;
+    char *buffer;
+} vfs_monitor_loop_t;
+
+static __thread vfs_monitor_loop_t *vfs_monitor_thread_loop = NULL;
+
+static void vfs_monitor_flush(vfs_monitor_t *monitor);
+
+static int vfs_monitor_table_init(vfs_monitor_table_t *table)
+{
+    unsigned int i;
+
+    table->buckets = vmem_malloc(vmem_alloc_default(), VFS_MONITOR_BUCKETS_MIN * sizeof(vlist_t));
+    if (!table->buckets) {
+        return -1;
+    }
+
+    for (i = 0; i < VFS_MONITOR_BUCKETS_MIN; i++) {
+        vlist_init(&table->buckets[i]);
+    }
+    table->nb_buckets = VFS_MONITOR_BUCKETS_MIN;
+    table->count = 0;
+
+    return 0;
+}
+
+static vlist_t *vfs_monitor_table_bucket(vfs_monitor_table_t *table, uint32_t hash)
+{
+    return &table->buckets[hash & (table->nb_buckets - 1)];
+}
+
+static void vfs_monitor_table_grow(vfs_monitor_table_t *table)
+{
+    unsigned int nb_buckets = table->nb_buckets * 2;
+    vfs_monitor_hentry_t *entry;
+    vlist_t *buckets;
+    unsigned int i;
+
+    /* a failed allocation only makes the chains longer */
+    buckets = vmem_malloc(vmem_alloc_default(), nb_buckets * sizeof(vlist_t));
+    if (!buckets) {
+        return;
+    }
+
+    for (i = 0; i < nb_buckets; i++) {
+        vlist_init(&buckets[i]);
+    }
+
+    for (i = 0; i < table->nb_buckets; i++) {
+        while (!vlist_is_empty(&table->buckets[i])) {
+            vlist_get_head(&table->buckets[i], entry);
+            vlist_delete(&entry->node);
+            vlist_add_tail(&buckets[entry->hash & (nb_buckets - 1)], &entry->node);
+        }
+    }
+
+    vmem_free(vmem_alloc_default(), table->buckets);
+    table->buckets = buckets;
+    table->nb_buckets = nb_buckets;
+}
+
+static void vfs_monitor_table_insert(vfs_monitor_table_t *table, vfs_monitor_hentry_t *entry, uint32_t hash)
+{
+    if (table->count >= table->nb_buckets) {
+        vfs_monitor_table_grow(table);
+    }
+
+    entry->hash = hash;
+    vlist_add_tail(vfs_monitor_table_bucket(table, hash), &entry->node);
+    table->count++;
+}
+
+static void vfs_monitor_table_remove(vfs_monitor_table_t *table, vfs_monitor_hentry_t *entry)
+{
+    if (entry->node.next) {
+        vlist_delete(&entry->node);
+        table->count--;
+    }
+}
+
+static uint32_t vfs_monitor_hash(const vfs_monitor_t *monitor, const char *name)
+{
+    uint32_t hash = 2166136261u ^ (uint32_t)((uintptr_t)monitor >> 4);
+
+    while (*name) {
+        hash = (hash ^ (unsigned char)*name++) * 16777619u;
+    }
+
+    return hash;
+}
+
+static uint32_t vfs_monitor_in_mask(uint32_t type_mask, uint32_t flags)
+{
+    uint32_t in_mask = IN_DELETE_SELF | IN_MOVE_SELF;
+
+    if (type_mask & VFS_EVENT_CREATE) {
+        in_mask |= IN_CREATE | IN_MOVED_TO;
+    }
+    if (type_mask & VFS_EVENT_MODIFY) {
+        in_mask |= IN_MODIFY;
+    }
+    if (type_mask & VFS_EVENT_DELETE) {
+        in_mask |= IN_DELETE | IN_MOVED_FROM;
+    }
+    if (flags & VFS_MONITOR_RECURSIVE) {
+        in_mask |= IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM;
+    }
+
+    return in_mask;
+}
+
+static uint32_t vfs_monitor_type(uint32_t in_mask)
+{
+    uint32_t type_mask = VFS_EVENT_NONE;
+
+    if (in_mask & (IN_CREATE | IN_MOVED_TO)) {
+        type_mask |= VFS_EVENT_CREATE;
+    }
+    if (in_mask & IN_MODIFY) {
+        type_mask |= VFS_EVENT_MODIFY;
+    }
+    if (in_mask & (IN_DELETE | IN_MOVED_FROM)) {
+        type_mask |= VFS_EVENT_DELETE;
+    }
+
+    return type_mask;
+}
+
+static void vfs_monitor_set_ready(vfs_monitor_loop_t *loop, vfs_monitor_t *monitor)
+{
+    if (!monitor->ready.next) {
+        vlist_add_tail(&loop->ready, &monitor->ready);
+    }
+}
+
+/* End of the coalescing window, opened by the first event of the burst */
+static void vfs_monitor_timer_cb(vtimer_t timer, void *ctxt)
+{
+    vfs_monitor_t *monitor = (vfs_monitor_t *)ctxt;
+
+    vtimer_delete(timer);
+    monitor->timer = NULL;
+    vfs_monitor_flush(monitor);
+}
+
+/* Queue an event for the monitor, merged with a pending one on the same name when coalescing */
+static void vfs_monitor_queue(vfs_monitor_loop_t *loop, vfs_monitor_t *monitor, const char *dir, const char *name,
+                              uint32_t type_mask)
+{
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    vfs_monitor_pending_t *pending;
+    vlist_t *bucket, *node;
+    uint32_t hash = 0;
+
+    pending = vmem_calloc(vmem_alloc_default(), sizeof(*pending) + dir_len + name_len + 2);
+    if (!pending) {
+        vapi_warning("vfs_monitor: event on %s/%s dropped, out of memory", monitor->root, name);
+        return;
+    }
+
+    memcpy(pending->name, dir, dir_len);
+    if (dir_len > 0 && name_len > 0) {
+        pending->name[dir_len++] = '/';
+    }
+    memcpy(pending->name + dir_len, name, name_len + 1);
+
+    if (monitor->params.coalesce_ms > 0) {
+        hash = vfs_monitor_hash(monitor, pending->name);
+        bucket = vfs_monitor_table_bucket(&loop->pending, hash);
+        for (node = bucket->next; node != bucket; node = node->next) {
+            vfs_monitor_pending_t *other = (vfs_monitor_pending_t *)node;
+
+            if (other->h.hash == hash && other->monitor == monitor && strcmp(other->name, pending->name) == 0) {
+                other->type_mask |= type_mask;
+                vmem_free(vmem_alloc_default(), pending);
+                return;
+            }
+        }
+        vfs_monitor_table_insert(&loop->pending, &pending->h, hash);
+    }
+
+    pending->monitor = monitor;
+    pending->type_mask = type_mask;
+
+    if (monitor->params.coalesce_ms == 0) {
+        vfs_monitor_set_ready(loop, monitor);
+    } else if (!monitor->timer) {
+        monitor->timer = vtimer_start_timeout(vfs_monitor_timer_cb, monitor->params.coalesce_ms, monitor);
+        if (!monitor->timer) {
+            vfs_monitor_set_ready(loop, monitor);
+        }
+    }
+    vlist_add_tail(&monitor->pending, &pending->node);
+}
+
+/* Deliver the pending events of the monitor */
+static void vfs_monitor_flush(vfs_monitor_t *monitor)
+{
+    vfs_monitor_loop_t *loop = vfs_monitor_thread_loop;
+    vfs_monitor_pending_t *pending;
+    vlist_t *node;
+
+    if (monitor->timer) {
+        vtimer_delete(monitor->timer);
+        monitor->timer = NULL;
+    }
+
+    /* the callback can queue more events for this monitor, or cancel it, which is deferred */
+    while (!vlist_is_empty(&monitor->pending)) {
+        vlist_get_head(&monitor->pending, node);
+        pending = container_of(vfs_monitor_pending_t, node, node);
+        vlist_delete(&pending->node);
+        vfs_monitor_table_remove(&loop->pending, &pending->h);
+
+        monitor->cb(VEVENT_OCCURED, pending->type_mask, pending->name, monitor->ctxt);
+        vmem_free(vmem_alloc_default(), pending);
+    }
+}
+
+/* Is the watch descriptor used by another watch, of this or of another monitor */
+static int vfs_monitor_wd_shared(vfs_monitor_loop_t *loop, vfs_monitor_watch_t *watch)
+{
+    vlist_t *bucket = vfs_monitor_table_bucket(&loop->watches, (uint32_t)watch->wd);
+    vlist_t *node;
+
+    for (node = bucket->next; node != bucket; node = node->next) {
+        vfs_monitor_watch_t *other = (vfs_monitor_watch_t *)node;
+
+        if (other != watch && other->wd == watch->wd) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void vfs_monitor_drop_watch(vfs_monitor_loop_t *loop, vfs_monitor_watch_t *watch, int remove)
+{
+    if (remove && !vfs_monitor_wd_shared(loop, watch)) {
+        inotify_rm_watch(loop->fd, watch->wd);
+    }
+
+    vfs_monitor_table_remove(&loop->watches, &watch->h);
+    vlist_delete(&watch->node);
+    vmem_free(vmem_alloc_default(), watch);
+}
+
+/* Watch a directory of the monitor, and its subdirectories for a recursive one */
+static int vfs_monitor_add_watch(vfs_monitor_loop_t *loop, vfs_monitor_t *monitor, const char *path, int report)
+{
+    size_t len = strlen(path);
+    char fullpath[PATH_MAX];
+    vfs_monitor_watch_t *watch;
+    struct dirent *entry;
+    DIR *dir;
+    int wd;
+
+    if (snprintf(fullpath, sizeof(fullpath), "%s%s%s", monitor->root, len ? "/" : "", path) >= (int)sizeof(fullpath)) {
+        vapi_warning("vfs_monitor: path too long under %s", monitor->root);
+        return -1;
+    }
+
+    wd = inotify_add_watch(loop->fd, fullpath, monitor->in_mask | IN_MASK_ADD | IN_ONLYDIR | IN_DONT_FOLLOW);
+    if (wd < 0) {
+        vapi_warning("vfs_monitor: cannot watch %s: errno = %d (%s)", fullpath, errno, strerror(errno));
+        return -1;
+    }
+
+    watch = vmem_calloc(vmem_alloc_default(), sizeof(*watch) + len + 1);
+    if (!watch) {
+        if (!vfs_monitor_wd_shared(loop, &(vfs_monitor_watch_t){ .wd = wd })) {
+            inotify_rm_watch(loop->fd, wd);
+        }
+        return -1;
+    }
+    watch->wd = wd;
+    watch->monitor = monitor;
+    watch->len = len;
+    memcpy(watch->path, path, len + 1);
+    vfs_monitor_table_insert(&loop->watches, &watch->h, (uint32_t)wd);
+    vlist_add_tail(&monitor->watches, &watch->node);
+
+    if (!(monitor->params.flags & VFS_MONITOR_RECURSIVE) && !report) {
+        return 0;
+    }
+
+    /* entries created before the watch was added are reported as created now */
+    dir = opendir(fullpath);
+    if (!dir) {
+        return 0;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        if (report && (monitor->type_mask & VFS_EVENT_CREATE)) {
+            vfs_monitor_queue(loop, monitor, path, entry->d_name, VFS_EVENT_CREATE);
+        }
+
+        if (entry->d_type == DT_DIR || entry->d_type == DT_UNKNOWN) {
+            char subpath[PATH_MAX];
+            vfs_stat_t statbuf;
+
+            if (snprintf(subpath, sizeof(subpath), "%s%s%s", path, len ? "/" : "", entry->d_name) >= (int)sizeof(subpath)) {
+                continue;
+            }
+            if (entry->d_type == DT_UNKNOWN) {
+                snprintf(fullpath + strlen(monitor->root), sizeof(fullpath) - strlen(monitor->root), "/%s", subpath);
+                if (lstat(fullpath, &statbuf) != 0 || !S_ISDIR(statbuf.st_mode)) {
+                    continue;
+                }
+            }
+            vfs_monitor_add_watch(loop, monitor, subpath, report);
+        }
+    }
+
+    closedir(dir);
+
+    return 0;
+}
+
+/* Drop the watches of a directory moved out of a recursive monitor, and of its subdirectories */
+static void vfs_monitor_drop_tree(vfs_monitor_loop_t *loop, vfs_monitor_t *monitor, const char *path)
+{
+    size_t len = strlen(path);
+    vlist_t *node, *next;
+
+    for (node = monitor->watches.next; node != &monitor->watches; node = next) {
+        vfs_monitor_watch_t *watch = container_of(vfs_monitor_watch_t, node, node);
+
+        next = node->next;
+        if (watch->len >= len && strncmp(watch->path, path, len) == 0 &&
+            (watch->path[len] == '\0' || watch->path[len] == '/')) {
+            vfs_monitor_drop_watch(loop, watch, 1);
+        }
+    }
+}
+
+static void vfs_monitor_subdir(vfs_monitor_loop_t *loop, vfs_monitor_t *monitor, const char *dir, const char *name,
+                               int add)
+{
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    vfs_monitor_subdir_t *subdir;
+
+    subdir = vmem_malloc(vmem_alloc_default(), sizeof(*subdir) + dir_len + name_len + 2);
+    if (!subdir) {
+        return;
+    }
+
+    subdir->monitor = monitor;
+    subdir->add = add;
+    memcpy(subdir->path, dir, dir_len);
+    if (dir_len > 0) {
+        subdir->path[dir_len++] = '/';
+    }
+    memcpy(subdir->path + dir_len, name, name_len + 1);
+    vlist_add_tail(&loop->subdirs, &subdir->node);
+}
+
+/* Remove the monitor from the loop, its callback is called by the caller */
+static void vfs_monitor_release(vfs_monitor_loop_t *loop, vfs_monitor_t *monitor)
+{
+    vfs_monitor_pending_t *pending;
+    vfs_monitor_watch_t *watch;
+    vfs_monitor_subdir_t *subdir;
+    vlist_t *node, *next;
+
+    if (monitor->timer) {
+        vtimer_delete(monitor->timer);
+        monitor->timer = NULL;
+    }
+
+    while (!vlist_is_empty(&monitor->watches)) {
+        vlist_get_head(&monitor->watches, node);
+        watch = container_of(vfs_monitor_watch_t, node, node);
+        vfs_monitor_drop_watch(loop, watch, 1);
+    }
+
+    while (!vlist_is_empty(&monitor->pending)) {
+        vlist_get_head(&monitor->pending, node);
+        pending = container_of(vfs_monitor_pending_t, node, node);
+        vlist_delete(&pending->node);
+        vfs_monitor_table_remove(&loop->pending, &pending->h);
+        vmem_free(vmem_alloc_default(), pending);
+    }
+
+    for (node = loop->subdirs.next; node != &loop->subdirs; node = next) {
+        next = node->next;
+        subdir = (vfs_monitor_subdir_t *)node;
+        if (subdir->monitor == monitor) {
+            vlist_delete(&subdir->node);
+            vmem_free(vmem_alloc_default(), subdir);
+        }
+    }
+
+    vlist_delete(&monitor->ready);
+    vlist_delete(&monitor->node);
+}
+
+static void vfs_monitor_end(vfs_monitor_loop_t *loop, vfs_monitor_t *monitor, vevent_reason_t reason)
+{
+    vfs_monitor_release(loop, monitor);
+    monitor->cb(reason, VFS_EVENT_NONE, monitor->root, monitor->ctxt);
+    vmem_free(vmem_alloc_default(), monitor);
+}
+
+/* vevent cancel or timeout */
+static void vfs_monitor_cancel(vevent_reason_t reason, void *ctxt)
+{
+    vfs_monitor_t *monitor = (vfs_monitor_t *)ctxt;
+
+    /* the vevent is deleted after this callback */
+    monitor->event = NULL;
+    vfs_monitor_end(vfs_monitor_thread_loop, monitor, reason);
+}
+
+static void vfs_monitor_event(vfs_monitor_loop_t *loop, const struct inotify_event *ev)
+{
+    vlist_t *bucket, *node, *next;
+    vfs_monitor_t *monitor;
+
+    /* events were lost: every monitor gets a catch-all event, to rescan what it watches */
+    if (ev->mask & IN_Q_OVERFLOW) {
+        vapi_warning("vfs_monitor: inotify queue overflow, events lost");
+        for (node = loop->monitors.next; node != &loop->monitors; node = node->next) {
+            monitor = (vfs_monitor_t *)node;
+            if (!monitor->failed) {
+                vfs_monitor_queue(loop, monitor, "", "", monitor->type_mask);
+            }
+        }
+        return;
+    }
+
+    bucket = vfs_monitor_table_bucket(&loop->watches, (uint32_t)ev->wd);
+    for (node = bucket->next; node != bucket; node = next) {
+        vfs_monitor_watch_t *watch = (vfs_monitor_watch_t *)node;
+        uint32_t type_mask;
+
+        next = node->next;
+        if (watch->wd != ev->wd || watch->monitor->failed) {
+            continue;
+        }
+        monitor = watch->monitor;
+
+        /* the directory itself is gone: the end of the monitor, or of a subdirectory watch */
+        if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+            if (watch->len == 0) {
+                monitor->failed = 1;
+                vfs_monitor_set_ready(loop, monitor);
+            } else if (ev->mask & IN_IGNORED) {
+                vfs_monitor_drop_watch(loop, watch, 0);
+            }
+            continue;
+        }
+
+        type_mask = vfs_monitor_type(ev->mask) & monitor->type_mask;
+        if (type_mask != VFS_EVENT_NONE && ev->len > 0) {
+            vfs_monitor_queue(loop, monitor, watch->path, ev->name, type_mask);
+        }
+
+        if ((monitor->params.flags & VFS_MONITOR_RECURSIVE) && (ev->mask & IN_ISDIR)) {
+            if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                vfs_monitor_subdir(loop, monitor, watch->path, ev->name, 1);
+            } else if (ev->mask & IN_MOVED_FROM) {
+                vfs_monitor_subdir(loop, monitor, watch->path, ev->name, 0);
+            }
+        }
+    }
+}
+
+static int vfs_monitor_read_cb(int fd, vloop_event_handle_t handle, void *ctx)
+{
+    vfs_monitor_loop_t *loop = (vfs_monitor_loop_t *)ctx;
+    vfs_monitor_subdir_t *subdir;
+    vfs_monitor_t *monitor;
+    ssize_t len, off;
+    vlist_t *node;
+    int i;
+
+    for (i = 0; i < VFS_MONITOR_READS_MAX; i++) {
+        len = read(fd, loop->buffer, VFS_MONITOR_BUFFER_SIZE);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                vapi_warning("vfs_monitor: inotify read failed: errno = %d (%s)", errno, strerror(errno));
+            }
+            break;
+        }
+
+        for (off = 0; off < len; off += sizeof(struct inotify_event) + ((struct inotify_event *)(loop->buffer + off))->len) {
+            vfs_monitor_event(loop, (struct inotify_event *)(loop->buffer + off));
+
+            /* watches are added and dropped outside of the lookup, before the next event */
+            while (!vlist_is_empty(&loop->subdirs)) {
+                vlist_get_head(&loop->subdirs, subdir);
+                vlist_delete(&subdir->node);
+                if (subdir->add) {
+                    vfs_monitor_add_watch(loop, subdir->monitor, subdir->path, 1);
+                } else {
+                    vfs_monitor_drop_tree(loop, subdir->monitor, subdir->path);
+                }
+                vmem_free(vmem_alloc_default(), subdir);
+            }
+        }
+
+        /* a short read drained the queue */
+        if (len < VFS_MONITOR_BUFFER_SIZE - (ssize_t)(sizeof(struct inotify_event) + NAME_MAX + 1)) {
+            break;
+        }
+    }
+
+    while (!vlist_is_empty(&loop->ready)) {
+        vlist_get_head(&loop->ready, node);
+        monitor = container_of(vfs_monitor_t, ready, node);
+        vlist_delete(&monitor->ready);
+
+        vfs_monitor_flush(monitor);
+        if (monitor->failed) {
+            vevent_delete(monitor->event);
+            monitor->event = NULL;
+            vfs_monitor_end(loop, monitor, VEVENT_FAILURE);
+        }
+    }
+
+    return 0;
+}
+
+static vfs_monitor_loop_t *vfs_monitor_get_loop(void)
+{
+    vfs_monitor_loop_t *loop = vfs_monitor_thread_loop;
+
+    if (loop) {
+        return loop;
+    }
+
+    if (!vloop_get_base()) {
+        vapi_error("vfs_monitor: not called from a loop thread");
+        return NULL;
+    }
+
+    loop = vmem_calloc(vmem_alloc_default(), sizeof(*loop));
+    if (!loop) {
+        return NULL;
+    }
+
+    loop->buffer = vmem_malloc(vmem_alloc_default(), VFS_MONITOR_BUFFER_SIZE);
+    if (!loop->buffer || vfs_monitor_table_init(&loop->watches) < 0 || vfs_monitor_table_init(&loop->pending) < 0) {
+        goto vfs_monitor_get_loop_exit_0;
+    }
+
+    loop->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (loop->fd < 0) {
+        vapi_error("vfs_monitor: inotify_init1 failed: errno = %d (%s)", errno, strerror(errno));
+        goto vfs_monitor_get_loop_exit_0;
+    }
+
+    loop->handle = vloop_add_fd(loop->fd, VLOOP_FD_READ, vfs_monitor_read_cb, NULL, loop);
+    if (!loop->handle || vloop_enable_cb(loop->handle, VLOOP_FD_READ) != 0) {
+        vapi_error("vfs_monitor: failed to add inotify fd to event loop");
+        if (loop->handle) {
+            vloop_remove_fd(loop->handle);
+        }
+        close(loop->fd);
+        goto vfs_monitor_get_loop_exit_0;
+    }
+
+    vlist_init(&loop->monitors);
+    vlist_init(&loop->ready);
+    vlist_init(&loop->subdirs);
+    vfs_monitor_thread_loop = loop;
+
+    return loop;
+
+vfs_monitor_get_loop_exit_0:
+    vmem_free(vmem_alloc_default(), loop->watches.buckets);
+    vmem_free(vmem_alloc_default(), loop->pending.buckets);
+    vmem_free(vmem_alloc_default(), loop->buffer);
+    vmem_free(vmem_alloc_default(), loop);
+    return NULL;
+}
+
+vevent_t *vfs_monitor(const char *path, uint32_t type_mask, vfs_monitor_cb_t cb, void *ctxt)
+{
+    return vfs_monitor_ex(path, type_mask, NULL, cb, ctxt);
+}
+
+vevent_t *vfs_monitor_ex(const char *path, uint32_t type_mask, const vfs_monitor_params_t *params,
+                         vfs_monitor_cb_t cb, void *ctxt)
+{
+    static const vfs_monitor_params_t default_params = VFS_MONITOR_PARAMS_DEFAULT;
+    size_t len = strlen(path);
+    vfs_monitor_loop_t *loop;
+    vfs_monitor_t *monitor;
+
+    if (!cb || len == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    loop = vfs_monitor_get_loop();
+    if (!loop) {
+        return NULL;
+    }
+
+    monitor = vmem_calloc(vmem_alloc_default(), sizeof(*monitor) + len + 1);
+    if (!monitor) {
+        return NULL;
+    }
+
+    /* names are reported relative to the path, without a trailing slash */
+    memcpy(monitor->root, path, len + 1);
+    while (len > 1 && monitor->root[len - 1] == '/') {
+        monitor->root[--len] = '\0';
+    }
+    monitor->params = params ? *params : default_params;
+    monitor->type_mask = type_mask;
+    monitor->in_mask = vfs_monitor_in_mask(type_mask, monitor->params.flags);
+    monitor->cb = cb;
+    monitor->ctxt = ctxt;
+    vlist_init(&monitor->watches);
+    vlist_init(&monitor->pending);
+
+    if (vfs_monitor_add_watch(loop, monitor, "", 0) < 0) {
+        vfs_monitor_release(loop, monitor);
+        vmem_free(vmem_alloc_default(), monitor);
+        return NULL;
+    }
+
+    monitor->event = vevent_new(vfs_monitor_cancel, monitor);
+    if (!monitor->event) {
+        vapi_error("vfs_monitor: failed to create vevent");
+        vfs_monitor_release(loop, monitor);
+        vmem_free(vmem_alloc_default(), monitor);
+        return NULL;
+    }
+    vlist_add_tail(&loop->monitors, &monitor->node);
+
+    return monitor->event;
+}
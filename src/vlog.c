@@ -1,3 +1,6 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* pthread_setname_np */
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,6 +21,7 @@
 #include <libvapi/vlog_file.h>
 #include <libvapi/vtnd.h>
 #include <libvapi/vtnd_log.h>
+#include <libvapi/vlog_flightrec.h>
 
 #include "vlog_vapi.h"
 #include "vlog_core.h"
@@ -95,13 +99,13 @@ static vlog_internal_config_t log_config = {
     .m_ysyslog.fd = 0,
     .m_ysyslog.local_addr = "",
     .m_ysyslog.local_port = 514,
+    .m_ysyslog.transport = VLOG_SYSLOG_DGRAM,
     .m_default_loglevel = VLOG_DISABLED,
     .m_set_loglevel_from_output_level = 0
 };
 
 static vthread_mutex_t vlog_config_lock;
-static volatile sig_atomic_t error_records_file_fd_flag = 0;
-static int error_records_file_fd = -1;
+static volatile sig_atomic_t error_records_file_flag = 0;
 static const int c_syslog_user_fac = 8;
 static const int c_syslog_local1_fac = 136;
 
@@ -130,6 +134,80 @@ static int vlog_is_error_level(vlog_level_t level)
 }
 
 
+/* Unregistered log ids only let error levels through. */
+signed char vlog_module_threshold[VLOG_MAX_MODULES] = {
+    [0 ... VLOG_MAX_MODULES - 1] = VLOG_ERROR
+};
+
+/* Level of each log id, below the early filter threshold when the flight recorder wants more */
+static signed char vlog_module_level[VLOG_MAX_MODULES] = {
+    [0 ... VLOG_MAX_MODULES - 1] = VLOG_DISABLED
+};
+
+/* Category of each module, read by the trace path without lock to pick the syslog facility */
+static unsigned char vlog_module_category[VLOG_MAX_MODULES];
+
+/* OpenTracing status of the vapi components, read by their hooks without lock */
+static unsigned char vlog_component_status[COMPONENT_DEST_MAX] = {
+    [0 ... COMPONENT_DEST_MAX - 1] = VLOG_STATUS_DISABLED
+};
+
+/* Log id of the trace being printed by this thread, see vlog_set_default_tags() */
+#define VLOG_TRACE_NO_MODULE    ((vlog_id_t)-1)
+static __thread vlog_id_t vlog_trace_module = VLOG_TRACE_NO_MODULE;
+/* Call site of the trace being printed by this thread, see __vlog_set_callsite() */
+static __thread vlog_callsite_t *vlog_trace_site = NULL;
+/* Key-value pairs of the trace being printed by this thread, see vlog_kv() */
+__thread vlog_kvs_t vlog_kvs;
+
+/* Publish the early filter threshold of a module, to be called whenever m_level changes. */
+static void vlog_module_update_threshold(vlog_module_t *mod)
+{
+    signed char thresh = MAX(MAX(mod->m_level, VLOG_ERROR), vlog_flightrec_get_floor());
+
+    if (mod->m_logid < VLOG_MAX_MODULES) {
+        __atomic_store_n(&vlog_module_level[mod->m_logid], mod->m_level, __ATOMIC_RELAXED);
+        __atomic_store_n(&vlog_module_threshold[mod->m_logid], thresh, __ATOMIC_RELAXED);
+    }
+}
+
+/* Thresholds of all modules, to be called when the flight recorder floor changes. */
+void vlog_update_module_thresholds(void)
+{
+    vlog_module_t *tmp = NULL;
+    struct vlist *nodep = NULL;
+
+    vmutex_lock(&vlog_config_lock);
+    vlist_foreach(&(log_config.m_module_list),nodep) {
+        tmp = container_of(vlog_module_t, m_node, nodep);
+        vlog_module_update_threshold(tmp);
+    }
+    vmutex_unlock(&vlog_config_lock);
+}
+
+/* The trace passed the early filter of its module for an output, not only for the flight recorder */
+int vlog_module_output_enabled(vlog_id_t module, vlog_level_t level)
+{
+    signed char mod_level;
+
+    if (vlog_is_error_level(level) || module >= VLOG_MAX_MODULES)
+        return 1;
+
+    mod_level = __atomic_load_n(&vlog_module_level[module], __ATOMIC_RELAXED);
+
+    return mod_level != VLOG_DISABLED && level <= mod_level;
+}
+
+static int vlog_trace_output_enabled(vlog_level_t level)
+{
+    /* a call site set on is printed whatever the level of its module */
+    if (vlog_trace_site != NULL &&
+        __atomic_load_n(&vlog_trace_site->flags, __ATOMIC_RELAXED) == VLOG_CALLSITE_ON)
+        return 1;
+
+    return vlog_module_output_enabled(vlog_trace_module, level);
+}
+
 static int get_module_by_id(vlog_id_t log_id, vlog_module_t **mod)
 {
     int ret = -1;
@@ -184,136 +262,340 @@ static void vlog_install_default_filters(void)
     return;
 }
 
-static int vlog_format_trace(char *output, size_t output_size, const char *msg, int output_index)
+/* Outputs of the regular traces, in the order they are written to */
+static const vlog_output_t vlog_trace_outputs[] = {
+    VLOG_CONSOLE_INDEX,
+    VLOG_LOGFILE_INDEX,
+    VLOG_TNDD_INDEX,
+    VLOG_SYSLOG_INDEX,
+};
+#define VLOG_TRACE_OUTPUTS  (sizeof(vlog_trace_outputs) / sizeof(vlog_trace_outputs[0]))
+
+/* Line buffer of the traces, rendered once per distinct output format */
+static __thread char vlog_trace_line[VLOG_MAX_TAGS_SIZE+VLOG_MAX_MSG_SIZE];
+static __thread int vlog_trace_depth = 0;
+
+static void vlog_format_trace(char *output, size_t output_size, vlog_format_t *fmt, vlog_format_args_t *args)
 {
     int linefeed;
     buffer_t buf;
     static const char *trunc = "<TRUNCATED>\n";
 
-    if (LEVEL_ENABLED_ON_OUTPUT(output_index, vlog_tags.TAG_LEVEL)) {
-        bufinit(&buf, output, output_size);
-        vlog_format(&buf, log_config.m_destformat[output_index], msg, &vlog_tags);
-        linefeed = bufprintf(&buf, "\n");
-        if (linefeed == 0)  /* line feed could not be printed means that the buffer is full */
-            sprintf(&output[output_size - strlen(trunc) - 1], "%s", trunc);
+    bufinit(&buf, output, output_size);
+    vlog_format_args(&buf, fmt, args);
+    linefeed = bufprintf(&buf, "\n");
+    if (linefeed == 0)  /* line feed could not be printed means that the buffer is full */
+        sprintf(&output[output_size - strlen(trunc) - 1], "%s", trunc);
+}
 
-        return 0;
+/* Bit mask of the trace outputs enabled for the current level */
+static unsigned int vlog_trace_enabled_outputs(void)
+{
+    unsigned int enabled = 0;
+    size_t i;
+
+    for (i = 0; i < VLOG_TRACE_OUTPUTS; i++) {
+        if (LEVEL_ENABLED_ON_OUTPUT(vlog_trace_outputs[i], vlog_tags.TAG_LEVEL))
+            enabled |= 1u << i;
     }
 
-    return 1;
+    return enabled;
 }
 
-static int vlog_fulldump_format_trace(char **output, const char *msg, int output_index)
+/* Outputs among the pending ones that render the same line as output i */
+static unsigned int vlog_trace_same_format(unsigned int pending, size_t i)
 {
-    char *result = NULL;
-    buffer_t buf;
-    int expanded_tags_len = -1;
+    vlog_format_t *fmt = log_config.m_destformat[vlog_trace_outputs[i]];
+    unsigned int same = 0;
+    size_t j;
+
+    for (j = i; j < VLOG_TRACE_OUTPUTS; j++) {
+        if ((pending & (1u << j)) && vlog_format_equal(fmt, log_config.m_destformat[vlog_trace_outputs[j]]))
+            same |= 1u << j;
+    }
+
+    return same;
+}
+
+static int vlog_trace_syslog_pri(void)
+{
+    vlog_id_t module = vlog_trace_module;
+
+    if (module < VLOG_MAX_MODULES &&
+        __atomic_load_n(&vlog_module_category[module], __ATOMIC_RELAXED) == VLOG_OPERATOR)
+        return c_syslog_user_fac + (int)vlog_tags.TAG_LEVEL;
+
+    /* print internal logs as debug level to syslog only */
+    return c_syslog_local1_fac + (int)vlog_tags.TAG_LEVEL;
+}
+
+void vlog_output_write(vlog_output_t output_index, int syslog_pri, vlog_level_t level, const char *str)
+{
+    switch (output_index) {
+    case VLOG_CONSOLE_INDEX:
+        fputs(str, stdout);
+        break;
+    case VLOG_LOGFILE_INDEX:
+        vlog_file_write(&(log_config.m_vlogfile), (char *)str);
+        break;
+    case VLOG_TNDD_INDEX:
+        vtnd_log_write((char *)str, level);
+        break;
+    case VLOG_SYSLOG_INDEX:
+        vlog_syslog_print(&log_config.m_ysyslog, syslog_pri, str);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Send what the outputs queued, at the end of a burst */
+void vlog_output_flush(vlog_output_t output_index)
+{
+    if (output_index == VLOG_SYSLOG_INDEX && log_config.m_logsys)
+        vlog_syslog_flush(&log_config.m_ysyslog);
+    else if (output_index == VLOG_TNDD_INDEX)
+        vtnd_log_flush();
+}
+
+#define VLOG_OUTPUT_FLUSH_MS    10      /* longest wait of a queued trace for its batch to go out */
+
+/* Flushes the batched outputs when no later trace fills their batch */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    unsigned int pending;               /* bit mask of the outputs holding queued traces */
+    int running;
+    int hooks_registered;
+} vlog_output_flusher = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .pending = 0,
+    .running = 0,
+    .hooks_registered = 0,
+};
+
+static void vlog_output_flush_pending(void)
+{
+    unsigned int pending = __atomic_exchange_n(&vlog_output_flusher.pending, 0, __ATOMIC_ACQ_REL);
+    int out;
 
-    if (LEVEL_ENABLED_ON_OUTPUT(output_index, vlog_tags.TAG_LEVEL)) {
-        expanded_tags_len = vlog_format_get_len(log_config.m_destformat[output_index], msg, &vlog_tags);
-        if (expanded_tags_len == -1) {
-            vapi_error("vlog_format_get_len failed");
-            return 1;
+    for (out = 0; out < VLOG_DEST_MAX; out++) {
+        if (pending & (1u << out))
+            vlog_output_flush(out);
+    }
+}
+
+static void *vlog_output_flusher_thread(void *arg)
+{
+    struct timespec deadline;
+
+    pthread_mutex_lock(&vlog_output_flusher.lock);
+
+    while (vlog_output_flusher.running) {
+        if (__atomic_load_n(&vlog_output_flusher.pending, __ATOMIC_ACQUIRE) == 0) {
+            pthread_cond_wait(&vlog_output_flusher.cond, &vlog_output_flusher.lock);
+            continue;
         }
 
-        result = vmem_calloc(vmem_alloc_default(), expanded_tags_len + 2); /* '\n' + '\0' */
-        if (result == NULL) {
-            vapi_error("vmem_calloc failed");
-            return 1;
+        /* the batch timer, started by the first trace queued since the last flush */
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += VLOG_OUTPUT_FLUSH_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
         }
+        pthread_cond_timedwait(&vlog_output_flusher.cond, &vlog_output_flusher.lock, &deadline);
 
-        memset(result, 0, expanded_tags_len + 2);
-        bufinit(&buf, result, expanded_tags_len + 2); /* '\n' + '\0' */
-        vlog_format(&buf, log_config.m_destformat[output_index], msg, &vlog_tags);
-        bufprintf(&buf, "\n");
+        pthread_mutex_unlock(&vlog_output_flusher.lock);
+        vlog_output_flush_pending();
+        pthread_mutex_lock(&vlog_output_flusher.lock);
+    }
 
-        *output = result;
-        return 0;
+    pthread_mutex_unlock(&vlog_output_flusher.lock);
+
+    return NULL;
+}
+
+static void vlog_output_flusher_atexit(void)
+{
+    pthread_mutex_lock(&vlog_output_flusher.lock);
+    if (vlog_output_flusher.running) {
+        vlog_output_flusher.running = 0;
+        pthread_cond_signal(&vlog_output_flusher.cond);
+        pthread_mutex_unlock(&vlog_output_flusher.lock);
+        pthread_join(vlog_output_flusher.thread, NULL);
+    } else {
+        pthread_mutex_unlock(&vlog_output_flusher.lock);
     }
 
-    return 1;
+    vlog_output_flush_pending();
 }
 
-void vlog_output_trace(const char *span_name, const char *msg)
+static void vlog_output_flusher_atfork_child(void)
 {
-    vlog_module_t *mod = NULL;
-    buffer_t buf;
-    char output[VLOG_MAX_TAGS_SIZE+VLOG_MAX_MSG_SIZE];
-    char module_output[VLOG_MAX_TAGS_SIZE+VLOG_MAX_MSG_SIZE];
-    int syslog_pri = c_syslog_local1_fac;
+    /* the flusher is not forked, it is started again by the next queued trace */
+    pthread_mutex_init(&vlog_output_flusher.lock, NULL);
+    pthread_cond_init(&vlog_output_flusher.cond, NULL);
+    vlog_output_flusher.running = 0;
+}
 
-    memset(output, 0, sizeof(output));
-    memset(module_output, 0, sizeof(module_output));
+/* The output queued a trace: it goes out with its batch, or when the batch timer expires */
+static void vlog_output_flush_later(vlog_output_t output_index)
+{
+    unsigned int bit = 1u << output_index;
 
-    bufinit(&buf, module_output, sizeof(module_output));
+    if (__atomic_load_n(&vlog_output_flusher.pending, __ATOMIC_RELAXED) & bit)
+        return;
 
-    if (vlog_format_trace(output, sizeof(output), module_output, VLOG_CONSOLE_INDEX) == 0)
-        fputs(output, stdout);
+    /* the flusher is already timing an earlier trace */
+    if (__atomic_fetch_or(&vlog_output_flusher.pending, bit, __ATOMIC_ACQ_REL) != 0)
+        return;
 
-    if (vlog_format_trace(output, sizeof(output), module_output, VLOG_LOGFILE_INDEX) == 0)
-        vlog_file_write(&(log_config.m_vlogfile), output);
+    pthread_mutex_lock(&vlog_output_flusher.lock);
 
-    if (vlog_format_trace(output, sizeof(output), module_output, VLOG_TNDD_INDEX) == 0)
-        vtnd_log_write(output, vlog_tags.TAG_LEVEL);
+    if (!vlog_output_flusher.hooks_registered) {
+        atexit(vlog_output_flusher_atexit);
+        pthread_atfork(NULL, NULL, vlog_output_flusher_atfork_child);
+        vlog_output_flusher.hooks_registered = 1;
+    }
 
-    if (vlog_format_trace(output, sizeof(output), module_output, VLOG_SYSLOG_INDEX) == 0) {
-        if (mod && mod->m_category == VLOG_OPERATOR) {
-            syslog_pri = c_syslog_user_fac + (int)vlog_tags.TAG_LEVEL;
-            vlog_syslog_print(&log_config.m_ysyslog, syslog_pri, output);
+    if (!vlog_output_flusher.running) {
+        vlog_output_flusher.running = 1;
+        if (pthread_create(&vlog_output_flusher.thread, NULL, vlog_output_flusher_thread, NULL) != 0) {
+            vlog_output_flusher.running = 0;
+            pthread_mutex_unlock(&vlog_output_flusher.lock);
+            vlog_output_flush_pending();
+            return;
         }
-        else {
-            /* print internal logs as debug level to syslog only */
-            syslog_pri += (int)vlog_tags.TAG_LEVEL;
-            vlog_syslog_print(&log_config.m_ysyslog, syslog_pri, output);
+        pthread_setname_np(vlog_output_flusher.thread, "vlog_flush");
+    }
+
+    pthread_cond_signal(&vlog_output_flusher.cond);
+    pthread_mutex_unlock(&vlog_output_flusher.lock);
+}
+
+int vlog_output_write_asyncsignalsafe(vlog_output_t output_index, const char *str, size_t len)
+{
+    if (output_index == VLOG_CONSOLE_INDEX)
+        return (write(STDOUT_FILENO, str, len) < 0) ? -1 : 0;
+    if (output_index == VLOG_LOGFILE_INDEX)
+        return vlog_file_write_asyncsignalsafe(&(log_config.m_vlogfile), str, len);
+
+    return -1;
+}
+
+static void vlog_output_dispatch(vlog_output_t output_index, int syslog_pri, const char *str)
+{
+    vlog_level_t level = vlog_tags.TAG_LEVEL;
+
+    if (vlog_async_enabled() && vlog_async_push(output_index, syslog_pri, level, str) == 0)
+        return;
+
+    vlog_output_write(output_index, syslog_pri, level, str);
+
+    /* errors go out at once, the other traces with their batch */
+    if (level <= VLOG_ERROR)
+        vlog_output_flush(output_index);
+    else if (output_index == VLOG_SYSLOG_INDEX || output_index == VLOG_TNDD_INDEX)
+        vlog_output_flush_later(output_index);
+}
+
+static void vlog_output_trace_at(const char *span_name, const struct timespec *ts, const char *msg)
+{
+    vlog_format_args_t args;
+    char nested[VLOG_MAX_TAGS_SIZE+VLOG_MAX_MSG_SIZE];
+    char *line = vlog_trace_line;
+    unsigned int pending, same;
+    vlog_output_t out;
+    size_t i, j;
+
+    pending = vlog_trace_enabled_outputs();
+    if (pending == 0)
+        return;
+
+    /* An output may log while writing, don't overwrite the line being dispatched. */
+    if (vlog_trace_depth++ > 0)
+        line = nested;
+
+    vlog_format_args_init(&args, msg, &vlog_tags);
+    args.module = vlog_trace_module;
+    args.kvs = &vlog_kvs;
+    args.ts = ts;
+
+    for (i = 0; i < VLOG_TRACE_OUTPUTS; i++) {
+        if (!(pending & (1u << i)))
+            continue;
+
+        same = vlog_trace_same_format(pending, i);
+        vlog_format_trace(line, sizeof(nested), log_config.m_destformat[vlog_trace_outputs[i]], &args);
+
+        for (j = i; j < VLOG_TRACE_OUTPUTS; j++) {
+            if (!(same & (1u << j)))
+                continue;
+            out = vlog_trace_outputs[j];
+            vlog_output_dispatch(out, (out == VLOG_SYSLOG_INDEX) ? vlog_trace_syslog_pri() : 0, line);
         }
+        pending &= ~same;
     }
+
+    vlog_trace_depth--;
+}
+
+void vlog_output_trace(const char *span_name, const char *msg)
+{
+    vlog_output_trace_at(span_name, NULL, msg);
 }
 
+/* Same as vlog_output_trace for messages of any length, written synchronously */
 static void vlog_fulldump_output_trace(const char *msg)
 {
-    vlog_module_t *mod = NULL;
+    vlog_format_args_t args;
+    vlog_format_t *fmt;
+    unsigned int pending, same;
+    char *output;
     buffer_t buf;
-    char *module_output = NULL;
-    char *output = NULL;
-    int msg_len = -1;
-    int syslog_pri = c_syslog_local1_fac;
+    vlog_output_t out;
+    int len;
+    size_t i, j;
 
-    module_output = vmem_calloc(vmem_alloc_default(), msg_len + 2);  /* '\n' + '\0' */
-    if (module_output == NULL) {
-        vapi_error("vmem_calloc failed");
-        return;
-    }
-    bufinit(&buf, module_output, msg_len + 2);  /* '\n' + '\0' */
+    pending = vlog_trace_enabled_outputs();
 
-    if (vlog_fulldump_format_trace(&output, module_output, VLOG_CONSOLE_INDEX) == 0) {
-        fputs(output, stdout);
-        vmem_free(vmem_alloc_default(), output);
-    }
+    vlog_format_args_init(&args, msg, &vlog_tags);
+    args.module = vlog_trace_module;
+    args.kvs = &vlog_kvs;
 
-    if (vlog_fulldump_format_trace(&output, module_output, VLOG_LOGFILE_INDEX) == 0) {
-        vlog_file_write(&(log_config.m_vlogfile), output);
-        vmem_free(vmem_alloc_default(), output);
-    }
+    for (i = 0; i < VLOG_TRACE_OUTPUTS; i++) {
+        if (!(pending & (1u << i)))
+            continue;
 
-    if (vlog_fulldump_format_trace(&output, module_output, VLOG_TNDD_INDEX) == 0) {
-        vtnd_log_write(output, vlog_tags.TAG_LEVEL);
-        vmem_free(vmem_alloc_default(), output);
-    }
+        same = vlog_trace_same_format(pending, i);
+        pending &= ~same;
 
-    if (vlog_fulldump_format_trace(&output, module_output, VLOG_SYSLOG_INDEX) == 0) {
-        if (mod && mod->m_category == VLOG_OPERATOR) {
-            syslog_pri = c_syslog_user_fac + (int)vlog_tags.TAG_LEVEL;
-            vlog_syslog_print(&log_config.m_ysyslog, syslog_pri, output);
+        fmt = log_config.m_destformat[vlog_trace_outputs[i]];
+        len = vlog_format_args_get_len(fmt, &args);
+        output = vmem_malloc(vmem_alloc_default(), len + 2); /* '\n' + '\0' */
+        if (output == NULL) {
+            vapi_error("vmem_malloc failed");
+            continue;
         }
-        else {
-            /* print internal logs as debug level to syslog only */
-            syslog_pri += (int)vlog_tags.TAG_LEVEL;
-            vlog_syslog_print(&log_config.m_ysyslog, syslog_pri, output);
+
+        bufinit(&buf, output, len + 2);
+        vlog_format_args(&buf, fmt, &args);
+        bufprintf(&buf, "\n");
+
+        for (j = i; j < VLOG_TRACE_OUTPUTS; j++) {
+            if (!(same & (1u << j)))
+                continue;
+            out = vlog_trace_outputs[j];
+            vlog_output_write(out, (out == VLOG_SYSLOG_INDEX) ? vlog_trace_syslog_pri() : 0,
+                              vlog_tags.TAG_LEVEL, output);
+            vlog_output_flush(out);
         }
+
         vmem_free(vmem_alloc_default(), output);
     }
-
-    vmem_free(vmem_alloc_default(), module_output);
 }
 
 void vlog_output_error_record(const char *msg, vlog_level_t level, unsigned long type,
@@ -381,7 +663,10 @@ static int vlog_module_level_enabled(vlog_id_t log_id, vlog_level_t log_level)
 
 int vlog_level_enabled_on_vapi_component(vlog_vapi_component_t component_id)
 {
-    return 0;
+    if ((unsigned int)component_id >= COMPONENT_DEST_MAX)
+        return 0;
+
+    return __atomic_load_n(&vlog_component_status[component_id], __ATOMIC_RELAXED) == VLOG_STATUS_ENABLED;
 }
 
 /* scan the line for useful maps info, and put it in output if found
@@ -504,8 +789,7 @@ static int vlog_core_open(void)
             log_config.m_errorfile = 1;
             log_config.m_destinit[VLOG_ERRORFILE_INDEX] = 1;
             log_config.m_destlevel[VLOG_ERRORFILE_INDEX] = VLOG_ERROR;
-            error_records_file_fd = vlog_file_get_fd(&(log_config.m_yerrorfile));
-            error_records_file_fd_flag = 1;
+            error_records_file_flag = 1;
             log_config.m_yerrorfile.cb = vlog_dump_maps_to_log_file;
             vlog_dump_maps_to_log_file(&(log_config.m_yerrorfile));
         } else {
@@ -559,6 +843,9 @@ static int __vlog_module_register(const char module_name[VLOG_MAX_MOD_NAME], vlo
     new_mod->m_level = log_config.m_default_loglevel;
     new_mod->m_update_ctx = NULL;
     new_mod->m_category = category;
+    if (new_mod->m_logid < VLOG_MAX_MODULES)
+        __atomic_store_n(&vlog_module_category[new_mod->m_logid], category, __ATOMIC_RELAXED);
+    vlog_module_update_threshold(new_mod);
     log_config.m_nbr_modules++; /* incremented with every registered module */
 
     *log_id = new_mod->m_logid;
@@ -612,6 +899,7 @@ int vlog_module_config_loglevel(vlog_id_t id, int value)
         goto exit_set_loglevel;
     } else {
         mod->m_level = value;
+        vlog_module_update_threshold(mod);
         if (mod->m_update_ctx && mod->m_update_ctx->user_cb)
             mod->m_update_ctx->user_cb(id, mod->m_level, mod->m_update_ctx->user_ctx);
     }
@@ -643,8 +931,10 @@ static int vlog_modules_update_loglevel(vlog_level_t level, vlog_category_t cate
 
     vlist_foreach(&(log_config.m_module_list),nodep) {
         tmp = container_of(vlog_module_t, m_node, nodep);
-        if (tmp->m_category == category)
+        if (tmp->m_category == category) {
             tmp->m_level = level;
+            vlog_module_update_threshold(tmp);
+        }
 
         if (tmp->m_level > log_config.m_default_loglevel) {
             cnt++;
@@ -675,6 +965,12 @@ void vlog_set_default_threshold(vlog_output_t output, vlog_level_t thresh, vlog_
     }
 }
 
+static void vlog_timezone_changed(const char *tz_name, time_t delta, void *user_ctx)
+{
+    /* the cached log timestamps still use the previous timezone */
+    vtime_time_date_invalidate();
+}
+
 /* main init fuction, to be called once during main init (vloop) */
 int vlog_init(void)
 {
@@ -699,6 +995,12 @@ int vlog_init(void)
     /* initialize trace and debug module */
     vlog_dbg_init_module();
 
+    if (vtime_register_timezone_cb(vlog_timezone_changed, NULL) != 0)
+        vapi_warning("log timestamps will not follow timezone changes");
+
+    if (vlog_flightrec_init(VLOG_FLIGHTREC_RING_SIZE, VLOG_FLIGHTREC_DEFAULT_FLOOR) != 0)
+        vapi_warning("flight recorder not started");
+
     vlog_install_default_filters();
 
     /* open all required log facilities XXX error checking */
@@ -741,23 +1043,49 @@ void __vlog_printf(const char *fmt, ...)
     va_end(args);
 }
 
-void __vlog_vprintf(const char *fmt, va_list ap)
+static void vlog_vprintf_trace(const char *span_name, const char *fmt, va_list ap)
 {
     char msg[VLOG_MAX_MSG_SIZE];
-    int is_error, is_filtered;
+    int is_error, is_filtered, is_recorded, is_repeat;
+    vlog_level_t level = vlog_tags.TAG_LEVEL;
 
     memset(msg, 0, sizeof(msg));
 
-    is_error = vlog_is_error_level(vlog_tags.TAG_LEVEL);
-    is_filtered = vlog_tags_filter();
-    if (is_error || !is_filtered)
+    is_error = vlog_is_error_level(level);
+    is_recorded = (level <= __atomic_load_n(&vlog_flightrec_floor, __ATOMIC_RELAXED));
+    is_filtered = !vlog_trace_output_enabled(level) || vlog_tags_filter();
+    if (is_error || !is_filtered || is_recorded)
         vsnprintf(msg, sizeof(msg), fmt, ap);
 
     vlog_strn_cleanup_and_trim(msg, VLOG_MAX_MSG_SIZE - 1);
 
-    if (!is_filtered)
-        vlog_output_trace(NULL, msg);
+    /* the flight recorder also keeps the traces no output takes */
+    if (is_recorded)
+        vlog_flightrec_record(level, msg, strlen(msg));
+
+    is_repeat = vlog_ratelimit_filter(span_name, is_filtered ? NULL : msg);
+
+    if (!is_filtered && !is_repeat)
+        vlog_output_trace(span_name, msg);
 
+    vlog_trace_module = VLOG_TRACE_NO_MODULE;
+    vlog_trace_site = NULL;
+    vlog_kvs_clear();
+    vlog_tags_clear();
+}
+
+void __vlog_vprintf(const char *fmt, va_list ap)
+{
+    vlog_vprintf_trace(NULL, fmt, ap);
+}
+
+/* Output an already formatted message of the given module and level, e.g. a decoded deferred record */
+void vlog_output_message(vlog_id_t module, vlog_level_t level, const struct timespec *ts, const char *msg)
+{
+    vlog_trace_module = module;
+    vlog_tags.TAG_LEVEL = level;
+    vlog_output_trace_at(NULL, ts, msg);
+    vlog_trace_module = VLOG_TRACE_NO_MODULE;
     vlog_tags_clear();
 }
 
@@ -774,22 +1102,7 @@ void __vlog_printf_ot(const char *spanName, const char *fmt, ...)
 
 void __vlog_vprintf_ot(const char* spanName, const char *fmt, va_list ap)
 {
-    char msg[VLOG_MAX_MSG_SIZE];
-    int is_error, is_filtered;
-
-    is_error = vlog_is_error_level(vlog_tags.TAG_LEVEL);
-
-    is_filtered = vlog_tags_filter();
-
-    if (is_error || !is_filtered)
-        vsnprintf(msg, sizeof(msg), fmt, ap);
-
-    vlog_strn_cleanup_and_trim(msg, VLOG_MAX_MSG_SIZE - 1);
-
-    if (!is_filtered)
-        vlog_output_trace(spanName, msg);
-
-    vlog_tags_clear();
+    vlog_vprintf_trace(spanName, fmt, ap);
 }
 
 void __vlog_hexdump(void *addr, size_t size)
@@ -801,19 +1114,23 @@ void __vlog_hexdump(void *addr, size_t size)
     if (addr == NULL)
         return;
 
-    is_filtered = vlog_tags_filter();
+    /* dumps are too large for the flight recorder */
+    is_filtered = !vlog_trace_output_enabled(vlog_tags.TAG_LEVEL) || vlog_tags_filter();
 
-    ret = hexdump(addr, size, &output);
-    if (ret < 0) {
-        vapi_warning("hexdump fail");
-        return;
+    if (!is_filtered) {
+        ret = hexdump(addr, size, &output);
+        if (ret < 0) {
+            vapi_warning("hexdump fail");
+        } else {
+            vlog_fulldump_output_trace(output);
+        }
+        free(output);
     }
 
-    if (!is_filtered)
-        vlog_fulldump_output_trace(output);
-
+    vlog_trace_module = VLOG_TRACE_NO_MODULE;
+    vlog_trace_site = NULL;
+    vlog_kvs_clear();
     vlog_tags_clear();
-    free(output);
 }
 
 void __vlog_print_full(const char *str, __attribute__((unused)) size_t len)
@@ -823,29 +1140,30 @@ void __vlog_print_full(const char *str, __attribute__((unused)) size_t len)
     if (str == NULL)
         return;
 
-    is_filtered = vlog_tags_filter();
+    is_filtered = !vlog_trace_output_enabled(vlog_tags.TAG_LEVEL) || vlog_tags_filter();
     if (!is_filtered)
         vlog_fulldump_output_trace(str);
 
+    vlog_trace_module = VLOG_TRACE_NO_MODULE;
+    vlog_trace_site = NULL;
+    vlog_kvs_clear();
     vlog_tags_clear();
 }
 
-void vlog_print_error_asyncsignalsafe(const char *str)
+void vlog_write_error_asyncsignalsafe(const char *str, size_t len)
 {
-    int len = strlen(str);
-
     /* write to console */
-    write(STDERR_FILENO, "\n", 1);
     write(STDERR_FILENO, str, len);
 
     /* write to error records log file */
-    if (error_records_file_fd_flag == 1) {
-        error_records_file_fd = vlog_file_get_fd(&(log_config.m_yerrorfile));
-        if (error_records_file_fd > 0) {
-            write(error_records_file_fd, "\n", 1);
-            write(error_records_file_fd, str, len);
-        }
-    }
+    if (error_records_file_flag == 1)
+        vlog_file_write_asyncsignalsafe(&(log_config.m_yerrorfile), str, len);
+}
+
+void vlog_print_error_asyncsignalsafe(const char *str)
+{
+    vlog_write_error_asyncsignalsafe("\n", 1);
+    vlog_write_error_asyncsignalsafe(str, strlen(str));
 }
 
 
@@ -958,6 +1276,17 @@ int vlog_module_get_data(vlog_id_t id, char name[VLOG_MAX_MOD_NAME], int *level,
     return 0;
 }
 
+int vlog_status_get_data(vlog_vapi_component_t id, char name[VLOG_MAX_MOD_NAME], vlog_status_t *status)
+{
+    if ((unsigned int)id >= COMPONENT_DEST_MAX)
+        return -1;
+
+    snprintf(name, VLOG_MAX_MOD_NAME, "%s", vlog_vapi_component_str[id]);
+    *status = __atomic_load_n(&vlog_component_status[id], __ATOMIC_RELAXED);
+
+    return 0;
+}
+
 int vlog_output_get_max_entries(vlog_output_t id)
 {
     if (id == VLOG_LOGFILE_INDEX)
@@ -1005,6 +1334,21 @@ int vlog_output_set_status(int id, int status)
     }
 }
 
+int vlog_output_set_opentracing_status(int id, int status)
+{
+    if ((unsigned int)id >= COMPONENT_DEST_MAX) {
+        vapi_warning("error: invalid vapi component [%d]", id);
+        return -1;
+    } else if (status != VLOG_STATUS_DISABLED && status != VLOG_STATUS_ENABLED) {
+        vapi_warning("error: invalid opentracing status [%d] for vapi component [%d]", status, id);
+        return -1;
+    }
+
+    __atomic_store_n(&vlog_component_status[id], status, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
 int vlog_output_set_loglevel(int id, int value)
 {
     if (id == VLOG_ERRORFILE_INDEX) {
@@ -1117,6 +1461,7 @@ int vlog_get_default_loglevel(void)
 }
 
 
+/* Slow path of __vlog_early_filter for log ids beyond the threshold table */
 int vlog_early_filter(vlog_id_t module, vlog_level_t level)
 {
     // filter out non-error levels if the level is not activated for this module
@@ -1129,8 +1474,13 @@ int vlog_early_filter(vlog_id_t module, vlog_level_t level)
     return 0;
 }
 
-void vlog_set_default_tags(const char *file, int line, const char *function)
+void vlog_set_default_tags(vlog_id_t module, vlog_level_t level, const char *file, int line, const char *function)
 {
+    vlog_trace_module = module;
+    vlog_trace_site = NULL;
+    vlog_kvs_clear();
+    vlog_tags.TAG_LEVEL = level;
+
     //char *filename = strrchr(file, '/');
 
     //vlog_tags_set_TAG_FILE_PATH(file);
@@ -1142,6 +1492,53 @@ void vlog_set_default_tags(const char *file, int line, const char *function)
     //    vlog_tags_set_TAG_FILE_NAME(filename+1);
 }
 
+void __vlog_set_callsite(vlog_callsite_t *site, vlog_id_t module, vlog_level_t level)
+{
+    __atomic_fetch_add(&site->hits, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&site->module, module, __ATOMIC_RELAXED);
+
+    vlog_set_default_tags(module, level, site->file, site->line, site->func);
+    vlog_trace_site = site;
+}
+
+void vlog_kv(const char *key, vlog_kv_type_t type, ...)
+{
+    vlog_kv_t *kv;
+    va_list ap;
+
+    if (key == NULL || vlog_kvs.count >= VLOG_MAX_KV)
+        return;
+
+    kv = &vlog_kvs.kv[vlog_kvs.count];
+    kv->key = key;
+    kv->type = type;
+
+    va_start(ap, type);
+    switch (type) {
+    case VLOG_KV_STR:
+        kv->val.s = va_arg(ap, const char *);
+        break;
+    case VLOG_KV_INT:
+        kv->val.i = va_arg(ap, long long);
+        break;
+    case VLOG_KV_UINT:
+        kv->val.u = va_arg(ap, unsigned long long);
+        break;
+    case VLOG_KV_DOUBLE:
+        kv->val.d = va_arg(ap, double);
+        break;
+    case VLOG_KV_BOOL:
+        kv->val.i = va_arg(ap, int);
+        break;
+    default:
+        va_end(ap);
+        return;
+    }
+    va_end(ap);
+
+    vlog_kvs.count++;
+}
+
 void vlog_set_static_tags(void)
 {
     //vlog_tags_set_TAG_APP_NAME(vloop_get_application_name());
@@ -1251,6 +1648,56 @@ int vlog_reset_syslog_config(vlog_category_t syslog_category)
     return 0;
 }
 
+int vlog_set_syslog_destination(const char *addr, int port, vlog_syslog_transport_t transport)
+{
+    vlog_syslog_type_t *handle = &log_config.m_ysyslog;
+    int ret = 0;
+
+    if (addr == NULL || strlen(addr) >= sizeof(handle->local_addr) ||
+        (addr[0] != '/' && (port <= 0 || port > 65535)) ||
+        (transport != VLOG_SYSLOG_DGRAM && transport != VLOG_SYSLOG_STREAM)) {
+        vapi_error("invalid syslog destination %s:%d", addr ? addr : "(null)", port);
+        return -1;
+    }
+
+    vmutex_lock(&vlog_config_lock);
+
+    /* switched under the handle mutex, concurrent traces go to the old or to the new destination */
+    if (log_config.m_logsys) {
+        ret = vlog_syslog_reopen(handle, addr, port, transport);
+        if (ret != 0)
+            log_config.m_logsys = 0;
+        goto exit_set_destination;
+    }
+
+    strcpy(handle->local_addr, addr);
+    handle->local_port = port;
+    handle->transport = transport;
+
+    /* vlog_init opens it otherwise */
+    if (!_log_is_initialized())
+        goto exit_set_destination;
+
+    ret = vlog_syslog_init(handle);
+    if (ret == 0) {
+        log_config.m_logsys = 1;
+        log_config.m_destinit[VLOG_SYSLOG_INDEX] = 1;
+    }
+
+exit_set_destination:
+    vmutex_unlock(&vlog_config_lock);
+
+    return (ret == 0) ? 0 : -1;
+}
+
+void vlog_get_syslog_stats(vlog_syslog_stats_t *stats)
+{
+    if (stats == NULL)
+        return;
+
+    vlog_syslog_get_stats(&log_config.m_ysyslog, stats);
+}
+
 int vlog_print_error_enabled(void)
 {
     return (log_config.m_errorfile > 0);
@@ -0,0 +1,546 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* pthread_setname_np */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <libvapi/vlog.h>
+#include <libvapi/vlog_async.h>
+#include <libvapi/vlist.h>
+
+#include "vlog_core.h"
+#include "vlog_vapi.h"
+
+#define VLOG_ASYNC_TEXT_SIZE        VLOG_ASYNC_RECORD_SIZE
+#define VLOG_ASYNC_MIN_RECORDS      16
+#define VLOG_ASYNC_MAX_RECORDS      65536
+#define VLOG_ASYNC_CONSOLE_BATCH    16384
+#define VLOG_ASYNC_IDLE_MS          100
+#define VLOG_ASYNC_FLUSH_TIMEOUT_MS 5000
+
+typedef struct {
+    uint64_t ts;            /* monotonic ns, orders records across rings */
+    uint8_t output;
+    uint8_t level;
+    uint16_t syslog_pri;
+    uint16_t len;
+    char text[VLOG_ASYNC_TEXT_SIZE] __attribute__((aligned(8)));   /* may hold a binary record */
+} vlog_async_record_t;
+
+/* Single producer (owning thread), single consumer (writer thread, or crash handler). */
+typedef struct vlog_async_ring {
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t tail __attribute__((aligned(64)));
+    uint32_t mask;
+    unsigned long dropped;
+    int orphan;             /* owning thread exited, free once drained */
+    vlist_t node;
+    vlog_async_record_t records[];
+} vlog_async_ring_t;
+
+static struct {
+    volatile int enabled;
+    volatile int running;
+    vlog_async_policy_t policy;
+    uint32_t ring_records;
+    pthread_t writer;
+    pthread_mutex_t lock;           /* protects ring list and writer wakeup, never held for I/O */
+    pthread_cond_t cond;
+    int writer_sleeping;
+    int producers;                  /* threads inside vlog_async_push_record, for stop */
+    pthread_key_t ring_key;
+    int atexit_registered;
+    vlist_t rings;
+    unsigned int nr_rings;
+    unsigned long written;
+    unsigned long dropped;          /* drops of already released rings */
+    unsigned long sync;
+} vlog_async = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .rings = ELIST_INITIALIZER(vlog_async.rings),
+};
+
+static __thread vlog_async_ring_t *vlog_async_thread_ring = NULL;
+static __thread int vlog_async_is_writer = 0;
+static __thread int vlog_async_thread_exited = 0;
+
+/* Rings drained by the writer, copied from the list under the lock. Writer only. */
+static vlog_async_ring_t **vlog_async_snapshot = NULL;
+static unsigned int vlog_async_snapshot_size = 0;
+
+static inline uint64_t vlog_async_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void vlog_async_ring_release(void *arg)
+{
+    vlog_async_ring_t *ring = (vlog_async_ring_t *)arg;
+
+    /* Later TLS destructors may log: they go out synchronously, not to the released ring. */
+    vlog_async_thread_ring = NULL;
+    vlog_async_thread_exited = 1;
+
+    /* The writer frees the ring once it has been drained. */
+    __atomic_store_n(&ring->orphan, 1, __ATOMIC_RELEASE);
+}
+
+__attribute__ ((constructor)) static void vlog_async_constructor(void)
+{
+    pthread_key_create(&vlog_async.ring_key, vlog_async_ring_release);
+}
+
+static vlog_async_ring_t *vlog_async_get_ring(void)
+{
+    vlog_async_ring_t *ring = vlog_async_thread_ring;
+
+    if (ring != NULL || vlog_async_thread_exited)
+        return ring;
+
+    /* Plain malloc: vmem may log, and this runs inside the log path. */
+    ring = calloc(1, sizeof(*ring) + vlog_async.ring_records * sizeof(vlog_async_record_t));
+    if (ring == NULL)
+        return NULL;
+
+    ring->mask = vlog_async.ring_records - 1;
+    vlist_init(&ring->node);
+
+    pthread_mutex_lock(&vlog_async.lock);
+    vlist_add_tail(&vlog_async.rings, &ring->node);
+    vlog_async.nr_rings++;
+    pthread_mutex_unlock(&vlog_async.lock);
+
+    pthread_setspecific(vlog_async.ring_key, ring);
+    vlog_async_thread_ring = ring;
+
+    return ring;
+}
+
+static void vlog_async_wakeup(void)
+{
+    /* Pairs with the fence of the writer going to sleep: either it sees the record, or we see the flag. */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&vlog_async.writer_sleeping, __ATOMIC_RELAXED))
+        return;
+
+    pthread_mutex_lock(&vlog_async.lock);
+    pthread_cond_signal(&vlog_async.cond);
+    pthread_mutex_unlock(&vlog_async.lock);
+}
+
+int vlog_async_enabled(void)
+{
+    return __atomic_load_n(&vlog_async.enabled, __ATOMIC_RELAXED) && !vlog_async_is_writer;
+}
+
+int vlog_async_push(vlog_output_t output, int syslog_pri, vlog_level_t level, const char *str)
+{
+    return vlog_async_push_record(output, syslog_pri, level, str, strlen(str));
+}
+
+int vlog_async_push_record(vlog_output_t output, int syslog_pri, vlog_level_t level, const void *data, size_t len)
+{
+    vlog_async_ring_t *ring;
+    vlog_async_record_t *rec;
+    uint32_t head, tail;
+
+    if (vlog_async_is_writer)
+        goto sync;
+
+    /* Announced before checking running: vlog_async_stop waits for us before its last drain. */
+    __atomic_fetch_add(&vlog_async.producers, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&vlog_async.running, __ATOMIC_SEQ_CST))
+        goto sync_leave;
+
+    ring = vlog_async_get_ring();
+    if (ring == NULL)
+        goto sync_leave;
+
+    head = ring->head;
+    for (;;) {
+        tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if ((head - tail) <= ring->mask)
+            break;
+
+        switch (vlog_async.policy) {
+        case VLOG_ASYNC_DROP_NEW:
+            __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_sub(&vlog_async.producers, 1, __ATOMIC_RELEASE);
+            return 0;
+        case VLOG_ASYNC_DROP_OLD:
+            /* Competes with the writer for the oldest record. */
+            if (__atomic_compare_exchange_n(&ring->tail, &tail, tail + 1, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+            break;
+        case VLOG_ASYNC_BLOCK:
+        default:
+            if (!__atomic_load_n(&vlog_async.running, __ATOMIC_RELAXED))
+                goto sync_leave;
+            vlog_async_wakeup();
+            usleep(50);
+            break;
+        }
+    }
+
+    rec = &ring->records[head & ring->mask];
+    if (len >= sizeof(rec->text))
+        len = sizeof(rec->text) - 1;
+
+    rec->ts = vlog_async_now();
+    rec->output = output;
+    rec->level = level;
+    rec->syslog_pri = syslog_pri;
+    rec->len = len;
+    memcpy(rec->text, data, len);
+    rec->text[len] = '\0';
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    __atomic_fetch_sub(&vlog_async.producers, 1, __ATOMIC_RELEASE);
+
+    vlog_async_wakeup();
+
+    return 0;
+
+sync_leave:
+    __atomic_fetch_sub(&vlog_async.producers, 1, __ATOMIC_RELEASE);
+sync:
+    __atomic_fetch_add(&vlog_async.sync, 1, __ATOMIC_RELAXED);
+    return -1;
+}
+
+/* Copy out the oldest record of a ring. Returns 0 if the ring is empty. */
+static int vlog_async_ring_peek(vlog_async_ring_t *ring, uint32_t *tail)
+{
+    *tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    return *tail != __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
+
+static void vlog_async_console_flush(char *batch, size_t *batch_len)
+{
+    if (*batch_len == 0)
+        return;
+
+    fwrite(batch, 1, *batch_len, stdout);
+    fflush(stdout);
+    *batch_len = 0;
+}
+
+/* Whether a ring holds records. Called with vlog_async.lock held. */
+static int vlog_async_pending(void)
+{
+    vlog_async_ring_t *ring;
+    vlist_t *node;
+    uint32_t tail;
+
+    vlist_foreach(&vlog_async.rings, node) {
+        ring = container_of(vlog_async_ring_t, node, node);
+        if (vlog_async_ring_peek(ring, &tail))
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Copy the ring list for a drain, and free the drained rings of exited threads.
+ * Only the drainer frees rings, so the copied pointers stay valid without the lock.
+ */
+static unsigned int vlog_async_take_snapshot(void)
+{
+    vlog_async_ring_t *ring, **snapshot;
+    unsigned int count = 0;
+    vlist_t *node;
+    uint32_t tail;
+
+    pthread_mutex_lock(&vlog_async.lock);
+
+    vlist_foreach(&vlog_async.rings, node) {
+        ring = container_of(vlog_async_ring_t, node, node);
+        if (__atomic_load_n(&ring->orphan, __ATOMIC_ACQUIRE) && !vlog_async_ring_peek(ring, &tail)) {
+            vlog_async.dropped += ring->dropped;
+            vlist_delete(&ring->node);
+            vlog_async.nr_rings--;
+            free(ring);
+        }
+    }
+
+    if (vlog_async.nr_rings > vlog_async_snapshot_size) {
+        snapshot = realloc(vlog_async_snapshot, vlog_async.nr_rings * 2 * sizeof(*snapshot));
+        if (snapshot != NULL) {
+            vlog_async_snapshot = snapshot;
+            vlog_async_snapshot_size = vlog_async.nr_rings * 2;
+        }
+    }
+
+    vlist_foreach(&vlog_async.rings, node) {
+        if (count == vlog_async_snapshot_size)
+            break;
+        vlog_async_snapshot[count++] = container_of(vlog_async_ring_t, node, node);
+    }
+
+    pthread_mutex_unlock(&vlog_async.lock);
+
+    return count;
+}
+
+/* Drain all rings in timestamp order, without holding vlog_async.lock. */
+static unsigned long vlog_async_drain(void)
+{
+    static char batch[VLOG_ASYNC_CONSOLE_BATCH];
+    size_t batch_len = 0;
+    unsigned long count = 0;
+    vlog_async_record_t rec;
+    vlog_async_ring_t *ring, *oldest;
+    unsigned int nr_rings, i;
+    uint32_t tail, oldest_tail = 0;
+
+    nr_rings = vlog_async_take_snapshot();
+
+    for (;;) {
+        oldest = NULL;
+
+        for (i = 0; i < nr_rings; i++) {
+            ring = vlog_async_snapshot[i];
+            if (!vlog_async_ring_peek(ring, &tail))
+                continue;
+            if ((oldest == NULL) ||
+                (ring->records[tail & ring->mask].ts < oldest->records[oldest_tail & oldest->mask].ts)) {
+                oldest = ring;
+                oldest_tail = tail;
+            }
+        }
+
+        if (oldest == NULL)
+            break;
+
+        memcpy(&rec, &oldest->records[oldest_tail & oldest->mask], sizeof(rec));
+
+        /* Lost the record to a VLOG_ASYNC_DROP_OLD producer while copying it. */
+        if (!__atomic_compare_exchange_n(&oldest->tail, &oldest_tail, oldest_tail + 1, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            continue;
+
+        rec.text[sizeof(rec.text) - 1] = '\0';
+
+        if (rec.output == VLOG_DEFERRED_INDEX) {
+            vlog_deferred_write(rec.ts, rec.text, rec.len);
+        } else if (rec.output == VLOG_CONSOLE_INDEX) {
+            if (batch_len + rec.len > sizeof(batch))
+                vlog_async_console_flush(batch, &batch_len);
+            memcpy(&batch[batch_len], rec.text, rec.len);
+            batch_len += rec.len;
+        } else {
+            vlog_output_write(rec.output, rec.syslog_pri, rec.level, rec.text);
+        }
+        count++;
+    }
+
+    vlog_async_console_flush(batch, &batch_len);
+    vlog_output_flush(VLOG_SYSLOG_INDEX);
+    vlog_output_flush(VLOG_TNDD_INDEX);
+    vlog_deferred_flush();
+
+    __atomic_fetch_add(&vlog_async.written, count, __ATOMIC_RELAXED);
+
+    return count;
+}
+
+static void *vlog_async_writer(void *arg)
+{
+    struct timespec deadline;
+
+    vlog_async_is_writer = 1;
+
+    while (__atomic_load_n(&vlog_async.running, __ATOMIC_ACQUIRE)) {
+        if (vlog_async_drain() != 0)
+            continue;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += VLOG_ASYNC_IDLE_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        pthread_mutex_lock(&vlog_async.lock);
+        __atomic_store_n(&vlog_async.writer_sleeping, 1, __ATOMIC_RELAXED);
+        /* Recheck after announcing sleep, a producer may have missed the flag. */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (vlog_async.running && !vlog_async_pending())
+            pthread_cond_timedwait(&vlog_async.cond, &vlog_async.lock, &deadline);
+        __atomic_store_n(&vlog_async.writer_sleeping, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&vlog_async.lock);
+    }
+
+    /* Final drain on stop. */
+    vlog_async_drain();
+
+    return NULL;
+}
+
+static void vlog_async_atexit(void)
+{
+    vlog_async_stop();
+}
+
+int vlog_async_start(unsigned int ring_records, vlog_async_policy_t policy)
+{
+    uint32_t size = VLOG_ASYNC_MIN_RECORDS;
+
+    if (vlog_async.running)
+        return 0;
+
+    if (ring_records > VLOG_ASYNC_MAX_RECORDS) {
+        vapi_error("async log ring size %u exceeds %u records", ring_records, VLOG_ASYNC_MAX_RECORDS);
+        return -1;
+    }
+
+    while (size < ring_records)
+        size <<= 1;
+
+    /* Rings of a previous run have another size: only reuse when drained and matching. */
+    if (vlog_async.nr_rings != 0 && vlog_async.ring_records != size) {
+        vapi_error("async log ring size cannot change while rings are allocated");
+        return -1;
+    }
+
+    vlog_async.ring_records = size;
+    vlog_async.policy = policy;
+    vlog_async.running = 1;
+
+    if (pthread_create(&vlog_async.writer, NULL, vlog_async_writer, NULL) != 0) {
+        vlog_async.running = 0;
+        vapi_error("failed to create async log writer: %s", strerror(errno));
+        return -1;
+    }
+    pthread_setname_np(vlog_async.writer, "vlog_writer");
+
+    if (!vlog_async.atexit_registered) {
+        atexit(vlog_async_atexit);
+        vlog_async.atexit_registered = 1;
+    }
+
+    __atomic_store_n(&vlog_async.enabled, 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+void vlog_async_stop(void)
+{
+    if (!vlog_async.running)
+        return;
+
+    /* New records go out synchronously from here on. */
+    __atomic_store_n(&vlog_async.enabled, 0, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&vlog_async.lock);
+    __atomic_store_n(&vlog_async.running, 0, __ATOMIC_SEQ_CST);
+    pthread_cond_signal(&vlog_async.cond);
+    pthread_mutex_unlock(&vlog_async.lock);
+
+    pthread_join(vlog_async.writer, NULL);
+
+    /* Producers which saw running before it dropped may still be pushing: wait, then drain them. */
+    while (__atomic_load_n(&vlog_async.producers, __ATOMIC_ACQUIRE) != 0)
+        usleep(10);
+    vlog_async_drain();
+}
+
+int vlog_async_flush(void)
+{
+    vlog_async_ring_t *ring;
+    vlist_t *node;
+    uint32_t tail;
+    int pending, waited_ms = 0;
+
+    if (!vlog_async.running || vlog_async_is_writer)
+        return 0;
+
+    for (;;) {
+        pending = 0;
+
+        pthread_mutex_lock(&vlog_async.lock);
+        vlist_foreach(&vlog_async.rings, node) {
+            ring = container_of(vlog_async_ring_t, node, node);
+            if (vlog_async_ring_peek(ring, &tail))
+                pending = 1;
+        }
+        pthread_cond_signal(&vlog_async.cond);
+        pthread_mutex_unlock(&vlog_async.lock);
+
+        if (!pending)
+            return 0;
+
+        if (waited_ms++ >= VLOG_ASYNC_FLUSH_TIMEOUT_MS)
+            return -1;
+
+        usleep(1000);
+    }
+}
+
+void vlog_async_set_policy(vlog_async_policy_t policy)
+{
+    vlog_async.policy = policy;
+}
+
+void vlog_async_get_stats(vlog_async_stats_t *stats)
+{
+    vlog_async_ring_t *ring;
+    vlist_t *node;
+
+    if (stats == NULL)
+        return;
+
+    pthread_mutex_lock(&vlog_async.lock);
+
+    stats->written = __atomic_load_n(&vlog_async.written, __ATOMIC_RELAXED);
+    stats->sync = __atomic_load_n(&vlog_async.sync, __ATOMIC_RELAXED);
+    stats->dropped = vlog_async.dropped;
+    stats->rings = vlog_async.nr_rings;
+    vlist_foreach(&vlog_async.rings, node) {
+        ring = container_of(vlog_async_ring_t, node, node);
+        stats->dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&vlog_async.lock);
+}
+
+/*
+ * Called from the fatal signal handlers: hand the pending console and log file
+ * records straight to their outputs. No locks, no stdio.
+ */
+void vlog_async_flush_asyncsignalsafe(void)
+{
+    vlog_async_ring_t *ring;
+    vlog_async_record_t *rec;
+    vlist_t *node;
+    uint32_t tail;
+
+    if (!vlog_async.running)
+        return;
+
+    vlist_foreach(&vlog_async.rings, node) {
+        ring = container_of(vlog_async_ring_t, node, node);
+        while (vlog_async_ring_peek(ring, &tail)) {
+            rec = &ring->records[tail & ring->mask];
+            if (rec->len < sizeof(rec->text))
+                vlog_output_write_asyncsignalsafe(rec->output, rec->text, rec->len);
+            if (!__atomic_compare_exchange_n(&ring->tail, &tail, tail + 1, 0,
+                                             __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                break;
+        }
+    }
+}
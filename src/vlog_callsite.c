@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <libvapi/vlog.h>
+
+#include "vlog_core.h"
+#include "vlog_vapi.h"
+
+#define VLOG_CALLSITE_MAX_RANGES    64      /* executable and shared objects using vlog */
+
+/* Call site section of one executable or shared object */
+typedef struct {
+    vlog_callsite_t *start;
+    vlog_callsite_t *stop;
+} vlog_callsite_range_t;
+
+static struct {
+    pthread_mutex_t lock;
+    vlog_callsite_range_t ranges[VLOG_CALLSITE_MAX_RANGES];
+    unsigned int count;
+} vlog_callsite_table = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .count = 0,
+};
+
+/* Called once by the constructor of each executable or shared object, a range is kept once */
+void __vlog_callsites_register(vlog_callsite_t *start, vlog_callsite_t *stop)
+{
+    unsigned int i;
+
+    if (start == NULL || stop <= start)
+        return;
+
+    pthread_mutex_lock(&vlog_callsite_table.lock);
+
+    for (i = 0; i < vlog_callsite_table.count; i++) {
+        if (vlog_callsite_table.ranges[i].start == start)
+            break;
+    }
+
+    if (i == vlog_callsite_table.count && i < VLOG_CALLSITE_MAX_RANGES) {
+        vlog_callsite_table.ranges[i].start = start;
+        vlog_callsite_table.ranges[i].stop = stop;
+        vlog_callsite_table.count++;
+    }
+
+    pthread_mutex_unlock(&vlog_callsite_table.lock);
+}
+
+/* Called by the destructor of the object when it is unloaded */
+void __vlog_callsites_unregister(vlog_callsite_t *start)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&vlog_callsite_table.lock);
+
+    for (i = 0; i < vlog_callsite_table.count; i++) {
+        if (vlog_callsite_table.ranges[i].start == start) {
+            vlog_callsite_table.ranges[i] = vlog_callsite_table.ranges[--vlog_callsite_table.count];
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&vlog_callsite_table.lock);
+}
+
+void vlog_callsites_foreach(void (*cb)(vlog_callsite_t *site, void *arg), void *arg)
+{
+    vlog_callsite_t *site;
+    unsigned int i;
+
+    pthread_mutex_lock(&vlog_callsite_table.lock);
+
+    for (i = 0; i < vlog_callsite_table.count; i++) {
+        for (site = vlog_callsite_table.ranges[i].start; site < vlog_callsite_table.ranges[i].stop; site++)
+            cb(site, arg);
+    }
+
+    pthread_mutex_unlock(&vlog_callsite_table.lock);
+}
+
+/* The path of the site is file, or ends with "/file" */
+static int vlog_callsite_match_file(const vlog_callsite_t *site, const char *file)
+{
+    size_t len = strlen(site->file);
+    size_t flen = strlen(file);
+
+    if (flen > len)
+        return 0;
+    if (flen == len)
+        return strcmp(site->file, file) == 0;
+
+    return site->file[len - flen - 1] == '/' && strcmp(site->file + len - flen, file) == 0;
+}
+
+int vlog_callsite_set(const char *file, int line, vlog_callsite_state_t state)
+{
+    vlog_callsite_t *site;
+    unsigned int i;
+    int count = 0;
+
+    if (file == NULL || line < 0 || state > VLOG_CALLSITE_OFF) {
+        vapi_error("invalid call site %s:%d state %d", file ? file : "(null)", line, state);
+        return -1;
+    }
+
+    pthread_mutex_lock(&vlog_callsite_table.lock);
+
+    for (i = 0; i < vlog_callsite_table.count; i++) {
+        for (site = vlog_callsite_table.ranges[i].start; site < vlog_callsite_table.ranges[i].stop; site++) {
+            if ((line != 0 && site->line != line) || !vlog_callsite_match_file(site, file))
+                continue;
+            __atomic_store_n(&site->flags, state, __ATOMIC_RELAXED);
+            count++;
+        }
+    }
+
+    pthread_mutex_unlock(&vlog_callsite_table.lock);
+
+    return count;
+}
+
+/* Copy the format on one line, with its control characters escaped */
+static void vlog_callsite_escape(char *buf, size_t size, const char *fmt)
+{
+    size_t len = 0;
+
+    for (; *fmt != '\0' && len + 3 < size; fmt++) {
+        if (*fmt == '\n' || *fmt == '\t' || *fmt == '"' || *fmt == '\\') {
+            buf[len++] = '\\';
+            buf[len++] = (*fmt == '\n') ? 'n' : (*fmt == '\t') ? 't' : *fmt;
+        } else if ((unsigned char)*fmt >= ' ') {
+            buf[len++] = *fmt;
+        }
+    }
+    buf[len] = '\0';
+}
+
+void vlog_callsites_dump(const char *file, void (*print_cb)(void *cb_arg, const char *line), void *cb_arg)
+{
+    static const char *states[] = { "default", "on", "off" };
+    const char *name, *level;
+    vlog_callsite_t *site;
+    vlog_id_t module;
+    unsigned char flags;
+    char fmt[128];
+    char line[VLOG_MAX_FILENAME + VLOG_MAX_MOD_NAME + sizeof(fmt) + 128];
+    unsigned int i;
+
+    pthread_mutex_lock(&vlog_callsite_table.lock);
+
+    for (i = 0; i < vlog_callsite_table.count; i++) {
+        for (site = vlog_callsite_table.ranges[i].start; site < vlog_callsite_table.ranges[i].stop; site++) {
+            if (file != NULL && strstr(site->file, file) == NULL)
+                continue;
+
+            module = __atomic_load_n(&site->module, __ATOMIC_RELAXED);
+            name = (module != (vlog_id_t)-1) ? vlog_module_get_name(module) : NULL;
+            level = (site->level >= 0) ? vlog_level_to_str(site->level) : NULL;
+            flags = __atomic_load_n(&site->flags, __ATOMIC_RELAXED);
+            vlog_callsite_escape(fmt, sizeof(fmt), site->fmt ? site->fmt : "");
+
+            snprintf(line, sizeof(line), "%s:%d %s() | %-16s | %-14s | %-7s | hits=%lu \"%s\"",
+                     site->file, site->line, site->func, name ? name : "-", level ? level : "-",
+                     states[flags <= VLOG_CALLSITE_OFF ? flags : 0],
+                     __atomic_load_n(&site->hits, __ATOMIC_RELAXED), fmt);
+            print_cb(cb_arg, line);
+        }
+    }
+
+    pthread_mutex_unlock(&vlog_callsite_table.lock);
+}
@@ -124,6 +124,9 @@ int vlog_output_set_max_files(int id, int value);
 int vlog_output_cleanup_files(int id);
 
 void vlog_output_trace(const char *span_name, const char *msg);
+void vlog_output_write(vlog_output_t output_index, int syslog_pri, vlog_level_t level, const char *str);
+void vlog_output_flush(vlog_output_t output_index);
+int vlog_output_write_asyncsignalsafe(vlog_output_t output_index, const char *str, size_t len);
 void vlog_output_error_record(const char *msg, vlog_level_t level, unsigned long type, const char *app, const char *file, int line);
 ptrdiff_t vlog_strn_cleanup_and_trim(char *str, ptrdiff_t max_chars);
 
@@ -147,6 +150,36 @@ void vlog_print_error_asyncsignalsafe(const char *str);
 
 void vlog_set_static_tags(void);
 
+/* ts is the wall clock time of the trace, NULL for now */
+void vlog_output_message(vlog_id_t module, vlog_level_t level, const struct timespec *ts, const char *msg);
+
+/* flight recorder, see vlog_flightrec.h */
+extern int vlog_flightrec_floor;
+void vlog_flightrec_record(vlog_level_t level, const char *msg, size_t len);
+void vlog_flightrec_dump_asyncsignalsafe(void);
+void vlog_update_module_thresholds(void);
+int vlog_module_output_enabled(vlog_id_t module, vlog_level_t level);
+void vlog_write_error_asyncsignalsafe(const char *str, size_t len);
+
+/* Call cb on each call site of the loaded objects, with the call site table locked */
+void vlog_callsites_foreach(void (*cb)(vlog_callsite_t *site, void *arg), void *arg);
+
+/* Drop a formatted trace repeating the previous one of its call site, see vlog_ratelimit.c */
+int vlog_ratelimit_filter(const char *span_name, const char *msg);
+
+/* asynchronous output, see vlog_async.h */
+#define VLOG_ASYNC_RECORD_SIZE  (VLOG_MAX_TAGS_SIZE + VLOG_MAX_MSG_SIZE)
+#define VLOG_DEFERRED_INDEX     VLOG_DEST_MAX   /* ring record holding a deferred binary record */
+
+int vlog_async_enabled(void);
+int vlog_async_push(vlog_output_t output_index, int syslog_pri, vlog_level_t level, const char *str);
+int vlog_async_push_record(vlog_output_t output_index, int syslog_pri, vlog_level_t level, const void *data, size_t len);
+void vlog_async_flush_asyncsignalsafe(void);
+
+/* deferred records, see vlog_deferred.h; called by the asynchronous writer */
+void vlog_deferred_write(uint64_t ts, const void *data, size_t len);
+void vlog_deferred_flush(void);
+
 int vlog_output_enabled(int output);
 
 int vlog_print_error_enabled(void);
@@ -1,13 +1,22 @@
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <libvapi/vdbg.h>
 #include <libvapi/vlog.h>
 #include <libvapi/vtnd.h>
+#include <libvapi/vlog_async.h>
+#include <libvapi/vlog_deferred.h>
+#include <libvapi/vlog_flightrec.h>
+#include <libvapi/vlog_span.h>
+#include <libvapi/vtnd_log.h>
 
 #include "vlog_core.h"
 #include "vlog_dbg.h"
+#include "vlog_deferred_decode.h"
 //#include "vlog_tags_filters_dbg.h"
 //#include "vlog_tags_dbg.h"
 
@@ -46,6 +55,9 @@ static void log_dbg_help(void *ctx)
     vdbg_printf("* filter       setting log tag filters\n");
     vdbg_printf("* tag          list existing tags\n");
     vdbg_printf("* cleanup      cleanup log files\n");
+    vdbg_printf("* deferred     deferred-formatting call sites and binary log\n");
+    vdbg_printf("* show         show log counters\n");
+    vdbg_printf("* flightrecorder  in-memory rings of the last traces per thread\n");
     vdbg_printf("...\n");
 }
 
@@ -63,6 +75,7 @@ static void get_help(void *ctx)
     vdbg_printf("* output max_files ID    prints the max nbr of files for file output ID\n");
     vdbg_printf("* output max_entries ID  prints the max nbr of entries for file output ID\n");
     vdbg_printf("* opentracing ID         prints the log details of vapi component ID\n");
+    vdbg_printf("* async                  prints the asynchronous output counters\n");
 }
 
 static void set_help(void *ctx)
@@ -76,15 +89,19 @@ static void set_help(void *ctx)
     vdbg_printf("* module loglevel ID VAL                     sets the loglevel to VAL for module ID\n");
     vdbg_printf("* output loglevel ID VAL                     sets the loglevel to VAL for output ID\n");
     vdbg_printf("* module format ID FORMAT                    sets the log format to FORMAT for module ID\n");
+    vdbg_printf("* module ratelimit ID RATE BURST             limits each call site of module ID to RATE traces/s, RATE 0 disables\n");
+    vdbg_printf("* module repeat ID 0|1                       disable/enable the suppression of repeated traces for module ID\n");
     vdbg_printf("* output format ID FORMAT                    sets the log format to FORMAT for output ID\n");
     vdbg_printf("* output max_files ID VAL                    sets the max nbr of files to VAL for file output ID\n");
     vdbg_printf("* output max_entries ID VAL                  sets the max nbr of entries to VAL for file output ID\n");
     vdbg_printf("* opentracing ID VLOG_ENABLED|VLOG_DISABLED  enable/disable opentracing logs for vapi component ID\n");
+    vdbg_printf("* callsite FILE[:LINE] on|off|default        traces the call sites of FILE at LINE (all lines if omitted) whatever the module level\n");
     vdbg_printf("\n");
     vdbg_printf("Format examples:\n");
     vdbg_printf("* [%%TAG_FILE_NAME:%%TAG_FILE_LINE] %%MSG\n");
     vdbg_printf("* @%%TIME %%MSG\n");
     vdbg_printf("* VLAN %%08TAG_VLAN - %%MSG\n");
+    vdbg_printf("* %%JSON  (one JSON object per line, with the key-values of vlog_printf_kv)\n");
 }
 
 static void log_cleanup_help(void *ctx)
@@ -98,6 +115,48 @@ static void log_cleanup_help(void *ctx)
     vdbg_printf("* output ID                            clean up the files for file output ID\n");
 }
 
+static void deferred_help(void *ctx)
+{
+    vdbg_printf("Log debug Help: deferred\n");
+    vdbg_printf("------------------------\n");
+    vdbg_printf("\n");
+    vdbg_printf("Usage: log deferred <params>\n");
+    vdbg_printf("\n");
+    vdbg_printf("Parameters:\n");
+    vdbg_printf("* sites                  prints the registered deferred call sites\n");
+    vdbg_printf("* open FILE              writes deferred records unformatted to binary log FILE\n");
+    vdbg_printf("* close                  closes the binary log, records go to the log outputs again\n");
+    vdbg_printf("* decode FILE            prints binary log FILE as text\n");
+}
+
+static void show_help(void *ctx)
+{
+    vdbg_printf("Log debug Help: show\n");
+    vdbg_printf("--------------------\n");
+    vdbg_printf("\n");
+    vdbg_printf("Usage: log show <params>\n");
+    vdbg_printf("\n");
+    vdbg_printf("Parameters:\n");
+    vdbg_printf("* ratelimit              prints the rate limits and the suppression counters per call site\n");
+    vdbg_printf("* callsites [FILE]       prints the call sites of files matching FILE, with their state and hit count\n");
+    vdbg_printf("* syslog                 prints the syslog output counters\n");
+    vdbg_printf("* tndd                   prints the tndd log client counters\n");
+    vdbg_printf("* spans                  prints the opentracing span counters\n");
+}
+
+static void flightrec_help(void *ctx)
+{
+    vdbg_printf("Log debug Help: flightrecorder\n");
+    vdbg_printf("------------------------------\n");
+    vdbg_printf("\n");
+    vdbg_printf("Usage: log flightrecorder <params>\n");
+    vdbg_printf("\n");
+    vdbg_printf("Parameters:\n");
+    vdbg_printf("* dump [KB]              prints the last KB of each thread ring, the whole rings by default\n");
+    vdbg_printf("* floor VAL              records the traces down to level VAL, VLOG_DISABLED stops recording\n");
+    vdbg_printf("* crash_dump KB          sets the KB of each ring written to the error records on a crash\n");
+}
+
 static void dump_maps_help(void *ctx)
 {
     vdbg_printf("Log debug Help: dump_maps\n" \
@@ -301,6 +360,52 @@ static int set_cmd_log_output_format_detail(char *cmd, char *args)
     return ret;
 }
 
+static int set_cmd_log_module_ratelimit_detail(char *cmd, char *args)
+{
+    int ret = 0;
+    char param1[VDBG_MAX_CMD_LEN] = "";
+    char param2[VDBG_MAX_CMD_LEN] = "";
+    char module[VDBG_MAX_CMD_LEN] = "";
+    char val1[VDBG_MAX_CMD_LEN] = "";
+    char val2[VDBG_MAX_CMD_LEN] = "";
+    vlog_id_t id = 0;
+
+    vdbg_scan_args(args, "%s %s %s %s %s", param1, param2, module, val1, val2);
+
+    id = get_id_from_string(module);
+
+    if (strlen(module) == 0 || (signed)id == -1) {
+        vdbg_printf("error: missing or unknown module [%s]\n", module);
+        ret = -1;
+    } else
+    if (strncmp("ratelimit", param2, VDBG_MAX_CMD_LEN) == 0) {
+        if (strlen(val1) == 0 || strlen(val2) == 0) {
+            vdbg_printf("error: missing rate or burst\n");
+            ret = -1;
+        } else {
+            ret = vlog_module_set_ratelimit(id, strtoul(val1, NULL, 0), strtoul(val2, NULL, 0));
+            if (ret != 0)
+                vdbg_printf("error: could not set rate limit for [%d]\n", (int)id);
+        }
+    } else {
+        if (strlen(val1) == 0) {
+            vdbg_printf("error: missing value\n");
+            ret = -1;
+        } else {
+            ret = vlog_module_set_repeat_suppression(id, atoi(val1));
+            if (ret != 0)
+                vdbg_printf("error: could not set repeat suppression for [%d]\n", (int)id);
+        }
+    }
+
+    if (ret != 0) {
+        vdbg_printf("Usage: log set module ratelimit ID RATE BURST\n");
+        vdbg_printf("       log set module repeat ID 0|1\n");
+    }
+
+    return ret;
+}
+
 /* set log module param */
 static int set_cmd_log_module_detail(char *cmd, char *args)
 {
@@ -336,6 +441,12 @@ static int set_cmd_log_module_detail(char *cmd, char *args)
                 vdbg_printf("error: could not set loglevel for [%d]\n", (int)id);
         }
     } else
+    if (strncmp("ratelimit", param2, VDBG_MAX_CMD_LEN) == 0) {
+        ret = set_cmd_log_module_ratelimit_detail(cmd, args);
+    } else
+    if (strncmp("repeat", param2, VDBG_MAX_CMD_LEN) == 0) {
+        ret = set_cmd_log_module_ratelimit_detail(cmd, args);
+    } else
     if (strncmp("format", param2, VDBG_MAX_CMD_LEN) == 0) {
         ret = set_cmd_log_module_format_detail(cmd, args);
     } else {
@@ -473,6 +584,50 @@ static int set_cmd_log_status_detail(char *cmd, char *args)
     return ret;
 }
 
+static int set_cmd_log_callsite_detail(char *cmd, char *args)
+{
+    char param1[VDBG_MAX_CMD_LEN] = "";
+    char file[VDBG_MAX_CMD_LEN] = "";
+    char state[VDBG_MAX_CMD_LEN] = "";
+    vlog_callsite_state_t val;
+    char *colon;
+    int line = 0;
+    int ret;
+
+    /* param1 equals "callsite" here */
+    vdbg_scan_args(args, "%s %s %s", param1, file, state);
+
+    if (strncmp("on", state, VDBG_MAX_CMD_LEN) == 0) {
+        val = VLOG_CALLSITE_ON;
+    } else if (strncmp("off", state, VDBG_MAX_CMD_LEN) == 0) {
+        val = VLOG_CALLSITE_OFF;
+    } else if (strncmp("default", state, VDBG_MAX_CMD_LEN) == 0) {
+        val = VLOG_CALLSITE_DEFAULT;
+    } else {
+        vdbg_printf("Usage: log set callsite FILE[:LINE] on|off|default\n");
+        return -1;
+    }
+
+    colon = strrchr(file, ':');
+    if (colon != NULL) {
+        *colon = '\0';
+        line = atoi(colon + 1);
+    }
+
+    if (strlen(file) == 0 || (colon != NULL && line <= 0)) {
+        vdbg_printf("Usage: log set callsite FILE[:LINE] on|off|default\n");
+        return -1;
+    }
+
+    ret = vlog_callsite_set(file, line, val);
+    if (ret < 0)
+        return -1;
+
+    vdbg_printf("%d call site(s) set %s\n", ret, state);
+
+    return 0;
+}
+
 /* main callback for setters */
 static int set_cmd(char *cmd, char *args, void *ctx)
 {
@@ -491,6 +646,8 @@ static int set_cmd(char *cmd, char *args, void *ctx)
         return set_cmd_log_output_detail(cmd, args);
     } else if (strncmp("opentracing", param1, VDBG_MAX_CMD_LEN) == 0) {
         return set_cmd_log_status_detail(cmd, args);
+    } else if (strncmp("callsite", param1, VDBG_MAX_CMD_LEN) == 0) {
+        return set_cmd_log_callsite_detail(cmd, args);
     } else {
         vdbg_printf("error: unkown parameter [%s]\n", param1);
         vdbg_printf("Usage: log set help\n");
@@ -698,6 +855,18 @@ static int get_cmd_log_status_detail(char *cmd, char *args, void *ctx)
     return 0;
 }
 
+static int get_cmd_log_async(void)
+{
+    vlog_async_stats_t stats;
+
+    vlog_async_get_stats(&stats);
+
+    vdbg_printf("written=%lu dropped=%lu sync=%lu rings=%u\n",
+                stats.written, stats.dropped, stats.sync, stats.rings);
+
+    return 0;
+}
+
 /* main callback for getters */
 static int get_cmd(char *cmd, char *args, void *ctx)
 {
@@ -718,6 +887,8 @@ static int get_cmd(char *cmd, char *args, void *ctx)
         return get_cmd_log_output_detail(cmd, args, ctx);
     } else if (strncmp("opentracing", param1, VDBG_MAX_CMD_LEN) == 0) {
         return get_cmd_log_status_detail(cmd, args, ctx);
+    } else if (strncmp("async", param1, VDBG_MAX_CMD_LEN) == 0) {
+        return get_cmd_log_async();
     } else {
         vdbg_printf("error: unkown parameter [%s]\n", param1);
         vdbg_printf("Usage: log get help");
@@ -774,6 +945,247 @@ static int log_cleanup_cmd(char *cmd, char *args, void *ctx)
     return 0;
 }
 
+static void deferred_print_line(void *cb_arg, const char *line)
+{
+    vdbg_printf("%s\n", line);
+}
+
+static int deferred_decode(const char *path)
+{
+    char *text = NULL, *line, *saveptr = NULL;
+    size_t size = 0;
+    FILE *out;
+    long count;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        vdbg_printf("error: cannot open [%s]\n", path);
+        return -1;
+    }
+
+    out = open_memstream(&text, &size);
+    if (out == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    count = vlog_deferred_decode(fd, out);
+    fclose(out);
+    close(fd);
+
+    for (line = strtok_r(text, "\n", &saveptr); line != NULL; line = strtok_r(NULL, "\n", &saveptr))
+        vdbg_printf("%s\n", line);
+    free(text);
+
+    if (count < 0) {
+        vdbg_printf("error: [%s] is not a valid binary log\n", path);
+        return -1;
+    }
+
+    vdbg_printf("%ld records\n", count);
+
+    return 0;
+}
+
+static int log_deferred_cmd(char *cmd, char *args, void *ctx)
+{
+    char param1[VDBG_MAX_CMD_LEN] = "";
+    char path[VDBG_MAX_CMD_LEN] = "";
+
+    vdbg_scan_args(args, "%s %s", param1, path);
+
+    if (strlen(param1) == 0) {
+        vdbg_printf("error: missing parameter\n");
+        return 0;
+    }
+
+    if (strncmp("sites", param1, VDBG_MAX_CMD_LEN) == 0) {
+        vlog_deferred_dump_sites(deferred_print_line, NULL);
+    } else if (strncmp("open", param1, VDBG_MAX_CMD_LEN) == 0 ||
+               strncmp("decode", param1, VDBG_MAX_CMD_LEN) == 0) {
+        if (strlen(path) == 0) {
+            vdbg_printf("error: missing file\n");
+            vdbg_printf("Usage: log deferred %s FILE\n", param1);
+            return -1;
+        }
+        if (param1[0] == 'd')
+            return deferred_decode(path);
+        if (vlog_deferred_open(path) != 0) {
+            vdbg_printf("error: cannot open binary log [%s]\n", path);
+            return -1;
+        }
+    } else if (strncmp("close", param1, VDBG_MAX_CMD_LEN) == 0) {
+        vlog_deferred_close();
+    } else {
+        vdbg_printf("error: unkown parameter [%s]\n", param1);
+        vdbg_printf("Usage: log deferred help");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void flightrec_print_line(void *cb_arg, const char *line, size_t len)
+{
+    vdbg_printf("%.*s", (int)len, line);
+}
+
+static int log_flightrec_cmd(char *cmd, char *args, void *ctx)
+{
+    char param1[VDBG_MAX_CMD_LEN] = "";
+    char value[VDBG_MAX_CMD_LEN] = "";
+    vlog_level_t lvl;
+
+    vdbg_scan_args(args, "%s %s", param1, value);
+
+    if (strlen(param1) == 0) {
+        vdbg_printf("floor: %s\n", vlog_level_to_str(vlog_flightrec_get_floor()));
+        return 0;
+    }
+
+    if (strncmp("dump", param1, VDBG_MAX_CMD_LEN) == 0) {
+        vlog_flightrec_dump(flightrec_print_line, NULL, strtoul(value, NULL, 0) * 1024);
+    } else if (strncmp("floor", param1, VDBG_MAX_CMD_LEN) == 0) {
+        lvl = get_loglevel_from_string(value);
+        if (strlen(value) == 0 || lvl == 0) {
+            vdbg_printf("error: missing or unknown level [%s]\n", value);
+            vdbg_printf("Usage: log flightrecorder floor VAL\n");
+            return -1;
+        }
+        if (vlog_flightrec_set_floor(lvl) != 0) {
+            vdbg_printf("error: could not set flight recorder floor\n");
+            return -1;
+        }
+    } else if (strncmp("crash_dump", param1, VDBG_MAX_CMD_LEN) == 0) {
+        if (strlen(value) == 0) {
+            vdbg_printf("error: missing size\n");
+            vdbg_printf("Usage: log flightrecorder crash_dump KB\n");
+            return -1;
+        }
+        vlog_flightrec_set_dump_size(strtoul(value, NULL, 0) * 1024);
+    } else {
+        vdbg_printf("error: unkown parameter [%s]\n", param1);
+        vdbg_printf("Usage: log flightrecorder help");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void show_print_line(void *cb_arg, const char *line)
+{
+    vdbg_printf("%s\n", line);
+}
+
+static int show_cmd_log_ratelimit(void)
+{
+    unsigned int rate, burst;
+    const char *name;
+    vlog_id_t id;
+    int repeat;
+
+    vdbg_printf("Module rate limits:\n");
+    for (id = 0; id < VLOG_MAX_MODULES; id++) {
+        name = vlog_module_get_name(id);
+        if (name == NULL || vlog_module_get_ratelimit(id, &rate, &burst, &repeat) != 0)
+            continue;
+        if (rate == 0 && !repeat)
+            continue;
+        vdbg_printf("%-16s rate=%u/s burst=%u repeat=%s\n", name, rate, burst, repeat ? "suppressed" : "kept");
+    }
+
+    vdbg_printf("\nCall sites:\n");
+    vlog_ratelimit_dump_sites(show_print_line, NULL);
+
+    return 0;
+}
+
+static int show_cmd_log_callsites(char *args)
+{
+    char param1[VDBG_MAX_CMD_LEN] = "";
+    char file[VDBG_MAX_CMD_LEN] = "";
+
+    vdbg_scan_args(args, "%s %s", param1, file);
+    vlog_callsites_dump(strlen(file) ? file : NULL, show_print_line, NULL);
+
+    return 0;
+}
+
+static int show_cmd_log_syslog(void)
+{
+    vlog_syslog_stats_t stats;
+
+    vlog_get_syslog_stats(&stats);
+
+    vdbg_printf("sent       : %lu\n", stats.sent);
+    vdbg_printf("batches    : %lu\n", stats.batches);
+    vdbg_printf("dropped    : %lu\n", stats.dropped);
+    vdbg_printf("retries    : %lu\n", stats.retries);
+    vdbg_printf("reconnects : %lu\n", stats.reconnects);
+
+    return 0;
+}
+
+static int show_cmd_log_tndd(void)
+{
+    vtnd_log_stats_t stats;
+
+    vtnd_log_client_get_stats(&stats);
+
+    vdbg_printf("records     : %lu\n", stats.records);
+    vdbg_printf("datagrams   : %lu\n", stats.datagrams);
+    vdbg_printf("shm records : %lu\n", stats.shm_records);
+    vdbg_printf("doorbells   : %lu\n", stats.doorbells);
+    vdbg_printf("dropped     : %lu\n", stats.dropped);
+
+    return 0;
+}
+
+static int show_cmd_log_spans(void)
+{
+    vlog_span_stats_t stats;
+
+    vlog_span_get_stats(&stats);
+
+    vdbg_printf("names      : %lu\n", stats.names);
+    vdbg_printf("spans      : %lu\n", stats.spans);
+    vdbg_printf("batches    : %lu\n", stats.batches);
+    vdbg_printf("dropped    : %lu\n", stats.dropped);
+
+    return 0;
+}
+
+static int log_show_cmd(char *cmd, char *args, void *ctx)
+{
+    char param1[VDBG_MAX_CMD_LEN] = "";
+
+    vdbg_scan_args(args, "%s", param1);
+
+    if (strlen(param1) == 0) {
+        vdbg_printf("error: missing parameter\n");
+        return 0;
+    }
+
+    if (strncmp("ratelimit", param1, VDBG_MAX_CMD_LEN) == 0) {
+        return show_cmd_log_ratelimit();
+    } else if (strncmp("callsites", param1, VDBG_MAX_CMD_LEN) == 0) {
+        return show_cmd_log_callsites(args);
+    } else if (strncmp("syslog", param1, VDBG_MAX_CMD_LEN) == 0) {
+        return show_cmd_log_syslog();
+    } else if (strncmp("tndd", param1, VDBG_MAX_CMD_LEN) == 0) {
+        return show_cmd_log_tndd();
+    } else if (strncmp("spans", param1, VDBG_MAX_CMD_LEN) == 0) {
+        return show_cmd_log_spans();
+    } else {
+        vdbg_printf("error: unkown parameter [%s]\n", param1);
+        vdbg_printf("Usage: log show help");
+        return -1;
+    }
+
+    return 0;
+}
+
 /****************************************************************************/
 /* initialize tnd module 'log' */
 int vlog_dbg_init_module(void)
@@ -786,6 +1198,9 @@ int vlog_dbg_init_module(void)
         //vdbg_link_cmd("log", "tag", vlog_tags_help_cb, vlog_tags_cmd_cb, NULL);
         vdbg_link_cmd("log", "cleanup", log_cleanup_help, log_cleanup_cmd, NULL);
         vdbg_link_cmd("log", "dump_maps", dump_maps_help, dump_maps_cb, NULL);
+        vdbg_link_cmd("log", "deferred", deferred_help, log_deferred_cmd, NULL);
+        vdbg_link_cmd("log", "show", show_help, log_show_cmd, NULL);
+        vdbg_link_cmd("log", "flightrecorder", flightrec_help, log_flightrec_cmd, NULL);
     }
 
     return 0;
@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <libvapi/vlog.h>
+#include <libvapi/vlog_async.h>
+#include <libvapi/vlog_deferred.h>
+
+#include "vlog_core.h"
+#include "vlog_vapi.h"
+#include "vlog_deferred_decode.h"
+
+#define VLOG_DEFERRED_FILE_BUF_SIZE     65536
+#define VLOG_DEFERRED_SITE_NONE         UINT32_MAX      /* id of sites beyond the site table */
+
+#if VLOG_ASYNC_RECORD_SIZE > VLOG_DEFERRED_STR_MAX
+#error "deferred string arguments may exceed VLOG_DEFERRED_STR_MAX"
+#endif
+
+static struct {
+    pthread_mutex_t lock;           /* protects registration and the binary file */
+    vlog_deferred_site_t *sites[VLOG_DEFERRED_MAX_SITES];
+    uint32_t nr_sites;              /* id 0 is never assigned */
+    int fd;
+    uint8_t site_written[VLOG_DEFERRED_MAX_SITES];
+    char buf[VLOG_DEFERRED_FILE_BUF_SIZE];
+    size_t buf_len;
+} vlog_deferred = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .nr_sites = 1,
+    .fd = -1,
+};
+
+static uint32_t vlog_deferred_register(vlog_deferred_site_t *site)
+{
+    uint32_t id;
+    int nargs;
+
+    pthread_mutex_lock(&vlog_deferred.lock);
+
+    id = site->id;
+    if (id != 0)
+        goto exit_register;
+
+    nargs = vlog_deferred_parse(site->fmt, site->types, VLOG_DEFERRED_MAX_ARGS);
+    site->nargs = (nargs < 0) ? -1 : nargs;
+
+    if (vlog_deferred.nr_sites < VLOG_DEFERRED_MAX_SITES) {
+        id = vlog_deferred.nr_sites++;
+        vlog_deferred.sites[id] = site;
+    } else {
+        id = VLOG_DEFERRED_SITE_NONE;
+        site->nargs = -1;
+    }
+
+    /* Publish the id last: it tells the other threads the site is ready. */
+    __atomic_store_n(&site->id, id, __ATOMIC_RELEASE);
+
+exit_register:
+    pthread_mutex_unlock(&vlog_deferred.lock);
+
+    return id;
+}
+
+void __vlog_deferred(vlog_deferred_site_t *site, vlog_id_t module, ...)
+{
+    uint8_t rec[VLOG_ASYNC_RECORD_SIZE - 1] __attribute__((aligned(8)));
+    vlog_deferred_hdr_t *hdr = (vlog_deferred_hdr_t *)rec;
+    size_t off = sizeof(*hdr);
+    uint32_t id;
+    va_list ap;
+    int i;
+
+    id = __atomic_load_n(&site->id, __ATOMIC_ACQUIRE);
+    if (id == 0)
+        id = vlog_deferred_register(site);
+
+    __atomic_fetch_add(&site->hits, 1, __ATOMIC_RELAXED);
+
+    /* Traces kept by the flight recorder are formatted right away into the ring of
+     * this thread, as are those of log ids which do not fit the record header. */
+    if (site->nargs < 0 || module > UINT16_MAX || !vlog_async_enabled() ||
+        !vlog_module_output_enabled(module, site->level) ||
+        site->level <= __atomic_load_n(&vlog_flightrec_floor, __ATOMIC_RELAXED))
+        goto sync;
+
+    va_start(ap, module);
+    for (i = 0; i < site->nargs; i++) {
+        switch (site->types[i]) {
+        case VLOG_DEFERRED_ARG_INT: {
+            int32_t v = va_arg(ap, int);
+            if (off + sizeof(v) > sizeof(rec))
+                goto truncated;
+            memcpy(&rec[off], &v, sizeof(v));
+            off += sizeof(v);
+            break;
+        }
+        case VLOG_DEFERRED_ARG_LONG:
+        case VLOG_DEFERRED_ARG_LLONG:
+        case VLOG_DEFERRED_ARG_PTR: {
+            int64_t v;
+            if (site->types[i] == VLOG_DEFERRED_ARG_LONG)
+                v = va_arg(ap, long);
+            else if (site->types[i] == VLOG_DEFERRED_ARG_LLONG)
+                v = va_arg(ap, long long);
+            else
+                v = (uintptr_t)va_arg(ap, void *);
+            if (off + sizeof(v) > sizeof(rec))
+                goto truncated;
+            memcpy(&rec[off], &v, sizeof(v));
+            off += sizeof(v);
+            break;
+        }
+        case VLOG_DEFERRED_ARG_DOUBLE: {
+            double v = va_arg(ap, double);
+            if (off + sizeof(v) > sizeof(rec))
+                goto truncated;
+            memcpy(&rec[off], &v, sizeof(v));
+            off += sizeof(v);
+            break;
+        }
+        case VLOG_DEFERRED_ARG_STR:
+        default: {
+            const char *s = va_arg(ap, const char *);
+            uint16_t len;
+            if (s == NULL)
+                s = "(null)";
+            if (off + sizeof(len) > sizeof(rec))
+                goto truncated;
+            len = strnlen(s, sizeof(rec) - off - sizeof(len));
+            memcpy(&rec[off], &len, sizeof(len));
+            memcpy(&rec[off + sizeof(len)], s, len);
+            off += sizeof(len) + len;
+            break;
+        }
+        }
+    }
+truncated:
+    va_end(ap);
+
+    hdr->site = id;
+    hdr->module = (uint16_t)module;
+    hdr->len = off - sizeof(*hdr);
+
+    if (vlog_async_push_record(VLOG_DEFERRED_INDEX, 0, site->level, rec, off) == 0)
+        return;
+
+sync:
+    vlog_set_default_tags(module, site->level, site->file, site->line, NULL);
+    va_start(ap, module);
+    __vlog_vprintf(site->fmt, ap);
+    va_end(ap);
+}
+
+/* Wall clock time of a record stamped with the monotonic clock when it was pushed */
+static void vlog_deferred_wallclock(uint64_t ts, struct timespec *wall)
+{
+    struct timespec mono, real;
+    uint64_t mono_ns, real_ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    mono_ns = (uint64_t)mono.tv_sec * 1000000000ULL + mono.tv_nsec;
+    real_ns = (uint64_t)real.tv_sec * 1000000000ULL + real.tv_nsec;
+
+    if (ts < mono_ns)
+        real_ns -= mono_ns - ts;
+
+    wall->tv_sec = real_ns / 1000000000ULL;
+    wall->tv_nsec = real_ns % 1000000000ULL;
+}
+
+static void vlog_deferred_flush_locked(void)
+{
+    size_t off = 0;
+    ssize_t ret;
+
+    while (off < vlog_deferred.buf_len) {
+        ret = write(vlog_deferred.fd, &vlog_deferred.buf[off], vlog_deferred.buf_len - off);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            vapi_error("binary log write failed [%s], %zu bytes lost",
+                       strerror(errno), vlog_deferred.buf_len - off);
+            break;
+        }
+        off += ret;
+    }
+
+    vlog_deferred.buf_len = 0;
+}
+
+static void vlog_deferred_append(const void *data, size_t len)
+{
+    if (vlog_deferred.buf_len + len > sizeof(vlog_deferred.buf))
+        vlog_deferred_flush_locked();
+
+    memcpy(&vlog_deferred.buf[vlog_deferred.buf_len], data, len);
+    vlog_deferred.buf_len += len;
+}
+
+void vlog_deferred_write(uint64_t ts, const void *data, size_t len)
+{
+    const vlog_deferred_hdr_t *hdr = (const vlog_deferred_hdr_t *)data;
+    const vlog_deferred_site_t *site;
+    vlog_deferred_file_site_t fsite;
+    vlog_deferred_file_record_t frec;
+    char msg[VLOG_MAX_MSG_SIZE];
+    struct timespec wall;
+    size_t args_len;
+
+    if (len < sizeof(*hdr) || hdr->site >= VLOG_DEFERRED_MAX_SITES)
+        return;
+
+    args_len = MIN(len - sizeof(*hdr), (size_t)hdr->len);
+
+    pthread_mutex_lock(&vlog_deferred.lock);
+
+    site = vlog_deferred.sites[hdr->site];
+    if (site == NULL)
+        goto exit_write;
+
+    if (vlog_deferred.fd < 0) {
+        pthread_mutex_unlock(&vlog_deferred.lock);
+        vlog_deferred_format(site->fmt, hdr + 1, args_len, msg, sizeof(msg));
+        vlog_deferred_wallclock(ts, &wall);
+        vlog_output_message(hdr->module, site->level, &wall, msg);
+        return;
+    }
+
+    if (!vlog_deferred.site_written[hdr->site]) {
+        fsite.type = VLOG_DEFERRED_ENTRY_SITE;
+        fsite.id = hdr->site;
+        fsite.level = site->level;
+        fsite.line = site->line;
+        fsite.fmt_len = strlen(site->fmt);
+        fsite.file_len = strlen(site->file);
+        vlog_deferred_append(&fsite, sizeof(fsite));
+        vlog_deferred_append(site->fmt, fsite.fmt_len);
+        vlog_deferred_append(site->file, fsite.file_len);
+        vlog_deferred.site_written[hdr->site] = 1;
+    }
+
+    frec.type = VLOG_DEFERRED_ENTRY_RECORD;
+    frec.ts = ts;
+    frec.hdr = *hdr;
+    frec.hdr.len = args_len;
+    vlog_deferred_append(&frec, sizeof(frec));
+    vlog_deferred_append(hdr + 1, args_len);
+
+exit_write:
+    pthread_mutex_unlock(&vlog_deferred.lock);
+}
+
+void vlog_deferred_flush(void)
+{
+    pthread_mutex_lock(&vlog_deferred.lock);
+    if (vlog_deferred.fd >= 0)
+        vlog_deferred_flush_locked();
+    pthread_mutex_unlock(&vlog_deferred.lock);
+}
+
+static void vlog_deferred_close_locked(void)
+{
+    if (vlog_deferred.fd < 0)
+        return;
+
+    vlog_deferred_flush_locked();
+    close(vlog_deferred.fd);
+    vlog_deferred.fd = -1;
+}
+
+int vlog_deferred_open(const char *path)
+{
+    vlog_deferred_file_hdr_t fhdr;
+    struct timespec mono, real;
+    int fd;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        vapi_error("failed to open binary log %s [%s]", path, strerror(errno));
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+
+    memcpy(fhdr.magic, VLOG_DEFERRED_MAGIC, VLOG_DEFERRED_MAGIC_SIZE);
+    fhdr.mono_ns = (uint64_t)mono.tv_sec * 1000000000ULL + mono.tv_nsec;
+    fhdr.real_ns = (uint64_t)real.tv_sec * 1000000000ULL + real.tv_nsec;
+
+    if (write(fd, &fhdr, sizeof(fhdr)) != sizeof(fhdr)) {
+        vapi_error("failed to write binary log header %s [%s]", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    pthread_mutex_lock(&vlog_deferred.lock);
+    vlog_deferred_close_locked();
+    vlog_deferred.fd = fd;
+    memset(vlog_deferred.site_written, 0, sizeof(vlog_deferred.site_written));
+    pthread_mutex_unlock(&vlog_deferred.lock);
+
+    return 0;
+}
+
+void vlog_deferred_close(void)
+{
+    /* Records still in the rings go to the file, not to the log outputs. */
+    vlog_async_flush();
+
+    pthread_mutex_lock(&vlog_deferred.lock);
+    vlog_deferred_close_locked();
+    pthread_mutex_unlock(&vlog_deferred.lock);
+}
+
+void vlog_deferred_dump_sites(void (*print_cb)(void *cb_arg, const char *line), void *cb_arg)
+{
+    const vlog_deferred_site_t *site;
+    char line[VLOG_MAX_MSG_SIZE + VLOG_MAX_FILENAME + 64];
+    uint32_t id;
+
+    pthread_mutex_lock(&vlog_deferred.lock);
+
+    for (id = 1; id < vlog_deferred.nr_sites; id++) {
+        site = vlog_deferred.sites[id];
+        snprintf(line, sizeof(line), "%4u | %-8s | %s:%d | hits=%lu%s | %s",
+                 id, vlog_level_to_str(site->level), site->file, site->line,
+                 __atomic_load_n(&site->hits, __ATOMIC_RELAXED),
+                 (site->nargs < 0) ? " sync" : "", site->fmt);
+        print_cb(cb_arg, line);
+    }
+
+    pthread_mutex_unlock(&vlog_deferred.lock);
+}
@@ -0,0 +1,403 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "vlog_deferred_decode.h"
+
+/* Kept free of other libvapi dependencies: also built into the offline decoder. */
+
+#define SPEC_MAX_SIZE   64
+
+typedef struct {
+    const char *start;          /* '%' */
+    const char *end;            /* one past the conversion character */
+    int star_width;
+    int star_prec;
+    char length[3];
+    char conv;
+} spec_t;
+
+/* Scan the conversion specification at p ('%', not "%%"). Returns 0 on success. */
+static int spec_scan(const char *p, spec_t *spec)
+{
+    int n = 0;
+
+    memset(spec, 0, sizeof(*spec));
+    spec->start = p++;
+
+    while (*p && strchr("-+ #0'I", *p))
+        p++;
+
+    if (*p == '*') {
+        spec->star_width = 1;
+        p++;
+    } else {
+        while (*p >= '0' && *p <= '9')
+            p++;
+    }
+
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            spec->star_prec = 1;
+            p++;
+        } else {
+            while (*p >= '0' && *p <= '9')
+                p++;
+        }
+    }
+
+    while (*p && strchr("hlLqjzZt", *p) && n < 2)
+        spec->length[n++] = *p++;
+
+    if (*p == '\0')
+        return -1;
+
+    spec->conv = *p++;
+    spec->end = p;
+
+    return 0;
+}
+
+/* Encoding of the converted value of a specification, -1 if deferred formatting does not support it */
+static int spec_type(const spec_t *spec)
+{
+    const char *len = spec->length;
+
+    switch (spec->conv) {
+    case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+        if (len[0] == '\0' || len[0] == 'h')
+            return VLOG_DEFERRED_ARG_INT;
+        if (len[0] == 'L')
+            return -1;
+        if ((len[0] == 'l' && len[1] == 'l') || len[0] == 'q' || len[0] == 'j')
+            return VLOG_DEFERRED_ARG_LLONG;
+        return VLOG_DEFERRED_ARG_LONG;
+    case 'c':
+        return (len[0] == '\0' || len[0] == 'l') ? VLOG_DEFERRED_ARG_INT : -1;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+        return (len[0] == 'L') ? -1 : VLOG_DEFERRED_ARG_DOUBLE;
+    case 's':
+        return (len[0] == '\0') ? VLOG_DEFERRED_ARG_STR : -1;
+    case 'p':
+        return VLOG_DEFERRED_ARG_PTR;
+    default:
+        /* %n, %m (errno of the writer thread) and wide strings */
+        return -1;
+    }
+}
+
+int vlog_deferred_parse(const char *fmt, uint8_t *types, int max_args)
+{
+    const char *p = fmt;
+    spec_t spec;
+    int nargs = 0;
+    int type;
+
+    while ((p = strchr(p, '%')) != NULL) {
+        if (p[1] == '%') {
+            p += 2;
+            continue;
+        }
+
+        if (spec_scan(p, &spec) != 0)
+            return -1;
+
+        type = spec_type(&spec);
+        if (type < 0)
+            return -1;
+
+        if (nargs + spec.star_width + spec.star_prec + 1 > max_args)
+            return -1;
+
+        if (spec.star_width)
+            types[nargs++] = VLOG_DEFERRED_ARG_INT;
+        if (spec.star_prec)
+            types[nargs++] = VLOG_DEFERRED_ARG_INT;
+        types[nargs++] = type;
+
+        p = spec.end;
+    }
+
+    return nargs;
+}
+
+/* Read the next argument of the given encoding. Returns the bytes consumed, 0 if truncated. */
+static size_t arg_read(const uint8_t *args, size_t avail, int type, void *val, const char **str, uint16_t *str_len)
+{
+    switch (type) {
+    case VLOG_DEFERRED_ARG_INT:
+        if (avail < sizeof(int32_t))
+            return 0;
+        memcpy(val, args, sizeof(int32_t));
+        return sizeof(int32_t);
+    case VLOG_DEFERRED_ARG_STR:
+        if (avail < sizeof(uint16_t))
+            return 0;
+        memcpy(str_len, args, sizeof(uint16_t));
+        if (avail < sizeof(uint16_t) + *str_len)
+            return 0;
+        *str = (const char *)args + sizeof(uint16_t);
+        return sizeof(uint16_t) + *str_len;
+    default:
+        if (avail < sizeof(int64_t))
+            return 0;
+        memcpy(val, args, sizeof(int64_t));
+        return sizeof(int64_t);
+    }
+}
+
+static int spec_print(char *out, size_t size, const char *spec, const spec_t *s, int type,
+                      int64_t ival, double dval, const char *str)
+{
+    const char *len = s->length;
+
+    switch (type) {
+    case VLOG_DEFERRED_ARG_INT:
+        return snprintf(out, size, spec, (int)ival);
+    case VLOG_DEFERRED_ARG_LLONG:
+        if (len[0] == 'j')
+            return snprintf(out, size, spec, (intmax_t)ival);
+        return snprintf(out, size, spec, (long long)ival);
+    case VLOG_DEFERRED_ARG_LONG:
+        if (len[0] == 'z' || len[0] == 'Z')
+            return snprintf(out, size, spec, (size_t)ival);
+        if (len[0] == 't')
+            return snprintf(out, size, spec, (ptrdiff_t)ival);
+        return snprintf(out, size, spec, (long)ival);
+    case VLOG_DEFERRED_ARG_DOUBLE:
+        return snprintf(out, size, spec, dval);
+    case VLOG_DEFERRED_ARG_PTR:
+        return snprintf(out, size, spec, (void *)(uintptr_t)ival);
+    case VLOG_DEFERRED_ARG_STR:
+    default:
+        return snprintf(out, size, spec, str);
+    }
+}
+
+int vlog_deferred_format(const char *fmt, const void *args, size_t len, char *out, size_t size)
+{
+    const uint8_t *arg = (const uint8_t *)args;
+    const char *p = fmt;
+    const char *q;
+    char spec_str[SPEC_MAX_SIZE];
+    char str[VLOG_DEFERRED_STR_MAX + 1];
+    spec_t spec;
+    size_t off = 0, used, n;
+    int64_t ival = 0;
+    double dval = 0;
+    int32_t width = 0, prec = 0;
+    const char *sval = NULL;
+    uint16_t slen = 0;
+    int type, w;
+
+    if (size == 0)
+        return 0;
+
+#define OUT_APPEND(_n) off = ((off + (_n)) < size) ? (off + (_n)) : (size - 1)
+
+    while (*p && off < size - 1) {
+        q = strchr(p, '%');
+        if (q == NULL)
+            q = p + strlen(p);
+
+        n = q - p;
+        if (n > size - 1 - off)
+            n = size - 1 - off;
+        memcpy(&out[off], p, n);
+        off += n;
+
+        if (*q == '\0')
+            break;
+
+        if (q[1] == '%') {
+            out[off++] = '%';
+            p = q + 2;
+            continue;
+        }
+
+        if (spec_scan(q, &spec) != 0 || (type = spec_type(&spec)) < 0)
+            break;
+
+        if (spec.star_width) {
+            if ((used = arg_read(arg, len, VLOG_DEFERRED_ARG_INT, &width, NULL, NULL)) == 0)
+                break;
+            arg += used;
+            len -= used;
+        }
+        if (spec.star_prec) {
+            if ((used = arg_read(arg, len, VLOG_DEFERRED_ARG_INT, &prec, NULL, NULL)) == 0)
+                break;
+            arg += used;
+            len -= used;
+        }
+
+        ival = 0;
+        if (type == VLOG_DEFERRED_ARG_INT) {
+            int32_t i32;
+            used = arg_read(arg, len, type, &i32, &sval, &slen);
+            ival = i32;
+        } else if (type == VLOG_DEFERRED_ARG_DOUBLE) {
+            used = arg_read(arg, len, type, &dval, &sval, &slen);
+        } else {
+            used = arg_read(arg, len, type, &ival, &sval, &slen);
+        }
+        if (used == 0)
+            break;
+        arg += used;
+        len -= used;
+
+        if (type == VLOG_DEFERRED_ARG_STR) {
+            if (slen > VLOG_DEFERRED_STR_MAX)
+                slen = VLOG_DEFERRED_STR_MAX;
+            memcpy(str, sval, slen);
+            str[slen] = '\0';
+            sval = str;
+        }
+
+        /* Rebuild the specification with '*' replaced by the recorded values. */
+        n = 0;
+        for (q = spec.start; q < spec.end && n < sizeof(spec_str) - 12; q++) {
+            if (*q == '*') {
+                w = (q[-1] == '.') ? prec : width;
+                n += snprintf(&spec_str[n], sizeof(spec_str) - n, "%d", (int)w);
+            } else {
+                spec_str[n++] = *q;
+            }
+        }
+        spec_str[n] = '\0';
+
+        w = spec_print(&out[off], size - off, spec_str, &spec, type, ival, dval, sval);
+        if (w > 0)
+            OUT_APPEND((size_t)w);
+
+        p = spec.end;
+    }
+
+#undef OUT_APPEND
+
+    out[off] = '\0';
+
+    return (int)off;
+}
+
+/****************************************************************************/
+/* offline decoding of binary log files */
+
+typedef struct {
+    char *fmt;
+    char *file;
+    int level;
+    int line;
+} decode_site_t;
+
+static const char *decode_level_str(int level)
+{
+    switch (level) {
+    case 2: return "CRITICAL";
+    case 3: return "ERROR";
+    case 4: return "WARNING";
+    case 6: return "INFO";
+    case 7: return "DEBUG";
+    default: return "UNKNOWN";
+    }
+}
+
+static int decode_read(FILE *in, void *buf, size_t len)
+{
+    return (len == 0 || fread(buf, len, 1, in) == 1) ? 0 : -1;
+}
+
+long vlog_deferred_decode(int fd, FILE *out)
+{
+    vlog_deferred_file_hdr_t fhdr;
+    vlog_deferred_file_site_t fsite;
+    vlog_deferred_file_record_t frec;
+    decode_site_t *sites = NULL, *site;
+    uint32_t nr_sites = 0, i;
+    uint8_t args[UINT16_MAX];
+    char msg[4096], date[32];
+    struct tm tm;
+    time_t sec;
+    uint64_t real;
+    long count = 0;
+    FILE *in;
+    int type;
+
+    in = fdopen(dup(fd), "r");
+    if (in == NULL)
+        return -1;
+
+    if (decode_read(in, &fhdr, sizeof(fhdr)) != 0 ||
+        memcmp(fhdr.magic, VLOG_DEFERRED_MAGIC, VLOG_DEFERRED_MAGIC_SIZE) != 0) {
+        count = -1;
+        goto out;
+    }
+
+    while ((type = fgetc(in)) != EOF) {
+        if (type == VLOG_DEFERRED_ENTRY_SITE) {
+            if (decode_read(in, (uint8_t *)&fsite + 1, sizeof(fsite) - 1) != 0)
+                break;
+
+            if (fsite.id >= nr_sites) {
+                decode_site_t *tmp = realloc(sites, (fsite.id + 1) * sizeof(*sites));
+                if (tmp == NULL)
+                    break;
+                memset(&tmp[nr_sites], 0, (fsite.id + 1 - nr_sites) * sizeof(*sites));
+                sites = tmp;
+                nr_sites = fsite.id + 1;
+            }
+
+            site = &sites[fsite.id];
+            free(site->fmt);
+            free(site->file);
+            site->fmt = calloc(1, fsite.fmt_len + 1);
+            site->file = calloc(1, fsite.file_len + 1);
+            site->level = fsite.level;
+            site->line = fsite.line;
+            if (site->fmt == NULL || site->file == NULL ||
+                decode_read(in, site->fmt, fsite.fmt_len) != 0 ||
+                decode_read(in, site->file, fsite.file_len) != 0)
+                break;
+        } else if (type == VLOG_DEFERRED_ENTRY_RECORD) {
+            if (decode_read(in, (uint8_t *)&frec + 1, sizeof(frec) - 1) != 0 ||
+                decode_read(in, args, frec.hdr.len) != 0)
+                break;
+
+            if (frec.hdr.site >= nr_sites || sites[frec.hdr.site].fmt == NULL) {
+                fprintf(out, "<unknown call site %u>\n", frec.hdr.site);
+                continue;
+            }
+            site = &sites[frec.hdr.site];
+
+            vlog_deferred_format(site->fmt, args, frec.hdr.len, msg, sizeof(msg));
+
+            real = fhdr.real_ns + (frec.ts - fhdr.mono_ns);
+            sec = real / 1000000000ULL;
+            localtime_r(&sec, &tm);
+            strftime(date, sizeof(date), "%d/%m/%Y-%H:%M:%S", &tm);
+
+            fprintf(out, "%s.%06lu %-8s %s:%d [%u] %s\n", date, (unsigned long)(real % 1000000000ULL) / 1000,
+                    decode_level_str(site->level), site->file, site->line, frec.hdr.module, msg);
+            count++;
+        } else {
+            /* Unknown entry: the rest of the file cannot be framed. */
+            count = -1;
+            break;
+        }
+    }
+
+out:
+    for (i = 0; i < nr_sites; i++) {
+        free(sites[i].fmt);
+        free(sites[i].file);
+    }
+    free(sites);
+    fclose(in);
+
+    return count;
+}
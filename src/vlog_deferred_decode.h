@@ -0,0 +1,78 @@
+#ifndef __VLOG_DEFERRED_DECODE_H__
+#define __VLOG_DEFERRED_DECODE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Argument encodings of deferred records, derived from the format string */
+typedef enum {
+    VLOG_DEFERRED_ARG_INT,      /* int, char, short: 4 bytes */
+    VLOG_DEFERRED_ARG_LONG,     /* long, size_t, ptrdiff_t: 8 bytes */
+    VLOG_DEFERRED_ARG_LLONG,    /* long long, intmax_t: 8 bytes */
+    VLOG_DEFERRED_ARG_DOUBLE,   /* double, float: 8 bytes */
+    VLOG_DEFERRED_ARG_PTR,      /* void *: 8 bytes */
+    VLOG_DEFERRED_ARG_STR,      /* char *: 2 bytes length + characters, no terminator */
+} vlog_deferred_arg_t;
+
+/* Longest string argument formatted, no record holds more (see VLOG_ASYNC_RECORD_SIZE) */
+#define VLOG_DEFERRED_STR_MAX       512
+
+/* Header in front of the arguments of each deferred record */
+typedef struct {
+    uint32_t site;              /* call site id */
+    uint16_t module;            /* log id */
+    uint16_t len;               /* argument bytes following the header */
+} vlog_deferred_hdr_t;
+
+/*
+ * Binary log file layout, all integers in host byte order:
+ *   file header  : VLOG_DEFERRED_MAGIC, monotonic and realtime clock in ns at open
+ *   site entry   : 'S', id, level, line, fmt length, file length, fmt, file
+ *   record entry : 'R', monotonic ns, vlog_deferred_hdr_t, arguments
+ * A site entry precedes the first record of that site.
+ */
+#define VLOG_DEFERRED_MAGIC         "VLOGBIN1"
+#define VLOG_DEFERRED_MAGIC_SIZE    8
+#define VLOG_DEFERRED_ENTRY_SITE    'S'
+#define VLOG_DEFERRED_ENTRY_RECORD  'R'
+
+typedef struct __attribute__((packed)) {
+    char magic[VLOG_DEFERRED_MAGIC_SIZE];
+    uint64_t mono_ns;
+    uint64_t real_ns;
+} vlog_deferred_file_hdr_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t type;
+    uint32_t id;
+    int32_t level;
+    int32_t line;
+    uint16_t fmt_len;
+    uint16_t file_len;
+} vlog_deferred_file_site_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t type;
+    uint64_t ts;
+    vlog_deferred_hdr_t hdr;
+} vlog_deferred_file_record_t;
+
+/* Get the argument encodings of a format string. Returns the number of arguments, -1 if unsupported. */
+int vlog_deferred_parse(const char *fmt, uint8_t *types, int max_args);
+
+/* Format serialized arguments according to fmt. Returns the length of the formatted message. */
+int vlog_deferred_format(const char *fmt, const void *args, size_t len, char *out, size_t size);
+
+/* Decode a binary log file to text. Returns the number of records decoded, -1 on a read error. */
+long vlog_deferred_decode(int fd, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
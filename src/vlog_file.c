@@ -0,0 +1,794 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* fallocate */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include <libvapi/vlog.h>
+#include <libvapi/vlog_file.h>
+
+#include "vlog_core.h"
+#include "vlog_vapi.h"
+
+#define VLOG_FILE_LINE_SIZE         (VLOG_MAX_TAGS_SIZE + VLOG_MAX_MSG_SIZE + 2)
+#define VLOG_FILE_MIN_SEGMENT       (256 * 1024)
+#define VLOG_FILE_MAX_SEGMENT       (64 * 1024 * 1024)
+#define VLOG_FILE_PREFAULT_WINDOW   (4 * 1024 * 1024)
+#define VLOG_FILE_TICK_MS           250
+#define VLOG_FILE_FS_CHECK_PERIOD   5           /* seconds between watermark checks */
+
+typedef struct vlog_file_segment {
+    int fd;
+    char *map;
+    size_t size;                /* mapped length, file is truncated to it while active */
+    size_t offset;              /* next write position, reserved atomically */
+    size_t synced;              /* bytes flushed by the last flush */
+    size_t populated;           /* bytes pre-faulted in the map */
+    int entries;
+    int writers;                /* threads currently copying into the map */
+    time_t opened;
+    struct vlist node;
+} vlog_file_segment_t;
+
+static struct {
+    pthread_mutex_t lock;       /* protects the list and thread state */
+    pthread_cond_t cond;
+    pthread_t thread;
+    int running;
+    int kick;                   /* work requested while the thread was busy */
+    int atexit_registered;
+    struct vlist files;
+} vlog_file_maint = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .files = ELIST_INITIALIZER(vlog_file_maint.files),
+};
+
+/*
+ * Segment descriptors are recycled, never freed: a writer may still hold a stale
+ * pointer, it bumps the writers count and then sees the segment is not active.
+ */
+static struct {
+    pthread_mutex_t lock;
+    struct vlist free;
+} vlog_file_segments = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .free = ELIST_INITIALIZER(vlog_file_segments.free),
+};
+
+/* Set while this thread holds a handle mutex: its own log lines must not re-enter the file. */
+static __thread int vlog_file_busy = 0;
+
+static time_t vlog_file_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static void vlog_file_path(vlog_file_type_t *handle, int index, char *path, size_t size)
+{
+    const char *sep = "";
+    size_t len = strlen(handle->pathname);
+
+    if (len > 0 && handle->pathname[len - 1] != '/')
+        sep = "/";
+
+    if (index < 0)
+        snprintf(path, size, "%s%s.%s.next", handle->pathname, sep, handle->filename);
+    else if (index == 0)
+        snprintf(path, size, "%s%s%s", handle->pathname, sep, handle->filename);
+    else
+        snprintf(path, size, "%s%s%s.%d", handle->pathname, sep, handle->filename, index);
+}
+
+static size_t vlog_file_segment_size(vlog_file_type_t *handle)
+{
+    size_t size = VLOG_FILE_MAX_SEGMENT;
+    long page = sysconf(_SC_PAGESIZE);
+
+    /* Size for maxentries lines of maximum length, so rotation happens before the map is full. */
+    if (handle->maxentries > 0 && (size_t)handle->maxentries < VLOG_FILE_MAX_SEGMENT / VLOG_FILE_LINE_SIZE)
+        size = (size_t)handle->maxentries * VLOG_FILE_LINE_SIZE;
+    if (size < VLOG_FILE_MIN_SEGMENT)
+        size = VLOG_FILE_MIN_SEGMENT;
+
+    return (size + page - 1) & ~(size_t)(page - 1);
+}
+
+/* Length of the data in a segment: the map is zero-filled past the last line. */
+static size_t vlog_file_segment_used(vlog_file_segment_t *seg)
+{
+    size_t used = MIN(__atomic_load_n(&seg->offset, __ATOMIC_RELAXED), seg->size);
+
+    while (used > 0 && seg->map[used - 1] == '\0')
+        used--;
+
+    return used;
+}
+
+/* Fault in the pages ahead of the writers, so that the page faults are not taken on the caller path. */
+static void vlog_file_segment_prefault(vlog_file_segment_t *seg, size_t upto)
+{
+    size_t start = seg->populated & ~(size_t)(sysconf(_SC_PAGESIZE) - 1);
+
+    if (upto > seg->size)
+        upto = seg->size;
+    if (upto <= seg->populated)
+        return;
+
+#ifdef MADV_POPULATE_WRITE
+    madvise(seg->map + start, upto - start, MADV_POPULATE_WRITE);
+#endif
+    __atomic_store_n(&seg->populated, upto, __ATOMIC_RELAXED);
+}
+
+static vlog_file_segment_t *vlog_file_segment_alloc(void)
+{
+    vlog_file_segment_t *seg = NULL;
+    struct vlist *node;
+
+    pthread_mutex_lock(&vlog_file_segments.lock);
+    vlist_foreach(&vlog_file_segments.free, node) {
+        seg = container_of(vlog_file_segment_t, node, node);
+        vlist_delete(&seg->node);
+        break;
+    }
+    pthread_mutex_unlock(&vlog_file_segments.lock);
+
+    if (seg == NULL)
+        return calloc(1, sizeof(*seg));
+
+    /* Keep the writers count, stale writers still decrement it. */
+    seg->map = NULL;
+    seg->size = 0;
+    seg->offset = 0;
+    seg->synced = 0;
+    seg->populated = 0;
+    seg->entries = 0;
+
+    return seg;
+}
+
+static void vlog_file_segment_free(vlog_file_segment_t *seg)
+{
+    pthread_mutex_lock(&vlog_file_segments.lock);
+    vlist_add_tail(&vlog_file_segments.free, &seg->node);
+    pthread_mutex_unlock(&vlog_file_segments.lock);
+}
+
+static vlog_file_segment_t *vlog_file_segment_open(const char *path, size_t size, int append)
+{
+    vlog_file_segment_t *seg;
+    struct stat st;
+    int flags = O_RDWR | O_CREAT | O_CLOEXEC;
+
+    seg = vlog_file_segment_alloc();
+    if (seg == NULL)
+        return NULL;
+
+    if (!append)
+        flags |= O_TRUNC;
+
+    seg->fd = open(path, flags, 0644);
+    if (seg->fd < 0) {
+        vapi_error("failed to open log file %s [%s]", path, strerror(errno));
+        vlog_file_segment_free(seg);
+        return NULL;
+    }
+
+    if (fstat(seg->fd, &st) == 0 && (size_t)st.st_size > size)
+        size = st.st_size;
+
+    if (ftruncate(seg->fd, size) != 0) {
+        vapi_error("failed to size log file %s [%s]", path, strerror(errno));
+        goto error;
+    }
+
+    seg->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+    if (seg->map == MAP_FAILED) {
+        vapi_error("failed to map log file %s [%s]", path, strerror(errno));
+        goto error;
+    }
+
+    seg->size = size;
+    seg->opened = vlog_file_now();
+    vlist_init(&seg->node);
+
+    /* Continue after the existing lines. */
+    if (append && st.st_size > 0) {
+        seg->offset = st.st_size;
+        seg->offset = vlog_file_segment_used(seg);
+        seg->synced = seg->offset;
+        seg->populated = seg->offset;
+    }
+
+    /* Allocate the disk blocks up front, writes into holes are much slower. Not supported everywhere. */
+    if (fallocate(seg->fd, 0, seg->offset, size - seg->offset) != 0 && errno != EOPNOTSUPP)
+        vapi_warning("failed to preallocate log file %s [%s]", path, strerror(errno));
+
+    vlog_file_segment_prefault(seg, seg->offset + VLOG_FILE_PREFAULT_WINDOW);
+
+    return seg;
+
+error:
+    close(seg->fd);
+    vlog_file_segment_free(seg);
+    return NULL;
+}
+
+/* Truncate to the written length and release. No writer may still use the segment. */
+static void vlog_file_segment_close(vlog_file_segment_t *seg)
+{
+    size_t used = vlog_file_segment_used(seg);
+
+    munmap(seg->map, seg->size);
+    if (ftruncate(seg->fd, used) != 0)
+        vapi_warning("failed to truncate log file [%s]", strerror(errno));
+    close(seg->fd);
+    vlog_file_segment_free(seg);
+}
+
+/* Never blocks: the maintenance thread logs while holding its lock. */
+static void vlog_file_wakeup(void)
+{
+    __atomic_store_n(&vlog_file_maint.kick, 1, __ATOMIC_RELEASE);
+
+    if (pthread_mutex_trylock(&vlog_file_maint.lock) == 0) {
+        pthread_cond_signal(&vlog_file_maint.cond);
+        pthread_mutex_unlock(&vlog_file_maint.lock);
+    }
+}
+
+/* Count the rotated files present on disk. */
+static int vlog_file_count_rotated(vlog_file_type_t *handle)
+{
+    char path[2 * VLOG_MAX_FILENAME + 16];
+    int i;
+
+    for (i = 1; i <= handle->nb_logfiles_max; i++) {
+        vlog_file_path(handle, i, path, sizeof(path));
+        if (access(path, F_OK) != 0)
+            break;
+    }
+
+    return i - 1;
+}
+
+/*
+ * Switch to the pre-created next file. The renames and the close of the old file
+ * are left to the maintenance thread. Called with the handle mutex held.
+ */
+static int vlog_file_switch(vlog_file_type_t *handle)
+{
+    char path[2 * VLOG_MAX_FILENAME + 16];
+    vlog_file_segment_t *old = handle->seg;
+
+    if (handle->next == NULL) {
+        vlog_file_path(handle, -1, path, sizeof(path));
+        handle->next = vlog_file_segment_open(path, vlog_file_segment_size(handle), 0);
+        if (handle->next == NULL)
+            return -1;
+    }
+
+    __atomic_store_n(&handle->seg, handle->next, __ATOMIC_SEQ_CST);
+    handle->next = NULL;
+    handle->currententries = 0;
+    __atomic_store_n(&handle->rotate_pending, 0, __ATOMIC_RELAXED);
+    handle->currenttime = vlog_file_now();
+
+    if (old != NULL)
+        vlist_add_tail(&handle->filelist, &old->node);
+
+    return 0;
+}
+
+/* Rename chain: file.N-1 -> file.N ... file -> file.1, .file.next -> file */
+static void vlog_file_rename_chain(vlog_file_type_t *handle)
+{
+    char from[2 * VLOG_MAX_FILENAME + 16];
+    char to[2 * VLOG_MAX_FILENAME + 16];
+    int i;
+
+    if (handle->nb_logfiles_max > 0) {
+        vlog_file_path(handle, handle->nb_logfiles_max, to, sizeof(to));
+        unlink(to);
+        for (i = handle->nb_logfiles_max - 1; i >= 0; i--) {
+            vlog_file_path(handle, i, from, sizeof(from));
+            vlog_file_path(handle, i + 1, to, sizeof(to));
+            rename(from, to);
+        }
+    } else {
+        vlog_file_path(handle, 0, to, sizeof(to));
+        unlink(to);
+    }
+
+    vlog_file_path(handle, -1, from, sizeof(from));
+    vlog_file_path(handle, 0, to, sizeof(to));
+    rename(from, to);
+
+    handle->nb_logfiles = vlog_file_count_rotated(handle);
+}
+
+/* Close rotated out files once their last writer left. Called with the handle mutex held. */
+static void vlog_file_retire(vlog_file_type_t *handle, int wait)
+{
+    vlog_file_segment_t *seg;
+    struct vlist *node;
+
+    vlist_foreach(&handle->filelist, node) {
+        seg = container_of(vlog_file_segment_t, node, node);
+        while (__atomic_load_n(&seg->writers, __ATOMIC_SEQ_CST) != 0) {
+            if (!wait)
+                goto next;
+            sched_yield();
+        }
+        vlist_delete(&seg->node);
+        vlog_file_segment_close(seg);
+next:
+        ;
+    }
+}
+
+static void vlog_file_segment_sync(vlog_file_segment_t *seg)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    size_t end = MIN(__atomic_load_n(&seg->offset, __ATOMIC_RELAXED), seg->size);
+    size_t start = seg->synced & ~(size_t)(page - 1);
+
+    if (end <= seg->synced)
+        return;
+
+    msync(seg->map + start, end - start, MS_ASYNC);
+    fdatasync(seg->fd);
+    seg->synced = end;
+}
+
+/* Filesystem usage in percent of the log directory, -1 on error */
+static int vlog_file_fs_usage(vlog_file_type_t *handle)
+{
+    struct statvfs st;
+
+    if (statvfs(handle->pathname, &st) != 0 || st.f_blocks == 0)
+        return -1;
+
+    return (int)(100 - (st.f_bavail * 100) / st.f_blocks);
+}
+
+static void vlog_file_check_watermarks(vlog_file_type_t *handle)
+{
+    char path[2 * VLOG_MAX_FILENAME + 16];
+    int usage, i;
+
+    if (handle->fs_size_hwm <= 0)
+        return;
+
+    usage = vlog_file_fs_usage(handle);
+    if (usage < 0)
+        return;
+
+    if (usage >= handle->fs_size_hwm) {
+        /* Make room by dropping the oldest rotated files first. */
+        for (i = handle->nb_logfiles_max; i >= 1 && usage > handle->fs_size_lwm; i--) {
+            vlog_file_path(handle, i, path, sizeof(path));
+            if (unlink(path) == 0)
+                usage = vlog_file_fs_usage(handle);
+        }
+        handle->nb_logfiles = vlog_file_count_rotated(handle);
+
+        if (usage >= handle->fs_size_hwm && handle->rstate == rotate_normal) {
+            vapi_warning("log filesystem usage %d%% above %d%%, dropping lines of %s",
+                         usage, handle->fs_size_hwm, handle->filename);
+            handle->rstate = rotate_hwm_reached;
+        }
+    } else if (handle->rstate == rotate_hwm_reached && usage <= handle->fs_size_lwm) {
+        handle->rstate = rotate_lwm_reached;
+        vapi_info("log filesystem usage back at %d%%, %lu lines of %s dropped",
+                  usage, handle->dropped, handle->filename);
+    } else if (handle->rstate == rotate_lwm_reached) {
+        handle->rstate = rotate_normal;
+    }
+}
+
+/* Periodic and on-demand work for one file, in the maintenance thread */
+static void vlog_file_maintain(vlog_file_type_t *handle, time_t now, int fs_check)
+{
+    char path[2 * VLOG_MAX_FILENAME + 16];
+    vlog_file_segment_t *seg;
+    int rotated = 0;
+
+    vmutex_lock(&handle->mutex);
+    vlog_file_busy = 1;
+
+    seg = handle->seg;
+    if (seg == NULL) {
+        vlog_file_busy = 0;
+        vmutex_unlock(&handle->mutex);
+        return;
+    }
+
+    if (handle->maxtime > 0 && now - handle->currenttime >= handle->maxtime && vlog_file_segment_used(seg) > 0)
+        __atomic_store_n(&handle->rotate_pending, 1, __ATOMIC_RELAXED);
+
+    if (__atomic_load_n(&handle->rotate_pending, __ATOMIC_RELAXED) && vlog_file_switch(handle) == 0) {
+        vlog_file_rename_chain(handle);
+        rotated = 1;
+    }
+
+    seg = handle->seg;
+    handle->currententries = __atomic_load_n(&seg->entries, __ATOMIC_RELAXED);
+
+    /* Keep the mapped pages ahead of the writers. */
+    vlog_file_segment_prefault(seg, __atomic_load_n(&seg->offset, __ATOMIC_RELAXED) + VLOG_FILE_PREFAULT_WINDOW);
+
+    /* Prepare the file of the next rotation. */
+    if (handle->next == NULL) {
+        vlog_file_path(handle, -1, path, sizeof(path));
+        handle->next = vlog_file_segment_open(path, vlog_file_segment_size(handle), 0);
+    }
+
+    vlog_file_retire(handle, 0);
+
+    vlog_file_busy = 0;
+    vmutex_unlock(&handle->mutex);
+
+    vlog_file_flush(handle, now);
+
+    if (fs_check)
+        vlog_file_check_watermarks(handle);
+
+    if (rotated && handle->cb != NULL)
+        handle->cb(handle);
+}
+
+static void *vlog_file_maint_thread(void *arg)
+{
+    vlog_file_type_t *handle;
+    struct timespec deadline;
+    struct vlist *node;
+    time_t now, last_fs_check = 0;
+    int fs_check;
+
+    pthread_mutex_lock(&vlog_file_maint.lock);
+
+    while (vlog_file_maint.running) {
+        now = vlog_file_now();
+        fs_check = (now - last_fs_check >= VLOG_FILE_FS_CHECK_PERIOD);
+        if (fs_check)
+            last_fs_check = now;
+
+        __atomic_store_n(&vlog_file_maint.kick, 0, __ATOMIC_RELAXED);
+
+        vlist_foreach(&vlog_file_maint.files, node) {
+            handle = container_of(vlog_file_type_t, node, node);
+            vlog_file_maintain(handle, now, fs_check);
+        }
+
+        if (__atomic_load_n(&vlog_file_maint.kick, __ATOMIC_ACQUIRE))
+            continue;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += VLOG_FILE_TICK_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&vlog_file_maint.cond, &vlog_file_maint.lock, &deadline);
+    }
+
+    pthread_mutex_unlock(&vlog_file_maint.lock);
+
+    return NULL;
+}
+
+static void vlog_file_atexit(void)
+{
+    vlog_file_type_t *handle;
+    struct vlist *node;
+
+    /* Truncate the active files to their content. */
+    for (;;) {
+        pthread_mutex_lock(&vlog_file_maint.lock);
+        handle = NULL;
+        vlist_foreach(&vlog_file_maint.files, node) {
+            handle = container_of(vlog_file_type_t, node, node);
+            break;
+        }
+        pthread_mutex_unlock(&vlog_file_maint.lock);
+
+        if (handle == NULL)
+            break;
+        vlog_file_close(handle);
+    }
+}
+
+static int vlog_file_maint_add(vlog_file_type_t *handle)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&vlog_file_maint.lock);
+
+    if (!vlog_file_maint.atexit_registered) {
+        atexit(vlog_file_atexit);
+        vlog_file_maint.atexit_registered = 1;
+    }
+
+    vlist_add_tail(&vlog_file_maint.files, &handle->node);
+
+    if (!vlog_file_maint.running) {
+        vlog_file_maint.running = 1;
+        if (pthread_create(&vlog_file_maint.thread, NULL, vlog_file_maint_thread, NULL) != 0) {
+            vlog_file_maint.running = 0;
+            vlist_delete(&handle->node);
+            ret = -1;
+        } else {
+            pthread_setname_np(vlog_file_maint.thread, "vlog_file");
+        }
+    }
+
+    pthread_mutex_unlock(&vlog_file_maint.lock);
+
+    return ret;
+}
+
+static void vlog_file_maint_remove(vlog_file_type_t *handle)
+{
+    int stop;
+
+    pthread_mutex_lock(&vlog_file_maint.lock);
+    vlist_delete(&handle->node);
+    stop = vlist_is_empty(&vlog_file_maint.files) && vlog_file_maint.running;
+    if (stop) {
+        vlog_file_maint.running = 0;
+        pthread_cond_signal(&vlog_file_maint.cond);
+    }
+    pthread_mutex_unlock(&vlog_file_maint.lock);
+
+    if (stop && !pthread_equal(pthread_self(), vlog_file_maint.thread))
+        pthread_join(vlog_file_maint.thread, NULL);
+}
+
+int vlog_file_open(vlog_file_type_t *handle)
+{
+    char path[2 * VLOG_MAX_FILENAME + 16];
+    struct stat st;
+
+    if (handle == NULL || strlen(handle->filename) == 0)
+        return -1;
+
+    if (handle->seg != NULL)
+        return 0;
+
+    vmutex_create(&handle->mutex);
+    vlist_init(&handle->filelist);
+    vlist_init(&handle->node);
+    handle->rstate = rotate_normal;
+    handle->rotate_pending = 0;
+
+    /* A left over next file of a previous run */
+    vlog_file_path(handle, -1, path, sizeof(path));
+    unlink(path);
+
+    vlog_file_path(handle, 0, path, sizeof(path));
+
+    if (handle->force_rotate && stat(path, &st) == 0 && st.st_size > 0) {
+        vlog_file_path(handle, -1, path, sizeof(path));
+        handle->next = vlog_file_segment_open(path, vlog_file_segment_size(handle), 0);
+        if (handle->next == NULL)
+            return -1;
+        vlog_file_switch(handle);
+        vlog_file_rename_chain(handle);
+    } else {
+        handle->seg = vlog_file_segment_open(path, vlog_file_segment_size(handle), 1);
+        if (handle->seg == NULL)
+            return -1;
+        handle->currententries = 0;
+        handle->currenttime = vlog_file_now();
+    }
+
+    handle->lastflushtime = vlog_file_now();
+    handle->nb_logfiles = vlog_file_count_rotated(handle);
+
+    if (vlog_file_maint_add(handle) != 0)
+        vapi_warning("no log file maintenance thread, %s rotates on the writer path", handle->filename);
+
+    return 0;
+}
+
+/* Slow path: the active file is full. Rotate in place, unless another thread already did. */
+static int vlog_file_write_full(vlog_file_type_t *handle, vlog_file_segment_t *seg)
+{
+    int ret = 0;
+
+    vmutex_lock(&handle->mutex);
+    vlog_file_busy = 1;
+    if (handle->seg == seg) {
+        ret = vlog_file_switch(handle);
+        if (ret == 0)
+            vlog_file_rename_chain(handle);
+    }
+    vlog_file_busy = 0;
+    vmutex_unlock(&handle->mutex);
+
+    vlog_file_wakeup();
+
+    return ret;
+}
+
+static int vlog_file_append(vlog_file_type_t *handle, const char *str, size_t len, int asyncsignalsafe)
+{
+    vlog_file_segment_t *seg;
+    size_t off, mark;
+    int entries;
+
+    for (;;) {
+        seg = __atomic_load_n(&handle->seg, __ATOMIC_SEQ_CST);
+        if (seg == NULL)
+            return -1;
+
+        /* Announce the copy, then make sure the segment was not switched meanwhile. */
+        __atomic_fetch_add(&seg->writers, 1, __ATOMIC_SEQ_CST);
+        if (seg != __atomic_load_n(&handle->seg, __ATOMIC_SEQ_CST)) {
+            __atomic_fetch_sub(&seg->writers, 1, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        if (len > seg->size) {
+            __atomic_fetch_sub(&seg->writers, 1, __ATOMIC_RELEASE);
+            return -1;
+        }
+
+        off = __atomic_fetch_add(&seg->offset, len, __ATOMIC_RELAXED);
+        if (off + len <= seg->size) {
+            memcpy(seg->map + off, str, len);
+            entries = __atomic_add_fetch(&seg->entries, 1, __ATOMIC_RELAXED);
+            /* The one line crossing the middle of the prefaulted window asks for more. */
+            mark = __atomic_load_n(&seg->populated, __ATOMIC_RELAXED) - VLOG_FILE_PREFAULT_WINDOW / 2;
+            __atomic_fetch_sub(&seg->writers, 1, __ATOMIC_RELEASE);
+            break;
+        }
+
+        if (asyncsignalsafe) {
+            /* No locks here: write past the map, the file is not truncated any more. */
+            ssize_t ret = pwrite(seg->fd, str, len, off);
+            (void)ret;
+            __atomic_fetch_sub(&seg->writers, 1, __ATOMIC_RELEASE);
+            return 0;
+        }
+
+        __atomic_fetch_sub(&seg->writers, 1, __ATOMIC_RELEASE);
+
+        if (vlog_file_write_full(handle, seg) != 0)
+            return -1;
+    }
+
+    if (asyncsignalsafe)
+        return 0;
+
+    if (handle->maxentries > 0 && entries == handle->maxentries) {
+        __atomic_store_n(&handle->rotate_pending, 1, __ATOMIC_RELAXED);
+        vlog_file_wakeup();
+    } else if (off <= mark && mark < off + len) {
+        vlog_file_wakeup();
+    }
+
+    return 0;
+}
+
+int vlog_file_write(vlog_file_type_t *handle, char *line)
+{
+    if (handle == NULL || line == NULL || vlog_file_busy)
+        return -1;
+
+    if (handle->rstate == rotate_hwm_reached) {
+        __atomic_fetch_add(&handle->dropped, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    return vlog_file_append(handle, line, strlen(line), 0);
+}
+
+int vlog_file_write_asyncsignalsafe(vlog_file_type_t *handle, const char *str, size_t len)
+{
+    if (handle == NULL || str == NULL)
+        return -1;
+
+    return vlog_file_append(handle, str, len, 1);
+}
+
+int vlog_file_flush(vlog_file_type_t *handle, time_t now)
+{
+    vlog_file_segment_t *seg;
+
+    if (handle == NULL || handle->seg == NULL)
+        return -1;
+
+    if (handle->flushtime <= 0 || now - handle->lastflushtime < handle->flushtime)
+        return 0;
+
+    vmutex_lock(&handle->mutex);
+    seg = handle->seg;
+    if (seg != NULL)
+        vlog_file_segment_sync(seg);
+    handle->lastflushtime = now;
+    vmutex_unlock(&handle->mutex);
+
+    return 0;
+}
+
+int vlog_file_close(vlog_file_type_t *handle)
+{
+    char path[2 * VLOG_MAX_FILENAME + 16];
+    vlog_file_segment_t *seg;
+
+    if (handle == NULL || handle->seg == NULL)
+        return -1;
+
+    vlog_file_maint_remove(handle);
+
+    vmutex_lock(&handle->mutex);
+    vlog_file_busy = 1;
+
+    seg = handle->seg;
+    __atomic_store_n(&handle->seg, NULL, __ATOMIC_SEQ_CST);
+    vlist_add_tail(&handle->filelist, &seg->node);
+
+    if (handle->next != NULL) {
+        vlog_file_segment_close(handle->next);
+        handle->next = NULL;
+        vlog_file_path(handle, -1, path, sizeof(path));
+        unlink(path);
+    }
+
+    vlog_file_retire(handle, 1);
+
+    vlog_file_busy = 0;
+    vmutex_unlock(&handle->mutex);
+
+    return 0;
+}
+
+int vlog_file_get_fd(vlog_file_type_t *handle)
+{
+    vlog_file_segment_t *seg;
+
+    if (handle == NULL)
+        return -1;
+
+    seg = __atomic_load_n(&handle->seg, __ATOMIC_ACQUIRE);
+
+    return (seg != NULL) ? seg->fd : -1;
+}
+
+/* Remove all rotated files */
+int vlog_file_cleanup(vlog_file_type_t *handle)
+{
+    char path[2 * VLOG_MAX_FILENAME + 16];
+    int i;
+
+    if (handle == NULL)
+        return -1;
+
+    vmutex_lock(&handle->mutex);
+    for (i = 1; i <= handle->nb_logfiles_max; i++) {
+        vlog_file_path(handle, i, path, sizeof(path));
+        unlink(path);
+    }
+    handle->nb_logfiles = 0;
+    vmutex_unlock(&handle->mutex);
+
+    return 0;
+}
@@ -0,0 +1,377 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // memfd_create
+#endif
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+
+#include <libvapi/vlog.h>
+#include <libvapi/vlog_flightrec.h>
+
+#include "vlog_core.h"
+#include "vlog_vapi.h"
+#include "bufprintf.h"
+
+#define VLOG_FLIGHTREC_MAGIC        0x564c4652      /* "VLFR" */
+#define VLOG_FLIGHTREC_HDR_SIZE     64              /* ring header, keeps the data aligned */
+
+enum {
+    VLOG_FLIGHTREC_FREE = 0,
+    VLOG_FLIGHTREC_USED,
+};
+
+/* Ring header, at the start of each ring in the shared mapping */
+typedef struct {
+    uint32_t magic;
+    uint32_t state;
+    int32_t tid;
+    char name[16];
+    uint64_t head;                      /* bytes ever written, only moved by the owner */
+} vlog_flightrec_ring_t;
+
+/* Record: header, message, then the record size again to walk the ring backwards */
+typedef struct {
+    uint64_t ts;                        /* realtime ns */
+    uint16_t len;                       /* message bytes */
+    uint8_t level;
+    uint8_t pad[5];
+} vlog_flightrec_rec_t;
+
+typedef uint16_t vlog_flightrec_trailer_t;
+
+static struct {
+    int fd;
+    char *map;
+    size_t map_size;
+    size_t ring_size;                   /* data bytes per ring, a power of 2 */
+    size_t dump_size;
+    unsigned int generation;            /* bumped when the mapping is replaced */
+    pthread_key_t ring_key;
+} vlog_flightrec = {
+    .fd = -1,
+    .dump_size = VLOG_FLIGHTREC_DUMP_SIZE,
+};
+
+int vlog_flightrec_floor = VLOG_DISABLED;
+
+static __thread vlog_flightrec_ring_t *vlog_flightrec_thread_ring = NULL;
+static __thread unsigned int vlog_flightrec_thread_generation = 0;
+
+static inline vlog_flightrec_ring_t *vlog_flightrec_ring(unsigned int i)
+{
+    return (vlog_flightrec_ring_t *)(vlog_flightrec.map + i * (VLOG_FLIGHTREC_HDR_SIZE + vlog_flightrec.ring_size));
+}
+
+static inline char *vlog_flightrec_data(vlog_flightrec_ring_t *ring)
+{
+    return (char *)ring + VLOG_FLIGHTREC_HDR_SIZE;
+}
+
+static void vlog_flightrec_ring_release(void *arg)
+{
+    vlog_flightrec_ring_t *ring = (vlog_flightrec_ring_t *)arg;
+
+    /* The content stays readable until another thread takes the ring. */
+    __atomic_store_n(&ring->state, VLOG_FLIGHTREC_FREE, __ATOMIC_RELEASE);
+}
+
+__attribute__ ((constructor)) static void vlog_flightrec_constructor(void)
+{
+    pthread_key_create(&vlog_flightrec.ring_key, vlog_flightrec_ring_release);
+}
+
+static vlog_flightrec_ring_t *vlog_flightrec_get_ring(void)
+{
+    vlog_flightrec_ring_t *ring;
+    uint32_t state;
+    unsigned int i, generation;
+
+    generation = __atomic_load_n(&vlog_flightrec.generation, __ATOMIC_ACQUIRE);
+    if (vlog_flightrec_thread_generation == generation)
+        return vlog_flightrec_thread_ring;
+
+    /* Claim the ring once per mapping, NULL if they are all taken. */
+    vlog_flightrec_thread_generation = generation;
+    vlog_flightrec_thread_ring = NULL;
+
+    if (vlog_flightrec.map == NULL)
+        return NULL;
+
+    /* Unused rings first, the rings of exited threads keep their traces a while longer */
+    for (i = 0; i < 2 * VLOG_FLIGHTREC_MAX_THREADS; i++) {
+        ring = vlog_flightrec_ring(i % VLOG_FLIGHTREC_MAX_THREADS);
+        if (i < VLOG_FLIGHTREC_MAX_THREADS && ring->magic == VLOG_FLIGHTREC_MAGIC)
+            continue;
+        state = VLOG_FLIGHTREC_FREE;
+        if (!__atomic_compare_exchange_n(&ring->state, &state, VLOG_FLIGHTREC_USED, 0,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            continue;
+
+        ring->tid = syscall(SYS_gettid);
+        memset(ring->name, 0, sizeof(ring->name));
+        prctl(PR_GET_NAME, ring->name, 0, 0, 0);
+        __atomic_store_n(&ring->head, 0, __ATOMIC_RELEASE);
+        ring->magic = VLOG_FLIGHTREC_MAGIC;
+
+        pthread_setspecific(vlog_flightrec.ring_key, ring);
+        vlog_flightrec_thread_ring = ring;
+        break;
+    }
+
+    return vlog_flightrec_thread_ring;
+}
+
+static inline void vlog_flightrec_put(vlog_flightrec_ring_t *ring, uint64_t pos, const void *src, size_t len)
+{
+    size_t mask = vlog_flightrec.ring_size - 1;
+    size_t off = pos & mask;
+    size_t first = MIN(len, vlog_flightrec.ring_size - off);
+
+    memcpy(vlog_flightrec_data(ring) + off, src, first);
+    if (first < len)
+        memcpy(vlog_flightrec_data(ring), (const char *)src + first, len - first);
+}
+
+static inline void vlog_flightrec_get(vlog_flightrec_ring_t *ring, uint64_t pos, void *dst, size_t len)
+{
+    size_t mask = vlog_flightrec.ring_size - 1;
+    size_t off = pos & mask;
+    size_t first = MIN(len, vlog_flightrec.ring_size - off);
+
+    memcpy(dst, vlog_flightrec_data(ring) + off, first);
+    if (first < len)
+        memcpy((char *)dst + first, vlog_flightrec_data(ring), len - first);
+}
+
+void vlog_flightrec_record(vlog_level_t level, const char *msg, size_t len)
+{
+    vlog_flightrec_ring_t *ring;
+    vlog_flightrec_rec_t rec;
+    vlog_flightrec_trailer_t size;
+    struct timespec ts;
+    uint64_t head;
+    size_t off;
+    char *data;
+
+    ring = vlog_flightrec_get_ring();
+    if (ring == NULL)
+        return;
+
+    len = MIN(len, (size_t)VLOG_MAX_MSG_SIZE);
+    size = sizeof(rec) + len + sizeof(size);
+
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    rec.ts = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    rec.len = len;
+    rec.level = level;
+
+    head = ring->head;
+    off = head & (vlog_flightrec.ring_size - 1);
+    if (off + size <= vlog_flightrec.ring_size) {
+        data = vlog_flightrec_data(ring) + off;
+        memcpy(data, &rec, sizeof(rec));
+        memcpy(data + sizeof(rec), msg, len);
+        memcpy(data + sizeof(rec) + len, &size, sizeof(size));
+    } else {
+        vlog_flightrec_put(ring, head, &rec, sizeof(rec));
+        vlog_flightrec_put(ring, head + sizeof(rec), msg, len);
+        vlog_flightrec_put(ring, head + sizeof(rec) + len, &size, sizeof(size));
+    }
+
+    __atomic_store_n(&ring->head, head + size, __ATOMIC_RELEASE);
+}
+
+static int vlog_flightrec_map(size_t ring_size)
+{
+    size_t map_size = VLOG_FLIGHTREC_MAX_THREADS * (VLOG_FLIGHTREC_HDR_SIZE + ring_size);
+    char *map;
+    int fd;
+
+    /* memfd pages are only allocated once a thread writes its ring */
+    fd = memfd_create("vlog_flightrec", MFD_CLOEXEC);
+    if (fd < 0) {
+        vapi_error("failed to create flight recorder memfd [%s]", strerror(errno));
+        return -1;
+    }
+
+    if (ftruncate(fd, map_size) != 0) {
+        vapi_error("failed to size flight recorder memfd [%s]", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        vapi_error("failed to map flight recorder [%s]", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    vlog_flightrec.fd = fd;
+    vlog_flightrec.map = map;
+    vlog_flightrec.map_size = map_size;
+    vlog_flightrec.ring_size = ring_size;
+    __atomic_add_fetch(&vlog_flightrec.generation, 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/* A forked child must not write into the rings it shares with its parent. */
+static void vlog_flightrec_atfork_child(void)
+{
+    if (vlog_flightrec.map == NULL)
+        return;
+
+    munmap(vlog_flightrec.map, vlog_flightrec.map_size);
+    close(vlog_flightrec.fd);
+    vlog_flightrec.map = NULL;
+    vlog_flightrec.fd = -1;
+
+    if (vlog_flightrec_map(vlog_flightrec.ring_size) != 0)
+        vlog_flightrec_floor = VLOG_DISABLED;
+}
+
+int vlog_flightrec_init(size_t ring_size, vlog_level_t floor)
+{
+    size_t size = 1;
+
+    if (vlog_flightrec.map != NULL)
+        return vlog_flightrec_set_floor(floor);
+
+    /* the ring index is a mask, and a record must fit */
+    while (size < ring_size)
+        size <<= 1;
+    if (size < 2 * (sizeof(vlog_flightrec_rec_t) + VLOG_MAX_MSG_SIZE + sizeof(vlog_flightrec_trailer_t)))
+        size = VLOG_FLIGHTREC_RING_SIZE;
+
+    if (vlog_flightrec_map(size) != 0)
+        return -1;
+
+    pthread_atfork(NULL, NULL, vlog_flightrec_atfork_child);
+
+    return vlog_flightrec_set_floor(floor);
+}
+
+int vlog_flightrec_set_floor(vlog_level_t floor)
+{
+    if (floor != VLOG_DISABLED && (floor < VLOG_CRITICAL || floor > VLOG_DEBUG)) {
+        vapi_error("invalid flight recorder floor [%d]", (int)floor);
+        return -1;
+    }
+
+    if (vlog_flightrec.map == NULL && floor != VLOG_DISABLED) {
+        vapi_error("flight recorder is not running");
+        return -1;
+    }
+
+    __atomic_store_n(&vlog_flightrec_floor, floor, __ATOMIC_RELAXED);
+    vlog_update_module_thresholds();
+
+    return 0;
+}
+
+vlog_level_t vlog_flightrec_get_floor(void)
+{
+    return (vlog_level_t)__atomic_load_n(&vlog_flightrec_floor, __ATOMIC_RELAXED);
+}
+
+void vlog_flightrec_set_dump_size(size_t size)
+{
+    vlog_flightrec.dump_size = size;
+}
+
+static void vlog_flightrec_dump_ring(vlog_flightrec_ring_t *ring, vlog_flightrec_write_cb_t write_cb,
+                                     void *cb_arg, size_t max_bytes)
+{
+    char line[VLOG_MAX_MSG_SIZE + 128];
+    char msg[VLOG_MAX_MSG_SIZE + 1];
+    vlog_flightrec_rec_t rec;
+    vlog_flightrec_trailer_t size;
+    uint64_t head, oldest, pos;
+    unsigned long count = 0;
+    buffer_t buf;
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head == 0)
+        return;
+
+    /* Oldest byte still in the ring, or in the dumped part of it */
+    oldest = (head > vlog_flightrec.ring_size) ? head - vlog_flightrec.ring_size : 0;
+    if (head - oldest > max_bytes)
+        oldest = head - max_bytes;
+
+    /* Walk back from the head to the oldest whole record */
+    for (pos = head; pos > oldest; pos -= size) {
+        if (pos - oldest < sizeof(size))
+            break;
+        vlog_flightrec_get(ring, pos - sizeof(size), &size, sizeof(size));
+        if (size < sizeof(rec) + sizeof(size) || size > pos - oldest)
+            break;
+        count++;
+    }
+
+    bufinit(&buf, line, sizeof(line));
+    bufprintf_asyncsignalsafe(&buf, "--- flight recorder: thread %d (%s), %lu records%s ---\n",
+                              (int)ring->tid, ring->name, count,
+                              (ring->state == VLOG_FLIGHTREC_USED) ? "" : ", exited");
+    write_cb(cb_arg, line, strlen(line));
+
+    for (; count > 0; count--) {
+        vlog_flightrec_get(ring, pos, &rec, sizeof(rec));
+        if (rec.len > VLOG_MAX_MSG_SIZE)
+            break;
+        vlog_flightrec_get(ring, pos + sizeof(rec), msg, rec.len);
+        msg[rec.len] = '\0';
+        pos += sizeof(rec) + rec.len + sizeof(size);
+
+        bufinit(&buf, line, sizeof(line));
+        bufprintf_asyncsignalsafe(&buf, "%lu.%06lu %-13s %s\n",
+                                  (unsigned long)(rec.ts / 1000000000ULL),
+                                  (unsigned long)(rec.ts % 1000000000ULL / 1000),
+                                  vlog_level_to_str((vlog_level_t)rec.level), msg);
+        write_cb(cb_arg, line, strlen(line));
+    }
+}
+
+void vlog_flightrec_dump(vlog_flightrec_write_cb_t write_cb, void *cb_arg, size_t max_bytes)
+{
+    vlog_flightrec_ring_t *ring;
+    unsigned int i;
+
+    if (vlog_flightrec.map == NULL)
+        return;
+
+    if (max_bytes == 0 || max_bytes > vlog_flightrec.ring_size)
+        max_bytes = vlog_flightrec.ring_size;
+
+    for (i = 0; i < VLOG_FLIGHTREC_MAX_THREADS; i++) {
+        ring = vlog_flightrec_ring(i);
+        if (ring->magic == VLOG_FLIGHTREC_MAGIC)
+            vlog_flightrec_dump_ring(ring, write_cb, cb_arg, max_bytes);
+    }
+}
+
+static void vlog_flightrec_error_write(void *cb_arg, const char *line, size_t len)
+{
+    vlog_write_error_asyncsignalsafe(line, len);
+}
+
+void vlog_flightrec_dump_asyncsignalsafe(void)
+{
+    static const char header[] = "\n************ FLIGHT RECORDER ***********\n";
+    static const char footer[] = "****************** END *****************\n";
+
+    if (vlog_flightrec.map == NULL)
+        return;
+
+    vlog_write_error_asyncsignalsafe(header, sizeof(header) - 1);
+    vlog_flightrec_dump(vlog_flightrec_error_write, NULL, vlog_flightrec.dump_size);
+    vlog_write_error_asyncsignalsafe(footer, sizeof(footer) - 1);
+}
@@ -1,35 +1,106 @@
 
 #include <ctype.h> // isdigit
+#include <math.h> // isfinite
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <libvapi/vlog.h>
+#include <libvapi/vtime.h>
 
 #include "vlog_format.h"
-#include "YlogTagFormatter.h"
-#include "YlogFormat.h"
 #include "vlog_vapi.h"
 
 
+/* One piece of a compiled format, rendered in sequence for each trace */
+struct vlog_format_unit {
+    enum type_t {
+        CONST,          // text copied as is
+        TIME,           // %TIME
+        MSG,            // %MSG
+        JSON,           // %JSON, the whole trace as a JSON object
+        TAG_LEVEL,      // %TAG_LEVEL
+        TAG_NAME,       // %TAG_name
+        PREFIX,         // prefix of the next tag, syslog only
+    } type;
+    std::string text;   // constant text, or printf conversion of a tag
+};
+
 struct vlog_format {
-    YlogFormat::UnitList units;
+    std::string str;
+    int set_prefix;
+    std::vector<vlog_format_unit> units;
 };
 
+static const struct {
+    const char *name;
+    vlog_format_unit::type_t type;
+} vlog_format_tags[] = {
+    { "TAG_LEVEL", vlog_format_unit::TAG_LEVEL },
+    { "TAG_name",  vlog_format_unit::TAG_NAME },
+};
+
+static void vlog_format_add(vlog_format_t *fmt, vlog_format_unit::type_t type, const char *s, const char *e)
+{
+    vlog_format_unit unit;
+
+    if (type == vlog_format_unit::CONST) {
+        if (e <= s)
+            return;
+        // merge consecutive constants, e.g. around %%
+        if (!fmt->units.empty() && fmt->units.back().type == vlog_format_unit::CONST) {
+            fmt->units.back().text.append(s, e - s);
+            return;
+        }
+    }
+
+    unit.type = type;
+    if (s != NULL)
+        unit.text.assign(s, e - s);
+    fmt->units.push_back(unit);
+}
+
+/* Match a tag name at s, return its unit type and set *e past it, or return CONST. */
+static vlog_format_unit::type_t vlog_format_parse_tag(const char *s, const char **e)
+{
+    size_t i, len;
+
+    for (i = 0; i < sizeof(vlog_format_tags) / sizeof(vlog_format_tags[0]); i++) {
+        len = strlen(vlog_format_tags[i].name);
+        if (strncmp(s, vlog_format_tags[i].name, len) == 0) {
+            *e = s + len;
+            return vlog_format_tags[i].type;
+        }
+    }
+
+    return vlog_format_unit::CONST;
+}
+
 vlog_format_t *vlog_format_compile(const char *fmt, int set_prefix)
 {
     const char *c, *s, *p, *e;
     char flag_dash_is_set, flag_plus_is_set, flag_space_is_set, flag_zero_is_set;
-    YlogFormat::UnitList *units;
-    YlogTags::TagFormatter *f;
+    vlog_format_unit::type_t tag;
+    std::string conv;
+    vlog_format_t *units;
 
     if (strlen(fmt) == 0) {
         vapi_warning("Failed to compile log format: empty string");
         return NULL;
     }
 
-    units = new YlogFormat::UnitList(fmt);
+    units = new vlog_format_t;
 
     if (units == NULL) {
         vapi_error("Failed to allocate memory for vlog format");
         return NULL;
     }
 
+    units->str = fmt;
+    units->set_prefix = set_prefix;
+
     for (c = fmt, s = c ; *c != '\0' ; c++) {
         if (!isprint(*c)) {
             vapi_warning("Non-printable char 0x%hhx in log format", *c);
@@ -42,22 +113,30 @@ vlog_format_t *vlog_format_compile(const char *fmt, int set_prefix)
             c++;
 
             if (*c == '%') {
-                units->addConstUnit(s, c);
+                vlog_format_add(units, vlog_format_unit::CONST, s, c);
                 s = c+1;
                 continue;
             }
 
             if (strncmp(c, "TIME", 4) == 0) {
-                units->addConstUnit(s, p);
-                units->addTimeUnit();
+                vlog_format_add(units, vlog_format_unit::CONST, s, p);
+                vlog_format_add(units, vlog_format_unit::TIME, NULL, NULL);
+                c += 3;
+                s = c+1;
+                continue;
+            }
+
+            if (strncmp(c, "JSON", 4) == 0) {
+                vlog_format_add(units, vlog_format_unit::CONST, s, p);
+                vlog_format_add(units, vlog_format_unit::JSON, NULL, NULL);
                 c += 3;
                 s = c+1;
                 continue;
             }
 
             if (strncmp(c, "MSG", 3) == 0) {
-                units->addConstUnit(s, p);
-                units->addMessageUnit();
+                vlog_format_add(units, vlog_format_unit::CONST, s, p);
+                vlog_format_add(units, vlog_format_unit::MSG, NULL, NULL);
                 c += 2;
                 s = c+1;
                 continue;
@@ -103,61 +182,420 @@ vlog_format_t *vlog_format_compile(const char *fmt, int set_prefix)
                 while (isdigit(*c)) {c++;}
             }
 
-            f = YlogTags::string2TagFormatter(p+1, c, &e);
+            tag = vlog_format_parse_tag(c, &e);
 
-            if (f != NULL) {
-                units->addConstUnit(s, p);
-                if (set_prefix)
-                    units->addPrefixUnit(f);
+            if (tag != vlog_format_unit::CONST) {
+                vlog_format_add(units, vlog_format_unit::CONST, s, p);
+                if (set_prefix && tag == vlog_format_unit::TAG_NAME)
+                    vlog_format_add(units, vlog_format_unit::PREFIX, NULL, NULL);
 
-                units->addTagUnit(f);
+                // all tags render as strings, keep the flags, width and precision
+                conv.assign(p, c - p);
+                conv += 's';
+                vlog_format_add(units, tag, conv.c_str(), conv.c_str() + conv.size());
                 c = e-1;
                 s = c+1;
+            } else {
+                // not a known tag: keep the text as is
+                c = p;
             }
         }
     }
 
-    units->addConstUnit(s, c);
+    vlog_format_add(units, vlog_format_unit::CONST, s, c);
 
-    return reinterpret_cast<vlog_format_t*>(units);
+    return units;
 }
 
 void vlog_format_free(vlog_format_t *fmt)
 {
-    YlogFormat::UnitList *units = reinterpret_cast<YlogFormat::UnitList*>(fmt);
+    delete fmt;
+}
+
+static const char *vlog_format_time(vlog_format_args_t *args)
+{
+    struct timespec ts;
 
-    delete units;
+    if (args->time_len < 0) {
+        if (args->ts != NULL)
+            ts = *args->ts;
+        else if (vtime_get_wallclock(&ts) != 0)
+            ts.tv_sec = -1;
+        if (ts.tv_sec < 0 || vtime_time_date_str_cached(args->time, sizeof(args->time), &ts) != 0)
+            args->time[0] = '\0';
+        args->time_len = strlen(args->time);
+    }
+
+    return args->time;
 }
 
-int vlog_format(buffer_t *buf, vlog_format_t *fmt, const char *msg, vlog_tags_t *tags)
+static const char *vlog_format_tag(const vlog_format_unit &unit, vlog_tags_t *tags)
 {
-    YlogFormat::UnitList *units = reinterpret_cast<YlogFormat::UnitList*>(fmt);
+    switch (unit.type) {
+    case vlog_format_unit::TAG_LEVEL:
+        return vlog_level_to_str((vlog_level_t)tags->TAG_LEVEL);
+    case vlog_format_unit::TAG_NAME:
+        return (tags->TAG_name_is_set && tags->TAG_name != NULL) ? tags->TAG_name : "";
+    case vlog_format_unit::PREFIX:
+        return (tags->TAG_name_is_set && tags->TAG_name_prefix != NULL) ? tags->TAG_name_prefix : "";
+    default:
+        return "";
+    }
+}
+
+/*
+ * JSON encoder. It writes in place in the line buffer of the trace, without allocation nor
+ * printf except for doubles. A line too short for the trace is still a valid object: strings
+ * are cut, the fields that do not fit are left out and "truncated":true is added.
+ */
+#define VLOG_JSON_TRUNCATED     ",\"truncated\":true"
+#define VLOG_JSON_RESERVE       (sizeof(VLOG_JSON_TRUNCATED) - 1 + 1)   /* + '}' */
+
+typedef struct {
+    char *p;            // NULL when only counting the length
+    size_t room;        // bytes left, the reserve excluded
+    size_t len;
+    int fields;
+    int truncated;
+} vlog_json_writer_t;
+
+/* Escape of each byte: 0 if copied as is, 'u' for \u00XX, else the char after the '\' */
+static const unsigned char vlog_json_escape[256] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    0,   0,   '"', 0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   '\\', 0,  0,   0,
+};
+
+static int vlog_json_raw(vlog_json_writer_t *w, const char *s, size_t n)
+{
+    if (w->p != NULL) {
+        if (n > w->room) {
+            w->truncated = 1;
+            return -1;
+        }
+        memcpy(w->p, s, n);
+        w->p += n;
+        w->room -= n;
+    }
+    w->len += n;
+
+    return 0;
+}
+
+/* Quoted and escaped string, cut if the room is short: the closing quote always fits */
+static int vlog_json_str(vlog_json_writer_t *w, const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *c = (const unsigned char *)s;
+    const unsigned char *run;
+    char esc[6];
+    size_t n, esc_len;
+
+    if (w->p != NULL && w->room < 2) {
+        w->truncated = 1;
+        return -1;
+    }
+
+    vlog_json_raw(w, "\"", 1);
+    if (w->p != NULL)
+        w->room--;          // keep the closing quote
+
+    while (*c != '\0') {
+        for (run = c; *c != '\0' && vlog_json_escape[*c] == 0; c++)
+            ;
+        n = c - run;
+        if (w->p != NULL && n > w->room) {
+            // cut on a UTF-8 character boundary
+            for (n = w->room; n > 0 && (run[n] & 0xc0) == 0x80; n--)
+                ;
+            c = run + n;
+            vlog_json_raw(w, (const char *)run, n);
+            break;
+        }
+        vlog_json_raw(w, (const char *)run, n);
+        if (*c == '\0')
+            break;
+
+        esc[0] = '\\';
+        if (vlog_json_escape[*c] == 'u') {
+            esc[1] = 'u';
+            esc[2] = '0';
+            esc[3] = '0';
+            esc[4] = hex[*c >> 4];
+            esc[5] = hex[*c & 0xf];
+            esc_len = 6;
+        } else {
+            esc[1] = vlog_json_escape[*c];
+            esc_len = 2;
+        }
+        if (vlog_json_raw(w, esc, esc_len) != 0)
+            break;
+        c++;
+    }
+
+    if (w->p != NULL)
+        w->room++;
+    vlog_json_raw(w, "\"", 1);
+
+    if (*c != '\0')
+        w->truncated = 1;
+
+    return 0;
+}
+
+static char *vlog_json_utoa(char *end, unsigned long long u)
+{
+    do {
+        *--end = '0' + u % 10;
+        u /= 10;
+    } while (u != 0);
+
+    return end;
+}
+
+static int vlog_json_value(vlog_json_writer_t *w, const vlog_kv_t *kv)
+{
+    char num[32];
+    char *s;
+    int len;
+
+    switch (kv->type) {
+    case VLOG_KV_STR:
+        if (kv->val.s != NULL)
+            return vlog_json_str(w, kv->val.s);
+        return vlog_json_raw(w, "null", 4);
+    case VLOG_KV_INT:
+        if (kv->val.i >= 0)
+            s = vlog_json_utoa(num + sizeof(num), kv->val.i);
+        else {
+            s = vlog_json_utoa(num + sizeof(num), -(unsigned long long)kv->val.i);
+            *--s = '-';
+        }
+        return vlog_json_raw(w, s, num + sizeof(num) - s);
+    case VLOG_KV_UINT:
+        s = vlog_json_utoa(num + sizeof(num), kv->val.u);
+        return vlog_json_raw(w, s, num + sizeof(num) - s);
+    case VLOG_KV_DOUBLE:
+        if (!isfinite(kv->val.d))
+            return vlog_json_raw(w, "null", 4);
+        len = snprintf(num, sizeof(num), "%.17g", kv->val.d);
+        return vlog_json_raw(w, num, len);
+    case VLOG_KV_BOOL:
+        return kv->val.i ? vlog_json_raw(w, "true", 4) : vlog_json_raw(w, "false", 5);
+    default:
+        return vlog_json_raw(w, "null", 4);
+    }
+}
+
+/* "key":value - a field without room for its key and value is left out, unless it can be cut */
+static void vlog_json_field(vlog_json_writer_t *w, const char *key, const vlog_kv_t *kv, int can_cut)
+{
+    vlog_json_writer_t saved = *w;
+
+    if (w->truncated)
+        return;
+
+    if ((w->fields > 0 && vlog_json_raw(w, ",", 1) != 0) ||
+        vlog_json_str(w, key) != 0 || w->truncated || vlog_json_raw(w, ":", 1) != 0 ||
+        vlog_json_value(w, kv) != 0 || (w->truncated && !can_cut)) {
+        *w = saved;
+        w->truncated = 1;
+        return;
+    }
+
+    w->fields++;
+}
+
+static void vlog_json_field_str(vlog_json_writer_t *w, const char *key, const char *val, int can_cut)
+{
+    vlog_kv_t kv;
+
+    kv.key = key;
+    kv.type = VLOG_KV_STR;
+    kv.val.s = val;
+    vlog_json_field(w, key, &kv, can_cut);
+}
+
+static void vlog_json_encode(vlog_json_writer_t *w, vlog_format_args_t *args)
+{
+    vlog_tags_t *tags = args->tags;
+    const char *module = NULL;
+    unsigned int i;
+
+    vlog_json_raw(w, "{", 1);
+    vlog_json_field_str(w, "time", vlog_format_time(args), 0);
+    vlog_json_field_str(w, "level", vlog_level_to_str((vlog_level_t)tags->TAG_LEVEL), 0);
+
+    if (args->module != (vlog_id_t)-1)
+        module = vlog_module_get_name(args->module);
+    if (module != NULL)
+        vlog_json_field_str(w, "module", module, 0);
+    if (tags->TAG_name_is_set && tags->TAG_name != NULL)
+        vlog_json_field_str(w, "name", tags->TAG_name, 0);
+
+    vlog_json_field_str(w, "msg", args->msg ? args->msg : "", 1);
+
+    for (i = 0; args->kvs != NULL && i < args->kvs->count; i++)
+        vlog_json_field(w, args->kvs->kv[i].key, &args->kvs->kv[i], 0);
+
+    // the reserve is left for the end of the object
+    if (w->p != NULL)
+        w->room += VLOG_JSON_RESERVE;
+    if (w->truncated)
+        vlog_json_raw(w, VLOG_JSON_TRUNCATED + (w->fields == 0), sizeof(VLOG_JSON_TRUNCATED) - 1 - (w->fields == 0));
+    vlog_json_raw(w, "}", 1);
+}
+
+static int vlog_format_json(buffer_t *buf, vlog_format_args_t *args)
+{
+    vlog_json_writer_t w;
+
+    // keep the terminating null byte, and the reserve to close the object
+    if (buf->available < 1 + 1 + VLOG_JSON_RESERVE)
+        return 0;
+
+    w.p = buf->data;
+    w.room = buf->available - 1 - VLOG_JSON_RESERVE;
+    w.len = 0;
+    w.fields = 0;
+    w.truncated = 0;
+
+    vlog_json_encode(&w, args);
+
+    *w.p = '\0';
+    buf->data = w.p;
+    buf->available -= w.len;
+
+    return w.len;
+}
+
+/* Length of the whole object, and the reserve the encoder keeps to close it */
+static int vlog_format_json_get_len(vlog_format_args_t *args)
+{
+    vlog_json_writer_t w;
+
+    w.p = NULL;
+    w.room = 0;
+    w.len = 0;
+    w.fields = 0;
+    w.truncated = 0;
+
+    vlog_json_encode(&w, args);
+
+    return w.len + VLOG_JSON_RESERVE;
+}
+
+int vlog_format_args(buffer_t *buf, vlog_format_t *fmt, vlog_format_args_t *args)
+{
+    int len = 0;
 
     // allow formatting traces without formatter for early traces
-    if (units == NULL)
-        return bufprintf(buf, "%s", msg);
+    if (fmt == NULL)
+        return bufprintf(buf, "%s", args->msg);
+
+    for (const vlog_format_unit &unit : fmt->units) {
+        switch (unit.type) {
+        case vlog_format_unit::CONST:
+            len += bufprintf(buf, "%s", unit.text.c_str());
+            break;
+        case vlog_format_unit::TIME:
+            len += bufprintf(buf, "%s", vlog_format_time(args));
+            break;
+        case vlog_format_unit::MSG:
+            len += bufprintf(buf, "%s", args->msg);
+            break;
+        case vlog_format_unit::JSON:
+            len += vlog_format_json(buf, args);
+            break;
+        case vlog_format_unit::PREFIX:
+            len += bufprintf(buf, "%s", vlog_format_tag(unit, args->tags));
+            break;
+        default:
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+            len += bufprintf(buf, unit.text.c_str(), vlog_format_tag(unit, args->tags));
+#pragma GCC diagnostic pop
+            break;
+        }
+    }
 
-    return units->print(buf, msg, tags);
+    return len;
 }
 
-const char *vlog_format_get_string(vlog_format_t *fmt)
+int vlog_format(buffer_t *buf, vlog_format_t *fmt, const char *msg, vlog_tags_t *tags)
 {
-    YlogFormat::UnitList *units = reinterpret_cast<YlogFormat::UnitList*>(fmt);
+    vlog_format_args_t args;
+
+    vlog_format_args_init(&args, msg, tags);
 
-    if (units == NULL)
+    return vlog_format_args(buf, fmt, &args);
+}
+
+const char *vlog_format_get_string(vlog_format_t *fmt)
+{
+    if (fmt == NULL)
         return "%MSG";
     else
-        return units->getString().c_str();
+        return fmt->str.c_str();
 }
 
 // allow to retrieve the complete size of expanded tags
-int vlog_format_get_len(vlog_format_t *fmt, const char *msg, vlog_tags_t *tags)
+int vlog_format_args_get_len(vlog_format_t *fmt, vlog_format_args_t *args)
 {
-    YlogFormat::UnitList *units = reinterpret_cast<YlogFormat::UnitList*>(fmt);
+    int len = 0;
 
     // allow formatting traces without formatter for early traces
-    if (units == NULL)
-        return msg ? strlen(msg) : 0;
-    else
-        return units->count(msg, tags);
+    if (fmt == NULL)
+        return args->msg ? strlen(args->msg) : 0;
+
+    for (const vlog_format_unit &unit : fmt->units) {
+        switch (unit.type) {
+        case vlog_format_unit::CONST:
+            len += unit.text.size();
+            break;
+        case vlog_format_unit::TIME:
+            vlog_format_time(args);
+            len += args->time_len;
+            break;
+        case vlog_format_unit::MSG:
+            len += args->msg ? strlen(args->msg) : 0;
+            break;
+        case vlog_format_unit::JSON:
+            len += vlog_format_json_get_len(args);
+            break;
+        case vlog_format_unit::PREFIX:
+            len += strlen(vlog_format_tag(unit, args->tags));
+            break;
+        default:
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+            len += snprintf(NULL, 0, unit.text.c_str(), vlog_format_tag(unit, args->tags));
+#pragma GCC diagnostic pop
+            break;
+        }
+    }
+
+    return len;
+}
+
+int vlog_format_get_len(vlog_format_t *fmt, const char *msg, vlog_tags_t *tags)
+{
+    vlog_format_args_t args;
+
+    vlog_format_args_init(&args, msg, tags);
+
+    return vlog_format_args_get_len(fmt, &args);
+}
+
+int vlog_format_equal(vlog_format_t *a, vlog_format_t *b)
+{
+    if (a == b)
+        return 1;
+    if (a == NULL || b == NULL)
+        return 0;
+
+    return a->set_prefix == b->set_prefix && a->str == b->str;
 }
@@ -2,6 +2,9 @@
 #ifndef __VLOG_FORMAT_H__
 #define __VLOG_FORMAT_H__
 
+#include <time.h>
+
+#include <libvapi/vlog.h>
 #include "bufprintf.h"
 //#include "generated/vlog_tags_values.h" // vlog_tags_t
 
@@ -22,11 +25,62 @@ extern __thread vlog_tags_t vlog_tags;
 struct vlog_format;
 typedef struct vlog_format vlog_format_t;
 
+#define VLOG_FORMAT_TIME_SIZE   32
+
+/* Key-value pairs of the trace being printed, see vlog_kv() */
+typedef struct {
+    const char *key;
+    vlog_kv_type_t type;
+    union {
+        const char *s;
+        long long i;
+        unsigned long long u;
+        double d;
+    } val;
+} vlog_kv_t;
+
+typedef struct {
+    unsigned int count;
+    vlog_kv_t kv[VLOG_MAX_KV];
+} vlog_kvs_t;
+
+extern __thread vlog_kvs_t vlog_kvs;
+
+static inline void vlog_kvs_clear(void)
+{
+    vlog_kvs.count = 0;
+}
+
+/* Values of one trace, shared by all the formats it is rendered with */
+typedef struct {
+    const char *msg;
+    vlog_tags_t *tags;
+    vlog_id_t module;                   /* (vlog_id_t)-1 if unknown */
+    vlog_kvs_t *kvs;                    /* NULL if none */
+    const struct timespec *ts;          /* wall clock time of the trace, NULL for now */
+    int time_len;                       /* -1 until %TIME was first rendered */
+    char time[VLOG_FORMAT_TIME_SIZE];
+} vlog_format_args_t;
+
+static inline void vlog_format_args_init(vlog_format_args_t *args, const char *msg, vlog_tags_t *tags)
+{
+    args->msg = msg;
+    args->tags = tags;
+    args->module = (vlog_id_t)-1;
+    args->kvs = NULL;
+    args->ts = NULL;
+    args->time_len = -1;
+}
+
 vlog_format_t * vlog_format_compile(const char *fmt, int set_prefix);
 void vlog_format_free(vlog_format_t *fmt);
 int vlog_format(buffer_t *buf, vlog_format_t *fmt, const char *msg, vlog_tags_t *tags);
+int vlog_format_args(buffer_t *buf, vlog_format_t *fmt, vlog_format_args_t *args);
 const char * vlog_format_get_string(vlog_format_t *fmt);
 int vlog_format_get_len(vlog_format_t *fmt, const char *msg, vlog_tags_t *tags);
+int vlog_format_args_get_len(vlog_format_t *fmt, vlog_format_args_t *args);
+/* Two formats render the same line: outputs using them can share it. */
+int vlog_format_equal(vlog_format_t *a, vlog_format_t *b);
 
 #ifdef __cplusplus
 }
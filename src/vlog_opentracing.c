@@ -5,6 +5,8 @@
 #include <sys/un.h>
 #include <unistd.h>
 
+#include <libvapi/vlog_span.h>
+
 #include "vlog_core.h"
 #include "vlog_opentracing.h"
 
@@ -26,6 +28,30 @@ void createTimer(time_t interval, void *ptr, void (*callback)(void *))
     vtimer_start_periodic_ts(TimerCallback, time, ptr);
 }
 
+/* Replay the spans recorded by the hooks into the tracer, with their measured duration */
+static void vlog_opentracing_export_spans(const vlog_span_t *spans, unsigned int count, void *cb_arg)
+{
+    char duration[24];
+    const char *name;
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        name = spans[i].name_str;
+
+        if (spans[i].ref == VLOG_SPAN_CHILD_OF)
+            vlog_start_child_span(name, (vlog_opentracing_context_ptr)spans[i].context, spans[i].context_size);
+        else if (spans[i].ref == VLOG_SPAN_FOLLOWS_FROM)
+            vlog_start_follows_from_span(name, (vlog_opentracing_context_ptr)spans[i].context, spans[i].context_size);
+        else
+            vlog_start_parent_span(name);
+
+        snprintf(duration, sizeof(duration), "%llu",
+                 (unsigned long long)(spans[i].end_ns - spans[i].start_ns) / 1000);
+        vlog_record_tag(name, "duration_us", duration);
+        vlog_finish_span(name);
+    }
+}
+
 int vlog_opentracing_open(vlog_opentracing_connection_t *handle)
 {
     if (handle == NULL)
@@ -33,6 +59,8 @@ int vlog_opentracing_open(vlog_opentracing_connection_t *handle)
 
     vlog_create_tracer(handle->service_name, handle->server_address, handle->server_port,
                        handle->spans_nmb_per_flush, handle->delay_per_flush_in_second, createTimer);
+    vlog_span_add_exporter(vlog_opentracing_export_spans, NULL);
+
     return 0;
 }
 
@@ -50,6 +78,8 @@ int vlog_opentracing_print(const char *span_name, vlog_tags_t *tags, const char
 
 int vlog_opentracing_close()
 {
+    vlog_span_flush();
+    vlog_span_remove_exporter(vlog_opentracing_export_spans, NULL);
     vlog_close_tracer();
 
     return 0;
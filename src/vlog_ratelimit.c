@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <libvapi/vlog.h>
+
+#include "vlog_core.h"
+#include "vlog_vapi.h"
+
+#define VLOG_RATELIMIT_NS   1000000000ULL
+
+/* Default limits of the call sites of each module, indexed by log id */
+static struct {
+    unsigned int rate;                  /* traces per second, 0 if not limited */
+    unsigned int burst;
+    int repeat;                         /* suppress repeated traces */
+} vlog_ratelimit_conf[VLOG_MAX_MODULES];
+
+unsigned char vlog_module_ratelimited[VLOG_MAX_MODULES];
+
+/* Serializes the updates of the limits of a module with its vlog_module_ratelimited flag */
+static pthread_mutex_t vlog_ratelimit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Site of the trace being printed by this thread, set once it passed the token bucket */
+static __thread vlog_ratelimit_site_t *vlog_ratelimit_cur;
+
+static void vlog_ratelimit_site_lock(vlog_ratelimit_site_t *site)
+{
+    while (__atomic_exchange_n(&site->lock, 1, __ATOMIC_ACQUIRE))
+        sched_yield();
+}
+
+static void vlog_ratelimit_site_unlock(vlog_ratelimit_site_t *site)
+{
+    __atomic_store_n(&site->lock, 0, __ATOMIC_RELEASE);
+}
+
+/* Called with vlog_ratelimit_lock held */
+static void vlog_ratelimit_update(vlog_id_t log_id)
+{
+    __atomic_store_n(&vlog_module_ratelimited[log_id],
+                     vlog_ratelimit_conf[log_id].rate != 0 || vlog_ratelimit_conf[log_id].repeat, __ATOMIC_RELAXED);
+}
+
+/* Slow path of __vlog_ratelimit: charge the token bucket of the site */
+int __vlog_ratelimit_pass(vlog_ratelimit_site_t *site, vlog_id_t module)
+{
+    unsigned int rate, burst;
+    uint64_t now, interval, tolerance, tat;
+
+    if (module >= VLOG_MAX_MODULES)
+        return 0;
+
+    rate = __atomic_load_n(&vlog_ratelimit_conf[module].rate, __ATOMIC_RELAXED);
+    if (rate == 0 && !__atomic_load_n(&vlog_ratelimit_conf[module].repeat, __ATOMIC_RELAXED)) {
+        if (site->until != 0)
+            __atomic_store_n(&site->until, 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    now = __vlog_ratelimit_now();
+
+    vlog_ratelimit_site_lock(site);
+
+    site->module = module;
+
+    /* Token bucket in its virtual scheduling form: one timestamp instead of a token count */
+    if (rate != 0) {
+        burst = MAX(__atomic_load_n(&vlog_ratelimit_conf[module].burst, __ATOMIC_RELAXED), 1U);
+        interval = VLOG_RATELIMIT_NS / rate;
+        tolerance = interval * (burst - 1);
+        tat = MAX(site->tat, now);
+
+        if (tat - now > tolerance) {
+            __atomic_store_n(&site->until, tat - tolerance, __ATOMIC_RELAXED);
+            __atomic_store_n(&site->suppressed, site->suppressed + 1, __ATOMIC_RELAXED);
+            vlog_ratelimit_site_unlock(site);
+            return 1;
+        }
+
+        site->tat = tat + interval;
+    }
+    __atomic_store_n(&site->until, 0, __ATOMIC_RELAXED);
+    site->passed++;
+
+    vlog_ratelimit_site_unlock(site);
+
+    vlog_ratelimit_cur = site;
+
+    return 0;
+}
+
+static uint64_t vlog_ratelimit_hash(const char *msg)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    while (*msg != '\0') {
+        hash ^= (unsigned char)*msg++;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+int vlog_ratelimit_filter(const char *span_name, const char *msg)
+{
+    vlog_ratelimit_site_t *site = vlog_ratelimit_cur;
+    unsigned long repeats, dropped;
+    char note[VLOG_MAX_MSG_SIZE];
+    uint64_t hash, now;
+    int repeat;
+
+    if (site == NULL)
+        return 0;
+    vlog_ratelimit_cur = NULL;
+
+    if (msg == NULL)
+        return 0;
+
+    hash = vlog_ratelimit_hash(msg);
+    now = __vlog_ratelimit_now();
+
+    vlog_ratelimit_site_lock(site);
+
+    repeat = __atomic_load_n(&vlog_ratelimit_conf[site->module].repeat, __ATOMIC_RELAXED);
+    if (repeat && site->last_time != 0 && hash == site->last_hash &&
+        now - site->last_time < VLOG_RATELIMIT_REPEAT_MAX_S * VLOG_RATELIMIT_NS) {
+        site->repeats++;
+        site->repeated++;
+        vlog_ratelimit_site_unlock(site);
+        return 1;
+    }
+
+    repeats = site->repeats;
+    site->repeats = 0;
+    site->last_hash = hash;
+    site->last_time = now;
+    dropped = __atomic_load_n(&site->suppressed, __ATOMIC_RELAXED) - site->reported;
+    site->reported += dropped;
+
+    vlog_ratelimit_site_unlock(site);
+
+    /* notes go out with the tags of the trace that follows them */
+    if (repeats != 0) {
+        snprintf(note, sizeof(note), "last message repeated %lu times", repeats);
+        vlog_output_trace(span_name, note);
+    }
+    if (dropped != 0) {
+        snprintf(note, sizeof(note), "%lu messages suppressed by rate limit", dropped);
+        vlog_output_trace(span_name, note);
+    }
+
+    return 0;
+}
+
+int vlog_module_set_ratelimit(vlog_id_t log_id, unsigned int rate, unsigned int burst)
+{
+    if (log_id >= VLOG_MAX_MODULES || vlog_module_get_name(log_id) == NULL) {
+        vapi_error("cannot set rate limit of unknown log id %lu", log_id);
+        return -1;
+    }
+
+    if (rate > VLOG_RATELIMIT_NS || (rate != 0 && burst == 0)) {
+        vapi_error("invalid rate limit %u/s burst %u for log id %lu", rate, burst, log_id);
+        return -1;
+    }
+
+    pthread_mutex_lock(&vlog_ratelimit_lock);
+    __atomic_store_n(&vlog_ratelimit_conf[log_id].burst, burst, __ATOMIC_RELAXED);
+    __atomic_store_n(&vlog_ratelimit_conf[log_id].rate, rate, __ATOMIC_RELAXED);
+    vlog_ratelimit_update(log_id);
+    pthread_mutex_unlock(&vlog_ratelimit_lock);
+
+    return 0;
+}
+
+int vlog_module_set_repeat_suppression(vlog_id_t log_id, int enable)
+{
+    if (log_id >= VLOG_MAX_MODULES || vlog_module_get_name(log_id) == NULL) {
+        vapi_error("cannot set repeat suppression of unknown log id %lu", log_id);
+        return -1;
+    }
+
+    pthread_mutex_lock(&vlog_ratelimit_lock);
+    __atomic_store_n(&vlog_ratelimit_conf[log_id].repeat, enable ? 1 : 0, __ATOMIC_RELAXED);
+    vlog_ratelimit_update(log_id);
+    pthread_mutex_unlock(&vlog_ratelimit_lock);
+
+    return 0;
+}
+
+int vlog_module_get_ratelimit(vlog_id_t log_id, unsigned int *rate, unsigned int *burst, int *repeat)
+{
+    if (log_id >= VLOG_MAX_MODULES)
+        return -1;
+
+    if (rate != NULL)
+        *rate = __atomic_load_n(&vlog_ratelimit_conf[log_id].rate, __ATOMIC_RELAXED);
+    if (burst != NULL)
+        *burst = __atomic_load_n(&vlog_ratelimit_conf[log_id].burst, __ATOMIC_RELAXED);
+    if (repeat != NULL)
+        *repeat = __atomic_load_n(&vlog_ratelimit_conf[log_id].repeat, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+typedef struct {
+    void (*print_cb)(void *cb_arg, const char *line);
+    void *cb_arg;
+} vlog_ratelimit_dump_t;
+
+static void vlog_ratelimit_dump_site(vlog_callsite_t *callsite, void *arg)
+{
+    vlog_ratelimit_dump_t *dump = arg;
+    vlog_ratelimit_site_t *site = &callsite->rl;
+    char line[VLOG_MAX_FILENAME + VLOG_MAX_MOD_NAME + 128];
+    unsigned long passed, suppressed, repeated;
+    const char *name;
+
+    passed = __atomic_load_n(&site->passed, __ATOMIC_RELAXED);
+    suppressed = __atomic_load_n(&site->suppressed, __ATOMIC_RELAXED);
+    repeated = __atomic_load_n(&site->repeated, __ATOMIC_RELAXED);
+
+    /* only the sites that went through the limits of their module */
+    if (passed == 0 && suppressed == 0 && repeated == 0)
+        return;
+
+    name = vlog_module_get_name(site->module);
+    snprintf(line, sizeof(line), "%s:%d | %-16s | passed=%lu suppressed=%lu repeated=%lu pending=%lu",
+             site->file, site->line, name ? name : "?", passed, suppressed, repeated,
+             __atomic_load_n(&site->repeats, __ATOMIC_RELAXED));
+    dump->print_cb(dump->cb_arg, line);
+}
+
+void vlog_ratelimit_dump_sites(void (*print_cb)(void *cb_arg, const char *line), void *cb_arg)
+{
+    vlog_ratelimit_dump_t dump = { print_cb, cb_arg };
+
+    vlog_callsites_foreach(vlog_ratelimit_dump_site, &dump);
+}
@@ -0,0 +1,405 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <libvapi/vlog.h>
+#include <libvapi/vlog_span.h>
+
+#include "vlog_core.h"
+
+/* Name ids: generation in the high bits, index of the name in the low bits, from 1 */
+#define VLOG_SPAN_INDEX_BITS    20
+#define VLOG_SPAN_INDEX_MASK    ((1u << VLOG_SPAN_INDEX_BITS) - 1)
+#define VLOG_SPAN_GEN_MASK      ((1u << (32 - VLOG_SPAN_INDEX_BITS)) - 1)
+#define VLOG_SPAN_CHUNK_BITS    10
+#define VLOG_SPAN_CHUNK_SIZE    (1u << VLOG_SPAN_CHUNK_BITS)
+#define VLOG_SPAN_MAX_CHUNKS    ((VLOG_SPAN_INDEX_MASK + 1) / VLOG_SPAN_CHUNK_SIZE)
+
+typedef struct {
+    uint32_t gen;                       /* generation of the current name */
+    uint32_t next_free;
+    char str[VLOG_MAX_SPAN_NAME];
+} vlog_span_name_entry_t;
+
+/* Spans of one thread: open ones, and finished ones waiting for a flush */
+typedef struct {
+    vlog_span_t open[VLOG_SPAN_POOL];
+    unsigned int nr_open;
+    vlog_span_t done[VLOG_SPAN_BATCH];
+    unsigned int nr_done;
+    int flushing;
+} vlog_span_thread_t;
+
+static struct {
+    pthread_mutex_t lock;               /* protects the name allocation and the exporters */
+    vlog_span_name_entry_t *chunks[VLOG_SPAN_MAX_CHUNKS];
+    uint32_t next_index;
+    uint32_t free_index;                /* released names, 0 if none */
+    unsigned long names;
+    struct {
+        vlog_span_export_cb_t cb;
+        void *cb_arg;
+    } exporters[VLOG_SPAN_MAX_EXPORTERS];
+    unsigned int nr_exporters;
+    pthread_key_t thread_key;
+    unsigned long spans;
+    unsigned long batches;
+    unsigned long dropped;
+} vlog_span = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .next_index = 1,
+    .free_index = 0,
+};
+
+static __thread vlog_span_thread_t *vlog_span_thread = NULL;
+
+static inline uint64_t vlog_span_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static vlog_span_name_entry_t *vlog_span_name_entry(uint32_t index)
+{
+    vlog_span_name_entry_t *chunk;
+
+    if (index == 0 || index > VLOG_SPAN_INDEX_MASK)
+        return NULL;
+
+    chunk = __atomic_load_n(&vlog_span.chunks[index >> VLOG_SPAN_CHUNK_BITS], __ATOMIC_ACQUIRE);
+    if (chunk == NULL)
+        return NULL;
+
+    return &chunk[index & (VLOG_SPAN_CHUNK_SIZE - 1)];
+}
+
+/* Take a free name entry, to be called with the lock held */
+static uint32_t vlog_span_name_alloc(void)
+{
+    vlog_span_name_entry_t *chunk, *entry;
+    uint32_t index;
+
+    if (vlog_span.free_index != 0) {
+        index = vlog_span.free_index;
+        vlog_span.free_index = vlog_span_name_entry(index)->next_free;
+        return index;
+    }
+
+    index = vlog_span.next_index;
+    if (index > VLOG_SPAN_INDEX_MASK)
+        return 0;
+
+    entry = vlog_span_name_entry(index);
+    if (entry == NULL) {
+        /* Plain calloc: vmem may log, and names are registered from the log hooks. */
+        chunk = calloc(VLOG_SPAN_CHUNK_SIZE, sizeof(*chunk));
+        if (chunk == NULL)
+            return 0;
+        __atomic_store_n(&vlog_span.chunks[index >> VLOG_SPAN_CHUNK_BITS], chunk, __ATOMIC_RELEASE);
+    }
+
+    vlog_span.next_index++;
+
+    return index;
+}
+
+static vlog_span_name_t vlog_span_name_vregister(const char *fmt, va_list ap)
+{
+    vlog_span_name_entry_t *entry;
+    uint32_t index, gen;
+
+    pthread_mutex_lock(&vlog_span.lock);
+
+    index = vlog_span_name_alloc();
+    if (index == 0) {
+        pthread_mutex_unlock(&vlog_span.lock);
+        return VLOG_SPAN_NAME_NONE;
+    }
+
+    entry = vlog_span_name_entry(index);
+    vsnprintf(entry->str, sizeof(entry->str), fmt, ap);
+    gen = entry->gen;
+    vlog_span.names++;
+
+    pthread_mutex_unlock(&vlog_span.lock);
+
+    return (gen << VLOG_SPAN_INDEX_BITS) | index;
+}
+
+vlog_span_name_t vlog_span_name_register(const char *fmt, ...)
+{
+    vlog_span_name_t name;
+    va_list ap;
+
+    va_start(ap, fmt);
+    name = vlog_span_name_vregister(fmt, ap);
+    va_end(ap);
+
+    return name;
+}
+
+vlog_span_name_t vlog_span_name_get_or_register(vlog_span_name_t *name, const char *fmt, ...)
+{
+    vlog_span_name_t cur = __atomic_load_n(name, __ATOMIC_ACQUIRE);
+    vlog_span_name_t expected = VLOG_SPAN_NAME_NONE;
+    va_list ap;
+
+    if (cur != VLOG_SPAN_NAME_NONE)
+        return cur;
+
+    va_start(ap, fmt);
+    cur = vlog_span_name_vregister(fmt, ap);
+    va_end(ap);
+
+    /* another thread may have registered the handle meanwhile: keep its name */
+    if (!__atomic_compare_exchange_n(name, &expected, cur, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        vlog_span_name_release(cur);
+        cur = expected;
+    }
+
+    return cur;
+}
+
+void vlog_span_name_release(vlog_span_name_t name)
+{
+    uint32_t index = name & VLOG_SPAN_INDEX_MASK;
+    vlog_span_name_entry_t *entry;
+
+    if (name == VLOG_SPAN_NAME_NONE)
+        return;
+
+    pthread_mutex_lock(&vlog_span.lock);
+
+    entry = vlog_span_name_entry(index);
+    if (entry != NULL && entry->gen == name >> VLOG_SPAN_INDEX_BITS) {
+        __atomic_store_n(&entry->gen, (entry->gen + 1) & VLOG_SPAN_GEN_MASK, __ATOMIC_RELEASE);
+        entry->next_free = vlog_span.free_index;
+        vlog_span.free_index = index;
+        vlog_span.names--;
+    }
+
+    pthread_mutex_unlock(&vlog_span.lock);
+}
+
+int vlog_span_name_copy(vlog_span_name_t name, char *buf, size_t size)
+{
+    vlog_span_name_entry_t *entry = vlog_span_name_entry(name & VLOG_SPAN_INDEX_MASK);
+    uint32_t gen = name >> VLOG_SPAN_INDEX_BITS;
+
+    if (entry == NULL || buf == NULL || size == 0)
+        return -1;
+
+    if (__atomic_load_n(&entry->gen, __ATOMIC_ACQUIRE) != gen)
+        return -1;
+
+    /* a release bumps the generation before the entry is reused: recheck it after the copy */
+    memcpy(buf, entry->str, size < sizeof(entry->str) ? size : sizeof(entry->str));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&entry->gen, __ATOMIC_RELAXED) != gen)
+        return -1;
+
+    buf[size - 1] = '\0';
+
+    return 0;
+}
+
+static void vlog_span_thread_flush(vlog_span_thread_t *t)
+{
+    struct {
+        vlog_span_export_cb_t cb;
+        void *cb_arg;
+    } exporters[VLOG_SPAN_MAX_EXPORTERS];
+    unsigned int i, nr_exporters;
+
+    if (t->nr_done == 0 || t->flushing)
+        return;
+
+    pthread_mutex_lock(&vlog_span.lock);
+    nr_exporters = vlog_span.nr_exporters;
+    memcpy(exporters, vlog_span.exporters, sizeof(exporters));
+    pthread_mutex_unlock(&vlog_span.lock);
+
+    /* the exporters may take mutexes or time callbacks: their own spans are not recorded */
+    t->flushing = 1;
+    for (i = 0; i < nr_exporters; i++)
+        exporters[i].cb(t->done, t->nr_done, exporters[i].cb_arg);
+    t->flushing = 0;
+
+    __atomic_fetch_add(&vlog_span.spans, t->nr_done, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&vlog_span.batches, 1, __ATOMIC_RELAXED);
+    t->nr_done = 0;
+}
+
+static void vlog_span_thread_release(void *arg)
+{
+    vlog_span_thread_t *t = (vlog_span_thread_t *)arg;
+
+    vlog_span_thread_flush(t);
+    vlog_span_thread = NULL;
+    free(t);
+}
+
+__attribute__ ((constructor)) static void vlog_span_constructor(void)
+{
+    pthread_key_create(&vlog_span.thread_key, vlog_span_thread_release);
+}
+
+static void vlog_span_atfork_child(void)
+{
+    pthread_mutex_init(&vlog_span.lock, NULL);
+}
+
+__attribute__ ((constructor)) static void vlog_span_atfork_constructor(void)
+{
+    pthread_atfork(NULL, NULL, vlog_span_atfork_child);
+}
+
+static vlog_span_thread_t *vlog_span_get_thread(void)
+{
+    vlog_span_thread_t *t = vlog_span_thread;
+
+    if (t != NULL)
+        return t;
+
+    t = calloc(1, sizeof(*t));
+    if (t == NULL)
+        return NULL;
+
+    pthread_setspecific(vlog_span.thread_key, t);
+    vlog_span_thread = t;
+
+    return t;
+}
+
+int vlog_span_start(vlog_span_name_t name, vlog_span_ref_t ref, const char *context, int context_size)
+{
+    vlog_span_thread_t *t = vlog_span_get_thread();
+    vlog_span_t *span;
+
+    if (t == NULL || t->flushing || name == VLOG_SPAN_NAME_NONE)
+        return -1;
+
+    if (t->nr_open == VLOG_SPAN_POOL) {
+        __atomic_fetch_add(&vlog_span.dropped, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    /* the handle may be deleted before the span is exported: keep a copy of its name */
+    span = &t->open[t->nr_open];
+    if (vlog_span_name_copy(name, span->name_str, sizeof(span->name_str)) != 0) {
+        __atomic_fetch_add(&vlog_span.dropped, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    t->nr_open++;
+    span->name = name;
+    span->ref = ref;
+    span->context_size = 0;
+    if (ref != VLOG_SPAN_PARENT && context != NULL && context_size > 0 &&
+        context_size <= VLOG_SPAN_MAX_CONTEXT) {
+        memcpy(span->context, context, context_size);
+        span->context_size = context_size;
+    } else {
+        span->ref = VLOG_SPAN_PARENT;
+    }
+    span->start_ns = vlog_span_now();
+
+    return 0;
+}
+
+void vlog_span_finish(vlog_span_name_t name)
+{
+    vlog_span_thread_t *t = vlog_span_thread;
+    vlog_span_t *done;
+    uint64_t now;
+    unsigned int i;
+
+    if (t == NULL || t->flushing || name == VLOG_SPAN_NAME_NONE)
+        return;
+
+    /* spans mostly finish in reverse order: search from the last one started */
+    for (i = t->nr_open; i > 0 && t->open[i - 1].name != name; i--)
+        ;
+    if (i == 0) {
+        __atomic_fetch_add(&vlog_span.dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    i--;
+
+    now = vlog_span_now();
+    done = &t->done[t->nr_done++];
+    memcpy(done, &t->open[i], offsetof(vlog_span_t, context) + t->open[i].context_size);
+    done->end_ns = now;
+
+    t->nr_open--;
+    if (i < t->nr_open)
+        memmove(&t->open[i], &t->open[i + 1], (t->nr_open - i) * sizeof(t->open[0]));
+
+    if (t->nr_done == VLOG_SPAN_BATCH || now - t->done[0].end_ns >= VLOG_SPAN_FLUSH_MS * 1000000ULL)
+        vlog_span_thread_flush(t);
+}
+
+void vlog_span_flush(void)
+{
+    if (vlog_span_thread != NULL)
+        vlog_span_thread_flush(vlog_span_thread);
+}
+
+unsigned int vlog_span_pending(void)
+{
+    return vlog_span_thread != NULL ? vlog_span_thread->nr_done : 0;
+}
+
+int vlog_span_add_exporter(vlog_span_export_cb_t export_cb, void *cb_arg)
+{
+    int ret = -1;
+
+    if (export_cb == NULL)
+        return -1;
+
+    pthread_mutex_lock(&vlog_span.lock);
+    if (vlog_span.nr_exporters < VLOG_SPAN_MAX_EXPORTERS) {
+        vlog_span.exporters[vlog_span.nr_exporters].cb = export_cb;
+        vlog_span.exporters[vlog_span.nr_exporters].cb_arg = cb_arg;
+        vlog_span.nr_exporters++;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&vlog_span.lock);
+
+    return ret;
+}
+
+void vlog_span_remove_exporter(vlog_span_export_cb_t export_cb, void *cb_arg)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&vlog_span.lock);
+    for (i = 0; i < vlog_span.nr_exporters; i++) {
+        if (vlog_span.exporters[i].cb == export_cb && vlog_span.exporters[i].cb_arg == cb_arg) {
+            vlog_span.nr_exporters--;
+            vlog_span.exporters[i] = vlog_span.exporters[vlog_span.nr_exporters];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&vlog_span.lock);
+}
+
+void vlog_span_get_stats(vlog_span_stats_t *stats)
+{
+    if (stats == NULL)
+        return;
+
+    pthread_mutex_lock(&vlog_span.lock);
+    stats->names = vlog_span.names;
+    pthread_mutex_unlock(&vlog_span.lock);
+
+    stats->spans = __atomic_load_n(&vlog_span.spans, __ATOMIC_RELAXED);
+    stats->batches = __atomic_load_n(&vlog_span.batches, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&vlog_span.dropped, __ATOMIC_RELAXED);
+}
@@ -1,19 +1,31 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* sendmmsg */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include <libvapi/vmutex.h>
-//#include <libvapi/ysocket.h>
 #include <libvapi/vfs.h>
 
 #include "vlog_syslog.h"
 #include "vlog_vapi.h"
 #include "vlog_core.h"
 
+#define VLOG_SYSLOG_SNDBUF              (256 * 1024)
+#define VLOG_SYSLOG_STREAM_TIMEOUT_MS   1000    /* stream mode waits for room up to this long */
+
 // global variable, that becomes set to  1 when central syslog server is listening, it prevents sendig messages that will be thrown away
 static int g_syslog_enabled = 0;
 
@@ -30,32 +42,234 @@ static void on_log_watch_event_cb(vevent_reason_t reason, uint32_t event_mask, c
     }
 }
 
-static int vlog_syslog_open(vlog_syslog_type_t *handle)
+static uint64_t vlog_syslog_now(void)
 {
-    int ret = 0;
-    int fd = -1;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Destination of the handle: an IPv4/IPv6 address and port, or a unix socket path */
+static int vlog_syslog_resolve(vlog_syslog_type_t *handle, struct sockaddr_storage *ss, socklen_t *len)
+{
+    struct sockaddr_in *in4 = (struct sockaddr_in *)ss;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)ss;
+    struct sockaddr_un *un = (struct sockaddr_un *)ss;
+
+    memset(ss, 0, sizeof(*ss));
+
+    if (handle->local_addr[0] == '/') {
+        un->sun_family = AF_UNIX;
+        strncpy(un->sun_path, handle->local_addr, sizeof(un->sun_path) - 1);
+        *len = sizeof(*un);
+    } else if (inet_pton(AF_INET, handle->local_addr, &in4->sin_addr) == 1) {
+        in4->sin_family = AF_INET;
+        in4->sin_port = htons(handle->local_port);
+        *len = sizeof(*in4);
+    } else if (inet_pton(AF_INET6, handle->local_addr, &in6->sin6_addr) == 1) {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(handle->local_port);
+        *len = sizeof(*in6);
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Open and connect the socket. Called with the handle mutex held. */
+static int vlog_syslog_connect(vlog_syslog_type_t *handle)
+{
+    struct sockaddr_storage ss;
+    socklen_t ss_len;
+    int type, fd, sndbuf = VLOG_SYSLOG_SNDBUF;
 
-    fd = ysocket_opendgram_client_fd(AF_INET);
+    handle->fd = -1;
 
-    ret = ysocket_bind_client_fd(fd, handle->local_addr);
-    if (ret < 0) {
-        vapi_error("error binding client socket to addr %s", handle->local_addr);
+    if (vlog_syslog_resolve(handle, &ss, &ss_len) < 0) {
+        vapi_error("invalid syslog address %s", handle->local_addr);
         return -1;
     }
 
-    int sndbuf = 256 * 1024;
-    ret = ysocket_setsockopt_fd(fd, SOL_SOCKET, SO_SNDBUF, (void *)&sndbuf, sizeof(sndbuf));
-    if (ret < 0) {
+    type = (handle->transport == VLOG_SYSLOG_STREAM) ? SOCK_STREAM : SOCK_DGRAM;
+
+    fd = socket(ss.ss_family, type | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        vapi_error("error opening syslog socket [%s]", strerror(errno));
+        return -1;
+    }
+
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) < 0)
         vapi_warning("setsockopt error [%s]", strerror(errno));
+
+    /* connected: sendmmsg needs no address, and stream framing starts on a fresh connection */
+    if (connect(fd, (struct sockaddr *)&ss, ss_len) < 0) {
+        vapi_error("error connecting syslog socket to %s [%s]", handle->local_addr, strerror(errno));
+        close(fd);
+        return -1;
     }
 
-    (void)vmutex_lock(&(handle->mutex));
+    /* the log path must not block on a full socket, flushes wait with a bounded poll */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
     handle->fd = fd;
-    (void)vmutex_unlock(&(handle->mutex));
 
     return 0;
 }
 
+static int vlog_syslog_open(vlog_syslog_type_t *handle)
+{
+    int ret;
+
+    (void)vmutex_lock(&(handle->mutex));
+    ret = vlog_syslog_connect(handle);
+    (void)vmutex_unlock(&(handle->mutex));
+
+    return ret;
+}
+
+static int vlog_syslog_reconnect(vlog_syslog_type_t *handle)
+{
+    if (handle->fd > 0)
+        close(handle->fd);
+
+    handle->stats.reconnects++;
+
+    return vlog_syslog_connect(handle);
+}
+
+static int vlog_syslog_wait(int fd, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    int ret;
+
+    do {
+        ret = poll(&pfd, 1, timeout_ms);
+    } while (ret < 0 && errno == EINTR);
+
+    return (ret > 0) ? 0 : -1;
+}
+
+/* One datagram per message, as many as the socket takes per sendmmsg. Returns messages sent. */
+static unsigned int vlog_syslog_send_dgram(vlog_syslog_type_t *handle)
+{
+    struct mmsghdr msgs[VLOG_SYSLOG_BATCH];
+    unsigned int i, sent = 0;
+    int retried = 0;
+    int nw;
+
+    memset(msgs, 0, handle->count * sizeof(msgs[0]));
+    for (i = 0; i < handle->count; i++) {
+        msgs[i].msg_hdr.msg_iov = &handle->iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (sent < handle->count) {
+        nw = sendmmsg(handle->fd, &msgs[sent], handle->count - sent, 0);
+        if (nw > 0) {
+            handle->stats.batches++;
+            sent += nw;
+            retried = 0;
+            continue;
+        }
+        if (nw < 0 && errno == EINTR)
+            continue;
+
+        /* one retry without progress, then the rest of the batch is dropped */
+        if (retried)
+            break;
+        retried = 1;
+        handle->stats.retries++;
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+            if (vlog_syslog_wait(handle->fd, VLOG_SYSLOG_RETRY_MS) < 0)
+                break;
+        } else if (errno != ECONNREFUSED) {
+            /* a refused datagram only reports an earlier one, the socket is still usable */
+            if (vlog_syslog_reconnect(handle) < 0)
+                break;
+        }
+    }
+
+    return sent;
+}
+
+/* Octet-counted messages (RFC 6587) on a stream. Returns messages sent. */
+static unsigned int vlog_syslog_send_stream(vlog_syslog_type_t *handle)
+{
+    struct iovec iov[VLOG_SYSLOG_BATCH];
+    struct msghdr mh;
+    unsigned int sent = 0, n;
+    size_t off = 0;
+    ssize_t nw;
+    int reconnected = 0;
+
+    while (sent < handle->count) {
+        n = handle->count - sent;
+        memcpy(iov, &handle->iov[sent], n * sizeof(iov[0]));
+        iov[0].iov_base = (char *)iov[0].iov_base + off;
+        iov[0].iov_len -= off;
+
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = iov;
+        mh.msg_iovlen = n;
+
+        nw = sendmsg(handle->fd, &mh, MSG_NOSIGNAL);
+        if (nw >= 0) {
+            handle->stats.batches++;
+            off += nw;
+            while (sent < handle->count && off >= handle->iov[sent].iov_len) {
+                off -= handle->iov[sent].iov_len;
+                sent++;
+            }
+            continue;
+        }
+        if (errno == EINTR)
+            continue;
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            handle->stats.retries++;
+            if (vlog_syslog_wait(handle->fd, VLOG_SYSLOG_STREAM_TIMEOUT_MS) < 0)
+                break;
+            continue;
+        }
+
+        /* connection lost: resend the message in progress whole on a new connection */
+        if (reconnected)
+            break;
+        reconnected = 1;
+        handle->stats.retries++;
+        off = 0;
+        if (vlog_syslog_reconnect(handle) < 0)
+            break;
+    }
+
+    return sent;
+}
+
+/* Called with the handle mutex held. */
+static void vlog_syslog_flush_locked(vlog_syslog_type_t *handle)
+{
+    unsigned int sent = 0;
+
+    if (handle->count == 0)
+        return;
+
+    if (handle->fd > 0) {
+        if (handle->transport == VLOG_SYSLOG_STREAM)
+            sent = vlog_syslog_send_stream(handle);
+        else
+            sent = vlog_syslog_send_dgram(handle);
+    }
+
+    handle->stats.sent += sent;
+    handle->stats.dropped += handle->count - sent;
+
+    handle->count = 0;
+    handle->batch_len = 0;
+}
+
 void create_log_watch()
 {
     //create directory -if it would not exist- so we can install watch on it
@@ -83,28 +297,61 @@ int vlog_syslog_init(vlog_syslog_type_t *handle)
     if (handle == NULL)
         return -1;
 
-    if (handle->fd != 0) {
+    if (handle->fd > 0) {
         vapi_error("vlog_syslog_open handle possibly in use, fd != 0 [%d]", handle->fd);
         return -1;
     }
 
-    ret = vmutex_create(&(handle->mutex));
-    if (ret != 0) {
-        vapi_error("vlog_syslog_open error create mutex [%s]", strerror(errno));
-        return -1;
-    }
+    /* the handle is reopened when the destination changes, mutex and watch stay */
+    if (!handle->mutex_created) {
+        ret = vmutex_create(&(handle->mutex));
+        if (ret != 0) {
+            vapi_error("vlog_syslog_open error create mutex [%s]", strerror(errno));
+            return -1;
+        }
+        handle->mutex_created = 1;
 
-    create_log_watch();
+        create_log_watch();
+    }
 
     return vlog_syslog_open(handle);
 }
 
+/*
+ * Send the queued messages to the current destination and connect to the new one, with the
+ * handle mutex held all along: a concurrent print queues either before or after the switch.
+ */
+int vlog_syslog_reopen(vlog_syslog_type_t *handle, const char *addr, int port, vlog_syslog_transport_t transport)
+{
+    int ret;
+
+    if (handle == NULL || !handle->mutex_created)
+        return -1;
+
+    (void)vmutex_lock(&(handle->mutex));
+
+    vlog_syslog_flush_locked(handle);
+    if (handle->fd > 0)
+        close(handle->fd);
+
+    strcpy(handle->local_addr, addr);
+    handle->local_port = port;
+    handle->transport = transport;
+
+    ret = vlog_syslog_connect(handle);
+
+    (void)vmutex_unlock(&(handle->mutex));
+
+    return ret;
+}
+
 int vlog_syslog_close(vlog_syslog_type_t *handle)
 {
     if (handle == NULL)
         return -1;
 
     (void)vmutex_lock(&(handle->mutex));
+    vlog_syslog_flush_locked(handle);
     if (handle->fd > 0) {
         close(handle->fd);
         handle->fd = -1;
@@ -114,65 +361,96 @@ int vlog_syslog_close(vlog_syslog_type_t *handle)
     return 0;
 }
 
+/*
+ * Queue the message, sent by the next flush: when the batch is full, when its oldest message
+ * is VLOG_SYSLOG_FLUSH_MS old, or when the caller flushes (end of a burst).
+ */
 int vlog_syslog_print(vlog_syslog_type_t *handle, int syslog_pri, const char *msg)
 {
     // prevent sending messages when syslog relay is not listening.
     if (! g_syslog_enabled) return 0;
 
-    size_t nleft, len_buffer;
-    int len, nw;
-    char buffer[VLOG_MAX_SYSLOG_MSG_SIZE] = {0};
-    char *pdata;
+    size_t len, pos;
+    int tmp_len;
+    uint64_t now;
+    char buffer[VLOG_MAX_SYSLOG_MSG_SIZE];
     static const char *trunc = "<TRUNC>";
 
-    if (handle == NULL || handle->fd <= 0 || msg == NULL)
+    if (handle == NULL || !handle->mutex_created || msg == NULL)
         return -1;
 
-    len = strlen(msg);
-    if (msg[len] == '\n')
-        len--;
+    if (msg[0] == '\0' || (msg[0] == '\n' && msg[1] == '\0'))
+        return 0;
 
     /* the syslog rfc requires the priority to be a combination of:
      *      * facility code (5 bits)
      *      * severity code (3 bits) (aka log level)
      */
-    if (len > 0) {
-        int tmp_len = snprintf(buffer, VLOG_MAX_SYSLOG_MSG_SIZE, "<%d>%s", syslog_pri, msg);
-        if (tmp_len < 0) {
-            return -1;
-        } else {
-            len_buffer = tmp_len;
-        }
+    tmp_len = snprintf(buffer, VLOG_MAX_SYSLOG_MSG_SIZE, "<%d>%s", syslog_pri, msg);
+    if (tmp_len < 0)
+        return -1;
 
-        if (len > VLOG_MAX_SYSLOG_MSG_SIZE - 1) {
-            sprintf(&buffer[VLOG_MAX_SYSLOG_MSG_SIZE - strlen(trunc) - 1], "%s", trunc);
-            len_buffer = VLOG_MAX_SYSLOG_MSG_SIZE;
-        }
+    len = tmp_len;
+    if (len > VLOG_MAX_SYSLOG_MSG_SIZE - 1) {
+        len = VLOG_MAX_SYSLOG_MSG_SIZE - 1;
+        memcpy(&buffer[len - strlen(trunc)], trunc, strlen(trunc));
+    } else if (buffer[len - 1] == '\n') {
+        len--;
+    }
 
-        /* send down socket */
-        nleft = len_buffer;
-        pdata = buffer;
+    (void)vmutex_lock(&(handle->mutex));
 
-        while (nleft > 0) {
-            len_buffer = nleft;
+    /* checked with the mutex held, the destination may be switching */
+    if (handle->fd <= 0) {
+        (void)vmutex_unlock(&(handle->mutex));
+        return -1;
+    }
 
-            do {
-                nw = ysocket_sendto_fd(handle->fd, pdata, &len_buffer, handle->local_addr, handle->local_port);
-            } while ((nw < 0) && (errno == EINTR));
+    /* room for the message and its octet count */
+    if (handle->count == VLOG_SYSLOG_BATCH || handle->batch_len + len + 8 > sizeof(handle->batch))
+        vlog_syslog_flush_locked(handle);
 
-            if (nw < 0) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    return 0;
-                } else {
-                    vlog_syslog_close(handle);
-                    return vlog_syslog_open(handle);
-                }
-            }
+    pos = handle->batch_len;
+    if (handle->transport == VLOG_SYSLOG_STREAM)
+        pos += sprintf(&handle->batch[pos], "%zu ", len);
+    memcpy(&handle->batch[pos], buffer, len);
 
-            nleft -= len_buffer;
-            pdata += len_buffer;
-        }
-    }
+    handle->iov[handle->count].iov_base = &handle->batch[handle->batch_len];
+    handle->iov[handle->count].iov_len = pos + len - handle->batch_len;
+    handle->batch_len = pos + len;
+
+    now = vlog_syslog_now();
+    if (handle->count++ == 0)
+        handle->first_ns = now;
+
+    if (handle->count == VLOG_SYSLOG_BATCH || now - handle->first_ns >= VLOG_SYSLOG_FLUSH_MS * 1000000ULL)
+        vlog_syslog_flush_locked(handle);
+
+    (void)vmutex_unlock(&(handle->mutex));
 
     return 0;
 }
+
+int vlog_syslog_flush(vlog_syslog_type_t *handle)
+{
+    if (handle == NULL || handle->count == 0)
+        return 0;
+
+    (void)vmutex_lock(&(handle->mutex));
+    vlog_syslog_flush_locked(handle);
+    (void)vmutex_unlock(&(handle->mutex));
+
+    return 0;
+}
+
+void vlog_syslog_get_stats(vlog_syslog_type_t *handle, vlog_syslog_stats_t *stats)
+{
+    if (!handle->mutex_created) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+
+    (void)vmutex_lock(&(handle->mutex));
+    *stats = handle->stats;
+    (void)vmutex_unlock(&(handle->mutex));
+}
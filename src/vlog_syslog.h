@@ -2,6 +2,7 @@
 #define __VLOG_SYSLOG_H__
 
 #include <stdint.h>
+#include <sys/uio.h>
 #include <libvapi/vlog.h>
 #include <libvapi/vmutex.h>
 #include <libvapi/vtimer.h>
@@ -12,17 +13,36 @@ extern "C" {
 
 #define VLOG_MAX_SYSLOG_ADDR 32
 
+#define VLOG_SYSLOG_BATCH           64              /* messages per sendmmsg */
+#define VLOG_SYSLOG_BATCH_SIZE      (64 * 1024)     /* bytes queued before a flush */
+#define VLOG_SYSLOG_FLUSH_MS        10              /* max age of a queued message */
+#define VLOG_SYSLOG_RETRY_MS        10              /* wait for socket room before dropping */
+
 typedef struct vlog_syslog_type {
     int fd;
-    char local_addr[VLOG_MAX_SYSLOG_ADDR];
+    char local_addr[VLOG_MAX_SYSLOG_ADDR];          /* IP address, or unix socket path */
     int local_port;
+    vlog_syslog_transport_t transport;
     vtimer_t conn_timer;
     vthread_mutex_t mutex;
+    int mutex_created;
+
+    /* queued messages, framed for the transport */
+    char batch[VLOG_SYSLOG_BATCH_SIZE];
+    size_t batch_len;
+    struct iovec iov[VLOG_SYSLOG_BATCH];
+    unsigned int count;
+    uint64_t first_ns;                              /* queue time of the oldest message */
+
+    vlog_syslog_stats_t stats;
 } vlog_syslog_type_t;
 
 int vlog_syslog_init(vlog_syslog_type_t *handle);
 int vlog_syslog_print(vlog_syslog_type_t *handle, int syslog_pri, const char *msg);
+int vlog_syslog_flush(vlog_syslog_type_t *handle);
+int vlog_syslog_reopen(vlog_syslog_type_t *handle, const char *addr, int port, vlog_syslog_transport_t transport);
 int vlog_syslog_close(vlog_syslog_type_t *handle);
+void vlog_syslog_get_stats(vlog_syslog_type_t *handle, vlog_syslog_stats_t *stats);
 
 #ifdef __cplusplus
 }
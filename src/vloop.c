@@ -27,6 +27,7 @@
 #include <libvapi/vloop_demand_event.h>
 #include <libvapi/vthread.h>
 #include <libvapi/vtimer.h>
+#include <libvapi/vlog_span.h>
 
 //#include "data/generated/vloop_cmdline.h"
 #include "vlog_core.h"
@@ -40,6 +41,7 @@
 //#include "yproto_dbg.h"
 //#include "s6_supervision.h"
 #include "vloop_internal.h"
+#include "vloop_trace.h"
 
 #ifndef VAPI_DEFAULT_CMD_FILE
 #define VAPI_DEFAULT_CMD_FILE ""
@@ -73,6 +75,7 @@ typedef struct {
     vloop_event_cb cb;
     vloop_event_handle_t vloop_handle;
     void *ctx;
+    vlog_span_name_t span_name;     /* interned on the first traced callback */
 } vloop_cb_ctx_t;
 
 static __thread vloop_info_t vloop_info_gt = {0};
@@ -125,23 +128,25 @@ static void vloop_cb(evutil_socket_t fd, short events, void *arg)
     if (!cb_ctx)
         return;
 
-    char span_name[VLOG_MAX_SPAN_NAME] = {0};
+    vlog_span_name_t span_name = VLOG_SPAN_NAME_NONE;
     if (vlog_level_enabled_on_vapi_component(VLOOP_INDEX)) {
-        snprintf(span_name, VLOG_MAX_SPAN_NAME - 1, "vloop_callback_%p", cb_ctx);
-
-        if ((cb_ctx->vloop_handle->jsonopentracer_context == NULL)
-            || (cb_ctx->vloop_handle->jsonopentracer_context_size == 0))
-            vlog_start_parent_span(span_name);
-        else
-            vlog_start_follows_from_span(span_name, cb_ctx->vloop_handle->jsonopentracer_context,
-                                         cb_ctx->vloop_handle->jsonopentracer_context_size);
+        span_name = vlog_span_name_get_or_register(&cb_ctx->span_name, "vloop_callback_%p", cb_ctx);
+        if (vlog_span_start(span_name, VLOG_SPAN_FOLLOWS_FROM, cb_ctx->vloop_handle->jsonopentracer_context,
+                            cb_ctx->vloop_handle->jsonopentracer_context_size) != 0)
+            span_name = VLOG_SPAN_NAME_NONE;
     }
 
-    if (cb_ctx->cb)
-        cb_ctx->cb(fd, cb_ctx->vloop_handle, cb_ctx->ctx); //TODO handle protector
+    /* the callback may remove the fd and free cb_ctx */
+    if (cb_ctx->cb) {
+        vloop_event_cb cb = cb_ctx->cb;
+
+        vloop_trace_begin(VLOOP_TRACE_CALLBACK, cb);
+        cb(fd, cb_ctx->vloop_handle, cb_ctx->ctx); //TODO handle protector
+        vloop_trace_end(VLOOP_TRACE_CALLBACK, cb);
+    }
 
-    if (vlog_level_enabled_on_vapi_component(YIPC_INDEX))
-        vlog_finish_span(span_name);
+    if (span_name != VLOG_SPAN_NAME_NONE)
+        vlog_span_finish(span_name);
 }
 
 struct event_base *vloop_get_base()
@@ -245,7 +250,11 @@ int vloop_action_process(vloop_info_t *vloop)
         vloop_action *action = container_of(vloop_action, node, node);
         vlist_delete(node);
 
-        action->func((vloop_action_t)action, action->ctxt);
+        /* the action may delete itself */
+        vloop_action_cb func = action->func;
+        vloop_trace_begin(VLOOP_TRACE_ACTION, func);
+        func((vloop_action_t)action, action->ctxt);
+        vloop_trace_end(VLOOP_TRACE_ACTION, func);
         cnt++;
     }
 
@@ -361,6 +370,7 @@ vloop_event_handle_t vloop_add_fd(int fd, vloop_fd_event_t event_type, vloop_eve
             cb_ctx->cb = read_cb;
             cb_ctx->vloop_handle = vloop_handle;
             cb_ctx->ctx = ctx;
+            cb_ctx->span_name = VLOG_SPAN_NAME_NONE;
             vloop_handle->read_handle = event_new(vloop_get_base(), fd, EV_PERSIST | EV_READ, vloop_cb, cb_ctx);
             if (!vloop_handle->read_handle) {
                 vmem_free(vmem_alloc_default(), cb_ctx);
@@ -376,6 +386,7 @@ vloop_event_handle_t vloop_add_fd(int fd, vloop_fd_event_t event_type, vloop_eve
             cb_ctx->cb = write_cb;
             cb_ctx->vloop_handle = vloop_handle;
             cb_ctx->ctx = ctx;
+            cb_ctx->span_name = VLOG_SPAN_NAME_NONE;
             vloop_handle->write_handle = event_new(vloop_get_base(), fd, EV_PERSIST | EV_WRITE, vloop_cb, cb_ctx);
             if (!vloop_handle->write_handle) {
                 vmem_free(vmem_alloc_default(), cb_ctx);
@@ -499,18 +510,22 @@ int vloop_remove_fd(vloop_event_handle_t vloop_event_handle)
 
     if (vloop_event_handle->read_handle) {
         event_del(vloop_event_handle->read_handle);
-        void *cb_ctx = event_get_callback_arg(vloop_event_handle->read_handle);
-        if (cb_ctx != NULL)
+        vloop_cb_ctx_t *cb_ctx = event_get_callback_arg(vloop_event_handle->read_handle);
+        if (cb_ctx != NULL) {
+            vlog_span_name_release(cb_ctx->span_name);
             vmem_free(vmem_alloc_default(), cb_ctx);
+        }
 
         event_free(vloop_event_handle->read_handle);
     }
 
     if (vloop_event_handle->write_handle) {
         event_del(vloop_event_handle->write_handle);
-        void *cb_ctx = event_get_callback_arg(vloop_event_handle->write_handle);
-        if (cb_ctx != NULL)
+        vloop_cb_ctx_t *cb_ctx = event_get_callback_arg(vloop_event_handle->write_handle);
+        if (cb_ctx != NULL) {
+            vlog_span_name_release(cb_ctx->span_name);
             vmem_free(vmem_alloc_default(), cb_ctx);
+        }
 
         event_free(vloop_event_handle->write_handle);
     }
@@ -533,8 +548,34 @@ void vloop_init_global_list()
     vlist_init(&vloop_list);
 }
 
+static void vloop_span_flush_cb(evutil_socket_t fd, short events, void *arg)
+{
+    vlog_span_flush();
+}
+
+/* Flush the spans of the loop once the oldest waited VLOG_SPAN_FLUSH_MS, even if no other
+ * span finishes meanwhile. A plain libevent timer: a vtimer would trace a span itself.
+ */
+static void vloop_span_flush_arm(struct event_base *base_loop, struct event **flush_ev)
+{
+    static const struct timeval timeout = { 0, VLOG_SPAN_FLUSH_MS * 1000 };
+
+    if (vlog_span_pending() == 0)
+        return;
+
+    if (*flush_ev == NULL) {
+        *flush_ev = evtimer_new(base_loop, vloop_span_flush_cb, NULL);
+        if (*flush_ev == NULL)
+            return;
+    }
+
+    if (!evtimer_pending(*flush_ev, NULL))
+        evtimer_add(*flush_ev, &timeout);
+}
+
 int event_process_loop(struct event_base *base_loop)
 {
+    struct event *span_flush_ev = NULL;
     int rc = 0;
 
     vloop_info_t *vloop = &vloop_info_gt;
@@ -546,10 +587,15 @@ int event_process_loop(struct event_base *base_loop)
         if (vloop_action_process(vloop))
             flags |= EVLOOP_NONBLOCK;
 
+        vloop_span_flush_arm(base_loop, &span_flush_ev);
+
         vloop->stats.loop_cnt++;
         rc = event_base_loop(base_loop, flags);
     } while (rc == 0);
 
+    if (span_flush_ev != NULL)
+        event_free(span_flush_ev);
+
     return rc;
 }
 
@@ -716,6 +762,8 @@ static void vloop_dbg_help(void *ctx)
     vdbg_printf("* show ctxt [clear]        : show all vloop context and optionally clear stats.\n");
     vdbg_printf("* show events [threadname] : show all libevent data.\n");
     vdbg_printf("* show timers [threadname] : show all ytimer contexts.\n");
+    vdbg_printf("* trace start <file>       : start tracing the loops of all threads.\n");
+    vdbg_printf("* trace stop               : stop tracing and write the Chrome trace file.\n");
     vdbg_printf("\n");
 }
 
@@ -739,6 +787,51 @@ static void get_help(void *ctx)
     vdbg_printf("\n");
 }
 
+static void trace_help(void *ctx)
+{
+    vdbg_printf("vloop debug Help: trace\n");
+    vdbg_printf("-----------------------\n");
+    vdbg_printf("\n");
+    vdbg_printf("vloop trace start <file>   start recording callbacks, actions, timers, mutex waits,\n");
+    vdbg_printf("                           semaphore waits and commands of all threads\n");
+    vdbg_printf("vloop trace stop           write the trace to the file, in the Chrome trace event format\n");
+    vdbg_printf("                           to be opened in chrome://tracing or ui.perfetto.dev\n");
+    vdbg_printf("\n");
+}
+
+static int trace_cmd(char *cmd, char *args, void *ctx)
+{
+    char command_str[64] = {'\0'};
+    char path[PATH_MAX] = {'\0'};
+    long count;
+
+    vdbg_scan_args(args, "%63s %4095s", command_str, path);
+
+    if (strcmp(command_str, "start") == 0) {
+        if (strlen(path) == 0) {
+            vdbg_printf("error: missing trace file\n");
+            return -1;
+        }
+        if (vloop_trace_start(path) != 0) {
+            vdbg_printf("error: could not start trace to %s\n", path);
+            return -1;
+        }
+        vdbg_printf("tracing to %s\n", path);
+    } else if (strcmp(command_str, "stop") == 0) {
+        count = vloop_trace_stop();
+        if (count < 0) {
+            vdbg_printf("error: could not write trace\n");
+            return -1;
+        }
+        vdbg_printf("%ld events written\n", count);
+    } else {
+        vdbg_printf("error: unkown parameter [%s]\n", command_str);
+        return -1;
+    }
+
+    return 0;
+}
+
 static vloop_info_t *get_loop(char *threadname)
 {
     vlist_t *node = NULL;
@@ -884,5 +977,6 @@ static int register_dbg_interface(void)
     vdbg_link_cmd("vloop", "show", vloop_dbg_help, vloop_dbg_cmd_show, NULL);
     vdbg_link_cmd("vloop", "get", get_help, get_cmd, NULL);
     vdbg_link_cmd("vloop", "set", set_help, set_cmd, NULL);
+    vdbg_link_cmd("vloop", "trace", trace_help, trace_cmd, NULL);
     return 0;
 }
@@ -0,0 +1,323 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* dladdr */
+#endif
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+
+#include <libvapi/vloop.h>
+
+#include "vlog_vapi.h"
+#include "vloop_trace.h"
+
+#define VLOOP_TRACE_GRACE_US    1000    /* lets the hooks in progress finish before the rings are read */
+#define VLOOP_TRACE_FILE_BUF    65536
+
+enum {
+    VLOOP_TRACE_RING_FREE = 0,
+    VLOOP_TRACE_RING_USED,
+};
+
+typedef struct {
+    uint64_t ts;                        /* monotonic ns */
+    const void *arg;
+    uint32_t event;
+    uint32_t end;
+} vloop_trace_rec_t;
+
+typedef struct {
+    uint32_t state;
+    int32_t tid;
+    char name[16];
+    unsigned int session;               /* trace the records belong to */
+    uint64_t head;                      /* records ever written in the session, only moved by the owner */
+    vloop_trace_rec_t recs[VLOOP_TRACE_RING_SIZE];
+} vloop_trace_ring_t;
+
+static const struct {
+    const char *name;
+    int async;
+    int arg_is_function;
+} vloop_trace_events[VLOOP_TRACE_EVENT_MAX] = {
+    [VLOOP_TRACE_CALLBACK]   = { "vloop_cb",     0, 1 },
+    [VLOOP_TRACE_ACTION]     = { "vloop_action", 0, 1 },
+    [VLOOP_TRACE_TIMER]      = { "vtimer_cb",    0, 1 },
+    [VLOOP_TRACE_MUTEX_WAIT] = { "vmutex_wait",  0, 0 },
+    [VLOOP_TRACE_SEM_WAIT]   = { "vsem_wait",    1, 0 },
+    [VLOOP_TRACE_EXEC]       = { "vsystem_exec", 1, 0 },
+};
+
+/* Not a vmutex: vmutex_lock is traced itself */
+static struct {
+    pthread_mutex_t lock;               /* protects the trace file and the ring table */
+    vloop_trace_ring_t *rings[VLOOP_TRACE_MAX_THREADS];
+    unsigned int nr_rings;
+    unsigned int session;               /* bumped by each vloop_trace_start() */
+    FILE *file;
+    pthread_key_t ring_key;
+} vloop_trace = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .nr_rings = 0,
+    .session = 0,
+    .file = NULL,
+};
+
+int vloop_trace_enabled = 0;
+
+static __thread vloop_trace_ring_t *vloop_trace_thread_ring = NULL;
+
+static void vloop_trace_ring_release(void *arg)
+{
+    vloop_trace_ring_t *ring = (vloop_trace_ring_t *)arg;
+
+    /* The records stay in the trace until another thread takes the ring. */
+    vloop_trace_thread_ring = NULL;
+    __atomic_store_n(&ring->state, VLOOP_TRACE_RING_FREE, __ATOMIC_RELEASE);
+}
+
+static void vloop_trace_atfork_child(void)
+{
+    pthread_mutex_init(&vloop_trace.lock, NULL);
+    /* the parent owns the trace file */
+    vloop_trace.file = NULL;
+    vloop_trace_enabled = 0;
+}
+
+__attribute__ ((constructor)) static void vloop_trace_constructor(void)
+{
+    pthread_key_create(&vloop_trace.ring_key, vloop_trace_ring_release);
+    pthread_atfork(NULL, NULL, vloop_trace_atfork_child);
+}
+
+/* Take a ring for the calling thread: the rings of exited threads are reused once their trace is written */
+static vloop_trace_ring_t *vloop_trace_claim_ring(void)
+{
+    vloop_trace_ring_t *ring = NULL;
+    unsigned int i;
+
+    pthread_mutex_lock(&vloop_trace.lock);
+
+    for (i = 0; i < vloop_trace.nr_rings; i++) {
+        if (__atomic_load_n(&vloop_trace.rings[i]->state, __ATOMIC_ACQUIRE) == VLOOP_TRACE_RING_FREE &&
+            vloop_trace.rings[i]->session != vloop_trace.session) {
+            ring = vloop_trace.rings[i];
+            break;
+        }
+    }
+
+    if (ring == NULL && vloop_trace.nr_rings < VLOOP_TRACE_MAX_THREADS) {
+        /* Plain calloc: the pages are only touched as the ring fills. */
+        ring = calloc(1, sizeof(*ring));
+        if (ring != NULL)
+            vloop_trace.rings[vloop_trace.nr_rings++] = ring;
+    }
+
+    if (ring != NULL) {
+        ring->tid = syscall(SYS_gettid);
+        memset(ring->name, 0, sizeof(ring->name));
+        prctl(PR_GET_NAME, ring->name, 0, 0, 0);
+        ring->session = vloop_trace.session - 1;
+        __atomic_store_n(&ring->state, VLOOP_TRACE_RING_USED, __ATOMIC_RELEASE);
+        pthread_setspecific(vloop_trace.ring_key, ring);
+    }
+
+    pthread_mutex_unlock(&vloop_trace.lock);
+
+    return ring;
+}
+
+static vloop_trace_ring_t *vloop_trace_get_ring(void)
+{
+    vloop_trace_ring_t *ring = vloop_trace_thread_ring;
+    unsigned int session = __atomic_load_n(&vloop_trace.session, __ATOMIC_ACQUIRE);
+
+    if (ring == NULL) {
+        ring = vloop_trace_claim_ring();
+        if (ring == NULL)
+            return NULL;
+        vloop_trace_thread_ring = ring;
+    }
+
+    /* First record of this thread in a new trace */
+    if (ring->session != session) {
+        __atomic_store_n(&ring->head, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&ring->session, session, __ATOMIC_RELEASE);
+    }
+
+    return ring;
+}
+
+void __vloop_trace_record(vloop_trace_event_t event, int end, const void *arg)
+{
+    vloop_trace_ring_t *ring = vloop_trace_thread_ring;
+    vloop_trace_rec_t *rec;
+    struct timespec ts;
+    uint64_t head;
+
+    if (ring == NULL || ring->session != __atomic_load_n(&vloop_trace.session, __ATOMIC_RELAXED)) {
+        ring = vloop_trace_get_ring();
+        if (ring == NULL)
+            return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    head = ring->head;
+    rec = &ring->recs[head & (VLOOP_TRACE_RING_SIZE - 1)];
+    rec->ts = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    rec->arg = arg;
+    rec->event = event;
+    rec->end = end;
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+int vloop_trace_start(const char *path)
+{
+    FILE *file;
+
+    if (path == NULL || path[0] == '\0') {
+        vapi_error("missing trace file");
+        return -1;
+    }
+
+    pthread_mutex_lock(&vloop_trace.lock);
+
+    if (vloop_trace.file != NULL) {
+        pthread_mutex_unlock(&vloop_trace.lock);
+        vapi_warning("a loop trace is already running");
+        return -1;
+    }
+
+    file = fopen(path, "we");
+    if (file == NULL) {
+        pthread_mutex_unlock(&vloop_trace.lock);
+        vapi_error("failed to open trace file %s [%s]", path, strerror(errno));
+        return -1;
+    }
+    setvbuf(file, NULL, _IOFBF, VLOOP_TRACE_FILE_BUF);
+
+    vloop_trace.file = file;
+    __atomic_store_n(&vloop_trace.session, vloop_trace.session + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&vloop_trace_enabled, 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&vloop_trace.lock);
+
+    return 0;
+}
+
+/* Thread names are free text: keep them valid in a JSON string */
+static void vloop_trace_sanitize(char *dst, const char *src, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i + 1 < size && src[i] != '\0'; i++)
+        dst[i] = (src[i] == '"' || src[i] == '\\' || (unsigned char)src[i] < ' ') ? '_' : src[i];
+    dst[i] = '\0';
+}
+
+static void vloop_trace_write_arg(FILE *file, const vloop_trace_rec_t *rec)
+{
+    Dl_info info;
+
+    if (vloop_trace_events[rec->event].arg_is_function &&
+        dladdr(rec->arg, &info) != 0 && info.dli_sname != NULL && info.dli_saddr == rec->arg)
+        fprintf(file, ",\"args\":{\"fn\":\"%s\"}", info.dli_sname);
+    else
+        fprintf(file, ",\"args\":{\"%s\":\"%p\"}", vloop_trace_events[rec->event].arg_is_function ? "fn" : "obj", rec->arg);
+}
+
+/* Write the records of one ring, the ends of durations begun before the oldest record are dropped */
+static unsigned long vloop_trace_write_ring(FILE *file, vloop_trace_ring_t *ring, int pid, int *first)
+{
+    const vloop_trace_rec_t *rec;
+    uint64_t head, pos;
+    unsigned long count = 0;
+    unsigned int depth = 0;
+    char name[sizeof(ring->name)];
+    const char *ph;
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    pos = (head > VLOOP_TRACE_RING_SIZE) ? head - VLOOP_TRACE_RING_SIZE : 0;
+
+    vloop_trace_sanitize(name, ring->name, sizeof(name));
+    fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            *first ? "" : ",", pid, ring->tid, name);
+    *first = 0;
+
+    for (; pos < head; pos++) {
+        rec = &ring->recs[pos & (VLOOP_TRACE_RING_SIZE - 1)];
+        if (rec->event >= VLOOP_TRACE_EVENT_MAX)
+            continue;
+
+        if (vloop_trace_events[rec->event].async) {
+            ph = rec->end ? "e" : "b";
+        } else if (rec->end) {
+            if (depth == 0)
+                continue;
+            depth--;
+            ph = "E";
+        } else {
+            depth++;
+            ph = "B";
+        }
+
+        fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"vapi\",\"ph\":\"%s\",\"ts\":%llu.%03u,\"pid\":%d,\"tid\":%d",
+                vloop_trace_events[rec->event].name, ph,
+                (unsigned long long)(rec->ts / 1000), (unsigned int)(rec->ts % 1000), pid, ring->tid);
+        if (vloop_trace_events[rec->event].async)
+            fprintf(file, ",\"id\":\"%p\"", rec->arg);
+        if (!rec->end)
+            vloop_trace_write_arg(file, rec);
+        fputs("}", file);
+        count++;
+    }
+
+    return count;
+}
+
+long vloop_trace_stop(void)
+{
+    long count = 0;
+    unsigned int i;
+    int first = 1;
+    int pid = getpid();
+    FILE *file;
+
+    pthread_mutex_lock(&vloop_trace.lock);
+
+    file = vloop_trace.file;
+    if (file == NULL) {
+        pthread_mutex_unlock(&vloop_trace.lock);
+        vapi_warning("no loop trace is running");
+        return -1;
+    }
+
+    __atomic_store_n(&vloop_trace_enabled, 0, __ATOMIC_RELEASE);
+    usleep(VLOOP_TRACE_GRACE_US);
+
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", file);
+    for (i = 0; i < vloop_trace.nr_rings; i++) {
+        if (__atomic_load_n(&vloop_trace.rings[i]->session, __ATOMIC_ACQUIRE) == vloop_trace.session)
+            count += vloop_trace_write_ring(file, vloop_trace.rings[i], pid, &first);
+    }
+    fputs("\n]}\n", file);
+
+    if (fclose(file) != 0) {
+        vapi_error("failed to write trace file [%s]", strerror(errno));
+        count = -1;
+    }
+    vloop_trace.file = NULL;
+
+    pthread_mutex_unlock(&vloop_trace.lock);
+
+    return (long)count;
+}
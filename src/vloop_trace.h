@@ -0,0 +1,55 @@
+#ifndef __VLOOP_TRACE_H__
+#define __VLOOP_TRACE_H__
+
+#include <stdint.h>
+
+/*
+ * Trace of the loop activity, see vloop_trace_start().
+ *
+ * The hooks record fixed-size events in a ring of the calling thread. Names and formatting
+ * are only resolved when the trace is written, in the Chrome trace event format.
+ */
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#define VLOOP_TRACE_RING_SIZE   65536   /* events per thread, a power of 2 */
+#define VLOOP_TRACE_MAX_THREADS 128
+
+/* Traced activities: a duration on the thread, or an asynchronous wait identified by its object */
+typedef enum {
+    VLOOP_TRACE_CALLBACK,       /* fd callback, arg is the callback */
+    VLOOP_TRACE_ACTION,         /* deferred action, arg is the action function */
+    VLOOP_TRACE_TIMER,          /* timer expiry, arg is the timer callback */
+    VLOOP_TRACE_MUTEX_WAIT,     /* contended vmutex_lock, arg is the mutex */
+    VLOOP_TRACE_SEM_WAIT,       /* asynchronous, vsem_wait until the callback, arg is the wait */
+    VLOOP_TRACE_EXEC,           /* asynchronous, vsystem_exec until termination, arg is the command */
+    VLOOP_TRACE_EVENT_MAX
+} vloop_trace_event_t;
+
+extern int vloop_trace_enabled;
+
+void __vloop_trace_record(vloop_trace_event_t event, int end, const void *arg);
+
+static inline int vloop_trace_is_enabled(void)
+{
+    return __builtin_expect(__atomic_load_n(&vloop_trace_enabled, __ATOMIC_RELAXED), 0);
+}
+
+static inline void vloop_trace_begin(vloop_trace_event_t event, const void *arg)
+{
+    if (vloop_trace_is_enabled())
+        __vloop_trace_record(event, 0, arg);
+}
+
+static inline void vloop_trace_end(vloop_trace_event_t event, const void *arg)
+{
+    if (vloop_trace_is_enabled())
+        __vloop_trace_record(event, 1, arg);
+}
+
+#if defined(__cplusplus)
+};
+#endif
+#endif
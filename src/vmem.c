@@ -3,12 +3,13 @@
 #endif
 #include <pthread.h>
 
-#include <sys/param.h>  /* roundup */
+#include <sys/param.h>  /* roundup, MAX */
 #include <stdlib.h>     /* malloc, calloc, free, posix_memalign, realloc */
 #include <malloc.h>     /* memalign */
 #include <string.h>     /* memset */
 #include <stdio.h>      /* snprintf, vsnprintf */
 #include <stdarg.h>
+#include <time.h>       /* clock_gettime */
 
 #include <libvapi/vmem.h>
 #include <libvapi/vtimer.h>
@@ -77,6 +78,45 @@ static pthread_mutex_t chain_lock_ = PTHREAD_MUTEX_INITIALIZER;
  */
 static pthread_mutex_t alloc_lock_ = PTHREAD_MUTEX_INITIALIZER;
 
+/*
+ * Allocation statistics are sharded per thread (threads are assigned a shard
+ * round-robin) so that accounting never takes a lock and rarely shares a cache line.
+ * Shards are only summed up when read.
+ */
+#define VMEM_STATS_SHARDS       16
+#define VMEM_STATS_CACHELINE    64
+
+typedef struct {
+    ulong_t allocs;
+    ulong_t frees;
+    long inuse;         /* Negative on a shard whose threads free more than they allocate. */
+    long peak;
+    ulong_t failed;
+    ulong_t bytes;
+    ulong_t hist[VMEM_STATS_HIST_BUCKETS];
+}
+__attribute__((aligned(VMEM_STATS_CACHELINE))) stats_shard_t;
+
+static __thread int stats_shard_ = -1;
+static unsigned stats_next_shard_ = 0;
+
+/*
+ * Readers of the allocation rate, each rate is computed since the previous read of the same
+ * reader so that a print and a dump do not reset each other's sample.
+ */
+typedef enum {
+    rate_api,       /* vmem_alloc_get_stats */
+    rate_print,     /* vmem_alloc_print */
+    rate_dump,      /* vmem_alloc_dump_stats */
+    rate_consumers
+} rate_consumer_t;
+
+typedef struct {
+    struct timespec ts;
+    ulong_t allocs;
+}
+rate_sample_t;
+
 typedef struct allocator {
     /*
      * Allocator chain (constant after allocator creation).
@@ -97,6 +137,12 @@ typedef struct allocator {
     vmem_locktype_t lock_type;      /* Pool lock type, if any. */
     void *pool_lock;                /* Optional lock to protect a thread-safe pool. */
     vmem_pool_t pool;               /* Optional pool. */
+
+    /*
+     * Statistics: shards are updated lock-free, rate samples are protected by alloc_lock.
+     */
+    stats_shard_t stats[VMEM_STATS_SHARDS];
+    rate_sample_t rate[rate_consumers];
 }
 allocator_t;
 
@@ -161,6 +207,61 @@ static inline void pool_unlock(const allocator_t *alloc)
         pthread_mutex_unlock((pthread_mutex_t *) alloc->pool_lock);
 }
 
+static inline stats_shard_t *stats_shard(allocator_t *alloc)
+{
+    if (stats_shard_ < 0)
+        stats_shard_ = __atomic_fetch_add(&stats_next_shard_, 1, __ATOMIC_RELAXED) % VMEM_STATS_SHARDS;
+
+    return &alloc->stats[stats_shard_];
+}
+
+static inline unsigned stats_bucket(size_t size)
+{
+    unsigned bucket;
+
+    if (size <= 16)
+        return 0;
+
+    /* Round up to the next power of two, 32 -> 1, 64 -> 2, ... */
+    bucket = (sizeof(unsigned long) * 8) - __builtin_clzl(size - 1) - 4;
+
+    return (bucket < VMEM_STATS_HIST_BUCKETS) ? bucket : (VMEM_STATS_HIST_BUCKETS - 1);
+}
+
+static inline void stats_alloc(allocator_t *alloc, void *ptr, size_t size)
+{
+    stats_shard_t *shard = stats_shard(alloc);
+
+    if (ptr == NULL) {
+        __atomic_fetch_add(&shard->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    __atomic_fetch_add(&shard->allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&shard->bytes, size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&shard->hist[stats_bucket(size)], 1, __ATOMIC_RELAXED);
+
+    /* Threads may share a shard: only raise the peak. */
+    long inuse = __atomic_add_fetch(&shard->inuse, 1, __ATOMIC_RELAXED);
+    long peak = __atomic_load_n(&shard->peak, __ATOMIC_RELAXED);
+
+    while ((inuse > peak) &&
+           !__atomic_compare_exchange_n(&shard->peak, &peak, inuse, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static inline void stats_free(allocator_t *alloc, int error)
+{
+    stats_shard_t *shard = stats_shard(alloc);
+
+    if (error)
+        __atomic_fetch_add(&shard->failed, 1, __ATOMIC_RELAXED);
+    else {
+        __atomic_fetch_add(&shard->frees, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&shard->inuse, 1, __ATOMIC_RELAXED);
+    }
+}
+
 static const char *get_lock_str(vmem_locktype_t lock_type)
 {
     const char *none_str = "NONE";
@@ -177,11 +278,14 @@ static const char *get_alloc_str(const allocator_t *alloc)
     const char *sys_str = "SYSTEM";
     const char *def_str = "DEFAULT";
     const char *pool_str = "POOL";
+    const char *cache_str = "CACHE";
 
     if (alloc == &alloc_sys_)
         return sys_str;
     else if (alloc == &alloc_def_)
         return def_str;
+    else if (vmem_pool_get_name(alloc->pool) != NULL)
+        return cache_str;
     else
         return pool_str;
 }
@@ -250,67 +354,74 @@ vmem_alloc_t vmem_alloc_default(void)
 }
 
 /*
- * Create a pool allocator with a pool of a number of elements of the same size.
+ * Wrap a pool into an allocator and add it to the chain of allocators.
+ * The pool is released on failure.
  */
-vmem_alloc_t vmem_alloc_create_pool(size_t size, ulong_t nr_elem, vmem_locktype_t lock_type)
+static allocator_t *alloc_create(vmem_pool_t pool, vmem_locktype_t lock_type)
 {
-    /* Create allocator. */
-    allocator_t *alloc = (allocator_t *) calloc(1, sizeof(allocator_t));
-
-    /* Create and initialize pool. */
-    if (alloc) {
-        alloc->pool = vmem_pool_create(size, nr_elem);
-
-        if (alloc->pool == NULL) {
-            free(alloc);
-            alloc = NULL;
-        }
+    if (pool == NULL)
+        return NULL;
+
+    /* Create allocator (aligned, to keep statistics shards on their own cache line). */
+    allocator_t *alloc = NULL;
+    if (posix_memalign((void **) &alloc, VMEM_STATS_CACHELINE, sizeof(allocator_t))) {
+        vmem_pool_delete(pool);
+        return NULL;
     }
+    memset(alloc, 0, sizeof(allocator_t));
+
+    alloc->pool = pool;
 
     /* Create and initialize pool lock. */
-    if (alloc) {
-        if (lock_type == vmem_locktype_none) {
-            alloc->lock_type = vmem_locktype_none;
-            alloc->pool_lock = NULL;
-        } else {
-            alloc->lock_type = vmem_locktype_mutex;
-            alloc->pool_lock = malloc(sizeof(pthread_mutex_t));
+    if (lock_type == vmem_locktype_none) {
+        alloc->lock_type = vmem_locktype_none;
+        alloc->pool_lock = NULL;
+    } else {
+        alloc->lock_type = vmem_locktype_mutex;
+        alloc->pool_lock = malloc(sizeof(pthread_mutex_t));
 
-            if (alloc->pool_lock) {
-                pthread_mutexattr_t mutex_attr;
+        if (alloc->pool_lock) {
+            pthread_mutexattr_t mutex_attr;
 
-                pthread_mutexattr_init(&mutex_attr);
-                /* See pthread.h and features.h */
+            pthread_mutexattr_init(&mutex_attr);
+            /* See pthread.h and features.h */
 #ifdef __USE_UNIX98
-                pthread_mutexattr_setprotocol(&mutex_attr, PTHREAD_PRIO_INHERIT);
+            pthread_mutexattr_setprotocol(&mutex_attr, PTHREAD_PRIO_INHERIT);
 #endif
-                pthread_mutex_init((pthread_mutex_t *) alloc->pool_lock, &mutex_attr);
-                pthread_mutexattr_destroy(&mutex_attr);
-            } else {
-                free(alloc->pool);
-                free(alloc);
-                alloc = NULL;
-            }
+            pthread_mutex_init((pthread_mutex_t *) alloc->pool_lock, &mutex_attr);
+            pthread_mutexattr_destroy(&mutex_attr);
+        } else {
+            vmem_pool_delete(pool);
+            free(alloc);
+            return NULL;
         }
     }
 
     /* Initialize allocator. */
-    if (alloc) {
-        alloc->alloc_lock = &alloc_lock_;
-        alloc->options = 0u;
+    alloc->alloc_lock = &alloc_lock_;
+    alloc->options = 0u;
 
-        chain_lock();
+    chain_lock();
 
-        /* Initially, install the default callback functions. */
-        alloc->log_cb = default_log_cb_;
-        alloc->err_cb = default_err_cb_;
+    /* Initially, install the default callback functions. */
+    alloc->log_cb = default_log_cb_;
+    alloc->err_cb = default_err_cb_;
 
-        /* Add allocator to the chain of existing allocators. */
-        alloc->next = chain_head_;
-        chain_head_ = alloc;
+    /* Add allocator to the chain of existing allocators. */
+    alloc->next = chain_head_;
+    chain_head_ = alloc;
 
-        chain_unlock();
-    }
+    chain_unlock();
+
+    return alloc;
+}
+
+/*
+ * Create a pool allocator with a pool of a number of elements of the same size.
+ */
+vmem_alloc_t vmem_alloc_create_pool(size_t size, ulong_t nr_elem, vmem_locktype_t lock_type)
+{
+    allocator_t *alloc = alloc_create(vmem_pool_create(size, nr_elem), lock_type);
 
     /* Try to log on system allocator (since logging cannot be enabled yet on this allocator). */
     int error = (alloc == NULL);
@@ -320,6 +431,80 @@ vmem_alloc_t vmem_alloc_create_pool(size_t size, ulong_t nr_elem, vmem_locktype_
     return (vmem_alloc_t) alloc;
 }
 
+/*
+ * Create an object cache: a growing, thread-safe pool of constructed objects.
+ */
+vmem_alloc_t vmem_cache_create(const char *name, size_t size, size_t align,
+                               vmem_cache_ctor_t ctor, vmem_cache_dtor_t dtor)
+{
+    allocator_t *alloc = alloc_create(vmem_pool_cache_create(name, size, align, ctor, dtor),
+                                      vmem_locktype_mutex);
+
+    int error = (alloc == NULL);
+    invoke_cb_cond(&alloc_sys_, error, "%s(name=%s, size=%zu, align=%zu) = %p",
+                   __FUNCTION__, name ? name : "", size, align, alloc);
+
+    return (vmem_alloc_t) alloc;
+}
+
+void *vmem_cache_alloc(vmem_alloc_t cache)
+{
+    allocator_t *alloc = (allocator_t *) cache;
+
+    return vmem_malloc(cache, alloc ? vmem_pool_get_size(alloc->pool) : 0);
+}
+
+void *vmem_cache_free(vmem_alloc_t cache, void *obj)
+{
+    return vmem_free(cache, obj);
+}
+
+ulong_t vmem_cache_shrink(vmem_alloc_t cache)
+{
+    allocator_t *alloc = (allocator_t *) cache;
+    ulong_t released;
+
+    if ((alloc == NULL) || (vmem_pool_get_name(alloc->pool) == NULL))
+        return 0;
+
+    pool_lock(alloc);
+
+    released = vmem_pool_shrink(alloc->pool);
+
+    pool_unlock(alloc);
+
+    return released;
+}
+
+vmem_error_t vmem_cache_destroy(vmem_alloc_t cache)
+{
+    allocator_t *alloc = (allocator_t *) cache;
+    allocator_t **prev;
+
+    if ((alloc == NULL) || (vmem_pool_get_name(alloc->pool) == NULL))
+        return vmem_error_failure;
+
+    /* Remove allocator from the chain, so iterators no longer see it. */
+    chain_lock();
+
+    for (prev = &chain_head_; *prev != NULL; prev = &(*prev)->next) {
+        if (*prev == alloc) {
+            *prev = alloc->next;
+            break;
+        }
+    }
+
+    chain_unlock();
+
+    vmem_pool_delete(alloc->pool);
+
+    pthread_mutex_destroy((pthread_mutex_t *) alloc->pool_lock);
+    free(alloc->pool_lock);
+    free(alloc);
+
+    return vmem_error_success;
+}
+
 /*
  * Delete a pool allocator with its pool of elements.
  */
@@ -367,6 +552,9 @@ void *vmem_malloc(vmem_alloc_t allocator, size_t size)
         pool_unlock(alloc);
     }
 
+    if (alloc != &alloc_sys_)
+        stats_alloc(alloc, ptr, size);
+
     int error = (ptr == NULL);
     invoke_cb_cond(alloc, error, "%s(allocator=%p, size=%zu) = %p", __FUNCTION__, alloc, size, ptr);
 
@@ -395,6 +583,9 @@ void *vmem_calloc(vmem_alloc_t allocator, size_t size)
         memset(ptr, 0, size);
     }
 
+    if (alloc != &alloc_sys_)
+        stats_alloc(alloc, ptr, size);
+
     int error = (ptr == NULL);
     invoke_cb_cond(alloc, error, "%s(allocator=%p, size=%zu) = %p", __FUNCTION__, alloc, size, ptr);
 
@@ -425,6 +616,9 @@ void *vmem_free(vmem_alloc_t allocator, void *ptr)
         pool_unlock(alloc);
     }
 
+    if ((alloc != &alloc_sys_) && (ptr != NULL))
+        stats_free(alloc, (ret_ptr != NULL));
+
     int error = (ret_ptr != NULL);
     invoke_cb_cond(alloc, error, "%s(allocator=%p, ptr=%p) = %p", __FUNCTION__, alloc, ptr, ret_ptr);
 
@@ -463,6 +657,9 @@ void *vmem_memalign(vmem_alloc_t allocator, size_t align, size_t size)
         ptr = NULL;
     }
 
+    if (alloc != &alloc_sys_)
+        stats_alloc(alloc, ptr, size);
+
     int error = (ptr == NULL);
     invoke_cb_cond(alloc, error, "%s(allocator=%p, align=%zu, size=%zu) = %p", __FUNCTION__, alloc, align, size, ptr);
 
@@ -488,6 +685,14 @@ void *vmem_realloc(vmem_alloc_t allocator, void *ptr, size_t size)
         new_ptr = NULL;
     }
 
+    /* Account a successful realloc as a free of the old block and an allocation of the new one. */
+    if (alloc != &alloc_sys_) {
+        if ((ptr != NULL) && ((new_ptr != NULL) || (size == 0)))
+            stats_free(alloc, 0);
+        if (size != 0)
+            stats_alloc(alloc, new_ptr, size);
+    }
+
     int error = (new_ptr == NULL);
     invoke_cb_cond(alloc, error, "%s(allocator=%p, ptr=%p, size=%zu) = %p", __FUNCTION__, alloc, ptr, size, new_ptr);
 
@@ -587,6 +792,45 @@ vmem_cb_t vmem_install_error_callback(vmem_alloc_t allocator, vmem_cb_t err_cb)
     return prev;
 }
 
+/*
+ * Aggregate the statistics shards of an allocator, with the rate since the previous call
+ * of the same reader.
+ */
+static void vmem_alloc_collect_stats(allocator_t *alloc, vmem_alloc_stats_t *stats,
+                                     rate_consumer_t consumer)
+{
+    rate_sample_t *sample = &alloc->rate[consumer];
+    struct timespec now;
+    unsigned i, j;
+
+    memset(stats, 0, sizeof(*stats));
+
+    for (i = 0; i < VMEM_STATS_SHARDS; i++) {
+        stats_shard_t *shard = &alloc->stats[i];
+
+        stats->allocs += __atomic_load_n(&shard->allocs, __ATOMIC_RELAXED);
+        stats->frees += __atomic_load_n(&shard->frees, __ATOMIC_RELAXED);
+        stats->peak += (ulong_t)MAX(__atomic_load_n(&shard->peak, __ATOMIC_RELAXED), 0L);
+        stats->failed += __atomic_load_n(&shard->failed, __ATOMIC_RELAXED);
+        stats->bytes += __atomic_load_n(&shard->bytes, __ATOMIC_RELAXED);
+        for (j = 0; j < VMEM_STATS_HIST_BUCKETS; j++)
+            stats->hist[j] += __atomic_load_n(&shard->hist[j], __ATOMIC_RELAXED);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    alloc_lock(alloc);
+
+    long elapsed_ms = (now.tv_sec - sample->ts.tv_sec) * 1000 +
+                      (now.tv_nsec - sample->ts.tv_nsec) / 1000000;
+    if ((sample->ts.tv_sec != 0) && (elapsed_ms > 0))
+        stats->rate = ((stats->allocs - sample->allocs) * 1000) / elapsed_ms;
+    sample->ts = now;
+    sample->allocs = stats->allocs;
+
+    alloc_unlock(alloc);
+}
+
 /*
  * Dump allocator info (using the specfied write callback function).
  */
@@ -617,6 +861,24 @@ void vmem_alloc_print(vmem_alloc_t allocator,
              get_lock_str(alloc->lock_type), alloc->pool_lock, alloc->pool);
     print_cb(cb_arg, buf);
 
+    vmem_alloc_stats_t stats;
+    char hist[VMEM_STATS_HIST_BUCKETS * 24];
+    int offset = 0;
+    unsigned i;
+
+    vmem_alloc_collect_stats(alloc, &stats, rate_print);
+
+    snprintf(buf, sizeof(buf), "\tallocs=%lu,frees=%lu,inuse=%lu,peak=%lu,failed=%lu  bytes=%lu  rate=%lu/s\n",
+             stats.allocs, stats.frees, stats.allocs - stats.frees, stats.peak, stats.failed, stats.bytes,
+             stats.rate);
+    print_cb(cb_arg, buf);
+
+    for (i = 0; i < VMEM_STATS_HIST_BUCKETS; i++)
+        offset += snprintf(&hist[offset], sizeof(hist) - offset, "%s%lu", i ? "," : "", stats.hist[i]);
+    print_cb(cb_arg, "\thist(16B..256KB+)=");
+    print_cb(cb_arg, hist);
+    print_cb(cb_arg, "\n");
+
     if (alloc->pool) {
         print_cb(cb_arg, "\t\t");
 
@@ -630,6 +892,96 @@ void vmem_alloc_print(vmem_alloc_t allocator,
     }
 }
 
+/*
+ * Statistics for the API callers, who share one rate sample.
+ */
+vmem_error_t vmem_alloc_get_stats(vmem_alloc_t allocator, vmem_alloc_stats_t *stats)
+{
+    allocator_t *alloc = (allocator_t *) allocator;
+
+    if ((alloc == NULL) || (stats == NULL))
+        return vmem_error_failure;
+
+    vmem_alloc_collect_stats(alloc, stats, rate_api);
+
+    return vmem_error_success;
+}
+
+/*
+ * Copy a string into a JSON string body, escaping quotes, backslashes and control characters.
+ */
+static void vmem_json_escape(char *buf, size_t size, const char *str)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t len = 0;
+    unsigned char c;
+
+    for (; (c = (unsigned char)*str) != '\0'; str++) {
+        if ((c == '"') || (c == '\\')) {
+            if (len + 2 >= size)
+                break;
+            buf[len++] = '\\';
+            buf[len++] = c;
+        } else if (c < 0x20) {
+            if (len + 6 >= size)
+                break;
+            buf[len++] = '\\';
+            buf[len++] = 'u';
+            buf[len++] = '0';
+            buf[len++] = '0';
+            buf[len++] = hex[c >> 4];
+            buf[len++] = hex[c & 0xf];
+        } else {
+            if (len + 1 >= size)
+                break;
+            buf[len++] = c;
+        }
+    }
+    buf[len] = '\0';
+}
+
+/*
+ * Dump the statistics of all allocators, one JSON object per line.
+ */
+void vmem_alloc_dump_stats(void (*print_cb)(void *cb_arg, const char *string),
+                           void *cb_arg)
+{
+    vmem_alloc_iter_t iter;
+    vmem_alloc_t curr;
+    vmem_alloc_stats_t stats;
+    char buf[256 + 6 * VMEM_CACHE_NAME_SIZE + VMEM_STATS_HIST_BUCKETS * 24];
+    char name[6 * VMEM_CACHE_NAME_SIZE];
+    int offset;
+    unsigned i;
+
+    if (print_cb == NULL)
+        return;
+
+    chain_lock();
+
+    vmem_alloc_iter_init(&iter);
+    while ((curr = vmem_alloc_iter_next(&iter))) {
+        allocator_t *alloc = (allocator_t *) curr;
+        const char *pool_name = vmem_pool_get_name(alloc->pool);
+
+        vmem_json_escape(name, sizeof(name), pool_name ? pool_name : "");
+        vmem_alloc_collect_stats(alloc, &stats, rate_dump);
+
+        offset = snprintf(buf, sizeof(buf),
+                          "{\"allocator\":\"%p\",\"type\":\"%s\",\"name\":\"%s\","
+                          "\"allocs\":%lu,\"frees\":%lu,\"peak\":%lu,\"failed\":%lu,\"bytes\":%lu,\"rate\":%lu,\"hist\":[",
+                          alloc, get_alloc_str(alloc), name,
+                          stats.allocs, stats.frees, stats.peak, stats.failed, stats.bytes, stats.rate);
+        for (i = 0; i < VMEM_STATS_HIST_BUCKETS; i++)
+            offset += snprintf(&buf[offset], sizeof(buf) - offset, "%s%lu", i ? "," : "", stats.hist[i]);
+        snprintf(&buf[offset], sizeof(buf) - offset, "]}\n");
+
+        print_cb(cb_arg, buf);
+    }
+
+    chain_unlock();
+}
+
 /*
  * (Re)initialize vmem_alloc_t iterator.
  */
@@ -1,7 +1,9 @@
 #include <sys/param.h>  /* roundup, MAX */
 #include <stddef.h>     /* offsetof */
 #include <stdlib.h>     /* malloc */
+#include <limits.h>     /* ULONG_MAX */
 #include <stdio.h>      /* snprintf */
+#include <string.h>     /* strncpy */
 
 #include <libvapi/vlist.h>
 #include "vmem_pool.h"
@@ -21,34 +23,119 @@ typedef union {
 }
 ymax_align_t;
 
+/*
+ * Free list accounting only: allocation/failure counters are kept lock-free
+ * per allocator (see vmem.c).
+ */
 typedef struct {
     ulong_t current;
     ulong_t lowest;
     ulong_t max;
-    ulong_t total;
-    ulong_t failed;
 }
 pool_stats_t;
 
 typedef struct {
     char *buf_begin;
     char *buf_end;
+    ulong_t nr_free;    /* Only valid while shrinking. */
     vlist_t node;
 }
 pool_entry_t;
 
+/*
+ * Object cache: blocks hold constructed objects, so the free list link is kept
+ * behind the object instead of overlaying its first bytes.
+ */
+typedef struct {
+    char name[VMEM_CACHE_NAME_SIZE];
+    size_t obj_size;
+    vmem_cache_ctor_t ctor;
+    vmem_cache_dtor_t dtor;
+    ulong_t constructed;
+    ulong_t destructed;
+    ulong_t released;
+}
+pool_cache_t;
+
 typedef struct {
     void *head;
     void *tail;
 
     ulong_t size;
     ulong_t max_elem;
+    ulong_t align;
+    ulong_t link_offset;    /* Offset of the free list link within a block. */
 
     vlist_t pool_list;
+    pool_entry_t **entries; /* Chunks sorted by address, to find the chunk of a block. */
+    size_t nr_entries;
+    size_t max_entries;
     pool_stats_t stats;
+    pool_cache_t *cache;    /* NULL for plain pools. */
 }
 pool_t;
 
+/* Objects per chunk of an object cache are chosen to fill this many bytes. */
+#define VMEM_CACHE_CHUNK_SIZE   4096
+#define VMEM_CACHE_MIN_ELEM     8
+
+static inline void **pool_link(const pool_t *top, void *block)
+{
+    return (void **)((char *)block + top->link_offset);
+}
+
+/* Index of the first chunk not below ptr, by binary search of the chunks sorted by address. */
+static size_t vmem_pool_entry_index(const pool_t *top, const void *ptr)
+{
+    size_t lo = 0, hi = top->nr_entries, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if ((const char *)ptr < top->entries[mid]->buf_end)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return lo;
+}
+
+/* Chunk holding ptr, NULL if it is not a block of this pool. */
+static pool_entry_t *vmem_pool_find_entry(const pool_t *top, const void *ptr)
+{
+    size_t i = vmem_pool_entry_index(top, ptr);
+
+    if ((i == top->nr_entries) || ((const char *)ptr < top->entries[i]->buf_begin))
+        return NULL;
+
+    return top->entries[i];
+}
+
+static int vmem_pool_insert_entry(pool_t *top, pool_entry_t *pool_entry)
+{
+    pool_entry_t **entries;
+    size_t i;
+
+    if (top->nr_entries == top->max_entries) {
+        size_t max_entries = top->max_entries ? (2 * top->max_entries) : 4;
+
+        entries = (pool_entry_t **)realloc(top->entries, max_entries * sizeof(*entries));
+        if (entries == NULL)
+            return 0;
+        top->entries = entries;
+        top->max_entries = max_entries;
+    }
+
+    i = vmem_pool_entry_index(top, pool_entry->buf_begin);
+    memmove(&top->entries[i + 1], &top->entries[i], (top->nr_entries - i) * sizeof(*top->entries));
+    top->entries[i] = pool_entry;
+    top->nr_entries++;
+
+    vlist_add_tail(&top->pool_list, &pool_entry->node);
+
+    return 1;
+}
+
 static ulong_t vmem_pool_get_elem(ulong_t nr_elem, size_t block_size)
 {
     ulong_t pool_elem = nr_elem;
@@ -64,7 +151,7 @@ static ulong_t vmem_pool_get_elem(ulong_t nr_elem, size_t block_size)
 static int vmem_pool_extend(vmem_pool_t pool)
 {
     pool_t *top = (pool_t *)pool;
-    size_t cnt = vlist_count(&top->pool_list);
+    size_t cnt = top->nr_entries;
 
     if ((cnt * top->max_elem) >= top->stats.max)
         return 0;
@@ -73,9 +160,15 @@ static int vmem_pool_extend(vmem_pool_t pool)
      * Round up pool header sizes to multiple of most restrictive alignment constraint
      * (to enforce proper alignment of first block after header).
      * */
-    size_t pool_header_size = roundup(sizeof(pool_entry_t), yalignof(ymax_align_t));
-
-    void *pool_ptr = malloc(pool_header_size + (top->size * top->max_elem));
+    size_t pool_header_size = roundup(sizeof(pool_entry_t), top->align);
+
+    void *pool_ptr = NULL;
+    if (top->align > yalignof(ymax_align_t)) {
+        if (posix_memalign(&pool_ptr, top->align, pool_header_size + (top->size * top->max_elem)))
+            pool_ptr = NULL;
+    } else {
+        pool_ptr = malloc(pool_header_size + (top->size * top->max_elem));
+    }
     if (pool_ptr == NULL) {
         return 0;
     }
@@ -84,16 +177,23 @@ static int vmem_pool_extend(vmem_pool_t pool)
     pool_entry->buf_begin = (char *)pool_ptr + pool_header_size;
     pool_entry->buf_end = pool_entry->buf_begin + (top->size * top->max_elem);
 
-    vlist_add_tail(&top->pool_list, &pool_entry->node);
+    if (!vmem_pool_insert_entry(top, pool_entry)) {
+        free(pool_ptr);
+        return 0;
+    }
 
-    /* Build linked list of blocks. */
+    /* Build linked list of blocks, constructing cached objects once. */
     ulong_t i;
     void **prev_ptr = &top->head;
     char *curr = pool_entry->buf_begin;
 
     for (i = 0; i < top->max_elem; i++) {
+        if (top->cache && top->cache->ctor) {
+            top->cache->ctor(curr);
+            top->cache->constructed++;
+        }
         *prev_ptr = curr;
-        prev_ptr = (void **)curr;
+        prev_ptr = pool_link(top, curr);
         curr += top->size;
     }
 
@@ -101,7 +201,7 @@ static int vmem_pool_extend(vmem_pool_t pool)
     *prev_ptr = 0;
 
     /* Keep the tail for releasing buffers to. */
-    top->tail = prev_ptr;
+    top->tail = curr - top->size;
 
     return 1;
 }
@@ -131,8 +231,12 @@ vmem_pool_t vmem_pool_create(size_t size, ulong_t nr_elem)
 
     top->max_elem = pool_elem;
     top->size = block_size;   /* Note: size would be more restrictive than block_size. */
+    top->align = yalignof(ymax_align_t);
+    top->link_offset = 0;
     top->stats.max = top->stats.current = top->stats.lowest = nr_elem;
-    top->stats.total = top->stats.failed = 0;
+    top->cache = NULL;
+    top->entries = NULL;
+    top->nr_entries = top->max_entries = 0;
     vlist_init(&top->pool_list);
 
     if (!vmem_pool_extend(top)) {
@@ -149,24 +253,21 @@ void *vmem_pool_alloc(vmem_pool_t pool, size_t size)
     if (p == NULL)
         return NULL;
 
-    if (size > p->size) {
-        p->stats.failed++;
+    if (size > p->size)
         return NULL;
-    }
 
     void *ptr = p->head;
-    if (ptr == NULL) {
-        p->stats.failed++;
+    if (ptr == NULL && vmem_pool_extend(p))
+        ptr = p->head;
+    if (ptr == NULL)
         return NULL;
-    }
 
-    p->head = *(void **)ptr;
+    p->head = *pool_link(p, ptr);
     if (p->head == NULL && !vmem_pool_extend(p)) {
         p->tail = NULL;
     }
 
     p->stats.current--;
-    p->stats.total++;
     if (p->stats.current < p->stats.lowest)
         p->stats.lowest = p->stats.current;
 
@@ -182,29 +283,19 @@ void *vmem_pool_free(vmem_pool_t pool, void *ptr)
     if (ptr == NULL)
         return NULL;
 
-    /* Check whether buffer to free belongs to this pool. */
-    vlist_t *node;
-    pool_entry_t *pool_entry = NULL;
-    bool pool_found = false;
-
-    vlist_foreach(&top->pool_list, node) {
-        pool_entry = container_of(pool_entry_t, node, node);
-        if (((char *)ptr < pool_entry->buf_begin) || (pool_entry->buf_end <= (char *)ptr)) {
-            continue;
-        } else {
-            pool_found = true;
-            break;
-        }
-    }
+    /* Check whether buffer to free belongs to this pool, in O(log chunks). */
+    pool_entry_t *pool_entry = vmem_pool_find_entry(top, ptr);
+    if (pool_entry == NULL)
+        return ptr;
 
-    if (!pool_found) {
+    /* Cached objects must be returned at the start of a block. */
+    if (top->cache && (((char *)ptr - pool_entry->buf_begin) % top->size) != 0)
         return ptr;
-    }
 
     /* Add newly freed buffer at the end. */
-    *(void **)ptr = NULL;
+    *pool_link(top, ptr) = NULL;
     if (top->tail != NULL)
-        *(void **)top->tail = ptr;
+        *pool_link(top, top->tail) = ptr;
     top->tail = ptr;
 
     if (top->head == NULL)
@@ -231,11 +322,183 @@ void vmem_pool_print(vmem_pool_t pool,
     vlist_t *node;
     pool_entry_t *pool_entry = NULL;
 
-    offset += snprintf(&buf[offset], sizeof(buf) - offset - 1, "size=%ld  max=%ld,curr=%ld,low=%ld,total=%ld,fail=%ld\n",
-                       p->size, p->stats.max, p->stats.current, p->stats.lowest, p->stats.total, p->stats.failed);
+    if (p->cache) {
+        offset += snprintf(&buf[offset], sizeof(buf) - offset - 1,
+                           "cache=%s  objsize=%zu,align=%lu  inuse=%lu,hwm=%lu  ctor=%lu,dtor=%lu,released=%lu\n",
+                           p->cache->name, p->cache->obj_size, p->align,
+                           p->stats.max - p->stats.current, p->stats.max - p->stats.lowest,
+                           p->cache->constructed, p->cache->destructed, p->cache->released);
+        offset += snprintf(&buf[offset], sizeof(buf) - offset - 1, "\t\tsize=%lu  chunks=%zu\n",
+                           p->size, p->nr_entries);
+    } else {
+        offset += snprintf(&buf[offset], sizeof(buf) - offset - 1, "size=%ld  max=%ld,curr=%ld,low=%ld\n",
+                           p->size, p->stats.max, p->stats.current, p->stats.lowest);
+    }
     vlist_foreach(&p->pool_list, node) {
+        /* Caches grow on demand: stop listing chunks once the buffer is full. */
+        if (offset >= (int)sizeof(buf) - 64)
+            break;
         pool_entry = container_of(pool_entry_t, node, node);
         offset += snprintf(&buf[offset], sizeof(buf) - offset - 1, "\t\tmax=%ld  start=%p,end=%p\n", p->max_elem, pool_entry->buf_begin, pool_entry->buf_end);
     }
     print_cb(cb_arg, buf);
 }
+
+vmem_pool_t vmem_pool_cache_create(const char *name, size_t size, size_t align,
+                                   vmem_cache_ctor_t ctor, vmem_cache_dtor_t dtor)
+{
+    if ((name == NULL) || (size == 0))
+        return NULL;
+
+    /* Alignment must be a power of two; never go below the pool default. */
+    if (align & (align - 1))
+        return NULL;
+    align = MAX(align, yalignof(ymax_align_t));
+
+    /* Object followed by its free list link, padded to keep the next object aligned. */
+    size_t link_offset = roundup(size, sizeof(void *));
+    size_t block_size = roundup(link_offset + sizeof(void *), align);
+
+    pool_t *top = (pool_t *)calloc(1, sizeof(pool_t));
+    if (top == NULL)
+        return NULL;
+
+    top->cache = (pool_cache_t *)calloc(1, sizeof(pool_cache_t));
+    if (top->cache == NULL) {
+        free(top);
+        return NULL;
+    }
+
+    strncpy(top->cache->name, name, sizeof(top->cache->name) - 1);
+    top->cache->obj_size = size;
+    top->cache->ctor = ctor;
+    top->cache->dtor = dtor;
+
+    top->max_elem = MAX(VMEM_CACHE_CHUNK_SIZE / block_size, VMEM_CACHE_MIN_ELEM);
+    top->size = block_size;
+    top->align = align;
+    top->link_offset = link_offset;
+    /* A cache grows on demand: in-use count is (max - current). */
+    top->stats.max = top->stats.current = top->stats.lowest = ULONG_MAX;
+    vlist_init(&top->pool_list);
+
+    if (!vmem_pool_extend(top)) {
+        free(top->cache);
+        free(top);
+        return NULL;
+    }
+
+    return (vmem_pool_t)top;
+}
+
+const char *vmem_pool_get_name(vmem_pool_t pool)
+{
+    pool_t *top = (pool_t *)pool;
+
+    if ((top == NULL) || (top->cache == NULL))
+        return NULL;
+
+    return top->cache->name;
+}
+
+size_t vmem_pool_get_size(vmem_pool_t pool)
+{
+    pool_t *top = (pool_t *)pool;
+
+    if (top == NULL)
+        return 0;
+
+    return top->cache ? top->cache->obj_size : top->size;
+}
+
+static void vmem_pool_release_entry(pool_t *top, pool_entry_t *pool_entry)
+{
+    size_t i = vmem_pool_entry_index(top, pool_entry->buf_begin);
+    char *curr;
+
+    if (top->cache && top->cache->dtor) {
+        for (curr = pool_entry->buf_begin; curr < pool_entry->buf_end; curr += top->size) {
+            top->cache->dtor(curr);
+            top->cache->destructed++;
+        }
+    }
+
+    top->nr_entries--;
+    memmove(&top->entries[i], &top->entries[i + 1], (top->nr_entries - i) * sizeof(*top->entries));
+
+    vlist_delete(&pool_entry->node);
+    free(pool_entry);
+}
+
+ulong_t vmem_pool_shrink(vmem_pool_t pool)
+{
+    pool_t *top = (pool_t *)pool;
+    vlist_t *node;
+    pool_entry_t *pool_entry;
+    ulong_t released = 0;
+    void *ptr;
+
+    if (top == NULL)
+        return 0;
+
+    vlist_foreach(&top->pool_list, node) {
+        pool_entry = container_of(pool_entry_t, node, node);
+        pool_entry->nr_free = 0;
+    }
+
+    /* Free objects are matched to their chunk in O(log chunks). */
+    for (ptr = top->head; ptr != NULL; ptr = *pool_link(top, ptr)) {
+        pool_entry = vmem_pool_find_entry(top, ptr);
+        if (pool_entry)
+            pool_entry->nr_free++;
+    }
+
+    /* Keep the first chunk around, like vmem_pool_create does. */
+    vlist_get_head(&top->pool_list, node);
+    container_of(pool_entry_t, node, node)->nr_free = 0;
+
+    /* Unlink the blocks of completely free chunks from the free list. */
+    void **prev_ptr = &top->head;
+    void *last = NULL;
+
+    for (ptr = top->head; ptr != NULL; ptr = *pool_link(top, ptr)) {
+        pool_entry = vmem_pool_find_entry(top, ptr);
+        if (pool_entry && (pool_entry->nr_free == top->max_elem))
+            continue;
+        *prev_ptr = ptr;
+        prev_ptr = pool_link(top, ptr);
+        last = ptr;
+    }
+    *prev_ptr = NULL;
+    top->tail = last;
+
+    vlist_foreach(&top->pool_list, node) {
+        pool_entry = container_of(pool_entry_t, node, node);
+        if (pool_entry->nr_free != top->max_elem)
+            continue;
+        vmem_pool_release_entry(top, pool_entry);
+        released++;
+    }
+
+    if (top->cache)
+        top->cache->released += released;
+
+    return released;
+}
+
+void vmem_pool_delete(vmem_pool_t pool)
+{
+    pool_t *top = (pool_t *)pool;
+    vlist_t *node;
+
+    if (top == NULL)
+        return;
+
+    vlist_foreach(&top->pool_list, node) {
+        vmem_pool_release_entry(top, container_of(pool_entry_t, node, node));
+    }
+
+    free(top->entries);
+    free(top->cache);
+    free(top);
+}
@@ -14,6 +14,12 @@ typedef void *vmem_pool_t;
 vmem_pool_t vmem_pool_create(size_t size, ulong_t nr_elem);
 void *vmem_pool_alloc(vmem_pool_t pool, size_t size);
 void *vmem_pool_free(vmem_pool_t pool, void *ptr);
+vmem_pool_t vmem_pool_cache_create(const char *name, size_t size, size_t align,
+                                   vmem_cache_ctor_t ctor, vmem_cache_dtor_t dtor);
+const char *vmem_pool_get_name(vmem_pool_t pool);
+size_t vmem_pool_get_size(vmem_pool_t pool);
+ulong_t vmem_pool_shrink(vmem_pool_t pool);
+void vmem_pool_delete(vmem_pool_t pool);
 void vmem_pool_print(vmem_pool_t pool,
                      void (*print_cb)(void *cb_arg, const char *string),
                      void *cb_arg);
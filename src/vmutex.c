@@ -4,8 +4,10 @@
 #include <libvapi/vlog.h>
 #include <libvapi/vmem.h>
 #include <libvapi/vmutex.h>
+#include <libvapi/vlog_span.h>
 
 #include "vlog_vapi.h"
+#include "vloop_trace.h"
 
 int vmutex_create(vthread_mutex_t *mutex)
 {
@@ -37,54 +39,66 @@ int vmutex_create(vthread_mutex_t *mutex)
 
     mutex->jsonopentracer_context = NULL;
     mutex->jsonopentracer_context_size = 0;
+    mutex->span_name = VLOG_SPAN_NAME_NONE;
 
 _vmutex_create_cleanup:
     (void)pthread_mutexattr_destroy(&attrib);
     return rc;
 }
 
+/* Start the span of a lock, as child of the context attached to the mutex if any */
+static vlog_span_name_t vmutex_span_start(vthread_mutex_t *mutex)
+{
+    vlog_span_name_t span_name = vlog_span_name_get_or_register(&mutex->span_name, "vmutex_%p", mutex);
+
+    if (vlog_span_start(span_name, VLOG_SPAN_CHILD_OF, mutex->jsonopentracer_context,
+                        mutex->jsonopentracer_context_size) != 0)
+        return VLOG_SPAN_NAME_NONE;
+
+    return span_name;
+}
+
+/* Only a lock that has to wait is traced */
+static int vmutex_lock_traced(vthread_mutex_t *mutex)
+{
+    int res;
+
+    if (pthread_mutex_trylock(&(mutex->mutex_id)) == 0)
+        return 0;
+
+    vloop_trace_begin(VLOOP_TRACE_MUTEX_WAIT, mutex);
+    res = pthread_mutex_lock(&(mutex->mutex_id));
+    vloop_trace_end(VLOOP_TRACE_MUTEX_WAIT, mutex);
+
+    return res;
+}
+
 int vmutex_lock(vthread_mutex_t *mutex)
 {
-    if (vlog_level_enabled_on_vapi_component(VMUTEX_INDEX)) {
-        int ret = VAPI_FAILURE;
-        char span_name[VLOG_MAX_SPAN_NAME] = {0};
-        snprintf(span_name, VLOG_MAX_SPAN_NAME - 1, "vmutex_%p", mutex);
-
-        if (mutex->jsonopentracer_context != NULL && mutex->jsonopentracer_context_size > 0) {
-            ret = vlog_start_child_span(span_name, mutex->jsonopentracer_context, mutex->jsonopentracer_context_size);
-        } else {
-            ret = vlog_start_parent_span(span_name);
-        }
-
-        if (ret == VAPI_FAILURE) {
-            vlog_notag_printf(0, VLOG_WARNING, "vmutex: cannot start span %s", span_name);
-        } else {
-            vmutex_attach_span_context_to_mutex(mutex, span_name);
-        }
-    }
+    if (vlog_level_enabled_on_vapi_component(VMUTEX_INDEX))
+        vmutex_span_start(mutex);
+
+    if (vloop_trace_is_enabled())
+        return vmutex_lock_traced(mutex);
 
     return pthread_mutex_lock(&(mutex->mutex_id));
 }
 
 int vmutex_trylock(vthread_mutex_t *mutex)
 {
-    if (vlog_level_enabled_on_vapi_component(VMUTEX_INDEX)) {
-        int ret = VAPI_FAILURE;
-        char span_name[VLOG_MAX_SPAN_NAME] = {0};
-        snprintf(span_name, VLOG_MAX_SPAN_NAME - 1, "vmutex_%p", mutex);
-
-        if (mutex->jsonopentracer_context != NULL && mutex->jsonopentracer_context_size > 0) {
-            ret = vlog_start_child_span(span_name, mutex->jsonopentracer_context, mutex->jsonopentracer_context_size);
-        } else {
-            ret = vlog_start_parent_span(span_name);
-        }
-
-        if (ret == VAPI_FAILURE) {
-            vlog_notag_printf(0, VLOG_WARNING, "vmutex: cannot start span %s", span_name);
-        }
-    }
+    vlog_span_name_t span_name = VLOG_SPAN_NAME_NONE;
+    int res;
+
+    if (vlog_level_enabled_on_vapi_component(VMUTEX_INDEX))
+        span_name = vmutex_span_start(mutex);
+
+    res = pthread_mutex_trylock(&mutex->mutex_id);
 
-    return pthread_mutex_trylock(&mutex->mutex_id);
+    /* no unlock will follow a failed attempt */
+    if (res != 0 && span_name != VLOG_SPAN_NAME_NONE)
+        vlog_span_finish(span_name);
+
+    return res;
 }
 
 int vmutex_timedlock(vthread_mutex_t *mutex, unsigned long timeout_ms)
@@ -114,18 +128,17 @@ int vmutex_unlock(vthread_mutex_t *mutex)
 {
     int res = pthread_mutex_unlock(&(mutex->mutex_id));
 
-    if (vlog_level_enabled_on_vapi_component(VMUTEX_INDEX)) {
-        char span_name[VLOG_MAX_SPAN_NAME] = {0};
-        snprintf(span_name, VLOG_MAX_SPAN_NAME - 1, "vmutex_%p", mutex);
-
-        vlog_finish_span(span_name);
-    }
+    if (vlog_level_enabled_on_vapi_component(VMUTEX_INDEX))
+        vlog_span_finish(mutex->span_name);
 
     return res;
 }
 
 int vmutex_delete(vthread_mutex_t *mutex)
 {
+    vlog_span_name_release(mutex->span_name);
+    mutex->span_name = VLOG_SPAN_NAME_NONE;
+
     if (mutex->jsonopentracer_context != NULL)
         vmem_free(vmem_alloc_default(), mutex->jsonopentracer_context);
 
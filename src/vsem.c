@@ -11,6 +11,7 @@
 
 #include "vlog_vapi.h"
 #include "vloop_internal.h"
+#include "vloop_trace.h"
 
 vlist_t sem_list;
 vthread_mutex_t mtx;
@@ -107,6 +108,7 @@ void vsem_free(vsem_t *sem)
 
 static void finish_sem_wait(vevent_reason_t reason, vsem_ctxt_t *ctxt)
 {
+    vloop_trace_end(VLOOP_TRACE_SEM_WAIT, ctxt);
     event_free(ctxt->lev);
     ctxt->user_cb(reason, ctxt->user_ctxt);
     vmem_free(vmem_alloc_default(), ctxt);
@@ -181,6 +183,8 @@ vevent_t *vsem_wait(vsem_t *sem, vsem_cb_t user_cb, void *user_ctxt)
     ctxt->user_cb = user_cb;
     ctxt->user_ctxt = user_ctxt;
 
+    vloop_trace_begin(VLOOP_TRACE_SEM_WAIT, ctxt);
+
     return yev;
 }
 
@@ -188,11 +188,17 @@ static void fatal_error_record(const char *file, int line, siginfo_t *si)
 
 static void fatal_signal_handler(int signum, siginfo_t *si, void *ucontext)
 {
+    /* Get pending asynchronous log records out before the crash report */
+    vlog_async_flush_asyncsignalsafe();
+
     /* Generate error record. If SIGABRT was raised via ysignal_abort,
      * the error record was already printed there */
     if (!(signum == SIGABRT && abort_expected))
         asyncsignalsafe_fatal_error_record(__FILE__, __LINE__, si, ucontext);
 
+    /* Last traces of each thread, including the levels not enabled */
+    vlog_flightrec_dump_asyncsignalsafe();
+
     vsystem_stop_childs();
 
     /* Call system default handler (restored by SA_RESETHAND) which
@@ -21,6 +21,7 @@
 
 #include "vsignal.h"
 #include "vloop_internal.h"
+#include "vloop_trace.h"
 #include "vlog_vapi.h"
 
 typedef struct vsystem_command {
@@ -129,6 +130,7 @@ static inline void _terminate(vsystem_command_t *cmd, vevent_reason_t reason, in
     if (cmd->hat_event) {
         vevent_delete(cmd->hat_event);
     }
+    vloop_trace_end(VLOOP_TRACE_EXEC, cmd);
     vmem_free(vmem_alloc_default(), cmd);
 }
 
@@ -404,6 +406,8 @@ vevent_t *vsystem_exec1(char **command, vsystem_terminate_cb_t on_terminate, vsy
     if (vmutex_unlock(&g_cmdlist_lock) != 0)
         vapi_error("Unable to release lock!");
 
+    vloop_trace_begin(VLOOP_TRACE_EXEC, new_cmd);
+
     if (child_pid)
         *child_pid = new_cmd->pid;
 
@@ -656,6 +660,9 @@ vevent_t *vsystem_exec_extend(char **command, char **env, char *work_dir,
     if (vmutex_unlock(&g_cmdlist_lock) != 0) {
         vapi_error("Unable to release lock!");
     }
+
+    vloop_trace_begin(VLOOP_TRACE_EXEC, new_cmd);
+
     return new_cmd->hat_event;
 }
 
@@ -29,6 +29,18 @@ typedef struct vtime_tz_ctx {
     void *user_ctx;
 } vtime_tz_ctx_t;
 
+/* date/time up to the second, see vtime_time_date_str_cached() */
+#define VTIME_DATE_PREFIX_SIZE  (ETIME_TIME_DATE_STR_LEN - 7 + 1)
+
+static unsigned int vtime_date_generation = 1;
+
+static __thread struct {
+    time_t sec;
+    unsigned int generation;
+    int len;
+    char prefix[VTIME_DATE_PREFIX_SIZE];
+} vtime_date_cache;
+
 static int _interval_to_sec(vtime_interval_t intval)
 {
     switch (intval) {
@@ -212,6 +224,51 @@ int vtime_time_date_str(char *buf, int len, struct timespec *time)
     return 0;
 }
 
+int vtime_time_date_str_cached(char *buf, int len, struct timespec *time)
+{
+    unsigned int generation = __atomic_load_n(&vtime_date_generation, __ATOMIC_ACQUIRE);
+    long usec;
+    char *p;
+    int i, ret;
+    struct tm t;
+
+    if (vtime_date_cache.sec != time->tv_sec || vtime_date_cache.generation != generation) {
+        if (vtime_date_cache.generation != generation)
+            tzset();
+        if (localtime_r(&(time->tv_sec), &t) == NULL)
+            return -1;
+
+        ret = strftime(vtime_date_cache.prefix, sizeof(vtime_date_cache.prefix), "%d/%m/%Y-%H:%M:%S", &t);
+        if (ret == 0)
+            return -1;
+
+        vtime_date_cache.len = ret;
+        vtime_date_cache.sec = time->tv_sec;
+        vtime_date_cache.generation = generation;
+    }
+
+    if (vtime_date_cache.len + 8 > len)
+        return -1;
+
+    memcpy(buf, vtime_date_cache.prefix, vtime_date_cache.len);
+    p = &buf[vtime_date_cache.len];
+    *p++ = '.';
+
+    usec = time->tv_nsec / 1000;
+    for (i = 5; i >= 0; i--) {
+        p[i] = '0' + usec % 10;
+        usec /= 10;
+    }
+    p[6] = '\0';
+
+    return 0;
+}
+
+void vtime_time_date_invalidate(void)
+{
+    __atomic_add_fetch(&vtime_date_generation, 1, __ATOMIC_RELEASE);
+}
+
 static const char *gc_timezone_file = "/etc/localtime";
 static const int gc_max_tz_file_path_length = 1024;
 
@@ -9,12 +9,14 @@
 #include <event2/event_struct.h>
 
 #include <libvapi/vlog.h>
+#include <libvapi/vlog_span.h>
 #include <libvapi/vloop.h>
 #include <libvapi/vmem.h>
 #include <libvapi/vtimer.h>
 
 #include "vlog_vapi.h"
 #include "vloop_internal.h"
+#include "vloop_trace.h"
 
 #define USE_LIBEVENT_PERIODIC_TIMER
 
@@ -52,6 +54,7 @@ struct _vtimer {
 
     vlog_opentracing_context_ptr jsonopentracer_context;
     int jsonopentracer_context_size;
+    vlog_span_name_t span_name;     /* interned on the first traced expiry */
 };
 
 static __thread struct _vtimer *g_head;
@@ -68,15 +71,12 @@ static void _int_callback(evutil_socket_t fd, short what, void *arg)
     vtimer_t tmr_handle = (vtimer_t)arg;
     struct _vtimer *tmr = (struct _vtimer *)arg;
 
-    char span_name[VLOG_MAX_SPAN_NAME] = {0};
+    vlog_span_name_t span_name = VLOG_SPAN_NAME_NONE;
     if (vlog_level_enabled_on_vapi_component(VTIMER_INDEX)) {
-        snprintf(span_name, VLOG_MAX_SPAN_NAME - 1, "vtimer_int_callback_%p", arg);
-
-        if (tmr->jsonopentracer_context == NULL || tmr->jsonopentracer_context_size == 0) {
-            vlog_start_parent_span(span_name);
-        } else {
-            vlog_start_follows_from_span(span_name, tmr->jsonopentracer_context, tmr->jsonopentracer_context_size);
-        }
+        span_name = vlog_span_name_get_or_register(&tmr->span_name, "vtimer_int_callback_%p", arg);
+        if (vlog_span_start(span_name, VLOG_SPAN_FOLLOWS_FROM, tmr->jsonopentracer_context,
+                            tmr->jsonopentracer_context_size) != 0)
+            span_name = VLOG_SPAN_NAME_NONE;
     }
 
     if (tmr->type == VTIMER_PERIODIC) {
@@ -93,11 +93,14 @@ static void _int_callback(evutil_socket_t fd, short what, void *arg)
         tmr->state = VTIMER_CREATED;
     }
 
-    tmr->callback(tmr_handle, tmr->user_context);
+    /* the callback may delete the timer */
+    vtimer_cb_t callback = tmr->callback;
+    vloop_trace_begin(VLOOP_TRACE_TIMER, callback);
+    callback(tmr_handle, tmr->user_context);
+    vloop_trace_end(VLOOP_TRACE_TIMER, callback);
 
-    if (vlog_level_enabled_on_vapi_component(VTIMER_INDEX)) {
-        vlog_finish_span(span_name);
-    }
+    if (span_name != VLOG_SPAN_NAME_NONE)
+        vlog_span_finish(span_name);
 }
 
 /*************************************************************************************/
@@ -107,26 +110,18 @@ static int _timerfd_callback(int fd, vloop_event_handle_t event_handle, void *ct
     if (ctx == NULL)
         return -1;
 
-    int ret = VAPI_FAILURE;
-    char span_name[VLOG_MAX_SPAN_NAME] = {0};
-    if (vlog_level_enabled_on_vapi_component(VTIMER_INDEX)) {
-        snprintf(span_name, VLOG_MAX_SPAN_NAME - 1, "vtimer_callback_%p", ctx);
-
-        if (event_handle->jsonopentracer_context == NULL || event_handle->jsonopentracer_context_size == 0) {
-            ret = vlog_start_parent_span(span_name);
-        } else {
-            ret = vlog_start_follows_from_span(span_name, event_handle->jsonopentracer_context, event_handle->jsonopentracer_context_size);
-        }
-
-        if (ret == VAPI_FAILURE) {
-            vlog_notag_printf(0, VLOG_WARNING, "vtimer: cannot start span %s", span_name);
-        }
-    }
-
     uint64_t val = 0;
     vtimer_t tmr_handle = (vtimer_t)ctx;
     struct _vtimer *tmr = (struct _vtimer *)ctx;
 
+    vlog_span_name_t span_name = VLOG_SPAN_NAME_NONE;
+    if (vlog_level_enabled_on_vapi_component(VTIMER_INDEX)) {
+        span_name = vlog_span_name_get_or_register(&tmr->span_name, "vtimer_callback_%p", ctx);
+        if (vlog_span_start(span_name, VLOG_SPAN_FOLLOWS_FROM, event_handle->jsonopentracer_context,
+                            event_handle->jsonopentracer_context_size) != 0)
+            span_name = VLOG_SPAN_NAME_NONE;
+    }
+
     if (tmr->type == VTIMER_ABSTIMEOUT) {
         tmr->state = VTIMER_CREATED;
     }
@@ -134,19 +129,20 @@ static int _timerfd_callback(int fd, vloop_event_handle_t event_handle, void *ct
     if (read(tmr->timer_fd, &val, sizeof(uint64_t)) != sizeof(uint64_t)) {
         vapi_error("Failed to read data from timerfd: errno=%d (%s)", errno, strerror(errno));
 
-        if (vlog_level_enabled_on_vapi_component(VTIMER_INDEX)) {
-            vlog_finish_span(span_name);
-        }
+        if (span_name != VLOG_SPAN_NAME_NONE)
+            vlog_span_finish(span_name);
 
         return -1;
     }
 
-    tmr->callback(tmr_handle, tmr->user_context);
+    /* the callback may delete the timer */
+    vtimer_cb_t callback = tmr->callback;
+    vloop_trace_begin(VLOOP_TRACE_TIMER, callback);
+    callback(tmr_handle, tmr->user_context);
+    vloop_trace_end(VLOOP_TRACE_TIMER, callback);
 
-    if (vlog_level_enabled_on_vapi_component(VTIMER_INDEX)) {
-        if (ret == VAPI_SUCCESS)
-            vlog_finish_span(span_name);
-    }
+    if (span_name != VLOG_SPAN_NAME_NONE)
+        vlog_span_finish(span_name);
 
     return 0;
 }
@@ -551,6 +547,7 @@ int vtimer_delete(vtimer_t timer)
         break;
     }
 
+    vlog_span_name_release(tmr->span_name);
     vmem_free(vmem_alloc_default(), tmr);
 
     return 0;
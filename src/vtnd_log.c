@@ -1,14 +1,27 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* recvmmsg, memfd_create */
+#endif
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
 
 #include <libvapi/vloop.h>
+#include <libvapi/vlist.h>
 #include <libvapi/vtnd_log.h>
 
 #include "vlog_core.h"
@@ -20,6 +33,55 @@
 #define VTND_LOG_MSG_LEN_MAX    2048
 #define VTND_LOG_SOCK_TRACES    "@tndd.traces"
 
+#define VTND_LOG_BATCH_MAGIC    0x4c544e56      /* "VNTL": records of one client */
+#define VTND_LOG_RING_MAGIC     0x52544e56      /* "VNTR": registration of a shared ring */
+#define VTND_LOG_DGRAM_SIZE     (16 * 1024)     /* max size of a batch datagram */
+#define VTND_LOG_FLUSH_MS       5               /* max age of a queued record */
+#define VTND_LOG_RECV_BATCH     16              /* datagrams per recvmmsg */
+#define VTND_LOG_ID_MAX         64
+#define VTND_LOG_REC_SKIP       0xffff          /* ring record: continue at the start */
+#define VTND_LOG_REREGISTER_S   1               /* min delay between ring registrations */
+#define VTND_LOG_RETRY_MS       10              /* wait for tndd before dropping a full batch */
+
+#define VTND_LOG_ALIGN(len)     (((len) + 3) & ~(size_t)3)
+
+
+/* Batch datagram: header, NUL-terminated client id, then records */
+typedef struct {
+    uint32_t magic;
+    uint16_t count;
+    uint16_t id_len;            /* including the NUL */
+} vtnd_log_batch_hdr_t;
+
+/* Record in a batch or a ring, followed by the NUL-terminated message */
+typedef struct {
+    uint16_t len;               /* message length including the NUL */
+    uint8_t level;
+    uint8_t error;
+} vtnd_log_rec_hdr_t;
+
+/* Registration of a ring, sent with the memfd and the eventfd */
+typedef struct {
+    uint32_t magic;
+    uint32_t size;
+    int32_t pid;
+    char id[VTND_LOG_ID_MAX];
+} vtnd_log_ring_reg_t;
+
+/*
+ * Shared ring, single producer (the client, under its lock) and single consumer (tndd).
+ * Records are 4-byte aligned, a record that does not fit before the end of the data is
+ * preceded by a VTND_LOG_REC_SKIP header.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t size;              /* bytes of data, power of two */
+    uint64_t head __attribute__((aligned(64)));     /* written by the client */
+    uint64_t tail __attribute__((aligned(64)));     /* written by tndd */
+    uint32_t waiting;           /* tndd drained the ring and waits for the doorbell */
+    char data[] __attribute__((aligned(64)));
+} vtnd_log_ring_t;
+
 
 static struct vtnd_log_client {
     int initialized;
@@ -27,14 +89,49 @@ static struct vtnd_log_client {
     char *id;
     struct sockaddr_un tndd_un_name;
     vloop_event_handle_t *wr_handle;
-} vtnd_log_client = {0};
 
+    pthread_mutex_t lock;       /* batch and ring */
+    char batch[VTND_LOG_DGRAM_SIZE];
+    size_t batch_len;
+    unsigned int count;
+    uint64_t first_ns;
+
+    vtnd_log_ring_t *ring;
+    size_t ring_map_size;
+    int ring_fd;
+    int ring_efd;
+    time_t ring_registered;
+    uint64_t ring_tail;         /* tail seen by the last flush */
+    time_t ring_tail_moved;
+
+    vtnd_log_stats_t stats;
+} vtnd_log_client = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ring_fd = -1,
+    .ring_efd = -1,
+};
+
+
+/* Ring of a client process, as mapped by tndd */
+typedef struct vtnd_log_server_ring {
+    vtnd_log_ring_t *ring;
+    size_t map_size;
+    uint32_t mask;
+    int efd;
+    pid_t pid;
+    char id[VTND_LOG_ID_MAX];
+    vloop_event_handle_t ev;
+    struct vlist node;
+} vtnd_log_server_ring_t;
 
 static struct vtnd_log_server {
     int sock;
     vtnd_log_serv_cb recv_cb;
     vtnd_log_cleanup_cb clean_cb;
-} vtnd_log_server = {0};
+    struct vlist rings;
+} vtnd_log_server = {
+    .rings = ELIST_INITIALIZER(vtnd_log_server.rings),
+};
 
 
 // TODO convert to generic internal vlog error handling mechanism for log infrastructure
@@ -56,10 +153,15 @@ static void __vtnd_log_file_error_printf(const char *file, int line, const char
 }
 
 
-static int vtnd_log_server_read_cb(int fd, vloop_event_handle_t event_handle, void* ctx)
+static int vtnd_log_sockaddr_len(void)
+{
+    return sizeof(sa_family_t) + strlen(VTND_LOG_SOCK_TRACES);
+}
+
+
+/* Legacy datagram of one record: "id#level#error#msg" */
+static int vtnd_log_server_parse_text(char *buffer)
 {
-    int len;
-    char buffer[VTND_LOG_MSG_LEN_MAX];
     char *log_msg_id = NULL;
     char *log_msg_string = NULL;
     int log_msg_level = -1;
@@ -67,58 +169,311 @@ static int vtnd_log_server_read_cb(int fd, vloop_event_handle_t event_handle, vo
     void *tmp;
     void *next;
 
-    while (1) {
-        len = recv(fd, buffer, VTND_LOG_MSG_LEN_MAX, 0);
-        if (len <= 0) {
-            if (errno != EAGAIN)
-                vtnd_log_file_error_printf("vtnd_log error recv msg, ret [%d] [%s]", len, strerror(errno));
-            break;
+    /* get log id */
+    next= buffer;
+    tmp = memchr(next, VTND_LOG_MSG_DELIM, 100);
+    if (tmp != NULL) {
+        *((char *)tmp) = '\0';
+        log_msg_id = next;
+        next = tmp + 1;
+    } else {
+        return -1;
+    }
+
+    /* get log level */
+    tmp = memchr(next, VTND_LOG_MSG_DELIM, 100);
+    if (tmp != NULL) {
+        *((char *)tmp) = '\0';
+        log_msg_level = atoi(next);
+        next = tmp + 1;
+    } else {
+        return -1;
+    }
+
+    /* get log error record */
+    tmp = memchr(next, VTND_LOG_MSG_DELIM, 100);
+    if (tmp != NULL) {
+        *((char *)tmp) = '\0';
+        log_msg_error_record = atoi(next);
+        next = tmp + 1;
+    } else {
+        return -1;
+    }
+
+    /* get log error record */
+    log_msg_string = next;
+
+    vtnd_log_server.recv_cb(log_msg_id, log_msg_level, log_msg_string, log_msg_error_record);
+
+    return 0;
+}
+
+
+/* Batch datagram: the messages are NUL-terminated in place, no copy */
+static int vtnd_log_server_parse_batch(char *buffer, size_t len)
+{
+    vtnd_log_batch_hdr_t hdr;
+    vtnd_log_rec_hdr_t rec;
+    const char *id;
+    size_t off;
+    unsigned int i;
+
+    memcpy(&hdr, buffer, sizeof(hdr));
+
+    off = sizeof(hdr);
+    if (hdr.id_len == 0 || off + hdr.id_len > len || buffer[off + hdr.id_len - 1] != '\0')
+        return -1;
+    id = &buffer[off];
+    off += hdr.id_len;
+
+    for (i = 0; i < hdr.count; i++) {
+        if (off + sizeof(rec) > len)
+            return -1;
+        memcpy(&rec, &buffer[off], sizeof(rec));
+        off += sizeof(rec);
+
+        if (rec.len == 0 || off + rec.len > len || buffer[off + rec.len - 1] != '\0')
+            return -1;
+
+        vtnd_log_server.recv_cb(id, rec.level, &buffer[off], rec.error);
+        off += rec.len;
+    }
+
+    return 0;
+}
+
+
+/* Drain a shared ring. The client may be anything: lengths are checked, messages copied. */
+static void vtnd_log_server_ring_drain(vtnd_log_server_ring_t *sring)
+{
+    vtnd_log_ring_t *ring = sring->ring;
+    char msg[VTND_LOG_MSG_LEN_MAX];
+    vtnd_log_rec_hdr_t rec;
+    uint64_t head, tail;
+    uint32_t off;
+
+    tail = ring->tail;
+
+    for (;;) {
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        while (tail != head) {
+            if (head - tail > sring->mask + 1)
+                goto corrupted;
+
+            off = tail & sring->mask;
+            memcpy(&rec, &ring->data[off], sizeof(rec));
+
+            if (rec.len == VTND_LOG_REC_SKIP) {
+                tail += sring->mask + 1 - off;
+                continue;
+            }
+            if (rec.len == 0 || rec.len > sizeof(msg) || off + sizeof(rec) + rec.len > sring->mask + 1)
+                goto corrupted;
+
+            memcpy(msg, &ring->data[off + sizeof(rec)], rec.len);
+            msg[rec.len - 1] = '\0';
+            tail += VTND_LOG_ALIGN(sizeof(rec) + rec.len);
+
+            vtnd_log_server.recv_cb(sring->id, rec.level, msg, rec.error);
         }
 
-        buffer[len] = '\0';
-
-        /* get log id */
-        next= buffer;
-        tmp = memchr(next, VTND_LOG_MSG_DELIM, 100);
-        if (tmp != NULL) {
-            *((char *)tmp) = '\0';
-            log_msg_id = next;
-            next = tmp + 1;
-        } else {
-            goto server_read_cb_error_parse;
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        /* announce the wait, then recheck: the client may have missed the flag */
+        __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == tail)
+            return;
+        __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+    }
+
+corrupted:
+    vtnd_log_file_error_printf("vtnd_log corrupted ring of %s [%d], skipped", sring->id, (int)sring->pid);
+    tail = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+}
+
+
+static int vtnd_log_server_ring_cb(int fd, vloop_event_handle_t event_handle, void *ctx)
+{
+    uint64_t value;
+
+    /* reset the doorbell before draining, a new one is rung after the wait flag is set */
+    if (read(fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        vtnd_log_file_error_printf("vtnd_log error read doorbell [%s]", strerror(errno));
+
+    vtnd_log_server_ring_drain((vtnd_log_server_ring_t *)ctx);
+
+    return 0;
+}
+
+
+static void vtnd_log_server_ring_release(vtnd_log_server_ring_t *sring)
+{
+    vtnd_log_server_ring_drain(sring);
+
+    vlist_delete(&sring->node);
+    if (sring->ev != NULL)
+        vloop_remove_fd(sring->ev);
+    close(sring->efd);
+    munmap(sring->ring, sring->map_size);
+    free(sring);
+}
+
+
+/* Register the ring of a client: replaces a previous ring of the same process, frees the ones of exited processes */
+static int vtnd_log_server_ring_add(vtnd_log_ring_reg_t *reg, int memfd, int efd)
+{
+    vtnd_log_server_ring_t *sring, *old;
+    struct vlist *node;
+    struct stat st;
+    size_t map_size;
+    void *map;
+    int seals;
+
+    vlist_foreach(&vtnd_log_server.rings, node) {
+        old = container_of(vtnd_log_server_ring_t, node, node);
+        if (old->pid == reg->pid || (kill(old->pid, 0) != 0 && errno == ESRCH))
+            vtnd_log_server_ring_release(old);
+    }
+
+    if (reg->size < VTND_LOG_SHM_MIN_SIZE || (reg->size & (reg->size - 1)) != 0)
+        return -1;
+    reg->id[sizeof(reg->id) - 1] = '\0';
+
+    /* a memfd shorter than the ring, or one the client may still resize, would fault the drain */
+    map_size = sizeof(vtnd_log_ring_t) + reg->size;
+    seals = fcntl(memfd, F_GET_SEALS);
+    if (seals < 0 || (seals & (F_SEAL_SHRINK | F_SEAL_GROW)) != (F_SEAL_SHRINK | F_SEAL_GROW))
+        return -1;
+    if (fstat(memfd, &st) != 0 || st.st_size < (off_t)map_size)
+        return -1;
+
+    map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+
+    sring = calloc(1, sizeof(*sring));
+    if (sring == NULL) {
+        munmap(map, map_size);
+        return -1;
+    }
+
+    sring->ring = (vtnd_log_ring_t *)map;
+    if (sring->ring->magic != VTND_LOG_RING_MAGIC || sring->ring->size != reg->size) {
+        munmap(map, map_size);
+        free(sring);
+        return -1;
+    }
+
+    sring->map_size = map_size;
+    sring->mask = reg->size - 1;
+    sring->efd = efd;
+    sring->pid = reg->pid;
+    strcpy(sring->id, reg->id);
+    vlist_add_tail(&vtnd_log_server.rings, &sring->node);
+
+    sring->ev = vloop_add_fd(efd, VLOOP_FD_READ, vtnd_log_server_ring_cb, NULL, sring);
+    if (sring->ev == NULL || vloop_enable_cb(sring->ev, VLOOP_FD_READ) != 0) {
+        vtnd_log_file_error_printf("vtnd_log error register ring of %s", sring->id);
+        vtnd_log_server_ring_release(sring);
+        return 0;
+    }
+
+    /* records written before the registration */
+    vtnd_log_server_ring_drain(sring);
+
+    return 0;
+}
+
+
+static void vtnd_log_server_handle_ring(char *buffer, size_t len, struct msghdr *mh)
+{
+    vtnd_log_ring_reg_t reg;
+    struct cmsghdr *cmsg;
+    int fds[2] = { -1, -1 };
+
+    for (cmsg = CMSG_FIRSTHDR(mh); cmsg != NULL; cmsg = CMSG_NXTHDR(mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(sizeof(fds)))
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    }
+
+    if (len == sizeof(reg) && fds[0] >= 0 && fds[1] >= 0) {
+        memcpy(&reg, buffer, sizeof(reg));
+        if (vtnd_log_server_ring_add(&reg, fds[0], fds[1]) == 0) {
+            close(fds[0]);
+            return;
         }
+    }
+
+    vtnd_log_file_error_printf("vtnd_log error register ring");
+    if (fds[0] >= 0)
+        close(fds[0]);
+    if (fds[1] >= 0)
+        close(fds[1]);
+}
 
-        /* get log level */
-        tmp = memchr(next, VTND_LOG_MSG_DELIM, 100);
-        if (tmp != NULL) {
-            *((char *)tmp) = '\0';
-            log_msg_level = atoi(next);
-            next = tmp + 1;
-        } else {
-            goto server_read_cb_error_parse;
+
+static int vtnd_log_server_read_cb(int fd, vloop_event_handle_t event_handle, void* ctx)
+{
+    static char buffers[VTND_LOG_RECV_BATCH][VTND_LOG_DGRAM_SIZE + 1];
+    static char controls[VTND_LOG_RECV_BATCH][CMSG_SPACE(2 * sizeof(int))];
+    struct mmsghdr msgs[VTND_LOG_RECV_BATCH];
+    struct iovec iov[VTND_LOG_RECV_BATCH];
+    uint32_t magic;
+    size_t len;
+    int i, n, ret;
+
+    while (1) {
+        memset(msgs, 0, sizeof(msgs));
+        for (i = 0; i < VTND_LOG_RECV_BATCH; i++) {
+            iov[i].iov_base = buffers[i];
+            iov[i].iov_len = VTND_LOG_DGRAM_SIZE;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = controls[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
         }
 
-        /* get log error record */
-        tmp = memchr(next, VTND_LOG_MSG_DELIM, 100);
-        if (tmp != NULL) {
-            *((char *)tmp) = '\0';
-            log_msg_error_record = atoi(next);
-            next = tmp + 1;
-        } else {
-            goto server_read_cb_error_parse;
+        n = recvmmsg(fd, msgs, VTND_LOG_RECV_BATCH, MSG_DONTWAIT | MSG_CMSG_CLOEXEC, NULL);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                vtnd_log_file_error_printf("vtnd_log error recv msg, ret [%d] [%s]", n, strerror(errno));
+            break;
         }
 
-        /* get log error record */
-        log_msg_string = next;
+        for (i = 0; i < n; i++) {
+            len = msgs[i].msg_len;
+            buffers[i][len] = '\0';
+            magic = 0;
+            if (len >= sizeof(magic))
+                memcpy(&magic, buffers[i], sizeof(magic));
+
+            if (magic == VTND_LOG_RING_MAGIC) {
+                vtnd_log_server_handle_ring(buffers[i], len, &msgs[i].msg_hdr);
+                continue;
+            }
+
+            if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+                ret = -1;
+            else if (magic == VTND_LOG_BATCH_MAGIC && len >= sizeof(vtnd_log_batch_hdr_t))
+                ret = vtnd_log_server_parse_batch(buffers[i], len);
+            else
+                ret = vtnd_log_server_parse_text(buffers[i]);
+
+            if (ret != 0)
+                vtnd_log_file_error_printf("vtnd_log error parse msg");
+        }
 
-        vtnd_log_server.recv_cb(log_msg_id, log_msg_level, log_msg_string, log_msg_error_record);
+        if (n < VTND_LOG_RECV_BATCH)
+            break;
     } /* end while */
 
     return 0;
-
-server_read_cb_error_parse:
-    vtnd_log_file_error_printf("vtnd_log error parse msg");
-    return -1;
 }
 
 
@@ -127,6 +482,7 @@ int vtnd_log_server_start(const char *service_name, vtnd_log_serv_cb recv_cb, vt
     int ret = 0;
     int sock = -1;
     int name_len = 0;
+    int rcvbuf = 1024 * 1024;
     struct sockaddr_un name = {0};
     vloop_event_handle_t tnd_log_ev = NULL;
 
@@ -148,7 +504,7 @@ int vtnd_log_server_start(const char *service_name, vtnd_log_serv_cb recv_cb, vt
     name.sun_family = AF_UNIX;
     name.sun_path[0] = '\0';
 
-    name_len = sizeof(sa_family_t) + strlen(VTND_LOG_SOCK_TRACES);
+    name_len = vtnd_log_sockaddr_len();
 
     ret = bind(sock, (struct sockaddr *) &name, name_len);
     if (ret != 0) {
@@ -164,6 +520,10 @@ int vtnd_log_server_start(const char *service_name, vtnd_log_serv_cb recv_cb, vt
         return -1;
     }
 
+    /* room for bursts of batches while the loop is busy */
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0)
+        vapi_warning("setsockopt error [%s]", strerror(errno));
+
     tnd_log_ev = vloop_add_fd(sock, VLOOP_FD_READ, vtnd_log_server_read_cb, NULL, NULL);
     if (tnd_log_ev == NULL) {
         vapi_error("vtnd_log error register tnd_log_ev");
@@ -189,6 +549,29 @@ int vtnd_log_server_start(const char *service_name, vtnd_log_serv_cb recv_cb, vt
 
 /**********************************************************************************************************************/
 
+static uint64_t vtnd_log_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* A forked child must not produce into the ring of its parent, nor inherit a held lock. */
+static void vtnd_log_client_atfork_child(void)
+{
+    pthread_mutex_init(&vtnd_log_client.lock, NULL);
+
+    if (vtnd_log_client.ring != NULL) {
+        munmap(vtnd_log_client.ring, vtnd_log_client.ring_map_size);
+        close(vtnd_log_client.ring_fd);
+        close(vtnd_log_client.ring_efd);
+        vtnd_log_client.ring = NULL;
+        vtnd_log_client.ring_fd = -1;
+        vtnd_log_client.ring_efd = -1;
+    }
+}
+
 int vtnd_log_client_start(const char *service_name)
 {
     int ret = 0;
@@ -222,6 +605,8 @@ int vtnd_log_client_start(const char *service_name)
         vapi_error("warning: could not set tnd log output level");
     vtnd_log_client.sock = sock;
 
+    pthread_atfork(NULL, NULL, vtnd_log_client_atfork_child);
+
     /* enable writing */
     vtnd_log_client.initialized = 1;
 
@@ -229,38 +614,232 @@ int vtnd_log_client_start(const char *service_name)
 }
 
 
+/* Send the ring to tndd. Called with the client lock held. */
+static int vtnd_log_client_ring_register(void)
+{
+    vtnd_log_ring_reg_t reg;
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    int fds[2];
+
+    memset(&reg, 0, sizeof(reg));
+    reg.magic = VTND_LOG_RING_MAGIC;
+    reg.size = vtnd_log_client.ring->size;
+    reg.pid = getpid();
+    snprintf(reg.id, sizeof(reg.id), "%s", vtnd_log_client.id ? vtnd_log_client.id : "");
+
+    iov.iov_base = &reg;
+    iov.iov_len = sizeof(reg);
+
+    memset(&mh, 0, sizeof(mh));
+    memset(control, 0, sizeof(control));
+    mh.msg_name = &vtnd_log_client.tndd_un_name;
+    mh.msg_namelen = vtnd_log_sockaddr_len();
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+
+    fds[0] = vtnd_log_client.ring_fd;
+    fds[1] = vtnd_log_client.ring_efd;
+    cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    vtnd_log_client.ring_registered = time(NULL);
+
+    return (sendmsg(vtnd_log_client.sock, &mh, MSG_DONTWAIT) < 0) ? -1 : 0;
+}
+
+
+/* Copy a record into the shared ring. Called with the client lock held. Returns -1 if full. */
+static int vtnd_log_client_ring_put(const char *output, size_t len, int level, int error)
+{
+    vtnd_log_ring_t *ring = vtnd_log_client.ring;
+    vtnd_log_rec_hdr_t rec;
+    uint64_t head, tail;
+    size_t need, off, contig, skip = 0;
+
+    need = VTND_LOG_ALIGN(sizeof(rec) + len + 1);
+    head = ring->head;
+    off = head & (ring->size - 1);
+    contig = ring->size - off;
+    if (need > contig)
+        skip = contig;
+
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head + skip + need - tail > ring->size)
+        return -1;
+
+    if (skip != 0) {
+        rec.len = VTND_LOG_REC_SKIP;
+        memcpy(&ring->data[off], &rec, sizeof(rec));
+        head += skip;
+        off = 0;
+    }
+
+    rec.len = len + 1;
+    rec.level = level;
+    rec.error = error;
+    memcpy(&ring->data[off], &rec, sizeof(rec));
+    memcpy(&ring->data[off + sizeof(rec)], output, len);
+    ring->data[off + sizeof(rec) + len] = '\0';
+
+    /* publish, then ring the doorbell only if tndd announced it waits */
+    __atomic_store_n(&ring->head, head + need, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&ring->waiting, 0, __ATOMIC_ACQ_REL)) {
+        uint64_t one = 1;
+        if (write(vtnd_log_client.ring_efd, &one, sizeof(one)) == sizeof(one))
+            vtnd_log_client.stats.doorbells++;
+    }
+
+    vtnd_log_client.stats.shm_records++;
+
+    return 0;
+}
+
+
+/*
+ * The ring holds records that tndd did not consume for VTND_LOG_REREGISTER_S. A ring that is
+ * drained, even slowly, is not registered again. Called with the client lock held.
+ */
+static int vtnd_log_client_ring_stalled(void)
+{
+    vtnd_log_ring_t *ring = vtnd_log_client.ring;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    time_t now = time(NULL);
+
+    if (tail == ring->head || tail != vtnd_log_client.ring_tail) {
+        vtnd_log_client.ring_tail = tail;
+        vtnd_log_client.ring_tail_moved = now;
+        return 0;
+    }
+
+    return now - vtnd_log_client.ring_tail_moved >= VTND_LOG_REREGISTER_S &&
+           now - vtnd_log_client.ring_registered >= VTND_LOG_REREGISTER_S;
+}
+
+
+/*
+ * Send the queued records in one datagram. Called with the client lock held.
+ * When tndd is busy the batch is kept for the next flush, unless room is needed.
+ */
+static void vtnd_log_client_flush_locked(int need_room)
+{
+    ssize_t ret;
+    int waited_ms = 0;
+
+    if (vtnd_log_client.count == 0)
+        return;
+
+    for (;;) {
+        ret = sendto(vtnd_log_client.sock, vtnd_log_client.batch, vtnd_log_client.batch_len, MSG_DONTWAIT,
+                     (struct sockaddr *) &(vtnd_log_client.tndd_un_name), vtnd_log_sockaddr_len());
+        if (ret >= 0 || (errno != EAGAIN && errno != ENOBUFS && errno != EINTR))
+            break;
+        if (!need_room)
+            return;
+        /* the socket of tndd is full, an unconnected datagram socket cannot poll for room */
+        if (waited_ms++ >= VTND_LOG_RETRY_MS)
+            break;
+        usleep(1000);
+    }
+
+    if (ret < 0) {
+        /* ECONNREFUSED: tndd is not running */
+        vtnd_log_client.stats.dropped += vtnd_log_client.count;
+    } else {
+        vtnd_log_client.stats.records += vtnd_log_client.count;
+        vtnd_log_client.stats.datagrams++;
+
+        /* tndd is up but does not drain the ring: it restarted and lost it */
+        if (vtnd_log_client.ring != NULL && vtnd_log_client_ring_stalled())
+            vtnd_log_client_ring_register();
+    }
+
+    vtnd_log_client.count = 0;
+    vtnd_log_client.batch_len = 0;
+}
+
+
+/* Queue a record in the batch datagram. Called with the client lock held. */
+static void vtnd_log_client_batch_put(const char *output, size_t len, int level, int error)
+{
+    vtnd_log_batch_hdr_t hdr;
+    vtnd_log_rec_hdr_t rec;
+    size_t id_len;
+    uint64_t now;
+    char *p;
+
+    id_len = strlen(vtnd_log_client.id ? vtnd_log_client.id : "") + 1;
+    if (id_len > VTND_LOG_ID_MAX)
+        id_len = VTND_LOG_ID_MAX;
+
+    if (vtnd_log_client.batch_len + sizeof(rec) + len + 1 > sizeof(vtnd_log_client.batch))
+        vtnd_log_client_flush_locked(1);
+
+    if (vtnd_log_client.count == 0) {
+        hdr.magic = VTND_LOG_BATCH_MAGIC;
+        hdr.count = 0;
+        hdr.id_len = id_len;
+        memcpy(vtnd_log_client.batch, &hdr, sizeof(hdr));
+        p = &vtnd_log_client.batch[sizeof(hdr)];
+        memcpy(p, vtnd_log_client.id ? vtnd_log_client.id : "", id_len - 1);
+        p[id_len - 1] = '\0';
+        vtnd_log_client.batch_len = sizeof(hdr) + id_len;
+    }
+
+    rec.len = len + 1;
+    rec.level = level;
+    rec.error = error;
+    p = &vtnd_log_client.batch[vtnd_log_client.batch_len];
+    memcpy(p, &rec, sizeof(rec));
+    memcpy(p + sizeof(rec), output, len);
+    p[sizeof(rec) + len] = '\0';
+    vtnd_log_client.batch_len += sizeof(rec) + len + 1;
+
+    vtnd_log_client.count++;
+    hdr.count = vtnd_log_client.count;
+    memcpy(&vtnd_log_client.batch[offsetof(vtnd_log_batch_hdr_t, count)], &hdr.count, sizeof(hdr.count));
+
+    now = vtnd_log_now();
+    if (vtnd_log_client.count == 1)
+        vtnd_log_client.first_ns = now;
+
+    /* error records go out at once, they may precede a crash */
+    if (error || now - vtnd_log_client.first_ns >= VTND_LOG_FLUSH_MS * 1000000ULL)
+        vtnd_log_client_flush_locked(0);
+}
+
+
+/*
+ * No traces from here on: they would come back to this output, under the lock.
+ * Failures show in the counters.
+ */
 static int __vtnd_log_write(char *output, int level, int error)
 {
-    int ret = 0;
-    int name_len = 0;
-    int errno_bak = 0;
-    char buffer[VTND_LOG_MSG_LEN_MAX] = "";
+    size_t len;
 
     if (vtnd_log_client.initialized == 0)
         return 0;
 
-    ret = snprintf(buffer, VTND_LOG_MSG_LEN_MAX, "%s#%d#%d#%s", vtnd_log_client.id, level, error, output);
-    if (ret < 0)
-        return -1;
+    /* room for the client id in the legacy limit */
+    len = strnlen(output, VTND_LOG_MSG_LEN_MAX - VTND_LOG_ID_MAX - 1);
 
-    name_len = sizeof(sa_family_t) + strlen(VTND_LOG_SOCK_TRACES);
+    pthread_mutex_lock(&vtnd_log_client.lock);
 
-    ret = sendto(vtnd_log_client.sock, buffer, strlen(buffer), MSG_DONTWAIT,
-            (struct sockaddr *) &(vtnd_log_client.tndd_un_name), name_len);
-    errno_bak = errno;
+    if (vtnd_log_client.ring == NULL || vtnd_log_client.count != 0 ||
+        vtnd_log_client_ring_put(output, len, level, error) != 0)
+        vtnd_log_client_batch_put(output, len, level, error);
 
-    if (ret < 0 && errno_bak != EAGAIN && errno_bak != ECONNREFUSED) {
-        vapi_debug("vtnd_log error sendto [%s]\n", strerror(errno));
-        ret = -1;
-    } else if (ret < 0 && errno_bak == ECONNREFUSED) {
-        /* XXX ignore */
-        ret = 0;
-    } else if (ret < 0 && errno_bak == EAGAIN) {
-        vapi_debug("vtnd_log error sendto [EAGAIN]");
-        ret = 0;
-    }
+    pthread_mutex_unlock(&vtnd_log_client.lock);
 
-    return ret;
+    return 0;
 }
 
 int vtnd_log_write(char *output, int level)
@@ -273,6 +852,93 @@ int vtnd_log_write_error(char *output, int level)
     return __vtnd_log_write(output, level, 1);
 }
 
+void vtnd_log_flush(void)
+{
+    if (vtnd_log_client.initialized == 0 || vtnd_log_client.count == 0)
+        return;
+
+    pthread_mutex_lock(&vtnd_log_client.lock);
+    vtnd_log_client_flush_locked(0);
+    pthread_mutex_unlock(&vtnd_log_client.lock);
+}
+
+int vtnd_log_client_enable_shm(size_t ring_size)
+{
+    vtnd_log_ring_t *ring;
+    size_t size = VTND_LOG_SHM_MIN_SIZE, map_size;
+    int fd, efd;
+
+    if (vtnd_log_client.initialized == 0) {
+        vapi_error("vtnd_log client is not started");
+        return -1;
+    }
+
+    if (vtnd_log_client.ring != NULL)
+        return 0;
+
+    while (size < ring_size)
+        size <<= 1;
+    map_size = sizeof(vtnd_log_ring_t) + size;
+
+    fd = memfd_create("vtnd_log_ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        vapi_error("vtnd_log error memfd_create [%s]", strerror(errno));
+        return -1;
+    }
+
+    if (ftruncate(fd, map_size) != 0) {
+        vapi_error("vtnd_log error ftruncate ring [%s]", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    /* tndd maps the ring only if its size cannot change under it */
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+        vapi_error("vtnd_log error seal ring [%s]", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    ring = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED) {
+        vapi_error("vtnd_log error mmap ring [%s]", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (efd < 0) {
+        vapi_error("vtnd_log error eventfd [%s]", strerror(errno));
+        munmap(ring, map_size);
+        close(fd);
+        return -1;
+    }
+
+    ring->magic = VTND_LOG_RING_MAGIC;
+    ring->size = size;
+
+    pthread_mutex_lock(&vtnd_log_client.lock);
+    vtnd_log_client.ring = ring;
+    vtnd_log_client.ring_map_size = map_size;
+    vtnd_log_client.ring_fd = fd;
+    vtnd_log_client.ring_efd = efd;
+    /* if tndd is not up yet, the ring is registered again once it answers */
+    (void)vtnd_log_client_ring_register();
+    pthread_mutex_unlock(&vtnd_log_client.lock);
+
+    return 0;
+}
+
+void vtnd_log_client_get_stats(vtnd_log_stats_t *stats)
+{
+    if (stats == NULL)
+        return;
+
+    pthread_mutex_lock(&vtnd_log_client.lock);
+    *stats = vtnd_log_client.stats;
+    pthread_mutex_unlock(&vtnd_log_client.lock);
+}
+
 int vtnd_log_client_is_enabled(void)
 {
     return ((vtnd_log_client.initialized) ? 1 : 0);